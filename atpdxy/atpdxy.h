@@ -1,10 +1,13 @@
 #pragma once
 
 #include "log.h"
+#include "binlog.h"
 #include "config.h"
 #include "singleton.h"
 #include "thread.h"
 #include "mutex.h"
+#include "channel.h"
+#include "future.h"
 #include "macro.h"
 #include "util.h"
 #include "fiber.h"
@@ -0,0 +1,619 @@
+#include "binlog.h"
+#include "config.h"
+#include "macro.h"
+#include <deque>
+#include <vector>
+
+namespace atpdxy {
+
+const char* const BinaryLog::MAGIC = "ATBLOG01";
+
+// 调用处和日志器的注册表，编号从1开始，注册后不会删除
+struct BinaryLogRegistry {
+    // 每块调用处的数量
+    static const size_t SITE_CHUNK_SIZE = 1024;
+    // 块的数量上限
+    static const size_t SITE_CHUNKS = 1024;
+
+    BinaryLogRegistry() {
+        for(auto& i : sites) {
+            i.store(nullptr, std::memory_order_relaxed);
+        }
+    }
+
+    Mutex mutex;
+    // 调用处按块分配，块发布后不再移动，查找时不加锁，下标是编号减1
+    std::atomic<BinaryLog::Site*> sites[SITE_CHUNKS];
+    // 已经注册的调用处数量，填好调用处之后才发布
+    std::atomic<uint32_t> siteCount = {0};
+    std::deque<std::string> loggers;
+};
+
+static BinaryLogRegistry& GetRegistry() {
+    static BinaryLogRegistry s_registry;
+    return s_registry;
+}
+
+// 顺序读取编码后的字段，越界时返回false
+class BinaryReader {
+public:
+    BinaryReader(const char* data, size_t size)
+        :m_data(data)
+        ,m_left(size) {
+    }
+
+    bool readUint32(uint32_t& v) {
+        return read(&v, 4);
+    }
+
+    bool readUint64(uint64_t& v) {
+        return read(&v, 8);
+    }
+
+    bool readDouble(double& v) {
+        return read(&v, 8);
+    }
+
+    bool readString(const char*& str, uint32_t& len) {
+        if(!readUint32(len) || len > m_left) {
+            return false;
+        }
+        str = m_data;
+        m_data += len;
+        m_left -= len;
+        return true;
+    }
+
+    bool readString(std::string& str) {
+        const char* p = nullptr;
+        uint32_t len = 0;
+        if(!readString(p, len)) {
+            return false;
+        }
+        str.assign(p, len);
+        return true;
+    }
+private:
+    bool read(void* v, size_t n) {
+        if(m_left < n) {
+            return false;
+        }
+        memcpy(v, m_data, n);
+        m_data += n;
+        m_left -= n;
+        return true;
+    }
+private:
+    const char* m_data;
+    size_t m_left;
+};
+
+// 追加一条定义或文本记录
+static void AppendRecord(std::string& out, uint32_t site, uint32_t thread_id, uint32_t logger
+                         , const std::string& payload) {
+    BinaryLog::RecordHeader header = BinaryLog::MakeHeader(sizeof(header) + payload.size(), site
+                , GetCurrentUS(), thread_id, 0, logger);
+    out.append((const char*)&header, sizeof(header));
+    out.append(payload);
+}
+
+uint32_t BinaryLog::RegisterSite(LogLevel::Level level, const char* file, int32_t line
+                                 , const char* fmt, const char* types) {
+    BinaryLogRegistry& registry = GetRegistry();
+    Mutex::Lock lock(registry.mutex);
+    uint32_t id = registry.siteCount.load(std::memory_order_relaxed) + 1;
+    size_t chunk = (id - 1) / BinaryLogRegistry::SITE_CHUNK_SIZE;
+    ASSERT_WITH_MSG(chunk < BinaryLogRegistry::SITE_CHUNKS, "too many binary log sites");
+    BinaryLog::Site* sites = registry.sites[chunk].load(std::memory_order_relaxed);
+    if(!sites) {
+        sites = new BinaryLog::Site[BinaryLogRegistry::SITE_CHUNK_SIZE];
+        registry.sites[chunk].store(sites, std::memory_order_relaxed);
+    }
+    Site& site = sites[(id - 1) % BinaryLogRegistry::SITE_CHUNK_SIZE];
+    site.id = id;
+    site.level = level;
+    site.line = line;
+    site.file = file;
+    site.fmt = fmt;
+    site.types = types;
+    registry.siteCount.store(id, std::memory_order_release);
+    return site.id;
+}
+
+uint32_t BinaryLog::RegisterLogger(const std::string& name) {
+    BinaryLogRegistry& registry = GetRegistry();
+    Mutex::Lock lock(registry.mutex);
+    registry.loggers.push_back(name);
+    return registry.loggers.size();
+}
+
+const BinaryLog::Site* BinaryLog::GetSite(uint32_t id) {
+    BinaryLogRegistry& registry = GetRegistry();
+    // 和注册时发布数量配对，读到的数量之内的调用处都已经填好
+    if(id == 0 || id > registry.siteCount.load(std::memory_order_acquire)) {
+        return nullptr;
+    }
+    BinaryLog::Site* sites = registry.sites[(id - 1) / BinaryLogRegistry::SITE_CHUNK_SIZE].load(std::memory_order_relaxed);
+    return &sites[(id - 1) % BinaryLogRegistry::SITE_CHUNK_SIZE];
+}
+
+void BinaryLog::DumpDefines(std::string& out, uint32_t& site_from, uint32_t& logger_from) {
+    BinaryLogRegistry& registry = GetRegistry();
+    Mutex::Lock lock(registry.mutex);
+    std::string payload;
+    uint32_t site_count = registry.siteCount.load(std::memory_order_relaxed);
+    for(; site_from <= site_count; ++site_from) {
+        const Site& site = *GetSite(site_from);
+        payload.clear();
+        AppendUint32(payload, site.id);
+        AppendUint32(payload, site.level);
+        AppendUint32(payload, site.line);
+        AppendString(payload, site.file.c_str(), site.file.size());
+        AppendString(payload, site.fmt.c_str(), site.fmt.size());
+        AppendString(payload, site.types.c_str(), site.types.size());
+        AppendRecord(out, SITE_DEFINE, 0, 0, payload);
+    }
+    for(; logger_from <= registry.loggers.size(); ++logger_from) {
+        const std::string& name = registry.loggers[logger_from - 1];
+        payload.clear();
+        AppendUint32(payload, logger_from);
+        AppendString(payload, name.c_str(), name.size());
+        AppendRecord(out, LOGGER_DEFINE, 0, 0, payload);
+    }
+}
+
+void BinaryLog::AppendString(std::string& out, const char* str, size_t len) {
+    AppendUint32(out, len);
+    out.append(str, len);
+}
+
+void BinaryLog::AppendUint32(std::string& out, uint32_t v) {
+    out.append((const char*)&v, 4);
+}
+
+// 按一个转换格式化一个参数，超出栈上缓冲区时再分配
+template<class T>
+static void FormatOne(std::ostream& os, const std::string& spec, T v) {
+    char buf[128];
+    int len = snprintf(buf, sizeof(buf), spec.c_str(), v);
+    if(len < 0) {
+        return;
+    }
+    if((size_t)len < sizeof(buf)) {
+        os.write(buf, len);
+        return;
+    }
+    std::vector<char> big(len + 1);
+    snprintf(&big[0], big.size(), spec.c_str(), v);
+    os.write(&big[0], len);
+}
+
+void BinaryLog::FormatArgs(std::ostream& os, const std::string& fmt, const std::string& types
+                           , const char* args, size_t size) {
+    BinaryReader reader(args, size);
+    size_t arg = 0;
+    // 按类型取出下一个参数，整数、浮点数和指针可以互相转换，类型已经在编译时按printf检查过
+    uint64_t u = 0;
+    double d = 0;
+    const char* str = nullptr;
+    uint32_t len = 0;
+    auto next = [&]() -> char {
+        char type = arg < types.size() ? types[arg++] : 0;
+        bool ok = false;
+        switch(type) {
+            case 'i':
+            case 'u':
+            case 'p':
+                ok = reader.readUint64(u);
+                d = type == 'i' ? (double)(int64_t)u : (double)u;
+                break;
+            case 'd':
+                ok = reader.readDouble(d);
+                u = (uint64_t)(int64_t)d;
+                break;
+            case 's':
+                ok = reader.readString(str, len);
+                break;
+        }
+        return ok ? type : 0;
+    };
+
+    size_t n = fmt.size();
+    size_t begin = 0;
+    std::string spec;
+    for(size_t i = 0; i < n; ++i) {
+        if(fmt[i] != '%') {
+            continue;
+        }
+        os.write(fmt.c_str() + begin, i - begin);
+        if(i + 1 < n && fmt[i + 1] == '%') {
+            os.put('%');
+            begin = ++i + 1;
+            continue;
+        }
+        // 解析标志、宽度、精度，去掉长度修饰，参数统一按64位整数或double格式化
+        spec = "%";
+        size_t j = i + 1;
+        while(j < n && strchr("-+ #0'", fmt[j])) {
+            spec.push_back(fmt[j++]);
+        }
+        for(int part = 0; part < 2; ++part) {
+            if(part == 1) {
+                if(j >= n || fmt[j] != '.') {
+                    break;
+                }
+                spec.push_back(fmt[j++]);
+            }
+            if(j < n && fmt[j] == '*') {
+                char type = next();
+                spec += std::to_string(type == 'i' ? (int64_t)u : (int64_t)(uint32_t)u);
+                ++j;
+            }
+            while(j < n && isdigit(fmt[j])) {
+                spec.push_back(fmt[j++]);
+            }
+        }
+        while(j < n && strchr("hlLqjzt", fmt[j])) {
+            ++j;
+        }
+        if(j >= n) {
+            begin = n;
+            break;
+        }
+        char conv = fmt[j];
+        begin = j + 1;
+        i = j;
+        char type = 0;
+        switch(conv) {
+            case 'd':
+            case 'i':
+            case 'o':
+            case 'u':
+            case 'x':
+            case 'X':
+                type = next();
+                if(type && type != 's') {
+                    spec += "ll";
+                    spec.push_back(conv);
+                    if(type == 'i' && (conv == 'd' || conv == 'i')) {
+                        FormatOne(os, spec, (long long)u);
+                    } else {
+                        FormatOne(os, spec, (unsigned long long)u);
+                    }
+                    continue;
+                }
+                break;
+            case 'c':
+                type = next();
+                if(type && type != 's') {
+                    spec.push_back(conv);
+                    FormatOne(os, spec, (int)u);
+                    continue;
+                }
+                break;
+            case 'f':
+            case 'F':
+            case 'e':
+            case 'E':
+            case 'g':
+            case 'G':
+            case 'a':
+            case 'A':
+                type = next();
+                if(type && type != 's') {
+                    spec.push_back(conv);
+                    FormatOne(os, spec, d);
+                    continue;
+                }
+                break;
+            case 'p':
+                type = next();
+                if(type && type != 's') {
+                    spec.push_back(conv);
+                    FormatOne(os, spec, (void*)(uintptr_t)u);
+                    continue;
+                }
+                break;
+            case 's':
+                type = next();
+                if(type == 's') {
+                    if(spec.size() == 1) {
+                        os.write(str, len);
+                    } else {
+                        spec.push_back(conv);
+                        FormatOne(os, spec, std::string(str, len).c_str());
+                    }
+                    continue;
+                }
+                break;
+            case 'n':
+                next();
+                continue;
+            default:
+                os.write(fmt.c_str() + i, 1);
+                continue;
+        }
+        // 参数缺失或者类型不匹配
+        os << "<?>";
+    }
+    if(begin < n) {
+        os.write(fmt.c_str() + begin, n - begin);
+    }
+}
+
+BinaryLogAppender::BinaryLogAppender(const std::string& filename, size_t buffer_size, bool block)
+    :AsyncLogAppender(filename, buffer_size, block) {
+}
+
+BinaryLogAppender::~BinaryLogAppender() {
+    // 后台线程会调用本类的虚函数，必须在本类析构之前停止
+    stop();
+}
+
+void BinaryLogAppender::log(Logger::ptr logger, LogLevel::Level level, LogEvent::ptr event) {
+    if(level < m_level) {
+        return;
+    }
+    // 在事件自带的输出缓冲区中拼出文本记录，不需要额外分配
+    const LogStream& content = event->getStream();
+    const char* file = event->getFile() ? event->getFile() : "";
+    uint32_t file_len = strlen(file);
+    uint32_t content_len = content.size();
+    uint32_t line = event->getLine();
+    uint32_t lv = level;
+    Logger::ptr owner = event->getLogger() ? event->getLogger() : logger;
+    BinaryLog::RecordHeader header = BinaryLog::MakeHeader(sizeof(header) + 16 + file_len + content_len
+                , BinaryLog::SITE_TEXT, event->getTimeUS(), event->getThreadId()
+                , event->getFiberId(), owner->getId());
+    LogStream& out = event->getOutput();
+    out.reset();
+    out.write((const char*)&header, sizeof(header));
+    out.write((const char*)&lv, 4);
+    out.write((const char*)&line, 4);
+    out.write((const char*)&file_len, 4);
+    out.write(file, file_len);
+    out.write((const char*)&content_len, 4);
+    out.write(content.data(), content_len);
+    if(push(out.data(), out.size()) && level >= LogLevel::FATAL) {
+        flush();
+    }
+}
+
+void BinaryLogAppender::logBinary(Logger* logger, LogLevel::Level level, const char* data, size_t size) {
+    if(level < m_level) {
+        return;
+    }
+    if(push(data, size) && level >= LogLevel::FATAL) {
+        flush();
+    }
+}
+
+void BinaryLogAppender::onThreadAttached() {
+    std::string payload;
+    const std::string& name = Thread::GetName();
+    BinaryLog::AppendString(payload, name.c_str(), name.size());
+    std::string record;
+    AppendRecord(record, BinaryLog::THREAD_DEFINE, GetThreadId(), 0, payload);
+    push(record.c_str(), record.size());
+}
+
+void BinaryLogAppender::prologue(std::string& out) {
+    if(!m_started) {
+        out.append(BinaryLog::MAGIC, BinaryLog::MAGIC_SIZE);
+    }
+    m_pendingSite = m_nextSite;
+    m_pendingLogger = m_nextLogger;
+    BinaryLog::DumpDefines(out, m_pendingSite, m_pendingLogger);
+}
+
+void BinaryLogAppender::prologueWritten(size_t written, size_t size) {
+    if(written == size) {
+        m_started = true;
+        m_nextSite = m_pendingSite;
+        m_nextLogger = m_pendingLogger;
+    } else if(written) {
+        // 文件中留下了半条记录，下一批从魔数开始重新写出全部定义，解码器跳到魔数处继续
+        m_started = false;
+        m_nextSite = 1;
+        m_nextLogger = 1;
+    }
+    // 一点都没写出时编号不变，下一批重新写出这些定义
+}
+
+void BinaryLogAppender::formatNotice(const std::string& msg, std::string& out) {
+    std::string payload;
+    BinaryLog::AppendUint32(payload, LogLevel::WARN);
+    BinaryLog::AppendUint32(payload, 0);
+    BinaryLog::AppendString(payload, "", 0);
+    BinaryLog::AppendString(payload, msg.c_str(), msg.size());
+    AppendRecord(out, BinaryLog::SITE_TEXT, GetThreadId(), GET_ROOT_LOGGER()->getId(), payload);
+}
+
+std::string BinaryLogAppender::toYamlString() {
+    YAML::Node node = YAML::Load(AsyncLogAppender::toYamlString());
+    node["type"] = "BinaryLogAppender";
+    node.remove("async");
+    std::stringstream ss;
+    ss << node;
+    return ss.str();
+}
+
+BinaryLogDecoder::BinaryLogDecoder(LogFormatter::ptr formatter)
+    :m_formatter(formatter) {
+    if(!m_formatter) {
+        Logger logger;
+        m_formatter = logger.getFormatter();
+    }
+}
+
+int64_t BinaryLogDecoder::decode(std::istream& is, std::ostream& os) {
+    std::string buf;
+    std::vector<char> chunk(64 * 1024);
+    size_t pos = 0;
+    bool first = true;
+    // 遇到损坏的记录后，跳过内容直到下一个魔数
+    bool skipping = false;
+    while(true) {
+        is.read(&chunk[0], chunk.size());
+        size_t n = is.gcount();
+        buf.append(&chunk[0], n);
+        while(true) {
+            size_t left = buf.size() - pos;
+            // 每次启动输出器都从魔数开始一段新的定义
+            if(left >= BinaryLog::MAGIC_SIZE
+                    && memcmp(buf.c_str() + pos, BinaryLog::MAGIC, BinaryLog::MAGIC_SIZE) == 0) {
+                m_sites.clear();
+                m_loggers.clear();
+                m_threads.clear();
+                pos += BinaryLog::MAGIC_SIZE;
+                first = false;
+                skipping = false;
+                continue;
+            }
+            if(skipping) {
+                size_t next = buf.find(BinaryLog::MAGIC, pos, BinaryLog::MAGIC_SIZE);
+                if(next == std::string::npos) {
+                    // 魔数可能被下一次读取截断，留下末尾不足一个魔数的部分
+                    size_t skip = left > BinaryLog::MAGIC_SIZE - 1 ? left - (BinaryLog::MAGIC_SIZE - 1) : 0;
+                    m_skipped += skip;
+                    pos += skip;
+                    break;
+                }
+                m_skipped += next - pos;
+                pos = next;
+                continue;
+            }
+            if(left < sizeof(BinaryLog::RecordHeader)) {
+                break;
+            }
+            if(first) {
+                return -1;
+            }
+            BinaryLog::RecordHeader header;
+            memcpy(&header, buf.c_str() + pos, sizeof(header));
+            if(header.size < sizeof(header) || header.size > BinaryLog::MAX_RECORD_SIZE) {
+                skipping = true;
+                continue;
+            }
+            if(left < header.size) {
+                break;
+            }
+            if(!decodeRecord(buf.c_str() + pos, header.size, os)) {
+                skipping = true;
+                continue;
+            }
+            pos += header.size;
+        }
+        buf.erase(0, pos);
+        pos = 0;
+        if(n == 0) {
+            break;
+        }
+    }
+    // 有内容但没有魔数的不是二进制日志
+    if(first && !buf.empty()) {
+        return -1;
+    }
+    if(skipping) {
+        m_skipped += buf.size();
+    }
+    // 末尾不完整的记录是进程异常退出时没有写完的，忽略
+    return m_count;
+}
+
+bool BinaryLogDecoder::decodeRecord(const char* data, size_t size, std::ostream& os) {
+    BinaryLog::RecordHeader header;
+    memcpy(&header, data, sizeof(header));
+    BinaryReader reader(data + sizeof(header), size - sizeof(header));
+    uint32_t level = 0;
+    uint32_t line = 0;
+    std::string file;
+    switch(header.site) {
+        case BinaryLog::SITE_DEFINE: {
+            BinaryLog::Site site;
+            if(!reader.readUint32(site.id) || !reader.readUint32(level)
+                    || !reader.readUint32(line) || !reader.readString(site.file)
+                    || !reader.readString(site.fmt) || !reader.readString(site.types)) {
+                return false;
+            }
+            site.level = (LogLevel::Level)level;
+            site.line = line;
+            m_sites[site.id] = site;
+            return true;
+        }
+        case BinaryLog::LOGGER_DEFINE: {
+            uint32_t id = 0;
+            std::string name;
+            if(!reader.readUint32(id) || !reader.readString(name)) {
+                return false;
+            }
+            m_loggers[id].reset(new Logger(name));
+            return true;
+        }
+        case BinaryLog::THREAD_DEFINE:
+            return reader.readString(m_threads[header.threadId]);
+        default:
+            break;
+    }
+
+    const char* content = nullptr;
+    uint32_t content_len = 0;
+    const BinaryLog::Site* site = nullptr;
+    if(header.site == BinaryLog::SITE_TEXT) {
+        if(!reader.readUint32(level) || !reader.readUint32(line)
+                || !reader.readString(file) || !reader.readString(content, content_len)) {
+            return false;
+        }
+    } else {
+        auto it = m_sites.find(header.site);
+        if(it == m_sites.end()) {
+            // 定义没有写进文件，比如写入失败，记录本身是完整的，用占位日志代替
+            decodeUnknown(header, os);
+            return true;
+        }
+        site = &it->second;
+        level = site->level;
+        line = site->line;
+    }
+    if(level < LogLevel::DEBUG || level > LogLevel::FATAL) {
+        return false;
+    }
+
+    Logger::ptr logger = getLogger(header.logger);
+    LogEvent::ptr event = LogEvent::AllocEvent(logger, (LogLevel::Level)level
+                , site ? site->file.c_str() : file.c_str(), line, 0, header.threadId
+                , header.fiberId, header.time, m_threads[header.threadId]);
+    if(site) {
+        BinaryLog::FormatArgs(event->getSS(), site->fmt, site->types
+                    , data + sizeof(header), size - sizeof(header));
+    } else {
+        event->getSS().write(content, content_len);
+    }
+    LogStream& out = m_formatter->render(logger, (LogLevel::Level)level, event);
+    os.write(out.data(), out.size());
+    LogEvent::FreeEvent(event);
+    ++m_count;
+    return true;
+}
+
+void BinaryLogDecoder::decodeUnknown(const BinaryLog::RecordHeader& header, std::ostream& os) {
+    Logger::ptr logger = getLogger(header.logger);
+    LogEvent::ptr event = LogEvent::AllocEvent(logger, LogLevel::UNKNOW, "", 0, 0, header.threadId
+                , header.fiberId, header.time, m_threads[header.threadId]);
+    event->getSS() << "<unknown site " << header.site << ", "
+        << header.size - sizeof(header) << " bytes of arguments>";
+    LogStream& out = m_formatter->render(logger, LogLevel::UNKNOW, event);
+    os.write(out.data(), out.size());
+    LogEvent::FreeEvent(event);
+    ++m_count;
+}
+
+Logger::ptr BinaryLogDecoder::getLogger(uint32_t id) {
+    Logger::ptr& logger = m_loggers[id];
+    if(!logger) {
+        logger.reset(new Logger("UNKNOW"));
+    }
+    return logger;
+}
+
+}
@@ -0,0 +1,347 @@
+#pragma once
+
+#include <string.h>
+#include <stdint.h>
+#include <string>
+#include <map>
+#include <iostream>
+#include <type_traits>
+#include "log.h"
+
+// 使用二进制方式将日志级别level的日志写入到logger，fmt必须是字符串常量
+// 调用处的格式字符串和参数类型在第一次执行时注册一次，之后每次只把参数的原始值拷贝到记录中，格式化推迟到解码时
+// 参数支持整数、浮点数、字符串(const char*)和指针，格式按printf检查
+#define BIN_LOG_LEVEL(logger, level, fmt, ...) \
+    do { \
+        if(logger->getLevel() <= level) { \
+            if(false) { \
+                atpdxy::BinaryLog::CheckFormat(fmt, ##__VA_ARGS__); \
+            } \
+            static const uint32_t s_bin_log_site = atpdxy::BinaryLog::RegisterSite(level, __FILE__, __LINE__, fmt, \
+                    atpdxy::BinaryLog::ArgTypes<decltype(atpdxy::BinaryLog::TypesOf(__VA_ARGS__))>::Get()); \
+            atpdxy::BinaryLog::Write(logger, level, s_bin_log_site, ##__VA_ARGS__); \
+        } \
+    } while(0)
+
+// 写debug级别的二进制日志
+#define BIN_DEBUG(logger, fmt, ...) BIN_LOG_LEVEL(logger, atpdxy::LogLevel::DEBUG, fmt, ##__VA_ARGS__)
+
+// 写info级别的二进制日志
+#define BIN_INFO(logger, fmt, ...)  BIN_LOG_LEVEL(logger, atpdxy::LogLevel::INFO, fmt, ##__VA_ARGS__)
+
+// 写warn级别的二进制日志
+#define BIN_WARN(logger, fmt, ...)  BIN_LOG_LEVEL(logger, atpdxy::LogLevel::WARN, fmt, ##__VA_ARGS__)
+
+// 写error级别的二进制日志
+#define BIN_ERROR(logger, fmt, ...) BIN_LOG_LEVEL(logger, atpdxy::LogLevel::ERROR, fmt, ##__VA_ARGS__)
+
+// 写fatal级别的二进制日志
+#define BIN_FATAL(logger, fmt, ...) BIN_LOG_LEVEL(logger, atpdxy::LogLevel::FATAL, fmt, ##__VA_ARGS__)
+
+namespace atpdxy {
+
+// 二进制日志的记录格式、调用处注册表和编码
+// 文件由若干段组成，每段以8字节的魔数开头，后面是连续的记录，每条记录以RecordHeader开头
+// 调用处、日志器和线程的定义也是记录，在引用它们的日志之前写出，解码器遇到魔数时清空已有的定义
+// 记录按本机字节序写出，只能在相同架构的机器上解码
+// 写一条记录的开销主要是读取墙上时间和拷贝到线程的环形缓冲区，日志器只在复制输出器列表时短暂持有自旋锁，查找调用处不加锁
+class BinaryLog {
+public:
+    // 文件每段开头的魔数
+    static const char* const MAGIC;
+    // 魔数长度
+    static const size_t MAGIC_SIZE = 8;
+
+    // 记录头，site是调用处编号，下面几个特殊编号表示定义或者文本记录
+    struct RecordHeader {
+        // 整条记录的字节数，包括记录头
+        uint32_t size;
+        // 调用处编号
+        uint32_t site;
+        // 微秒时间戳
+        uint64_t time;
+        // 线程id
+        uint32_t threadId;
+        // 协程id
+        uint32_t fiberId;
+        // 日志器编号
+        uint32_t logger;
+        uint32_t reserved;
+    };
+
+    // 已经格式化好的文本日志，内容是级别、行号、文件名和日志内容
+    static const uint32_t SITE_TEXT = 0;
+    // 调用处定义，内容是编号、级别、行号、文件名、格式和参数类型
+    static const uint32_t SITE_DEFINE = 0xffffffff;
+    // 日志器定义，内容是编号和名称
+    static const uint32_t LOGGER_DEFINE = 0xfffffffe;
+    // 线程定义，记录头中是线程id，内容是线程名称
+    static const uint32_t THREAD_DEFINE = 0xfffffffd;
+
+    // 单条记录的最大字节数
+    static const size_t MAX_RECORD_SIZE = 1024 * 1024;
+
+    // 一个调用处
+    struct Site {
+        uint32_t id = 0;
+        LogLevel::Level level = LogLevel::UNKNOW;
+        int32_t line = 0;
+        std::string file;
+        std::string fmt;
+        // 每个参数一个字符：i有符号整数，u无符号整数，d浮点数，s字符串，p指针
+        std::string types;
+    };
+
+    // 注册调用处，返回编号，每个调用处只在第一次执行时调用
+    static uint32_t RegisterSite(LogLevel::Level level, const char* file, int32_t line
+                                 , const char* fmt, const char* types);
+
+    // 注册日志器名称，返回编号，日志器构造时调用
+    static uint32_t RegisterLogger(const std::string& name);
+
+    // 查找调用处，不存在返回nullptr，不加锁，调用处注册后不会删除，返回的指针一直有效
+    static const Site* GetSite(uint32_t id);
+
+    // 返回编号从site_from开始的调用处和从logger_from开始的日志器的定义记录，用于写到文件中
+    // 返回后两个参数更新为下一次开始的编号
+    static void DumpDefines(std::string& out, uint32_t& site_from, uint32_t& logger_from);
+
+    // 把printf格式和编码后的参数格式化到os中
+    static void FormatArgs(std::ostream& os, const std::string& fmt, const std::string& types
+                           , const char* args, size_t size);
+
+    // 编码一个字符串
+    static void AppendString(std::string& out, const char* str, size_t len);
+
+    // 编码一个32位整数
+    static void AppendUint32(std::string& out, uint32_t v);
+
+    // 返回记录头
+    static RecordHeader MakeHeader(uint32_t size, uint32_t site, uint64_t time
+                                   , uint32_t thread_id, uint32_t fiber_id, uint32_t logger) {
+        RecordHeader header;
+        header.size = size;
+        header.site = site;
+        header.time = time;
+        header.threadId = thread_id;
+        header.fiberId = fiber_id;
+        header.logger = logger;
+        header.reserved = 0;
+        return header;
+    }
+
+    // 只用于在编译时按printf检查格式和参数，不会被调用
+    __attribute__((format(printf, 1, 2))) static void CheckFormat(const char* fmt, ...) {}
+
+    // 参数类型列表，只在decltype中使用
+    template<class... Args>
+    struct TypeList {};
+
+    template<class... Args>
+    static TypeList<typename std::decay<Args>::type...> TypesOf(const Args&... args);
+
+    // 参数类型对应的类型字符串
+    template<class List>
+    struct ArgTypes;
+
+    template<class... Args>
+    struct ArgTypes<TypeList<Args...> > {
+        static const char* Get() {
+            static const char s_types[] = {TypeCode<Args>::value..., '\0'};
+            return s_types;
+        }
+    };
+
+    // 编码参数并写入日志器
+    template<class... Args>
+    static void Write(const std::shared_ptr<Logger>& logger, LogLevel::Level level, uint32_t site, const Args&... args) {
+        size_t size = sizeof(RecordHeader) + ArgsSize(args...);
+        if(size > MAX_RECORD_SIZE) {
+            return;
+        }
+        // 记录一般很短，放在栈上，超长时才分配
+        char stack[512];
+        char* buf = size <= sizeof(stack) ? stack : new char[size];
+        RecordHeader header = MakeHeader(size, site, GetCurrentUS(), GetThreadId()
+                                         , GetFiberId(), logger->getId());
+        memcpy(buf, &header, sizeof(header));
+        Encode(buf + sizeof(header), args...);
+        logger->logBinary(level, buf, size);
+        if(buf != stack) {
+            delete[] buf;
+        }
+    }
+private:
+    // 类型编码
+    template<class T, class Enable = void>
+    struct TypeCode;
+
+    template<class T>
+    struct TypeCode<T, typename std::enable_if<std::is_same<T, char*>::value
+                                               || std::is_same<T, const char*>::value>::type> {
+        static const char value = 's';
+    };
+
+    template<class T>
+    struct TypeCode<T, typename std::enable_if<std::is_pointer<T>::value
+                                               && !std::is_same<T, char*>::value
+                                               && !std::is_same<T, const char*>::value>::type> {
+        static const char value = 'p';
+    };
+
+    template<class T>
+    struct TypeCode<T, typename std::enable_if<std::is_floating_point<T>::value>::type> {
+        static const char value = 'd';
+    };
+
+    template<class T>
+    struct TypeCode<T, typename std::enable_if<std::is_enum<T>::value
+                                               || (std::is_integral<T>::value && std::is_signed<T>::value)>::type> {
+        static const char value = 'i';
+    };
+
+    template<class T>
+    struct TypeCode<T, typename std::enable_if<std::is_integral<T>::value && std::is_unsigned<T>::value>::type> {
+        static const char value = 'u';
+    };
+
+    // 参数编码后的字节数
+    static size_t ArgsSize() { return 0;}
+
+    template<class T, class... Args>
+    static size_t ArgsSize(const T& v, const Args&... args) {
+        return ArgSize(v) + ArgsSize(args...);
+    }
+
+    template<class T>
+    static size_t ArgSize(const T&) { return 8;}
+
+    static size_t ArgSize(const char* v) { return 4 + (v ? strlen(v) : 0);}
+
+    static size_t ArgSize(char* v) { return ArgSize((const char*)v);}
+
+    // 编码参数，整数统一扩展成64位，浮点数扩展成double，字符串是4字节长度加内容
+    static void Encode(char* p) {}
+
+    template<class T, class... Args>
+    static void Encode(char* p, const T& v, const Args&... args) {
+        Encode(p + EncodeArg(p, v), args...);
+    }
+
+    template<class T>
+    static typename std::enable_if<std::is_floating_point<T>::value, size_t>::type
+    EncodeArg(char* p, const T& v) {
+        double d = v;
+        memcpy(p, &d, 8);
+        return 8;
+    }
+
+    template<class T>
+    static typename std::enable_if<std::is_integral<T>::value || std::is_enum<T>::value, size_t>::type
+    EncodeArg(char* p, const T& v) {
+        uint64_t u = (uint64_t)(int64_t)v;
+        if(std::is_unsigned<T>::value) {
+            u = (uint64_t)v;
+        }
+        memcpy(p, &u, 8);
+        return 8;
+    }
+
+    template<class T>
+    static size_t EncodeArg(char* p, T* const& v) {
+        uint64_t u = (uint64_t)(uintptr_t)v;
+        memcpy(p, &u, 8);
+        return 8;
+    }
+
+    static size_t EncodeArg(char* p, const char* const& v) {
+        uint32_t len = v ? strlen(v) : 0;
+        memcpy(p, &len, 4);
+        memcpy(p + 4, v, len);
+        return 4 + len;
+    }
+
+    static size_t EncodeArg(char* p, char* const& v) {
+        return EncodeArg(p, (const char* const&)v);
+    }
+};
+
+// 二进制日志文件输出器，在异步输出器的基础上写入二进制记录
+// 二进制日志直接拷贝调用处编码好的记录，文本日志记录级别、文件、行号和日志内容，都由解码工具按格式器还原成文本
+class BinaryLogAppender : public AsyncLogAppender {
+public:
+    typedef std::shared_ptr<BinaryLogAppender> ptr;
+
+    // 构造函数，参数和异步输出器相同
+    BinaryLogAppender(const std::string& filename, size_t buffer_size = 0, bool block = false);
+
+    ~BinaryLogAppender();
+
+    // 写入文本日志
+    void log(Logger::ptr logger, LogLevel::Level level, LogEvent::ptr event) override;
+
+    // 写入二进制日志
+    void logBinary(Logger* logger, LogLevel::Level level, const char* data, size_t size) override;
+
+    // 将输出器的配置转换成yaml
+    std::string toYamlString() override;
+protected:
+    // 写入线程名称的定义
+    void onThreadAttached() override;
+
+    // 写出魔数和新注册的调用处、日志器定义
+    void prologue(std::string& out) override;
+
+    // 定义全部写出后才推进编号，没写完时下一批重新开始一段
+    void prologueWritten(size_t written, size_t size) override;
+
+    // 提示转换成文本记录
+    void formatNotice(const std::string& msg, std::string& out) override;
+private:
+    // 是否已经写出魔数
+    bool m_started = false;
+    // 下一个需要写出定义的调用处和日志器编号，只在后台线程中使用
+    uint32_t m_nextSite = 1;
+    uint32_t m_nextLogger = 1;
+    // 本批prologue写到的编号，写出成功后才更新到上面两个值
+    uint32_t m_pendingSite = 1;
+    uint32_t m_pendingLogger = 1;
+};
+
+// 二进制日志文件解码器，按格式器把记录还原成文本
+class BinaryLogDecoder {
+public:
+    // 构造函数，formatter为空时使用日志器的默认格式
+    BinaryLogDecoder(LogFormatter::ptr formatter = nullptr);
+
+    // 解码is中的全部内容输出到os，返回解码的日志条数，不是二进制日志返回-1
+    // 遇到损坏的记录时跳到下一个魔数继续解码，引用了未定义调用处的记录输出一条占位日志
+    int64_t decode(std::istream& is, std::ostream& os);
+
+    // 返回因为损坏而跳过的字节数
+    uint64_t getSkipped() const { return m_skipped;}
+private:
+    // 解码一条记录，返回false表示格式错误
+    bool decodeRecord(const char* data, size_t size, std::ostream& os);
+
+    // 输出一条占位日志，代替无法解码的记录
+    void decodeUnknown(const BinaryLog::RecordHeader& header, std::ostream& os);
+
+    // 返回日志器编号对应的日志器
+    Logger::ptr getLogger(uint32_t id);
+private:
+    // 格式器
+    LogFormatter::ptr m_formatter;
+    // 调用处定义
+    std::map<uint32_t, BinaryLog::Site> m_sites;
+    // 日志器
+    std::map<uint32_t, Logger::ptr> m_loggers;
+    // 线程名称
+    std::map<uint32_t, std::string> m_threads;
+    // 解码的日志条数
+    int64_t m_count = 0;
+    // 跳过的字节数
+    uint64_t m_skipped = 0;
+};
+
+}
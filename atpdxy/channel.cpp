@@ -0,0 +1,181 @@
+#include "channel.h"
+#include "macro.h"
+
+namespace atpdxy {
+
+ChannelBase::ChannelBase() {
+}
+
+ChannelBase::~ChannelBase() {
+    ASSERT(!m_sendWaiters.head && !m_recvWaiters.head);
+}
+
+void ChannelBase::close() {
+    seal();
+    m_closed.store(true, std::memory_order_release);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    MutexType::Lock lock(m_mutex);
+    WaitList* lists[] = {&m_sendWaiters, &m_recvWaiters};
+    for(WaitList* list : lists) {
+        while(WaitNode* node = list->head) {
+            list->head = node->next;
+            node->prev = node->next = nullptr;
+            node->linked = false;
+            // 在锁内唤醒，select的等待者要先拿到锁把节点从各个通道删除后才能返回
+            node->waiter->wake();
+        }
+        list->tail = nullptr;
+        list->size.store(0, std::memory_order_relaxed);
+    }
+}
+
+void ChannelBase::wait(bool send) {
+    WaitLocal<FiberWaiter> waiter;
+    WaitLocal<WaitNode> node;
+    node->waiter = waiter.get();
+    addWaiter(node.get(), send);
+    // 加入队列之后再检查一次，对端在加入之前完成的操作看不到等待者，不会通知
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if((send ? canSend() : canRecv()) || isClosed()) {
+        // 删除失败说明已经被唤醒，唤醒者只修改了状态，可以直接返回
+        removeWaiter(node.get(), send);
+        return;
+    }
+    waiter->park();
+}
+
+void ChannelBase::addWaiter(WaitNode* node, bool send) {
+    WaitList& list = send ? m_sendWaiters : m_recvWaiters;
+    MutexType::Lock lock(m_mutex);
+    node->prev = list.tail;
+    node->next = nullptr;
+    if(list.tail) {
+        list.tail->next = node;
+    } else {
+        list.head = node;
+    }
+    list.tail = node;
+    node->linked = true;
+    list.size.fetch_add(1, std::memory_order_seq_cst);
+}
+
+bool ChannelBase::removeWaiter(WaitNode* node, bool send) {
+    WaitList& list = send ? m_sendWaiters : m_recvWaiters;
+    MutexType::Lock lock(m_mutex);
+    if(!node->linked) {
+        return false;
+    }
+    if(node->prev) {
+        node->prev->next = node->next;
+    } else {
+        list.head = node->next;
+    }
+    if(node->next) {
+        node->next->prev = node->prev;
+    } else {
+        list.tail = node->prev;
+    }
+    node->prev = node->next = nullptr;
+    node->linked = false;
+    list.size.fetch_sub(1, std::memory_order_relaxed);
+    return true;
+}
+
+void ChannelBase::notify(WaitList& list) {
+    MutexType::Lock lock(m_mutex);
+    WaitNode* node = list.head;
+    if(!node) {
+        return;
+    }
+    list.head = node->next;
+    if(list.head) {
+        list.head->prev = nullptr;
+    } else {
+        list.tail = nullptr;
+    }
+    node->prev = node->next = nullptr;
+    node->linked = false;
+    list.size.fetch_sub(1, std::memory_order_relaxed);
+    node->waiter->wake();
+}
+
+size_t ChannelSelect::addCase(ChannelBase* channel, bool send, std::function<bool()> attempt) {
+    Case c;
+    c.channel = channel;
+    c.send = send;
+    c.attempt = std::move(attempt);
+    m_cases.push_back(std::move(c));
+    return m_cases.size() - 1;
+}
+
+int ChannelSelect::tryWait() {
+    size_t n = m_cases.size();
+    for(size_t i = 0; i < n; ++i) {
+        size_t idx = (m_start + i) % n;
+        if(m_cases[idx].attempt()) {
+            m_start = idx + 1;
+            return idx;
+        }
+    }
+    return -1;
+}
+
+int ChannelSelect::wait() {
+    size_t n = m_cases.size();
+    m_nodes.resize(n);
+    m_woken.resize(n);
+    while(true) {
+        int r = tryWait();
+        if(r >= 0) {
+            return r;
+        }
+        // 已经关闭的通道上，发送分支不能再完成，接收分支取完关闭前发送的元素后不能再完成
+        bool alive = false;
+        for(auto& c : m_cases) {
+            if(!c.channel->isClosed() || (!c.send && !c.channel->isDrained())) {
+                alive = true;
+                break;
+            }
+        }
+        if(!alive) {
+            return -1;
+        }
+
+        // 同一个等待者加入所有通道的等待队列，任何一个通道都可以唤醒它
+        WaitLocal<FiberWaiter> waiter;
+        for(size_t i = 0; i < n; ++i) {
+            m_nodes[i] = ChannelBase::WaitNode();
+            m_nodes[i].waiter = waiter.get();
+            m_cases[i].channel->addWaiter(&m_nodes[i], m_cases[i].send);
+        }
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        // 已经关闭并且不能再完成的分支不算，否则其他分支还在等待时会一直空转
+        bool ready = false;
+        for(auto& c : m_cases) {
+            if(c.send ? (!c.channel->isClosed() && c.channel->canSend()) : c.channel->canRecv()) {
+                ready = true;
+                break;
+            }
+        }
+        if(!ready) {
+            waiter->park();
+        }
+        // 唤醒者在锁内唤醒，从所有通道删除之后不会再有人访问waiter
+        for(size_t i = 0; i < n; ++i) {
+            m_woken[i] = !m_cases[i].channel->removeWaiter(&m_nodes[i], m_cases[i].send);
+        }
+        r = tryWait();
+        // 被某个通道唤醒却没有从它完成，把这次通知转给该通道的下一个等待者，避免通知丢失
+        for(size_t i = 0; i < n; ++i) {
+            if(m_woken[i] && (int)i != r) {
+                ChannelBase* ch = m_cases[i].channel;
+                ch->notify(m_cases[i].send ? ch->m_sendWaiters : ch->m_recvWaiters);
+            }
+        }
+        if(r >= 0) {
+            return r;
+        }
+    }
+}
+
+}
@@ -0,0 +1,348 @@
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <new>
+#include <thread>
+#include <type_traits>
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+#include "mutex.h"
+
+namespace atpdxy {
+
+// 通道的类型无关部分：等待发送和等待接收的队列、关闭状态
+// 等待者是调用者的局部节点(见WaitLocal)，通过FiberWaiter挂起协程或阻塞线程
+class ChannelBase : Noncopyable {
+friend class ChannelSelect;
+public:
+    // 唤醒在锁内进行，可能需要系统调用，持有者被抢占时自旋会白白耗尽时间片，所以不用自旋锁
+    typedef Mutex MutexType;
+
+    virtual ~ChannelBase();
+
+    // 关闭通道，之后发送都失败，接收在取完剩余元素后失败，唤醒所有等待者
+    void close();
+
+    // 是否已经关闭
+    bool isClosed() const { return m_closed.load(std::memory_order_acquire);}
+
+    // 缓冲区现在是否有空位，用于挂起前的检查
+    virtual bool canSend() const = 0;
+
+    // 缓冲区现在是否有元素
+    virtual bool canRecv() const = 0;
+
+    // 是否已经关闭并且所有发送成功的元素都已经被取走
+    virtual bool isDrained() const = 0;
+protected:
+    // 等待队列的节点
+    struct WaitNode {
+        // 挂起的等待者，select时多个节点指向同一个等待者
+        FiberWaiter* waiter = nullptr;
+        WaitNode* prev = nullptr;
+        WaitNode* next = nullptr;
+        // 是否还在队列中
+        bool linked = false;
+    };
+
+    // 双向链表实现的等待队列，可以从中间删除
+    struct WaitList {
+        WaitNode* head = nullptr;
+        WaitNode* tail = nullptr;
+        // 节点数量，发送和接收成功后读取它判断是否需要唤醒
+        std::atomic<size_t> size = {0};
+    };
+
+    ChannelBase();
+
+    // 发送成功后唤醒一个等待接收者
+    void notifyRecv() {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if(m_recvWaiters.size.load(std::memory_order_relaxed)) {
+            notify(m_recvWaiters);
+        }
+    }
+
+    // 接收成功后唤醒一个等待发送者
+    void notifySend() {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if(m_sendWaiters.size.load(std::memory_order_relaxed)) {
+            notify(m_sendWaiters);
+        }
+    }
+
+    // 挂起直到可能可以发送(send为true)或者接收
+    void wait(bool send);
+
+    // 加入等待队列
+    void addWaiter(WaitNode* node, bool send);
+
+    // 从等待队列中删除，已经被唤醒者取出时返回false
+    bool removeWaiter(WaitNode* node, bool send);
+
+    // 唤醒队列中的一个等待者
+    void notify(WaitList& list);
+
+    // 关闭时调用，之后发送不能再占用新的槽
+    virtual void seal() = 0;
+protected:
+    // 是否已经关闭
+    std::atomic<bool> m_closed = {false};
+private:
+    // 保护等待队列
+    MutexType m_mutex;
+    // 等待发送的队列
+    WaitList m_sendWaiters;
+    // 等待接收的队列
+    WaitList m_recvWaiters;
+};
+
+// 有界的多生产者多消费者通道，用于串联协程流水线
+// 缓冲区是Vyukov的有界MPMC环形队列，每个槽有一个序号，发送和接收在不满和不空时只需要一次CAS，不加锁
+// 满时发送、空时接收挂起当前协程，由对端成功后唤醒，工作线程不会被阻塞，满的通道对上游形成背压
+// 不在协程中调用时阻塞当前线程，因此通道也可以连接普通线程和协程
+template<class T>
+class Channel : public ChannelBase {
+public:
+    typedef std::shared_ptr<Channel> ptr;
+
+    // 构造函数，容量向上取整为2的幂
+    // 至少为2，只有一个槽时写入后的序号和下一次写入的位置相同，无法区分满和空
+    Channel(size_t capacity = 64) {
+        size_t cap = 2;
+        while(cap < capacity) {
+            cap <<= 1;
+        }
+        m_mask = cap - 1;
+        m_buffer = new Cell[cap];
+        for(size_t i = 0; i < cap; ++i) {
+            m_buffer[i].seq.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    ~Channel() {
+        // 析构剩余的元素
+        size_t head = m_head.load(std::memory_order_relaxed);
+        size_t tail = m_tail.load(std::memory_order_relaxed) & CLOSED_BIT_MASK;
+        for(; head != tail; ++head) {
+            m_buffer[head & m_mask].get()->~T();
+        }
+        delete[] m_buffer;
+    }
+
+    // 返回容量
+    size_t getCapacity() const { return m_mask + 1;}
+
+    // 返回当前元素数量的近似值
+    size_t size() const {
+        size_t head = m_head.load(std::memory_order_relaxed);
+        size_t tail = m_tail.load(std::memory_order_relaxed) & CLOSED_BIT_MASK;
+        return tail > head ? tail - head : 0;
+    }
+
+    // 尝试发送，满或者已经关闭时返回false，失败时不会移走v
+    bool tryPush(T&& v) {
+        return tryPushImpl(std::move(v));
+    }
+
+    bool tryPush(const T& v) {
+        return tryPushImpl(v);
+    }
+
+    // 尝试接收，空时返回false
+    bool tryPop(T& v) {
+        size_t pos = m_head.load(std::memory_order_relaxed);
+        Cell* cell = nullptr;
+        while(true) {
+            cell = &m_buffer[pos & m_mask];
+            size_t seq = cell->seq.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+            if(diff == 0) {
+                if(m_head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if(diff < 0) {
+                return false;
+            } else {
+                pos = m_head.load(std::memory_order_relaxed);
+            }
+        }
+        T* p = cell->get();
+        v = std::move(*p);
+        p->~T();
+        cell->seq.store(pos + m_mask + 1, std::memory_order_release);
+        notifySend();
+        return true;
+    }
+
+    // 发送，满时挂起直到有空间，通道关闭返回false
+    bool push(T&& v) {
+        return pushImpl(std::move(v));
+    }
+
+    bool push(const T& v) {
+        return pushImpl(v);
+    }
+
+    // 接收，空时挂起直到有元素，通道关闭并且已经取完返回false
+    bool pop(T& v) {
+        while(true) {
+            if(tryPop(v)) {
+                return true;
+            }
+            if(isClosed()) {
+                return popClosed(v);
+            }
+            wait(false);
+        }
+    }
+
+    bool canSend() const override {
+        size_t pos = m_tail.load(std::memory_order_relaxed) & CLOSED_BIT_MASK;
+        size_t seq = m_buffer[pos & m_mask].seq.load(std::memory_order_acquire);
+        return (intptr_t)seq - (intptr_t)pos >= 0;
+    }
+
+    bool canRecv() const override {
+        size_t pos = m_head.load(std::memory_order_relaxed);
+        size_t seq = m_buffer[pos & m_mask].seq.load(std::memory_order_acquire);
+        return (intptr_t)seq - (intptr_t)(pos + 1) >= 0;
+    }
+
+    bool isDrained() const override {
+        if(!isClosed()) {
+            return false;
+        }
+        size_t tail = m_tail.load(std::memory_order_acquire) & CLOSED_BIT_MASK;
+        return m_head.load(std::memory_order_acquire) >= tail;
+    }
+protected:
+    void seal() override {
+        m_tail.fetch_or(CLOSED_BIT, std::memory_order_seq_cst);
+    }
+private:
+    // m_tail的最高位表示已经关闭，关闭之后占用槽的CAS都会失败，发送成功的元素一定在关闭前占用了槽
+    static const size_t CLOSED_BIT = (size_t)1 << (sizeof(size_t) * 8 - 1);
+    static const size_t CLOSED_BIT_MASK = CLOSED_BIT - 1;
+
+    // 环形队列的槽，seq等于pos时可以写入，等于pos+1时可以读出
+    struct Cell {
+        std::atomic<size_t> seq;
+        typename std::aligned_storage<sizeof(T), alignof(T)>::type storage;
+
+        T* get() { return reinterpret_cast<T*>(&storage);}
+    };
+
+    template<class V>
+    bool tryPushImpl(V&& v) {
+        size_t pos = m_tail.load(std::memory_order_relaxed);
+        Cell* cell = nullptr;
+        while(true) {
+            if(pos & CLOSED_BIT) {
+                return false;
+            }
+            cell = &m_buffer[pos & m_mask];
+            size_t seq = cell->seq.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+            if(diff == 0) {
+                if(m_tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if(diff < 0) {
+                return false;
+            } else {
+                pos = m_tail.load(std::memory_order_relaxed);
+            }
+        }
+        new (cell->get()) T(std::forward<V>(v));
+        cell->seq.store(pos + 1, std::memory_order_release);
+        notifyRecv();
+        return true;
+    }
+
+    // 关闭后接收，关闭前占用了槽的发送可能还没有写完，取到接收位置追上发送位置为止
+    bool popClosed(T& v) {
+        while(!isDrained()) {
+            if(tryPop(v)) {
+                return true;
+            }
+            std::this_thread::yield();
+        }
+        return false;
+    }
+
+    template<class V>
+    bool pushImpl(V&& v) {
+        while(true) {
+            if(tryPushImpl(std::forward<V>(v))) {
+                return true;
+            }
+            if(isClosed()) {
+                return false;
+            }
+            wait(true);
+        }
+    }
+private:
+    // 槽数减1
+    size_t m_mask = 0;
+    // 环形队列
+    Cell* m_buffer = nullptr;
+    // 填充，将发送和接收的位置分开在不同的缓存行上，避免伪共享
+    char m_pad1[64];
+    // 发送的位置
+    std::atomic<size_t> m_tail = {0};
+    char m_pad2[64 - sizeof(std::atomic<size_t>)];
+    // 接收的位置
+    std::atomic<size_t> m_head = {0};
+};
+
+// 在多个通道上等待，哪个分支先可以完成就执行哪个，类似Go的select
+// 分支在构造后可以反复使用，每次wait从不同的分支开始尝试，避免总是偏向前面的通道
+class ChannelSelect : Noncopyable {
+public:
+    // 添加接收分支，收到的元素写入value，返回分支下标
+    template<class T>
+    size_t recv(Channel<T>& channel, T& value) {
+        Channel<T>* ch = &channel;
+        T* v = &value;
+        return addCase(ch, false, [ch, v](){ return ch->tryPop(*v);});
+    }
+
+    // 添加发送分支，发送value的拷贝，返回分支下标
+    template<class T>
+    size_t send(Channel<T>& channel, const T& value) {
+        Channel<T>* ch = &channel;
+        const T* v = &value;
+        return addCase(ch, true, [ch, v](){ return ch->tryPush(*v);});
+    }
+
+    // 不等待，返回完成的分支下标，没有可以完成的分支返回-1
+    int tryWait();
+
+    // 等待直到有一个分支完成，返回分支下标，所有分支的通道都已经关闭并且不能再完成返回-1
+    int wait();
+private:
+    // 一个分支
+    struct Case {
+        ChannelBase* channel;
+        bool send;
+        std::function<bool()> attempt;
+    };
+
+    size_t addCase(ChannelBase* channel, bool send, std::function<bool()> attempt);
+private:
+    // 所有分支
+    std::vector<Case> m_cases;
+    // 等待时每个分支在通道中的节点
+    std::vector<ChannelBase::WaitNode> m_nodes;
+    // 等待结束时每个分支是否已经被通道唤醒
+    std::vector<char> m_woken;
+    // 下一次开始尝试的分支
+    size_t m_start = 0;
+};
+
+}
@@ -0,0 +1,120 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <ucontext.h>
+#include "context_config.h"
+
+// 协程上下文切换
+// context_config.h中定义ATPDXY_FIBER_ASM时使用汇编实现，只保存被调用者保存的寄存器，不涉及信号掩码的系统调用
+// 否则退回到glibc的ucontext实现
+#ifdef ATPDXY_FIBER_ASM
+extern "C" {
+// 保存当前寄存器到当前栈上，将栈顶写入*from，然后切换到to指向的栈并恢复寄存器
+void atpdxy_swap_context(void** from, void* to);
+
+// 新协程第一次切入时的入口，调用栈帧中保存的函数
+void atpdxy_context_entry();
+}
+#endif
+
+namespace atpdxy {
+
+// 协程上下文
+struct Context {
+#ifdef ATPDXY_FIBER_ASM
+    // 切出时的栈顶，寄存器保存在栈顶处
+    void* sp = nullptr;
+#else
+    // ucontext上下文
+    ucontext_t uc;
+#endif
+};
+
+// 返回当前使用的上下文切换实现名称
+inline const char* ContextBackendName() {
+#ifdef ATPDXY_FIBER_ASM
+    return "asm";
+#else
+    return "ucontext";
+#endif
+}
+
+// 初始化线程主协程的上下文，返回是否成功
+inline bool InitContext(Context& ctx) {
+#ifdef ATPDXY_FIBER_ASM
+    ctx.sp = nullptr;
+    return true;
+#else
+    return getcontext(&ctx.uc) == 0;
+#endif
+}
+
+// 在[stack, stack + size)上构造一个新的上下文，第一次切入时执行fn，fn不允许返回
+inline bool MakeContext(Context& ctx, void* stack, size_t size, void (*fn)()) {
+#ifdef ATPDXY_FIBER_ASM
+    // 栈顶按16字节对齐
+    uintptr_t top = ((uintptr_t)stack + size) & ~(uintptr_t)15;
+#if defined(__x86_64__)
+    // 栈帧布局(低地址到高地址)：fpucw, mxcsr, r15, r14, r13, r12, rbx, rbp, 返回地址
+    // 预留8字节使得atpdxy_context_entry中call之前rsp按16字节对齐
+    uint64_t* frame = (uint64_t*)(top - 88);
+    frame[0] = 0x037F;                      // x87控制字默认值
+    frame[1] = 0x1F80;                      // mxcsr默认值
+    frame[2] = 0;                           // r15
+    frame[3] = 0;                           // r14
+    frame[4] = 0;                           // r13
+    frame[5] = 0;                           // r12
+    frame[6] = (uint64_t)fn;                // rbx，入口函数
+    frame[7] = 0;                           // rbp
+    frame[8] = (uint64_t)&atpdxy_context_entry;
+#elif defined(__aarch64__)
+    // 栈帧布局(低地址到高地址)：d8-d15, x19-x28, x29, x30
+    uint64_t* frame = (uint64_t*)(top - 176);
+    for(int i = 0; i < 22; ++i) {
+        frame[i] = 0;
+    }
+    frame[8] = (uint64_t)fn;                // x19，入口函数
+    frame[19] = (uint64_t)&atpdxy_context_entry;
+#else
+#error "ATPDXY_FIBER_ASM is not supported on this architecture"
+#endif
+    ctx.sp = frame;
+    return true;
+#else
+    if(getcontext(&ctx.uc)) {
+        return false;
+    }
+    ctx.uc.uc_link = nullptr;
+    ctx.uc.uc_stack.ss_sp = stack;
+    ctx.uc.uc_stack.ss_size = size;
+    makecontext(&ctx.uc, fn, 0);
+    return true;
+#endif
+}
+
+// 返回已切出的上下文保存时的栈顶，用于共享栈模式下计算实际使用的栈空间
+inline void* ContextStackPointer(const Context& ctx) {
+#ifdef ATPDXY_FIBER_ASM
+    return ctx.sp;
+#elif defined(__x86_64__)
+    return (void*)ctx.uc.uc_mcontext.gregs[REG_RSP];
+#elif defined(__aarch64__)
+    return (void*)ctx.uc.uc_mcontext.sp;
+#else
+    // 不支持的架构，共享栈模式不可用
+    return nullptr;
+#endif
+}
+
+// 保存当前上下文到from，切换到to，返回是否成功
+inline bool SwapContext(Context& from, Context& to) {
+#ifdef ATPDXY_FIBER_ASM
+    atpdxy_swap_context(&from.sp, to.sp);
+    return true;
+#else
+    return swapcontext(&from.uc, &to.uc) == 0;
+#endif
+}
+
+}
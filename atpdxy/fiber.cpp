@@ -3,7 +3,14 @@
 #include "macro.h"
 #include "log.h"
 #include "scheduler.h"
+#include "stack_allocator.h"
+#include "stack_profiler.h"
+#include "util.h"
 #include <atomic>
+#include <new>
+#include <vector>
+#include <stdlib.h>
+#include <string.h>
 
 namespace atpdxy {
 
@@ -24,19 +31,128 @@ static thread_local Fiber::ptr t_threadFiber = nullptr;
 static ConfigVar<uint32_t>::ptr g_fiber_stack_size =
     Config::Lookup<uint32_t>("fiber.stack_size", 128 * 1024, "fiber stack size");
 
-// 申请和释放栈空间，更方便更改开辟内存的方法
-class MallocStackAllocator {
-public:
-    static void* Alloc(size_t size) {
-        return malloc(size);
+static ConfigVar<uint32_t>::ptr g_fiber_stack_paint =
+    Config::Lookup<uint32_t>("fiber.stack_paint", 0, "paint one in every N fiber stacks to measure peak usage, 0 disables");
+
+static ConfigVar<bool>::ptr g_fiber_stack_adaptive =
+    Config::Lookup<bool>("fiber.stack_adaptive", false, "size fiber stacks from the measured p99.9 usage of the entry");
+
+static ConfigVar<uint32_t>::ptr g_fiber_stack_headroom =
+    Config::Lookup<uint32_t>("fiber.stack_headroom", 100, "percent added to the measured p99.9 stack usage");
+
+// 缓存协程栈大小的配置值，创建协程时不再获取配置的读锁
+static std::atomic<uint32_t> s_fiber_stack_size {128 * 1024};
+static std::atomic<uint32_t> s_fiber_stack_paint {0};
+static std::atomic<bool> s_fiber_stack_adaptive {false};
+static std::atomic<uint32_t> s_fiber_stack_headroom {100};
+
+// 已经创建的独立栈协程数，用于按比例抽样染色
+static std::atomic<uint64_t> s_paint_seq {0};
+
+struct _FiberIniter {
+    _FiberIniter() {
+        s_fiber_stack_size = g_fiber_stack_size->getValue();
+        g_fiber_stack_size->addListener([](const uint32_t& old_value, const uint32_t& new_value){
+            INFO(g_logger) << "fiber stack size changed from " << old_value << " to " << new_value;
+            s_fiber_stack_size = new_value;
+        });
+        s_fiber_stack_paint = g_fiber_stack_paint->getValue();
+        g_fiber_stack_paint->addListener([](const uint32_t& old_value, const uint32_t& new_value){
+            INFO(g_logger) << "fiber stack paint changed from " << old_value << " to " << new_value;
+            s_fiber_stack_paint = new_value;
+        });
+        s_fiber_stack_adaptive = g_fiber_stack_adaptive->getValue();
+        g_fiber_stack_adaptive->addListener([](const bool& old_value, const bool& new_value){
+            INFO(g_logger) << "fiber stack adaptive changed from " << old_value << " to " << new_value;
+            s_fiber_stack_adaptive = new_value;
+        });
+        s_fiber_stack_headroom = g_fiber_stack_headroom->getValue();
+        g_fiber_stack_headroom->addListener([](const uint32_t& old_value, const uint32_t& new_value){
+            INFO(g_logger) << "fiber stack headroom changed from " << old_value << " to " << new_value;
+            s_fiber_stack_headroom = new_value;
+        });
     }
+};
+
+// 在main函数前初始化
+static _FiberIniter s_fiber_initer;
+
+static ConfigVar<uint32_t>::ptr g_fiber_shared_stack_size =
+    Config::Lookup<uint32_t>("fiber.shared_stack_size", 1024 * 1024, "fiber shared stack size");
+
+static ConfigVar<uint32_t>::ptr g_fiber_shared_stack_count =
+    Config::Lookup<uint32_t>("fiber.shared_stack_count", 4, "fiber shared stack count per thread");
 
-    static void Dealloc(void* vp, size_t size) {
-        return free(vp);
+// 已经注册的协程局部存储槽数
+static std::atomic<size_t> s_local_slots {0};
+
+// 每个槽的值的析构函数
+static void (*s_local_destroys[Fiber::LOCAL_MAX_SLOTS])(void*);
+
+// 栈顶之下的红区，切出时可能仍有数据，保存时一并拷贝
+static const size_t s_stack_red_zone = 128;
+
+// 共享栈，同一时刻只有一个协程在上面运行
+struct SharedStack {
+    typedef std::shared_ptr<SharedStack> ptr;
+
+    SharedStack(size_t s)
+        :size(s) {
+        stack = StackAllocator::Alloc(size);
     }
+
+    ~SharedStack() {
+        StackAllocator::Dealloc(stack, size);
+    }
+
+    // 栈的最低地址
+    void* stack = nullptr;
+    // 栈大小
+    size_t size = 0;
+    // 当前栈上内容所属的协程
+    Fiber* occupant = nullptr;
 };
 
-using StackAllocator = MallocStackAllocator;
+// 线程私有的共享栈池，第一次创建共享栈协程时按当前配置初始化
+class SharedStackPool {
+public:
+    // 轮流返回池中的共享栈
+    SharedStack::ptr next() {
+        if(m_stacks.empty()) {
+            uint32_t count = g_fiber_shared_stack_count->getValue();
+            uint32_t size = g_fiber_shared_stack_size->getValue();
+            for(uint32_t i = 0; i < (count ? count : 1); ++i) {
+                m_stacks.emplace_back(new SharedStack(size));
+            }
+        }
+        return m_stacks[m_next++ % m_stacks.size()];
+    }
+private:
+    // 共享栈，协程持有引用，线程退出后仍绑定在其上的协程析构时才释放
+    std::vector<SharedStack::ptr> m_stacks;
+    // 下一个分配的下标
+    size_t m_next = 0;
+};
+
+static thread_local SharedStackPool t_shared_stack_pool;
+
+// 是否对新分配的栈染色，每fiber.stack_paint个协程抽样一个
+static bool ShouldPaint() {
+    uint32_t rate = s_fiber_stack_paint.load(std::memory_order_relaxed);
+    if(!rate) {
+        return false;
+    }
+    return rate == 1 || s_paint_seq.fetch_add(1, std::memory_order_relaxed) % rate == 0;
+}
+
+// 入口的默认栈大小，开启自适应时按统计结果缩小
+static size_t DefaultStackSize(const void* entry, bool adaptive) {
+    size_t def = s_fiber_stack_size.load();
+    if(!adaptive) {
+        return def;
+    }
+    return StackProfiler::GetAdaptiveSize(entry, def, s_fiber_stack_headroom);
+}
 
 // 返回正在执行的协程id
 uint64_t Fiber::GetFiberId() {
@@ -51,7 +167,7 @@ Fiber::Fiber() {
     m_state = EXEC;
     SetThis(this);
 
-    if(getcontext(&m_ctx)) {
+    if(!InitContext(m_ctx)) {
         ASSERT_WITH_MSG(false, "getcontext");
     }
 
@@ -61,24 +177,32 @@ Fiber::Fiber() {
 }
 
 // 创建新的协程
-Fiber::Fiber(std::function<void()> cb, size_t stacksize, bool use_caller)
+Fiber::Fiber(Task cb, size_t stacksize, bool use_caller, bool shared_stack)
     :m_id(++s_fiber_id)
-    ,m_cb(cb) {
-    ++s_fiber_count;
-    m_stacksize = stacksize ? stacksize : g_fiber_stack_size->getValue();
+    ,m_cb(std::move(cb))
+    ,m_sharedStack(shared_stack) {
+    if(shared_stack) {
+        // 共享栈协程在第一次切入时才绑定共享栈，由调度协程切入，不支持call/back
+        ASSERT_WITH_MSG(!use_caller, "shared stack fiber can not use caller");
+        ++s_fiber_count;
+        DEBUG(g_logger) << "Fiber::Fiber shared id=" << m_id;
+        return;
+    }
+    // 没有指定栈大小时才按入口的统计结果调整
+    m_entry = m_cb.getEntry();
+    m_adaptive = !stacksize && s_fiber_stack_adaptive;
+    m_stacksize = stacksize ? stacksize : DefaultStackSize(m_entry, m_adaptive);
 
+    // 优先复用线程缓存中的栈，分配失败抛出std::bad_alloc
     m_stack = StackAllocator::Alloc(m_stacksize);
-    if(getcontext(&m_ctx)) {
-        ASSERT_WITH_MSG(false, "getcontext");
+    m_painted = ShouldPaint();
+    if(m_painted) {
+        StackProfiler::Paint(m_stack, m_stacksize);
     }
-    m_ctx.uc_link = nullptr;
-    m_ctx.uc_stack.ss_sp = m_stack;
-    m_ctx.uc_stack.ss_size = m_stacksize;
-
-    if(!use_caller) {
-        makecontext(&m_ctx, &Fiber::MainFunc, 0);
-    } else {
-        makecontext(&m_ctx, &Fiber::CallerMainFunc, 0);
+    ++s_fiber_count;
+    if(!MakeContext(m_ctx, m_stack, m_stacksize
+                , use_caller ? &Fiber::CallerMainFunc : &Fiber::MainFunc)) {
+        ASSERT_WITH_MSG(false, "makecontext");
     }
 
     DEBUG(g_logger) << "Fiber::Fiber id=" << m_id;
@@ -86,12 +210,19 @@ Fiber::Fiber(std::function<void()> cb, size_t stacksize, bool use_caller)
 
 Fiber::~Fiber() {
     --s_fiber_count;
-    if(m_stack) {
+    clearLocals();
+    free(m_localOverflow);
+    if(m_stack || m_sharedStack) {
         ASSERT(m_state == TERM
                 || m_state == EXCEPT
                 || m_state == INIT);
 
-        StackAllocator::Dealloc(m_stack, m_stacksize);
+        if(m_stack) {
+            recordStack(false);
+            StackAllocator::Dealloc(m_stack, m_stacksize);
+        } else {
+            releaseSharedStack();
+        }
     } else {
         ASSERT(!m_cb);
         ASSERT(m_state == EXEC);
@@ -106,29 +237,58 @@ Fiber::~Fiber() {
 
 //重置协程函数，并重置状态
 //INIT，TERM, EXCEPT
-void Fiber::reset(std::function<void()> cb) {
-    ASSERT(m_stack);
+void Fiber::reset(Task cb) {
+    ASSERT(m_stack || m_sharedStack);
     ASSERT(m_state == TERM
             || m_state == EXCEPT
             || m_state == INIT);
-    m_cb = cb;
-    if(getcontext(&m_ctx)) {
-        ASSERT_WITH_MSG(false, "getcontext");
+    if(m_stack) {
+        recordStack(true);
+        const void* entry = cb.getEntry();
+        size_t size = m_adaptive ? DefaultStackSize(entry, true) : m_stacksize;
+        if(size != m_stacksize) {
+            // 新任务的入口需要的栈大小不同，换一个栈
+            void* stack = StackAllocator::Alloc(size);
+            StackAllocator::Dealloc(m_stack, m_stacksize);
+            m_stack = stack;
+            m_stacksize = size;
+            if(m_painted) {
+                StackProfiler::Paint(m_stack, m_stacksize);
+            }
+        }
+        m_entry = entry;
+    }
+    m_cb = std::move(cb);
+    if(m_sharedStack) {
+        // 解除和共享栈以及线程的绑定，下次切入时重新绑定
+        releaseSharedStack();
+        m_shared.reset();
+        m_sharedThread = -1;
+    } else if(!MakeContext(m_ctx, m_stack, m_stacksize, &Fiber::MainFunc)) {
+        ASSERT_WITH_MSG(false, "makecontext");
     }
-
-    m_ctx.uc_link = nullptr;
-    m_ctx.uc_stack.ss_sp = m_stack;
-    m_ctx.uc_stack.ss_size = m_stacksize;
-
-    makecontext(&m_ctx, &Fiber::MainFunc, 0);
     m_state = INIT;
 }
 
+// 统计染色栈本次运行的峰值使用量
+void Fiber::recordStack(bool repaint) {
+    if(!m_painted || m_state == INIT) {
+        return;
+    }
+    size_t used = StackProfiler::Measure(m_stack, m_stacksize);
+    StackProfiler::Record(m_entry, used, m_stacksize);
+    if(repaint) {
+        // 只需要重新填充被改写的部分，哨兵值按8字节对齐
+        size_t painted = m_stacksize / sizeof(uint64_t) * sizeof(uint64_t);
+        StackProfiler::Paint((char*)m_stack + painted - used, used);
+    }
+}
+
 // 通过交换中转协程的上下文和当前协程的上下文，将本协程切入执行
 void Fiber::call() {
     SetThis(this);
     m_state = EXEC;
-    if(swapcontext(&t_threadFiber->m_ctx, &m_ctx)) {
+    if(!SwapContext(t_threadFiber->m_ctx, m_ctx)) {
         ASSERT_WITH_MSG(false, "swapcontext");
     }
 }
@@ -136,25 +296,95 @@ void Fiber::call() {
 // 通过交换当前协程的上下文和中转协程的上下文，运行中转协程，停止本协程的运行
 void Fiber::back() {
     SetThis(t_threadFiber.get());
-    if(swapcontext(&m_ctx, &t_threadFiber->m_ctx)) {
+    if(!SwapContext(m_ctx, t_threadFiber->m_ctx)) {
         ASSERT_WITH_MSG(false, "swapcontext");
     }
 }
 
 // 交换调度器的调度协程和当前协程的上下文，实现切换到当前协程执行
 void Fiber::swapIn() {
+    if(m_sharedStack) {
+        switchSharedStack();
+    }
     SetThis(this);
     ASSERT(m_state != EXEC);
     m_state = EXEC;
-    if(swapcontext(&Scheduler::GetMainFiber()->m_ctx, &m_ctx)) {
+    if(!SwapContext(Scheduler::GetMainFiber()->m_ctx, m_ctx)) {
         ASSERT_WITH_MSG(false, "swapcontext");
     }
+    // 运行结束的协程不再需要栈上的内容，让出共享栈
+    if(m_sharedStack && (m_state == TERM || m_state == EXCEPT)) {
+        releaseSharedStack();
+    }
+}
+
+// 在调度协程的栈上执行，此时共享栈上没有协程在运行
+void Fiber::switchSharedStack() {
+    bool fresh = false;
+    if(!m_shared) {
+        ASSERT(m_state == INIT);
+        m_shared = t_shared_stack_pool.next();
+        m_sharedThread = GetThreadId();
+        m_stacksize = m_shared->size;
+        fresh = true;
+    }
+    ASSERT_WITH_MSG(m_sharedThread == GetThreadId()
+            , "shared stack fiber resumed on another thread fiber_id=" + std::to_string(m_id));
+
+    Fiber* occupant = m_shared->occupant;
+    if(occupant == this) {
+        return;
+    }
+    // 先保存上一个占用者的栈内容，再在栈顶构造本协程的初始栈帧
+    if(occupant) {
+        occupant->saveSharedStack();
+    }
+    if(fresh) {
+        if(!MakeContext(m_ctx, m_shared->stack, m_stacksize, &Fiber::MainFunc)) {
+            ASSERT_WITH_MSG(false, "makecontext");
+        }
+    } else if(m_savedSize) {
+        char* top = (char*)m_shared->stack + m_shared->size;
+        memcpy(top - m_savedSize, m_savedStack, m_savedSize);
+    }
+    m_shared->occupant = this;
+}
+
+void Fiber::saveSharedStack() {
+    char* bottom = (char*)m_shared->stack;
+    char* top = bottom + m_shared->size;
+    char* sp = (char*)ContextStackPointer(m_ctx);
+    ASSERT(sp > bottom && sp <= top);
+    sp = (size_t)(sp - bottom) > s_stack_red_zone ? sp - s_stack_red_zone : bottom;
+
+    m_savedSize = top - sp;
+    if(m_savedCapacity < m_savedSize) {
+        free(m_savedStack);
+        m_savedStack = (char*)malloc(m_savedSize);
+        if(!m_savedStack) {
+            m_savedCapacity = 0;
+            throw std::bad_alloc();
+        }
+        m_savedCapacity = m_savedSize;
+    }
+    memcpy(m_savedStack, sp, m_savedSize);
+    m_shared->occupant = nullptr;
+}
+
+void Fiber::releaseSharedStack() {
+    if(m_shared && m_shared->occupant == this) {
+        m_shared->occupant = nullptr;
+    }
+    free(m_savedStack);
+    m_savedStack = nullptr;
+    m_savedSize = 0;
+    m_savedCapacity = 0;
 }
 
 // 交换调度器的当前协程和调度协程的上下文，实现将本协程切换到后台
 void Fiber::swapOut() {
     SetThis(Scheduler::GetMainFiber());
-    if(swapcontext(&m_ctx, &Scheduler::GetMainFiber()->m_ctx)) {
+    if(!SwapContext(m_ctx, Scheduler::GetMainFiber()->m_ctx)) {
         ASSERT_WITH_MSG(false, "swapcontext");
     }
 }
@@ -164,6 +394,70 @@ void Fiber::SetThis(Fiber* f) {
     t_fiber = f;
 }
 
+Fiber* Fiber::GetThisPtr() {
+    if(LIKELY(t_fiber)) {
+        return t_fiber;
+    }
+    return GetThis().get();
+}
+
+bool Fiber::InSharedStack() {
+    return t_fiber && t_fiber->m_sharedStack;
+}
+
+size_t Fiber::AllocLocalSlot(void (*destroy)(void*)) {
+    size_t slot = s_local_slots.fetch_add(1);
+    ASSERT_WITH_MSG(slot < LOCAL_MAX_SLOTS, "too many fiber local slots");
+    s_local_destroys[slot] = destroy;
+    return slot;
+}
+
+void Fiber::setLocal(size_t slot, void* value) {
+    ASSERT(slot < s_local_slots);
+    void** p = nullptr;
+    if(slot < LOCAL_INLINE_SLOTS) {
+        p = &m_locals[slot];
+    } else {
+        if(!m_localOverflow) {
+            // 保留到协程析构，复用协程时不需要重新申请
+            m_localOverflow = (void**)calloc(LOCAL_MAX_SLOTS - LOCAL_INLINE_SLOTS, sizeof(void*));
+            if(!m_localOverflow) {
+                // 值的所有权已经交给了协程，失败时释放
+                if(value) {
+                    s_local_destroys[slot](value);
+                }
+                throw std::bad_alloc();
+            }
+        }
+        p = &m_localOverflow[slot - LOCAL_INLINE_SLOTS];
+    }
+    void* old = *p;
+    *p = value;
+    if(old && old != value) {
+        s_local_destroys[slot](old);
+    }
+}
+
+void Fiber::clearLocals() {
+    size_t n = s_local_slots.load();
+    for(size_t i = 0; i < n; ++i) {
+        void** p = nullptr;
+        if(i < LOCAL_INLINE_SLOTS) {
+            p = &m_locals[i];
+        } else if(m_localOverflow) {
+            p = &m_localOverflow[i - LOCAL_INLINE_SLOTS];
+        } else {
+            break;
+        }
+        // 先清空再释放，析构函数中可以访问其他协程局部变量
+        void* v = *p;
+        if(v) {
+            *p = nullptr;
+            s_local_destroys[i](v);
+        }
+    }
+}
+
 // 返回正在执行的协程，如果没有设置当前正在执行的协程，返回中转协程
 Fiber::ptr Fiber::GetThis() {
     if(t_fiber) {
@@ -215,6 +509,8 @@ void Fiber::MainFunc() {
             << std::endl
             << atpdxy::BacktraceToString();
     }
+    // 在协程中释放局部变量，协程对象被复用时下一个任务看不到这些值
+    cur->clearLocals();
 
     // 将智能指针reset后可以将计数减少1，从而释放资源，然后将协程切入后台执行
     auto raw_ptr = cur.get();
@@ -244,6 +540,7 @@ void Fiber::CallerMainFunc() {
             << std::endl
             << atpdxy::BacktraceToString();
     }
+    cur->clearLocals();
 
     auto raw_ptr = cur.get();
     cur.reset();
@@ -2,13 +2,19 @@
 
 #include <memory>
 #include <functional>
-#include <ucontext.h>
+#include <utility>
+#include "context.h"
+#include "noncopyable.h"
+#include "task.h"
 
 namespace atpdxy {
 
 // 协程调度器类
 class Scheduler;
 
+// 共享栈
+struct SharedStack;
+
 // 协程类
 class Fiber : public std::enable_shared_from_this<Fiber> {
 friend class Scheduler;
@@ -35,12 +41,14 @@ private:
     Fiber();
 public:
     // 构造函数，设置协程执行的函数，协程栈的大小，是否在当前调用者协程上调度新的协程
-    Fiber(std::function<void()> cb, size_t stacksize = 0, bool use_caller = false);
+    // shared_stack为true时不单独分配协程栈，运行在线程的共享栈上，切出后只保存实际使用的栈内容
+    // 共享栈协程第一次运行后就绑定在该线程上，之后只能在该线程上被调度
+    Fiber(Task cb, size_t stacksize = 0, bool use_caller = false, bool shared_stack = false);
 
     ~Fiber();
 
     // 重置协程执行函数,并设置状态
-    void reset(std::function<void()> cb);
+    void reset(Task cb);
 
     // 将当前协程切换到运行状态
     void swapIn();
@@ -59,6 +67,45 @@ public:
 
     // 返回协程状态
     State getState() const { return m_state;}
+
+    // 返回是否运行在共享栈上
+    bool isSharedStack() const { return m_sharedStack;}
+
+    // 返回共享栈协程绑定的线程id，未绑定返回-1
+    int getSharedStackThread() const { return m_sharedThread;}
+
+    // 返回协程栈大小，共享栈协程为共享栈的大小
+    uint32_t getStackSize() const { return m_stacksize;}
+
+    // 返回共享栈协程切出后保存的栈内容大小
+    size_t getSavedStackSize() const { return m_savedSize;}
+
+    // 返回协程局部存储槽中的值，没有设置时返回nullptr
+    void* getLocal(size_t slot) const {
+        if(slot < LOCAL_INLINE_SLOTS) {
+            return m_locals[slot];
+        }
+        return m_localOverflow ? m_localOverflow[slot - LOCAL_INLINE_SLOTS] : nullptr;
+    }
+
+    // 设置协程局部存储槽中的值，原来的值用注册时的析构函数释放
+    // 申请超出内联槽数的数组失败时释放value并抛出std::bad_alloc
+    void setLocal(size_t slot, void* value);
+private:
+    // 释放所有协程局部存储的值
+    void clearLocals();
+
+    // 切入共享栈协程前，保存上一个占用共享栈的协程的栈内容并恢复本协程的栈内容
+    void switchSharedStack();
+
+    // 将共享栈上实际使用的部分保存到本协程的缓冲区中
+    void saveSharedStack();
+
+    // 释放对共享栈的占用
+    void releaseSharedStack();
+
+    // 栈已染色并且运行过时，记录本次运行的栈峰值使用量，repaint为true时重新染色以便下次测量
+    void recordStack(bool repaint);
 public:
     // 设置当前线程正在运行的协程
     static void SetThis(Fiber* f);
@@ -83,6 +130,21 @@ public:
 
     // 获取正在执行协程的id
     static uint64_t GetFiberId();
+
+    // 返回正在执行的协程的裸指针，不增加引用计数，没有时创建线程的主协程
+    static Fiber* GetThisPtr();
+
+    // 当前是否运行在共享栈协程中
+    static bool InSharedStack();
+
+    // 注册一个协程局部存储的槽，返回固定的下标，槽不会被回收
+    // destroy在协程结束或析构时释放槽中非空的值
+    static size_t AllocLocalSlot(void (*destroy)(void*));
+
+    // 内联在协程对象中的槽数，之后的槽放在第一次使用时申请的数组中
+    static const size_t LOCAL_INLINE_SLOTS = 8;
+    // 最多可以注册的槽数
+    static const size_t LOCAL_MAX_SLOTS = 256;
 private:
     // 协程id
     uint64_t m_id = 0;
@@ -91,11 +153,87 @@ private:
     // 协程状态
     State m_state = INIT;
     // 协程上下文
-    ucontext_t m_ctx;
+    Context m_ctx;
     // 协程运行栈指针
     void* m_stack = nullptr;
     // 协程运行函数
-    std::function<void()> m_cb;
+    Task m_cb;
+    // 是否运行在共享栈上
+    bool m_sharedStack = false;
+    // 栈是否已染色，结束时测量峰值使用量
+    bool m_painted = false;
+    // 栈大小是否按入口的统计结果调整
+    bool m_adaptive = false;
+    // 协程入口，用于按入口聚合栈使用量，见Task::getEntry
+    const void* m_entry = nullptr;
+    // 共享栈协程绑定的线程id
+    int m_sharedThread = -1;
+    // 共享栈协程运行所在的共享栈
+    std::shared_ptr<SharedStack> m_shared;
+    // 共享栈协程切出后保存栈内容的缓冲区
+    char* m_savedStack = nullptr;
+    // 保存的栈内容大小
+    size_t m_savedSize = 0;
+    // 缓冲区容量
+    size_t m_savedCapacity = 0;
+    // 协程局部存储的内联槽
+    void* m_locals[LOCAL_INLINE_SLOTS] = {};
+    // 超出内联槽数的槽，按需申请
+    void** m_localOverflow = nullptr;
+};
+
+// 协程局部变量，代替thread_local保存请求上下文
+// 协程可能在不同的工作线程上恢复执行，thread_local的值会随线程改变，协程局部变量跟随协程
+// 通常定义为全局或静态对象，构造时注册固定的槽下标，访问时只需要取当前协程再按下标取值，不查表
+// 值在协程结束时释放，调度器复用协程对象执行下一个任务时不会看到上一个任务的值
+template<class T>
+class FiberLocal : Noncopyable {
+public:
+    FiberLocal()
+        :m_slot(Fiber::AllocLocalSlot(&FiberLocal::Destroy)) {
+    }
+
+    // 返回当前协程中的值，没有设置时返回nullptr
+    T* get() const {
+        return static_cast<T*>(Fiber::GetThisPtr()->getLocal(m_slot));
+    }
+
+    // 返回当前协程中的值，没有设置时默认构造一个
+    T& operator*() const {
+        Fiber* cur = Fiber::GetThisPtr();
+        T* v = static_cast<T*>(cur->getLocal(m_slot));
+        if(!v) {
+            v = new T();
+            cur->setLocal(m_slot, v);
+        }
+        return *v;
+    }
+
+    T* operator->() const { return &**this;}
+
+    // 设置当前协程中的值
+    void set(const T& v) const {
+        Fiber::GetThisPtr()->setLocal(m_slot, new T(v));
+    }
+
+    void set(T&& v) const {
+        Fiber::GetThisPtr()->setLocal(m_slot, new T(std::move(v)));
+    }
+
+    // 释放当前协程中的值
+    void reset() const {
+        Fiber::GetThisPtr()->setLocal(m_slot, nullptr);
+    }
+
+    // 返回槽下标
+    size_t getSlot() const { return m_slot;}
+private:
+    static void Destroy(void* p) {
+        delete static_cast<T*>(p);
+    }
+private:
+    // 槽下标
+    size_t m_slot;
 };
 
 }
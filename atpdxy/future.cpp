@@ -0,0 +1,141 @@
+#include "future.h"
+
+namespace atpdxy {
+
+FutureStateBase::~FutureStateBase() {
+    ASSERT(m_waiters.empty());
+}
+
+void FutureStateBase::wait() {
+    if(isReady()) {
+        return;
+    }
+    WaitLocal<FiberWaiter> waiter;
+    {
+        MutexType::Lock lock(m_mutex);
+        if(isReady()) {
+            return;
+        }
+        m_waiters.push(waiter.get());
+    }
+    waiter->park();
+}
+
+void FutureStateBase::onReady(Task cb) {
+    if(!isReady()) {
+        MutexType::Lock lock(m_mutex);
+        if(!isReady()) {
+            m_callbacks.push_back(std::move(cb));
+            return;
+        }
+    }
+    cb();
+}
+
+void FutureStateBase::setException(std::exception_ptr e) {
+    beginSet();
+    m_exception = e;
+    complete();
+}
+
+void FutureStateBase::beginSet() {
+    // 重复设置结果是使用错误
+    bool set = m_set.exchange(true, std::memory_order_acq_rel);
+    ASSERT_WITH_MSG(!set, "future already satisfied");
+}
+
+void FutureStateBase::complete() {
+    FiberWaiter* waiters = nullptr;
+    std::vector<Task> callbacks;
+    {
+        MutexType::Lock lock(m_mutex);
+        m_ready.store(true, std::memory_order_release);
+        waiters = m_waiters.popAll();
+        callbacks.swap(m_callbacks);
+    }
+    // 在锁外唤醒和执行回调，回调中可能再等待或者设置其他Future
+    FiberWaitQueue::WakeAll(waiters);
+    for(auto& cb : callbacks) {
+        cb();
+    }
+}
+
+WaitGroup::~WaitGroup() {
+    ASSERT(m_waiters.empty());
+}
+
+void WaitGroup::add(int64_t n) {
+    int64_t count = m_count.fetch_add(n, std::memory_order_acq_rel) + n;
+    ASSERT_WITH_MSG(count >= 0, "WaitGroup negative count");
+    if(count != 0 || n >= 0) {
+        return;
+    }
+    FiberWaiter* waiters = nullptr;
+    {
+        MutexType::Lock lock(m_mutex);
+        waiters = m_waiters.popAll();
+    }
+    FiberWaitQueue::WakeAll(waiters);
+}
+
+void WaitGroup::wait() {
+    if(getCount() == 0) {
+        return;
+    }
+    WaitLocal<FiberWaiter> waiter;
+    {
+        MutexType::Lock lock(m_mutex);
+        // 计数归零的一方在递减之后才取等待队列，这里看到非0就一定会被唤醒
+        if(getCount() == 0) {
+            return;
+        }
+        m_waiters.push(waiter.get());
+    }
+    waiter->park();
+}
+
+Future<void> WhenAll(const std::vector<FutureStateBase::ptr>& states) {
+    // 所有回调共享的计数，最后一个完成的状态设置结果
+    struct Context {
+        std::atomic<size_t> remaining;
+        Promise<void> promise;
+    };
+    std::shared_ptr<Context> ctx = std::make_shared<Context>();
+    // 多算一个，注册完所有回调之前不会完成
+    ctx->remaining = states.size() + 1;
+    Future<void> future = ctx->promise.getFuture();
+    auto cb = [ctx](){
+        if(--ctx->remaining == 0) {
+            ctx->promise.setValue();
+        }
+    };
+    for(auto& i : states) {
+        i->onReady(cb);
+    }
+    cb();
+    return future;
+}
+
+Future<size_t> WhenAny(const std::vector<FutureStateBase::ptr>& states) {
+    ASSERT(!states.empty());
+    struct Context {
+        std::atomic<bool> done = {false};
+        Promise<size_t> promise;
+    };
+    std::shared_ptr<Context> ctx = std::make_shared<Context>();
+    Future<size_t> future = ctx->promise.getFuture();
+    for(size_t i = 0; i < states.size(); ++i) {
+        // 已经有结果之后剩下的状态不再注册回调
+        if(ctx->done) {
+            break;
+        }
+        states[i]->onReady([ctx, i](){
+            if(!ctx->done.exchange(true)) {
+                ctx->promise.setValue(i);
+            }
+        });
+    }
+    return future;
+}
+
+}
@@ -0,0 +1,370 @@
+#pragma once
+
+#include <atomic>
+#include <exception>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "macro.h"
+#include "mutex.h"
+#include "task.h"
+#include "scheduler.h"
+
+namespace atpdxy {
+
+// Future的共享状态中和结果类型无关的部分：完成标志、异常、等待者和完成回调
+class FutureStateBase : Noncopyable {
+public:
+    typedef std::shared_ptr<FutureStateBase> ptr;
+    typedef Spinlock MutexType;
+
+    virtual ~FutureStateBase();
+
+    // 是否已经完成
+    bool isReady() const { return m_ready.load(std::memory_order_acquire);}
+
+    // 等待完成，在协程中挂起协程，否则阻塞线程
+    void wait();
+
+    // 完成时执行cb，已经完成时立即在当前上下文执行
+    // 否则在设置结果的协程或线程中执行，回调中不能长时间阻塞
+    void onReady(Task cb);
+
+    // 以异常完成
+    void setException(std::exception_ptr e);
+
+    // 以异常完成时重新抛出
+    void rethrow() const {
+        if(m_exception) {
+            std::rethrow_exception(m_exception);
+        }
+    }
+
+    // 是否以异常完成
+    bool hasException() const { return isReady() && m_exception != nullptr;}
+protected:
+    // 开始设置结果，只能成功一次
+    void beginSet();
+
+    // 结果已经写好，标记完成，唤醒所有等待者并执行回调
+    void complete();
+protected:
+    // 异常，complete之前写入
+    std::exception_ptr m_exception;
+private:
+    // 保护等待队列和回调
+    MutexType m_mutex;
+    // 是否已经开始设置结果
+    std::atomic<bool> m_set = {false};
+    // 是否已经完成
+    std::atomic<bool> m_ready = {false};
+    // 等待完成的协程或线程
+    FiberWaitQueue m_waiters;
+    // 完成回调
+    std::vector<Task> m_callbacks;
+};
+
+// 带结果的共享状态，结果原地构造，不单独申请内存
+template<class T>
+class FutureState : public FutureStateBase {
+public:
+    typedef std::shared_ptr<FutureState> ptr;
+
+    ~FutureState() {
+        if(m_constructed) {
+            value().~T();
+        }
+    }
+
+    template<class V>
+    void setValue(V&& v) {
+        beginSet();
+        new (&m_storage) T(std::forward<V>(v));
+        m_constructed = true;
+        complete();
+    }
+
+    // 返回结果，只能在完成并且没有异常时调用
+    T& value() { return *reinterpret_cast<T*>(&m_storage);}
+private:
+    // 结果的存储
+    typename std::aligned_storage<sizeof(T), alignof(T)>::type m_storage;
+    // 结果是否已经构造
+    bool m_constructed = false;
+};
+
+template<>
+class FutureState<void> : public FutureStateBase {
+public:
+    typedef std::shared_ptr<FutureState> ptr;
+
+    void setValue() {
+        beginSet();
+        complete();
+    }
+
+    void value() {}
+};
+
+// 异步结果，可以拷贝，多个协程可以同时等待同一个结果
+template<class T>
+class Future {
+public:
+    typedef typename std::add_lvalue_reference<T>::type Reference;
+
+    Future() {}
+
+    explicit Future(typename FutureState<T>::ptr state)
+        :m_state(std::move(state)) {
+    }
+
+    // 是否关联了共享状态
+    bool valid() const { return m_state != nullptr;}
+
+    // 是否已经完成
+    bool isReady() const { return m_state->isReady();}
+
+    // 等待完成，不取结果
+    void wait() const { m_state->wait();}
+
+    // 等待完成并返回结果，以异常完成时抛出该异常
+    Reference get() const {
+        m_state->wait();
+        m_state->rethrow();
+        return m_state->value();
+    }
+
+    // 完成时执行cb，见FutureStateBase::onReady
+    void onReady(Task cb) const { m_state->onReady(std::move(cb));}
+
+    // 返回共享状态
+    const typename FutureState<T>::ptr& getState() const { return m_state;}
+private:
+    typename FutureState<T>::ptr m_state;
+};
+
+// 结果的设置方，只能移动，析构时还没有设置结果则以broken promise异常完成，等待者不会永远挂起
+template<class T>
+class PromiseBase {
+public:
+    PromiseBase()
+        :m_state(std::make_shared<FutureState<T> >()) {
+    }
+
+    PromiseBase(PromiseBase&& rhs)
+        :m_state(std::move(rhs.m_state)) {
+    }
+
+    PromiseBase& operator=(PromiseBase&& rhs) {
+        if(this != &rhs) {
+            abandon();
+            m_state = std::move(rhs.m_state);
+        }
+        return *this;
+    }
+
+    PromiseBase(const PromiseBase&) = delete;
+    PromiseBase& operator=(const PromiseBase&) = delete;
+
+    ~PromiseBase() {
+        abandon();
+    }
+
+    // 返回关联的Future，可以多次获取
+    Future<T> getFuture() const { return Future<T>(m_state);}
+
+    // 以异常完成
+    void setException(std::exception_ptr e) {
+        m_state->setException(e);
+        m_state.reset();
+    }
+protected:
+    // 还没有设置结果时以异常完成
+    void abandon() {
+        if(m_state) {
+            m_state->setException(std::make_exception_ptr(std::logic_error("broken promise")));
+            m_state.reset();
+        }
+    }
+protected:
+    // 共享状态，设置结果后释放
+    typename FutureState<T>::ptr m_state;
+};
+
+template<class T>
+class Promise : public PromiseBase<T> {
+public:
+    Promise() {}
+
+    Promise(Promise&&) = default;
+    Promise& operator=(Promise&&) = default;
+
+    // 设置结果，只能设置一次
+    void setValue(const T& v) {
+        this->m_state->setValue(v);
+        this->m_state.reset();
+    }
+
+    void setValue(T&& v) {
+        this->m_state->setValue(std::move(v));
+        this->m_state.reset();
+    }
+};
+
+template<>
+class Promise<void> : public PromiseBase<void> {
+public:
+    Promise() {}
+
+    Promise(Promise&&) = default;
+    Promise& operator=(Promise&&) = default;
+
+    void setValue() {
+        m_state->setValue();
+        m_state.reset();
+    }
+};
+
+// 等待一组任务完成，类似Go的sync.WaitGroup
+// 开始任务前add，任务结束时done，wait在计数归零前挂起协程
+class WaitGroup : Noncopyable {
+public:
+    typedef Spinlock MutexType;
+
+    WaitGroup(int64_t count = 0)
+        :m_count(count) {
+    }
+
+    ~WaitGroup();
+
+    // 增加计数，n为负数时减少，减到0时唤醒所有等待者
+    void add(int64_t n = 1);
+
+    // 一个任务完成
+    void done() { add(-1);}
+
+    // 等待计数归零
+    void wait();
+
+    // 返回当前计数
+    int64_t getCount() const { return m_count.load(std::memory_order_acquire);}
+private:
+    // 保护等待队列
+    MutexType m_mutex;
+    // 未完成的任务数
+    std::atomic<int64_t> m_count;
+    // 等待的协程或线程
+    FiberWaitQueue m_waiters;
+};
+
+// 所有状态都完成时完成，没有状态时立即完成
+Future<void> WhenAll(const std::vector<FutureStateBase::ptr>& states);
+
+// 任意一个状态完成时完成，结果为它的下标
+Future<size_t> WhenAny(const std::vector<FutureStateBase::ptr>& states);
+
+// 等待一组结果全部完成，完成后从各个Future中取结果，不会因为其中一个异常而提前完成
+template<class T>
+Future<void> WhenAll(const std::vector<Future<T> >& futures) {
+    std::vector<FutureStateBase::ptr> states;
+    states.reserve(futures.size());
+    for(auto& i : futures) {
+        states.push_back(i.getState());
+    }
+    return WhenAll(states);
+}
+
+// 结果类型不同的Future
+template<class... Ts>
+Future<void> WhenAll(const Future<Ts>&... futures) {
+    std::vector<FutureStateBase::ptr> states = {futures.getState()...};
+    return WhenAll(states);
+}
+
+// 等待一组结果中任意一个完成，返回它的下标，futures不能为空
+template<class T>
+Future<size_t> WhenAny(const std::vector<Future<T> >& futures) {
+    std::vector<FutureStateBase::ptr> states;
+    states.reserve(futures.size());
+    for(auto& i : futures) {
+        states.push_back(i.getState());
+    }
+    return WhenAny(states);
+}
+
+template<class... Ts>
+Future<size_t> WhenAny(const Future<Ts>&... futures) {
+    std::vector<FutureStateBase::ptr> states = {futures.getState()...};
+    return WhenAny(states);
+}
+
+// 执行cb并把返回值或者异常写入promise
+template<class R>
+struct AsyncInvoker {
+    template<class F>
+    static void Run(Promise<R>& promise, F& cb) {
+        promise.setValue(cb());
+    }
+};
+
+template<>
+struct AsyncInvoker<void> {
+    template<class F>
+    static void Run(Promise<void>& promise, F& cb) {
+        cb();
+        promise.setValue();
+    }
+};
+
+// 调度到协程中执行的任务，持有promise，任务没有执行就被销毁时Future以broken promise完成
+template<class F, class R>
+struct AsyncTask {
+    AsyncTask(F&& f, Promise<R>&& p)
+        :cb(std::move(f))
+        ,promise(std::move(p)) {
+    }
+
+    AsyncTask(AsyncTask&&) = default;
+
+    void operator()() {
+        try {
+            AsyncInvoker<R>::Run(promise, cb);
+        } catch(...) {
+            promise.setException(std::current_exception());
+        }
+    }
+
+    // 栈使用量按cb统计
+    const void* getEntry() const { return Task::GetEntry(cb);}
+
+    F cb;
+    Promise<R> promise;
+};
+
+// 在调度器中以新协程执行cb，返回它的结果，scheduler为nullptr时使用当前调度器
+// 用于把后端调用扇出到多个协程，再通过WhenAll或WaitGroup汇合
+template<class F>
+Future<typename std::result_of<typename std::decay<F>::type()>::type>
+Async(Scheduler* scheduler, F&& cb, int thread = -1) {
+    typedef typename std::decay<F>::type Fn;
+    typedef typename std::result_of<Fn()>::type R;
+    if(!scheduler) {
+        scheduler = Scheduler::GetThis();
+    }
+    ASSERT(scheduler);
+    Promise<R> promise;
+    Future<R> future = promise.getFuture();
+    scheduler->schedule(Task(AsyncTask<Fn, R>(Fn(std::forward<F>(cb)), std::move(promise))), thread);
+    return future;
+}
+
+template<class F>
+Future<typename std::result_of<typename std::decay<F>::type()>::type>
+Async(F&& cb) {
+    return Async(nullptr, std::forward<F>(cb));
+}
+
+}
@@ -4,6 +4,8 @@
 #include "iomanager.h"
 #include "macro.h"
 #include <dlfcn.h>
+#include <poll.h>
+#include <string.h>
 #include "fd_manager.h"
 
 atpdxy::Logger::ptr g_logger = GET_LOGGER_BY_NAME("system");
@@ -79,12 +81,6 @@ void set_hook_enable(bool flag) {
 }
 }
 
-// 存储定时器信息
-struct timer_info {
-    // 定时器是否被取消
-    int cancelled = 0;
-};
-
 // 封装io操作，在阻塞期间让出执行权，提高并发性能，当触发EAGAIN后，当前资源不可用，添加对应的事件和定时器
 // 等待任务被唤醒，此时需要让出执行权
 // fd-文件描述符
@@ -92,8 +88,10 @@ struct timer_info {
 // hook_fun_name-当前调用的函数名称
 // event-进行IO操作时关注的事件类型，如读取、写入
 // timeout_so超时设置
+// op-io_uring后端下交给内核执行的等价操作，nullptr表示总是等待epoll事件
 template<typename OriginFun, typename... Args>
-static ssize_t do_io(int fd, OriginFun fun, const char* hook_fun_name, uint32_t event, int timeout_so, Args&&... args) {
+static ssize_t do_io(int fd, OriginFun fun, const char* hook_fun_name, uint32_t event, int timeout_so
+                     , const atpdxy::IOManager::IoOp* op, Args&&... args) {
     if(!atpdxy::t_hook_enable) {
         // 没有hook则正常执行
         return fun(fd, std::forward<Args>(args)...);
@@ -116,7 +114,6 @@ static ssize_t do_io(int fd, OriginFun fun, const char* hook_fun_name, uint32_t
 
     // 返回读/写的超时时间
     uint64_t to = ctx->getTimeout(timeout_so);
-    std::shared_ptr<timer_info> tinfo(new timer_info);
 retry:
     // 执行系统调用函数
     ssize_t n = fun(fd, std::forward<Args>(args)...);
@@ -127,41 +124,28 @@ retry:
     // I/O操作会阻塞，EAGAIN表示当前资源不可用，需要阻塞
     if(n == -1 && errno == EAGAIN) {
         atpdxy::IOManager* iom = atpdxy::IOManager::GetThis();
-        atpdxy::Timer::ptr timer;
-        std::weak_ptr<timer_info> winfo(tinfo);
-        // 如果不等于-1，则设置了超时时间
-        if(to != (uint64_t)-1) {
-            timer = iom->addConditionTimer(to, [winfo, fd, iom, event]() {
-                auto t = winfo.lock();
-                // 如果条件已经为空或者定时器已经被取消直接返回
-                if(!t || t->cancelled) {
-                    return;
-                }
-                // 定时器未取消，设置错误码为超时
-                t->cancelled = ETIMEDOUT;
-                iom->cancelEvent(fd, (atpdxy::IOManager::Event)(event));
-            }, winfo);
+        // io_uring后端下由内核在数据就绪后直接完成操作，协程恢复时拿到结果，不需要再次系统调用
+        if(op && iom->canSubmitIo()) {
+            int64_t res = iom->submitIo(*op, to);
+            if(res >= 0) {
+                return res;
+            }
+            if(res != -EAGAIN) {
+                errno = -res;
+                return -1;
+            }
         }
-
-        int rt = iom->addEvent(fd, (atpdxy::IOManager::Event)(event));
-        if(UNLIKELY(rt)) {
+        // 超时由IOManager中该fd的读写定时器负责，不需要为每次等待创建定时器
+        int rt = iom->waitEvent(fd, (atpdxy::IOManager::Event)(event), to);
+        if(UNLIKELY(rt == -1)) {
             // 添加事件失败
             ERROR(g_logger) << hook_fun_name << " addEvent("
                 << fd << ", " << event << ")";
-            // 添加事件失败，如果已经添加了定时器，将定时器取消
-            if(timer) {
-                timer->cancel();
-            }
             return -1;
         } else {
-            atpdxy::Fiber::YieldToHold();
-            // 取消上次的定时器
-            if(timer) {
-                timer->cancel();
-            }
             // 如果超时了，设置错误码
-            if(tinfo->cancelled) {
-                errno = tinfo->cancelled;
+            if(rt) {
+                errno = rt;
                 return -1;
             }
             // 继续下次尝试获取资源来执行
@@ -171,6 +155,19 @@ retry:
     return n;
 }
 
+// io_uring后端下用超时操作实现睡眠，不经过定时器，返回false表示需要使用定时器
+static bool sleep_uring(atpdxy::IOManager* iom, uint64_t us) {
+    if(!iom->canSubmitIo()) {
+        return false;
+    }
+    __kernel_timespec ts;
+    ts.tv_sec = us / 1000000;
+    ts.tv_nsec = us % 1000000 * 1000;
+    atpdxy::IOManager::IoOp op(IORING_OP_TIMEOUT, -1, (uint64_t)&ts, 1);
+    // 超时到期以-ETIME完成，-EAGAIN表示ring已满没有提交
+    return iom->submitIo(op) != -EAGAIN;
+}
+
 extern "C" {
 // 初始化函数指针指向nullptr，在预处理阶段完成宏替换，之后编译的时候同init函数完成初始化
 #define XX(name) name ## _fun name ## _f = nullptr;
@@ -182,8 +179,11 @@ unsigned int sleep(unsigned int seconds) {
     if(!atpdxy::t_hook_enable) {
         return sleep_f(seconds);
     }
-    atpdxy::Fiber::ptr fiber = atpdxy::Fiber::GetThis();
     atpdxy::IOManager* iom = atpdxy::IOManager::GetThis();
+    if(sleep_uring(iom, seconds * 1000000ull)) {
+        return 0;
+    }
+    atpdxy::Fiber::ptr fiber = atpdxy::Fiber::GetThis();
     iom->addTimer(seconds * 1000, std::bind((void(atpdxy::Scheduler::*)(atpdxy::Fiber::ptr, int thread))&atpdxy::IOManager::schedule, iom, fiber, -1));
     atpdxy::Fiber::YieldToHold();
     return 0;
@@ -194,9 +194,13 @@ int usleep(useconds_t usec) {
     if(!atpdxy::t_hook_enable) {
         return usleep_f(usec);
     }
-    atpdxy::Fiber::ptr fiber = atpdxy::Fiber::GetThis();
     atpdxy::IOManager* iom = atpdxy::IOManager::GetThis();
-    iom->addTimer(usec / 1000, std::bind((void(atpdxy::Scheduler::*)(atpdxy::Fiber::ptr, int thread))&atpdxy::IOManager::schedule, iom, fiber, -1));
+    if(sleep_uring(iom, usec)) {
+        return 0;
+    }
+    // 微秒精度的定时器，不足1毫秒的睡眠不会被截断成0
+    atpdxy::Fiber::ptr fiber = atpdxy::Fiber::GetThis();
+    iom->addTimerUS(usec, std::bind((void(atpdxy::Scheduler::*)(atpdxy::Fiber::ptr, int thread))&atpdxy::IOManager::schedule, iom, fiber, -1));
     atpdxy::Fiber::YieldToHold();
     return 0;
 }
@@ -205,10 +209,14 @@ int nanosleep(const struct timespec *req, struct timespec *rem) {
     if(!atpdxy::t_hook_enable) {
         return nanosleep_f(req, rem);
     }
-    int timeout_ms = req->tv_sec * 1000 + req->tv_nsec / 1000 /1000;
-    atpdxy::Fiber::ptr fiber = atpdxy::Fiber::GetThis();
+    // 不足1微秒的部分向上取整，保证睡眠时间不短于请求的时间
+    uint64_t timeout_us = req->tv_sec * 1000000ull + (req->tv_nsec + 999) / 1000;
     atpdxy::IOManager* iom = atpdxy::IOManager::GetThis();
-    iom->addTimer(timeout_ms, std::bind((void(atpdxy::Scheduler::*)
+    if(sleep_uring(iom, timeout_us)) {
+        return 0;
+    }
+    atpdxy::Fiber::ptr fiber = atpdxy::Fiber::GetThis();
+    iom->addTimerUS(timeout_us, std::bind((void(atpdxy::Scheduler::*)
             (atpdxy::Fiber::ptr, int thread))&atpdxy::IOManager::schedule
             ,iom, fiber, -1));
     atpdxy::Fiber::YieldToHold();
@@ -258,37 +266,31 @@ int connect_with_timeout(int fd, const struct sockaddr* addr, socklen_t addrlen,
     }
 
     atpdxy::IOManager* iom = atpdxy::IOManager::GetThis();
-    atpdxy::Timer::ptr timer;
-    std::shared_ptr<timer_info> tinfo(new timer_info);
-    std::weak_ptr<timer_info> winfo(tinfo);
-    // timer_info用来跟踪定时器的状态
-    if(timeout_ms != (uint64_t)-1) {
-        timer = iom->addConditionTimer(timeout_ms, [winfo, fd, iom]() {
-                auto t = winfo.lock();
-                if(!t || t->cancelled) {
-                    return;
-                }
-                // 超时后取消事件
-                t->cancelled = ETIMEDOUT;
-                iom->cancelEvent(fd, atpdxy::IOManager::WRITE);
-        }, winfo);
-    }
-
-    int rt = iom->addEvent(fd, atpdxy::IOManager::WRITE);
-    if(rt == 0) {
-        atpdxy::Fiber::YieldToHold();
-        if(timer) {
-            timer->cancel();
+    if(iom->canSubmitIo()) {
+        // io_uring后端下在ring中等待可写，超时由链接的超时操作完成
+        atpdxy::IOManager::IoOp op(IORING_OP_POLL_ADD, fd, 0, 0, 0, POLLOUT);
+        int64_t res = iom->submitIo(op, timeout_ms);
+        if(res < 0) {
+            errno = -res;
+            return -1;
         }
-        if(tinfo->cancelled) {
-            errno = tinfo->cancelled;
+        int error = 0;
+        socklen_t len = sizeof(int);
+        if(-1 == getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len)) {
             return -1;
         }
-    } else {
-        // 添加事件失败，取消定时器
-        if(timer) {
-            timer->cancel();
+        if(error) {
+            errno = error;
+            return -1;
         }
+        return 0;
+    }
+    int rt = iom->waitEvent(fd, atpdxy::IOManager::WRITE, timeout_ms);
+    if(rt > 0) {
+        // 超时
+        errno = rt;
+        return -1;
+    } else if(rt == -1) {
         ERROR(g_logger) << "connect addEvent(" << fd << ", WRITE) error";
     }
     // 获取并返回错误码
@@ -310,7 +312,8 @@ int connect(int sockfd, const struct sockaddr *addr, socklen_t addrlen) {
 }
 
 int accept(int s, struct sockaddr *addr, socklen_t *addrlen) {
-    int fd = do_io(s, accept_f, "accept", atpdxy::IOManager::READ, SO_RCVTIMEO, addr, addrlen);
+    atpdxy::IOManager::IoOp op(IORING_OP_ACCEPT, s, (uint64_t)addr, 0, (uint64_t)addrlen);
+    int fd = do_io(s, accept_f, "accept", atpdxy::IOManager::READ, SO_RCVTIMEO, &op, addr, addrlen);
     if(fd >= 0) {
         // 保存上下文
         atpdxy::FdMgr::GetInstance()->get(fd, true);
@@ -319,43 +322,60 @@ int accept(int s, struct sockaddr *addr, socklen_t *addrlen) {
 }
 
 ssize_t read(int fd, void *buf, size_t count) {
-    return do_io(fd, read_f, "read", atpdxy::IOManager::READ, SO_RCVTIMEO, buf, count);
+    // 套接字上的read和flags为0的recv等价
+    atpdxy::IOManager::IoOp op(IORING_OP_RECV, fd, (uint64_t)buf, count);
+    return do_io(fd, read_f, "read", atpdxy::IOManager::READ, SO_RCVTIMEO, &op, buf, count);
 }
 
 ssize_t readv(int fd, const struct iovec *iov, int iovcnt) {
-    return do_io(fd, readv_f, "readv", atpdxy::IOManager::READ, SO_RCVTIMEO, iov, iovcnt);
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = (struct iovec*)iov;
+    msg.msg_iovlen = iovcnt;
+    atpdxy::IOManager::IoOp op(IORING_OP_RECVMSG, fd, (uint64_t)&msg, 1);
+    return do_io(fd, readv_f, "readv", atpdxy::IOManager::READ, SO_RCVTIMEO, &op, iov, iovcnt);
 }
 
 ssize_t recv(int sockfd, void *buf, size_t len, int flags) {
-    return do_io(sockfd, recv_f, "recv", atpdxy::IOManager::READ, SO_RCVTIMEO, buf, len, flags);
+    atpdxy::IOManager::IoOp op(IORING_OP_RECV, sockfd, (uint64_t)buf, len, 0, flags);
+    return do_io(sockfd, recv_f, "recv", atpdxy::IOManager::READ, SO_RCVTIMEO, &op, buf, len, flags);
 }
 
 ssize_t recvfrom(int sockfd, void *buf, size_t len, int flags, struct sockaddr *src_addr, socklen_t *addrlen) {
-    return do_io(sockfd, recvfrom_f, "recvfrom", atpdxy::IOManager::READ, SO_RCVTIMEO, buf, len, flags, src_addr, addrlen);
+    return do_io(sockfd, recvfrom_f, "recvfrom", atpdxy::IOManager::READ, SO_RCVTIMEO, nullptr, buf, len, flags, src_addr, addrlen);
 }
 
 ssize_t recvmsg(int sockfd, struct msghdr *msg, int flags) {
-    return do_io(sockfd, recvmsg_f, "recvmsg", atpdxy::IOManager::READ, SO_RCVTIMEO, msg, flags);
+    atpdxy::IOManager::IoOp op(IORING_OP_RECVMSG, sockfd, (uint64_t)msg, 1, 0, flags);
+    return do_io(sockfd, recvmsg_f, "recvmsg", atpdxy::IOManager::READ, SO_RCVTIMEO, &op, msg, flags);
 }
 
 ssize_t write(int fd, const void *buf, size_t count) {
-    return do_io(fd, write_f, "write", atpdxy::IOManager::WRITE, SO_SNDTIMEO, buf, count);
+    atpdxy::IOManager::IoOp op(IORING_OP_SEND, fd, (uint64_t)buf, count);
+    return do_io(fd, write_f, "write", atpdxy::IOManager::WRITE, SO_SNDTIMEO, &op, buf, count);
 }
 
 ssize_t writev(int fd, const struct iovec *iov, int iovcnt) {
-    return do_io(fd, writev_f, "writev", atpdxy::IOManager::WRITE, SO_SNDTIMEO, iov, iovcnt);
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = (struct iovec*)iov;
+    msg.msg_iovlen = iovcnt;
+    atpdxy::IOManager::IoOp op(IORING_OP_SENDMSG, fd, (uint64_t)&msg, 1);
+    return do_io(fd, writev_f, "writev", atpdxy::IOManager::WRITE, SO_SNDTIMEO, &op, iov, iovcnt);
 }
 
 ssize_t send(int s, const void *msg, size_t len, int flags) {
-    return do_io(s, send_f, "send", atpdxy::IOManager::WRITE, SO_SNDTIMEO, msg, len, flags);
+    atpdxy::IOManager::IoOp op(IORING_OP_SEND, s, (uint64_t)msg, len, 0, flags);
+    return do_io(s, send_f, "send", atpdxy::IOManager::WRITE, SO_SNDTIMEO, &op, msg, len, flags);
 }
 
 ssize_t sendto(int s, const void *msg, size_t len, int flags, const struct sockaddr *to, socklen_t tolen) {
-    return do_io(s, sendto_f, "sendto", atpdxy::IOManager::WRITE, SO_SNDTIMEO, msg, len, flags, to, tolen);
+    return do_io(s, sendto_f, "sendto", atpdxy::IOManager::WRITE, SO_SNDTIMEO, nullptr, msg, len, flags, to, tolen);
 }
 
 ssize_t sendmsg(int s, const struct msghdr *msg, int flags) {
-    return do_io(s, sendmsg_f, "sendmsg", atpdxy::IOManager::WRITE, SO_SNDTIMEO, msg, flags);
+    atpdxy::IOManager::IoOp op(IORING_OP_SENDMSG, s, (uint64_t)msg, 1, 0, flags);
+    return do_io(s, sendmsg_f, "sendmsg", atpdxy::IOManager::WRITE, SO_SNDTIMEO, &op, msg, flags);
 }
 
 int close(int fd) {
@@ -0,0 +1,163 @@
+#include "io_uring.h"
+#include "log.h"
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace atpdxy {
+
+static Logger::ptr g_logger = GET_LOGGER_BY_NAME("system");
+
+static int io_uring_setup(unsigned entries, io_uring_params* p) {
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete
+                          , unsigned flags, void* arg, size_t argsz) {
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+IoUring::IoUring(unsigned entries) {
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    m_fd = io_uring_setup(entries, &params);
+    if(m_fd < 0) {
+        ERROR(g_logger) << "io_uring_setup entries=" << entries << " errno=" << errno
+            << " errstr=" << strerror(errno);
+        return;
+    }
+    m_features = params.features;
+    if(!(m_features & IORING_FEAT_SINGLE_MMAP) || !(m_features & IORING_FEAT_EXT_ARG)) {
+        ERROR(g_logger) << "io_uring features=" << m_features << " not supported";
+        close(m_fd);
+        m_fd = -1;
+        return;
+    }
+
+    // 提交队列和完成队列的环共享一次映射
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    m_ringSize = sq_size > cq_size ? sq_size : cq_size;
+    m_ringPtr = mmap(nullptr, m_ringSize, PROT_READ | PROT_WRITE
+                     , MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQ_RING);
+    if(m_ringPtr == MAP_FAILED) {
+        ERROR(g_logger) << "mmap io_uring ring errno=" << errno << " errstr=" << strerror(errno);
+        m_ringPtr = nullptr;
+        close(m_fd);
+        m_fd = -1;
+        return;
+    }
+    m_sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+    void* sqes = mmap(nullptr, m_sqesSize, PROT_READ | PROT_WRITE
+                      , MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQES);
+    if(sqes == MAP_FAILED) {
+        ERROR(g_logger) << "mmap io_uring sqes errno=" << errno << " errstr=" << strerror(errno);
+        munmap(m_ringPtr, m_ringSize);
+        m_ringPtr = nullptr;
+        close(m_fd);
+        m_fd = -1;
+        return;
+    }
+    m_sqes = (io_uring_sqe*)sqes;
+
+    char* ring = (char*)m_ringPtr;
+    m_sqHead = (unsigned*)(ring + params.sq_off.head);
+    m_sqTail = (unsigned*)(ring + params.sq_off.tail);
+    m_sqMask = *(unsigned*)(ring + params.sq_off.ring_mask);
+    m_sqEntries = *(unsigned*)(ring + params.sq_off.ring_entries);
+    m_sqArray = (unsigned*)(ring + params.sq_off.array);
+    m_cqHead = (unsigned*)(ring + params.cq_off.head);
+    m_cqTail = (unsigned*)(ring + params.cq_off.tail);
+    m_cqMask = *(unsigned*)(ring + params.cq_off.ring_mask);
+    m_cqes = (io_uring_cqe*)(ring + params.cq_off.cqes);
+    m_sqeTail = *m_sqTail;
+}
+
+IoUring::~IoUring() {
+    if(m_sqes) {
+        munmap(m_sqes, m_sqesSize);
+    }
+    if(m_ringPtr) {
+        munmap(m_ringPtr, m_ringSize);
+    }
+    if(m_fd >= 0) {
+        close(m_fd);
+    }
+}
+
+bool IoUring::reserve(unsigned n) {
+    unsigned head = __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE);
+    if(m_sqeTail - head + n <= m_sqEntries) {
+        return true;
+    }
+    // 提交队列满了，先提交给内核腾出位置
+    if(submit() < 0) {
+        return false;
+    }
+    head = __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE);
+    return m_sqeTail - head + n <= m_sqEntries;
+}
+
+io_uring_sqe* IoUring::getSqe() {
+    if(!reserve(1)) {
+        return nullptr;
+    }
+    unsigned index = m_sqeTail & m_sqMask;
+    io_uring_sqe* sqe = &m_sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    m_sqArray[index] = index;
+    ++m_sqeTail;
+    return sqe;
+}
+
+int IoUring::submit(unsigned wait_nr, uint64_t timeout_us) {
+    // 发布本地填好的提交队列项
+    // 待提交的数量按内核的队列头计算，上次只提交了一部分(EBUSY/EAGAIN或者返回值偏少)时剩下的项这次一起提交
+    __atomic_store_n(m_sqTail, m_sqeTail, __ATOMIC_RELEASE);
+    unsigned to_submit = m_sqeTail - __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE);
+    if(!to_submit && !wait_nr) {
+        return 0;
+    }
+    unsigned flags = 0;
+    io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    __kernel_timespec ts;
+    if(wait_nr) {
+        flags |= IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+        arg.sigmask_sz = _NSIG / 8;
+        if(timeout_us != ~0ull) {
+            ts.tv_sec = timeout_us / 1000000;
+            ts.tv_nsec = timeout_us % 1000000 * 1000;
+            arg.ts = (uint64_t)&ts;
+        }
+    }
+    int rt = 0;
+    do {
+        rt = io_uring_enter(m_fd, to_submit, wait_nr, flags
+                            , wait_nr ? &arg : nullptr, wait_nr ? sizeof(arg) : 0);
+    } while(rt < 0 && errno == EINTR && !wait_nr);
+    return rt < 0 ? -errno : rt;
+}
+
+io_uring_cqe* IoUring::peekCqe() {
+    unsigned head = *m_cqHead;
+    if(head == __atomic_load_n(m_cqTail, __ATOMIC_ACQUIRE)) {
+        return nullptr;
+    }
+    return &m_cqes[head & m_cqMask];
+}
+
+void IoUring::seenCqe() {
+    __atomic_store_n(m_cqHead, *m_cqHead + 1, __ATOMIC_RELEASE);
+}
+
+bool IoUring::IsSupported() {
+    // 局部静态变量的初始化是线程安全的，只探测一次
+    static bool s_supported = IoUring(2).isValid();
+    return s_supported;
+}
+
+}
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <linux/io_uring.h>
+#include "noncopyable.h"
+
+namespace atpdxy {
+
+// io_uring的最小封装，直接使用系统调用和mmap，不依赖liburing
+// 一个实例只能由一个线程提交和收割，不是线程安全的
+class IoUring : Noncopyable {
+public:
+    // 创建entries个提交队列项的ring，失败时isValid返回false
+    IoUring(unsigned entries);
+
+    ~IoUring();
+
+    // 是否创建成功
+    bool isValid() const { return m_fd >= 0;}
+
+    // 保证提交队列至少还有n个空位，不够时先提交已有的项，仍然不够返回false
+    // 需要连续获取多个链接在一起的项时先调用，避免中途提交把链拆开
+    bool reserve(unsigned n);
+
+    // 返回一个清零的提交队列项，队列满时先提交已有的项，仍然失败返回nullptr
+    io_uring_sqe* getSqe();
+
+    // 返回还没有被内核取走的提交队列项数量
+    unsigned getPending() const { return m_sqeTail - __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE);}
+
+    // 提交所有待提交的项，wait_nr大于0时等待至少wait_nr个完成事件，最多等待timeout_us微秒
+    // timeout_us为~0ull表示一直等待，返回提交的数量，出错返回-errno，等待超时返回-ETIME
+    int submit(unsigned wait_nr = 0, uint64_t timeout_us = ~0ull);
+
+    // 返回下一个完成事件，没有返回nullptr，不需要系统调用
+    io_uring_cqe* peekCqe();
+
+    // 标记peekCqe返回的完成事件已经处理
+    void seenCqe();
+
+    // 当前内核是否支持本封装需要的io_uring特性
+    static bool IsSupported();
+private:
+    // ring的文件描述符
+    int m_fd = -1;
+    // 创建时内核返回的特性
+    uint32_t m_features = 0;
+
+    // 提交队列和完成队列共享的映射
+    void* m_ringPtr = nullptr;
+    // 映射的大小
+    size_t m_ringSize = 0;
+    // 提交队列项数组的映射
+    io_uring_sqe* m_sqes = nullptr;
+    // 提交队列项数组映射的大小
+    size_t m_sqesSize = 0;
+
+    // 提交队列头，由内核推进
+    unsigned* m_sqHead = nullptr;
+    // 提交队列尾，由本线程推进
+    unsigned* m_sqTail = nullptr;
+    // 提交队列掩码
+    unsigned m_sqMask = 0;
+    // 提交队列项数量
+    unsigned m_sqEntries = 0;
+    // 提交队列的下标数组
+    unsigned* m_sqArray = nullptr;
+    // 本地已经填好的提交队列尾，提交时发布到m_sqTail
+    unsigned m_sqeTail = 0;
+
+    // 完成队列头，由本线程推进
+    unsigned* m_cqHead = nullptr;
+    // 完成队列尾，由内核推进
+    unsigned* m_cqTail = nullptr;
+    // 完成队列掩码
+    unsigned m_cqMask = 0;
+    // 完成队列项数组
+    io_uring_cqe* m_cqes = nullptr;
+};
+
+}
@@ -1,15 +1,54 @@
 #include "iomanager.h"
+#include "config.h"
 #include "log.h"
 #include "macro.h"
 #include <errno.h>
-#include <fcntl.h>
+#include <poll.h>
 #include <string.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
 #include <unistd.h>
 
 namespace atpdxy {
 static atpdxy::Logger::ptr g_logger = GET_LOGGER_BY_NAME("system");
 
+// io_uring后端每个线程的ring大小
+static ConfigVar<uint32_t>::ptr g_uring_entries =
+    Config::Lookup<uint32_t>("iomanager.uring_entries", 256, "io_uring entries per worker");
+
+// io_uring后端积攒多少个操作或执行多少个任务后提交一次
+static ConfigVar<uint32_t>::ptr g_uring_batch =
+    Config::Lookup<uint32_t>("iomanager.uring_batch", 16, "io_uring submit batch");
+
+// I/O超时允许的延迟，大量连接的读写超时合并到同一个时间点，减少唤醒次数
+static ConfigVar<uint64_t>::ptr g_timeout_slack =
+    Config::Lookup<uint64_t>("iomanager.timeout_slack_ms", 0, "slack of io timeouts in ms");
+
+// ring中epoll句柄可读事件的user_data，操作的user_data是IoRequest的地址，链接的超时在地址上加1
+static const uint64_t s_uring_epoll_tag = 1;
+
+// 内核是否支持epoll_pwait2，不支持时退回到毫秒精度的epoll_wait
+static std::atomic<bool> s_has_epoll_pwait2 = {true};
+
+// 在epoll上等待最多timeout_us微秒，优先使用纳秒精度的epoll_pwait2，不足1毫秒的超时不会变成忙等
+static int EpollWaitUS(int epfd, epoll_event* events, int maxevents, uint64_t timeout_us) {
+#ifdef SYS_epoll_pwait2
+    if(s_has_epoll_pwait2.load(std::memory_order_relaxed)) {
+        struct timespec ts;
+        ts.tv_sec = timeout_us / 1000000;
+        ts.tv_nsec = timeout_us % 1000000 * 1000;
+        int rt = syscall(SYS_epoll_pwait2, epfd, events, maxevents, &ts, nullptr, 0);
+        if(rt >= 0 || errno != ENOSYS) {
+            return rt;
+        }
+        s_has_epoll_pwait2 = false;
+    }
+#endif
+    return epoll_wait(epfd, events, maxevents, (int)((timeout_us + 999) / 1000));
+}
+
 // 重载输出流运算符，将枚举类型和EPOLL_EVENTS转换成输出流形式，方便调试日志
 enum EpollCtlOp {
 
@@ -72,12 +111,22 @@ IOManager::FdContext::EventContext& IOManager::FdContext::getContext(IOManager::
     throw std::invalid_argument("getContext invalid event");
 }
 
+// 停止事件上下文的超时
+void IOManager::FdContext::stopDeadline(EventContext& ctx) {
+    if(ctx.deadline) {
+        ctx.deadline = 0;
+        ctx.timer->stop();
+    }
+}
+
 // 重置事件上下文
 void IOManager::FdContext::resetContext(EventContext& ctx) {
+    stopDeadline(ctx);
     ctx.cb = nullptr;
     // 智能指针用reset来释放资源
     ctx.fiber.reset();
     ctx.scheduler = nullptr;
+    ctx.thread = -1;
 }
 
 // 触发事件
@@ -89,37 +138,62 @@ void IOManager::FdContext::triggerEvent(IOManager::Event event) {
     events = (Event)(events & ~event);
     // 返回的是内部结构体EventContext的read/write上下文结构体
     EventContext& ctx = getContext(event);
+    stopDeadline(ctx);
     if(ctx.cb) {
-        ctx.scheduler->schedule(&ctx.cb);
+        ctx.scheduler->schedule(&ctx.cb, ctx.thread);
     } else {
-        ctx.scheduler->schedule(&ctx.fiber);
+        ctx.scheduler->schedule(&ctx.fiber, ctx.thread);
     }
     ctx.scheduler = nullptr;
+    ctx.thread = -1;
     return;
 }
 
 // 构造函数，设置线程数量、是否将调用线程纳入调度器以及调度器的名称
-IOManager::IOManager(size_t threads, bool use_caller, const std::string name):
-    Scheduler(threads, use_caller, name){
-    // 初始化epoll文件描述符
-    m_epfd = epoll_create(5);
-    ASSERT(m_epfd > 0);
-    // 创建管道
-    int rt = pipe(m_tickleFds);
-    ASSERT(!rt);
-    // 将管道的读加入到epoll事件表中，等待通知
-    epoll_event event;
-    memset(&event, 0, sizeof(epoll_event));
-    event.events = EPOLLIN | EPOLLET;
-    event.data.fd = m_tickleFds[0];
-    // 设置非阻塞
-    rt = fcntl(m_tickleFds[0], F_SETFL, O_NONBLOCK);
-    ASSERT(!rt);
-    // 将读端添加到事件表中
-    rt = epoll_ctl(m_epfd, EPOLL_CTL_ADD, m_tickleFds[0], &event);
-    ASSERT(!rt);
+IOManager::IOManager(size_t threads, bool use_caller, const std::string name
+                     , bool multi_reactor, Backend backend):
+    Scheduler(threads, use_caller, name),
+    m_multiReactor(multi_reactor),
+    m_backend(backend) {
+    if(m_backend == IO_URING && !IoUring::IsSupported()) {
+        WARN(g_logger) << "io_uring is not supported, fall back to epoll";
+        m_backend = EPOLL;
+    }
+    if(m_backend == IO_URING) {
+        // ring只能由一个线程提交，每个工作线程一个
+        m_multiReactor = true;
+        m_uringBatch = std::max(g_uring_batch->getValue(), 1u);
+    }
+    size_t count = m_multiReactor ? getWorkerCount() : 1;
+    // 多reactor模式下每个工作线程在自己的epoll上等待自己分片的定时器，不再竞争同一把锁
+    // 单reactor模式下其他线程的定时器放入唯一分片的收件箱，由负责定时器的线程取走
+    setTimerShards(count);
+    for(size_t i = 0; i < count; ++i) {
+        Reactor* reactor = new Reactor;
+        // 初始化epoll文件描述符
+        reactor->epfd = epoll_create(5);
+        ASSERT(reactor->epfd > 0);
+        // 创建非阻塞的eventfd，用来唤醒epoll_wait
+        reactor->tickleFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        ASSERT(reactor->tickleFd >= 0);
+        // 将eventfd加入到epoll事件表中，等待通知
+        epoll_event event;
+        memset(&event, 0, sizeof(epoll_event));
+        event.events = EPOLLIN | EPOLLET;
+        event.data.fd = reactor->tickleFd;
+        int rt = epoll_ctl(reactor->epfd, EPOLL_CTL_ADD, reactor->tickleFd, &event);
+        ASSERT(!rt);
+        if(m_backend == IO_URING) {
+            reactor->uring = new IoUring(g_uring_entries->getValue());
+            ASSERT(reactor->uring->isValid());
+        }
+        m_reactors.push_back(reactor);
+    }
     // 设置初始文件描述符容器大小
     contextResize(64);
+    for(size_t i = 0; i < getWorkerCount(); ++i) {
+        m_idleWorkers.push_back(new IdleWorker);
+    }
     // 开始执行调度器
     start();
 }
@@ -128,30 +202,75 @@ IOManager::IOManager(size_t threads, bool use_caller, const std::string name):
 IOManager::~IOManager() {
     stop();
     // 关闭文件描述符并释放指针
-    close(m_epfd);
-    close(m_tickleFds[0]);
-    close(m_tickleFds[1]);
+    for(auto& i : m_reactors) {
+        close(i->epfd);
+        close(i->tickleFd);
+        delete i->uring;
+        while(IoRequest* req = i->freeRequests.pop()) {
+            delete req;
+        }
+        delete i;
+    }
     for(size_t i = 0; i < m_fdContexts.size(); ++i) {
         if(m_fdContexts[i]) {
             delete m_fdContexts[i];
         }
     }
+    for(auto& i : m_idleWorkers) {
+        delete i;
+    }
 }
 
 // 向fd添加事件
-int IOManager::addEvent(int fd, Event event, std::function<void()> cb) {
-    FdContext* fd_ctx = nullptr;
-    RWMutexType::ReadLock lock(m_mutex);
-    if((int)m_fdContexts.size() > fd) {
-        fd_ctx = m_fdContexts[fd];
-        lock.unlock();
-    } else {
-        lock.unlock();
-        RWMutexType::WriteLock lock2(m_mutex);
-        contextResize(fd * 1.5);
-        fd_ctx = m_fdContexts[fd];
-    }
+int IOManager::addEvent(int fd, Event event, Task cb) {
+    FdContext* fd_ctx = getFdContext(fd);
     FdContext::MutexType::Lock lock2(fd_ctx->mutex);
+    return registerEvent(fd_ctx, event, std::move(cb));
+}
+
+// 挂起当前协程等待fd上的事件
+int IOManager::waitEvent(int fd, Event event, uint64_t timeout_ms) {
+    FdContext* fd_ctx = getFdContext(fd);
+    uint32_t seq = 0;
+    {
+        FdContext::MutexType::Lock lock(fd_ctx->mutex);
+        if(registerEvent(fd_ctx, event, nullptr)) {
+            return -1;
+        }
+        FdContext::EventContext& event_ctx = fd_ctx->getContext(event);
+        seq = ++event_ctx.seq;
+        if(timeout_ms != ~0ull) {
+            // 每个fd的读写各有一个定时器，第一次设置超时时创建，之后反复启动和停止
+            if(!event_ctx.timer) {
+                event_ctx.timer = createTimer([this, fd_ctx, event]() {
+                    onDeadline(fd_ctx, event);
+                }, g_timeout_slack->getValue());
+            }
+            event_ctx.deadline = GetMonotonicUS() + timeout_ms * 1000;
+            event_ctx.timer->restart(timeout_ms);
+        }
+    }
+    Fiber::YieldToHold();
+    // 唤醒之后同一个事件可能已经被其他协程重新等待，用序号判断超时的是不是本次等待
+    FdContext::MutexType::Lock lock(fd_ctx->mutex);
+    return fd_ctx->getContext(event).timedOutSeq == seq ? ETIMEDOUT : 0;
+}
+
+// 超时定时器到期，取消还在等待的事件
+void IOManager::onDeadline(FdContext* fd_ctx, Event event) {
+    FdContext::MutexType::Lock lock(fd_ctx->mutex);
+    FdContext::EventContext& event_ctx = fd_ctx->getContext(event);
+    // 事件已经触发，或者是上一次等待遗留的到期，新的等待还没有到时间
+    if(!(fd_ctx->events & event) || !event_ctx.deadline || GetMonotonicUS() < event_ctx.deadline) {
+        return;
+    }
+    event_ctx.timedOutSeq = event_ctx.seq;
+    cancelEventLocked(fd_ctx, event);
+}
+
+// 在fd_ctx上注册事件
+int IOManager::registerEvent(FdContext* fd_ctx, Event event, Task cb) {
+    int fd = fd_ctx->fd;
     // 添加事件时不应该重复添加事件
     if(UNLIKELY(fd_ctx->events & event)) {
         ERROR(g_logger) << "addEvent assert fd=" << fd << " event=" << (EPOLL_EVENTS)event 
@@ -159,12 +278,21 @@ int IOManager::addEvent(int fd, Event event, std::function<void()> cb) {
         ASSERT(!(fd_ctx->events & event));
     }
     int op = fd_ctx->events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+    if(op == EPOLL_CTL_ADD && m_multiReactor) {
+        // 注册到当前线程的epoll实例上，事件在当前线程触发，连接留在当前线程处理
+        int index = getCurrentWorkerIndex();
+        if(index == -1) {
+            index = m_nextReactor++ % m_reactors.size();
+        }
+        fd_ctx->reactor = index;
+    }
+    int epfd = m_reactors[fd_ctx->reactor]->epfd;
     epoll_event epevent;
     epevent.events = EPOLLET | fd_ctx->events | event;
     epevent.data.ptr = fd_ctx;
-    int rt = epoll_ctl(m_epfd, op, fd, &epevent);
+    int rt = epoll_ctl(epfd, op, fd, &epevent);
     if(rt) {
-        ERROR(g_logger) << "epoll_ctl(" << m_epfd << ", "
+        ERROR(g_logger) << "epoll_ctl(" << epfd << ", "
             << (EpollCtlOp)op << ", " << fd << ", " << (EPOLL_EVENTS)epevent.events << "):"
             << rt << " (" << errno << ") (" << strerror(errno) << ") fd_ctx->events="
             << (EPOLL_EVENTS)fd_ctx->events;
@@ -178,9 +306,13 @@ int IOManager::addEvent(int fd, Event event, std::function<void()> cb) {
     ASSERT(!event_ctx.scheduler && !event_ctx.fiber && !event_ctx.cb);
     // 设置事件的上下文是当前调度器
     event_ctx.scheduler = Scheduler::GetThis();
+    // 多reactor模式下事件触发后回到注册事件的线程执行，跨线程通过该线程的信箱投递
+    if(m_multiReactor && event_ctx.scheduler == this) {
+        event_ctx.thread = getWorkerThread(fd_ctx->reactor);
+    }
     if(cb) {
-        // 如果设置了回调函数，将事件上下文和传入的参数进行交换
-        event_ctx.cb.swap(cb);
+        // 如果设置了回调函数，移动到事件上下文中
+        event_ctx.cb = std::move(cb);
     } else {
         // 将事件上下文设置成当前协程
         event_ctx.fiber = Fiber::GetThis();
@@ -212,9 +344,10 @@ bool IOManager::delEvent(int fd, Event event) {
     epevent.events = EPOLLET | new_events;
     epevent.data.ptr = fd_ctx;
 
-    int rt = epoll_ctl(m_epfd, op, fd, &epevent);
+    int epfd = m_reactors[fd_ctx->reactor]->epfd;
+    int rt = epoll_ctl(epfd, op, fd, &epevent);
     if(rt) {
-        ERROR(g_logger) << "epoll_ctl(" << m_epfd << ", "
+        ERROR(g_logger) << "epoll_ctl(" << epfd << ", "
             << (EpollCtlOp)op << ", " << fd << ", " << (EPOLL_EVENTS)epevent.events << "):"
             << rt << " (" << errno << ") (" << strerror(errno) << ")";
         return false;
@@ -236,8 +369,14 @@ bool IOManager::cancelEvent(int fd, Event event) {
     FdContext* fd_ctx = m_fdContexts[fd];
     lock.unlock();
 
-    // 没有要取消的事件则返回
     FdContext::MutexType::Lock lock2(fd_ctx->mutex);
+    return cancelEventLocked(fd_ctx, event);
+}
+
+// 取消fd_ctx上的事件
+bool IOManager::cancelEventLocked(FdContext* fd_ctx, Event event) {
+    int fd = fd_ctx->fd;
+    // 没有要取消的事件则返回
     if(UNLIKELY(!(fd_ctx->events & event))) {
         return false;
     }
@@ -248,9 +387,10 @@ bool IOManager::cancelEvent(int fd, Event event) {
     epevent.events = EPOLLET | new_events;
     epevent.data.ptr = fd_ctx;
 
-    int rt = epoll_ctl(m_epfd, op, fd, &epevent);
+    int epfd = m_reactors[fd_ctx->reactor]->epfd;
+    int rt = epoll_ctl(epfd, op, fd, &epevent);
     if(rt) {
-        ERROR(g_logger) << "epoll_ctl(" << m_epfd << ", "
+        ERROR(g_logger) << "epoll_ctl(" << epfd << ", "
             << (EpollCtlOp)op << ", " << fd << ", " << (EPOLL_EVENTS)epevent.events << "):"
             << rt << " (" << errno << ") (" << strerror(errno) << ")";
         return false;
@@ -272,6 +412,11 @@ bool IOManager::cancelAll(int fd) {
     lock.unlock();
 
     FdContext::MutexType::Lock lock2(fd_ctx->mutex);
+    if(fd_ctx->uringOps) {
+        // ring持有文件的引用，关闭fd不会结束其中的操作，而且操作可能在其他线程的ring里，
+        // 关闭连接的读写让所有ring中的操作尽快完成
+        shutdown(fd, SHUT_RDWR);
+    }
     if(!fd_ctx->events) {
         return false;
     }
@@ -280,9 +425,10 @@ bool IOManager::cancelAll(int fd) {
     epoll_event epevent;
     epevent.events = 0;
     epevent.data.ptr = fd_ctx;
-    int rt = epoll_ctl(m_epfd, op, fd, &epevent);
+    int epfd = m_reactors[fd_ctx->reactor]->epfd;
+    int rt = epoll_ctl(epfd, op, fd, &epevent);
     if(rt) {
-        ERROR(g_logger) << "epoll_ctl(" << m_epfd << ", "
+        ERROR(g_logger) << "epoll_ctl(" << epfd << ", "
             << (EpollCtlOp)op << ", " << fd << ", " << (EPOLL_EVENTS)epevent.events << "):"
             << rt << " (" << errno << ") (" << strerror(errno) << ")";
         return false;
@@ -299,6 +445,148 @@ bool IOManager::cancelAll(int fd) {
     return true;
 }
 
+// 返回fd的上下文，不存在时扩容创建
+IOManager::FdContext* IOManager::getFdContext(int fd) {
+    RWMutexType::ReadLock lock(m_mutex);
+    if((int)m_fdContexts.size() > fd) {
+        return m_fdContexts[fd];
+    }
+    lock.unlock();
+    RWMutexType::WriteLock lock2(m_mutex);
+    contextResize(fd * 1.5);
+    return m_fdContexts[fd];
+}
+
+// 当前协程是否可以通过submitIo提交操作
+bool IOManager::canSubmitIo() {
+    return m_backend == IO_URING
+        && getCurrentWorkerIndex() != -1
+        && !Fiber::GetThis()->isSharedStack();
+}
+
+// 在当前线程的ring上提交操作并挂起当前协程直到操作完成
+int64_t IOManager::submitIo(const IoOp& op, uint64_t timeout_ms) {
+    int index = getCurrentWorkerIndex();
+    ASSERT(m_backend == IO_URING && index != -1);
+    Reactor* reactor = m_reactors[index];
+    IoUring* uring = reactor->uring;
+    bool has_timeout = timeout_ms != ~0ull;
+    // 操作和链接的超时必须在同一批提交
+    if(!uring->reserve(has_timeout ? 2 : 1)) {
+        return -EAGAIN;
+    }
+
+    IoRequest* req = reactor->freeRequests.pop();
+    if(!req) {
+        req = new IoRequest;
+    }
+    req->fiber = Fiber::GetThis();
+    req->res = 0;
+    req->refs = has_timeout ? 3 : 2;
+    req->fdCtx = nullptr;
+    if(op.fd >= 0) {
+        req->fdCtx = getFdContext(op.fd);
+        FdContext::MutexType::Lock lock(req->fdCtx->mutex);
+        ++req->fdCtx->uringOps;
+    }
+
+    io_uring_sqe* sqe = uring->getSqe();
+    sqe->opcode = op.opcode;
+    sqe->fd = op.fd;
+    sqe->addr = op.addr;
+    sqe->len = op.len;
+    sqe->off = op.off;
+    sqe->rw_flags = op.flags;
+    sqe->user_data = (uint64_t)req;
+    if(has_timeout) {
+        // 超时后内核取消前面的操作，操作以-ECANCELED完成
+        sqe->flags |= IOSQE_IO_LINK;
+        req->ts.tv_sec = timeout_ms / 1000;
+        req->ts.tv_nsec = timeout_ms % 1000 * 1000000;
+        io_uring_sqe* timeout = uring->getSqe();
+        timeout->opcode = IORING_OP_LINK_TIMEOUT;
+        timeout->fd = -1;
+        timeout->addr = (uint64_t)&req->ts;
+        timeout->len = 1;
+        timeout->user_data = (uint64_t)req | 1;
+    }
+    ++m_pendingEventCount;
+    // 积攒够一批立即提交，否则在任务回到调度协程或者线程空闲时提交
+    if(uring->getPending() >= m_uringBatch) {
+        uring->submit();
+        reactor->ticks = 0;
+    }
+
+    Fiber::YieldToHold();
+    // 完成后协程在提交它的线程上恢复，reactor和提交时相同
+    int64_t res = req->res;
+    releaseRequest(reactor, req);
+    if(has_timeout && res == -ECANCELED) {
+        res = -ETIMEDOUT;
+    }
+    return res;
+}
+
+// 释放操作节点的一个引用
+void IOManager::releaseRequest(Reactor* reactor, IoRequest* req) {
+    if(--req->refs == 0) {
+        req->fdCtx = nullptr;
+        reactor->freeRequests.push(req);
+    }
+}
+
+// 收割ring中已经完成的操作，返回epoll句柄是否有就绪的事件
+bool IOManager::reapCompletions(Reactor* reactor) {
+    bool epoll_ready = false;
+    int thread = GetThreadId();
+    while(io_uring_cqe* cqe = reactor->uring->peekCqe()) {
+        uint64_t data = cqe->user_data;
+        int32_t res = cqe->res;
+        reactor->uring->seenCqe();
+        if(data == s_uring_epoll_tag) {
+            reactor->epollArmed = false;
+            epoll_ready = true;
+            continue;
+        }
+        if(data & 1) {
+            // 链接的超时
+            releaseRequest(reactor, (IoRequest*)(data & ~1ull));
+            continue;
+        }
+        IoRequest* req = (IoRequest*)data;
+        req->res = res;
+        if(req->fdCtx) {
+            FdContext::MutexType::Lock lock(req->fdCtx->mutex);
+            --req->fdCtx->uringOps;
+        }
+        // 先放入任务再减少计数，避免其他线程误判为可以停止
+        schedule(&req->fiber, thread);
+        --m_pendingEventCount;
+        releaseRequest(reactor, req);
+    }
+    return epoll_ready;
+}
+
+// 任务回到调度协程后提交积攒的操作并收割已经完成的操作
+void IOManager::onTaskReturn() {
+    if(m_backend != IO_URING) {
+        return;
+    }
+    Reactor* reactor = m_reactors[getCurrentWorkerIndex()];
+    IoUring* uring = reactor->uring;
+    // 一直有任务执行时线程不会进入idle，最多执行m_uringBatch个任务就提交一次
+    if(uring->getPending()
+            && (uring->getPending() >= m_uringBatch || ++reactor->ticks >= m_uringBatch)) {
+        uring->submit();
+        reactor->ticks = 0;
+    }
+    if(reapCompletions(reactor)) {
+        epoll_event events[64];
+        int rt = epoll_wait(reactor->epfd, events, 64, 0);
+        processEvents(reactor, events, rt);
+    }
+}
+
 // 返回当前线程正在运行的IOManager
 IOManager* IOManager::GetThis() {
     return dynamic_cast<IOManager*>(Scheduler::GetThis());
@@ -310,15 +598,94 @@ void IOManager::tickle() {
     if(!hasIdleThreads()) {
         return;
     }
-    // 向管道写，通知有事件到达
-    int rt = write(m_tickleFds[1], "T", 1);
-    ASSERT(rt == 1);
+    // 优先唤醒一个休眠的线程，负责定时器的线程继续等待
+    if(unparkOne()) {
+        return;
+    }
+    // 单reactor模式下没有休眠的线程，唤醒在epoll_wait上等待的线程
+    if(!m_multiReactor && m_poller != -1) {
+        wakeReactor(m_reactors[0]);
+    }
+}
+
+// 通知指定的工作线程
+void IOManager::tickleThread(int thread) {
+    int index = getWorkerIndex(thread);
+    if(index == -1) {
+        tickle();
+        return;
+    }
+    if(unpark(index)) {
+        return;
+    }
+    // 单reactor模式下目标线程正在epoll_wait上等待
+    if(!m_multiReactor && m_poller == index) {
+        wakeReactor(m_reactors[0]);
+    }
+}
+
+// 唤醒休眠的工作线程，返回是否由本次调用唤醒
+bool IOManager::unpark(int index) {
+    IdleWorker* worker = m_idleWorkers[index];
+    bool parked = true;
+    if(!worker->parked.compare_exchange_strong(parked, false)) {
+        return false;
+    }
+    --m_parkedCount;
+    if(m_multiReactor) {
+        wakeReactor(m_reactors[index]);
+    } else {
+        worker->sem.notify();
+    }
+    return true;
+}
+
+// 唤醒任意一个休眠的工作线程
+bool IOManager::unparkOne() {
+    if(m_parkedCount == 0) {
+        return false;
+    }
+    // 优先唤醒不负责定时器的线程，避免定时器职责来回交接
+    int poller = m_poller;
+    for(size_t i = 0; i < m_idleWorkers.size(); ++i) {
+        if((int)i != poller && m_idleWorkers[i]->parked && unpark(i)) {
+            return true;
+        }
+    }
+    return poller != -1 && unpark(poller);
+}
+
+// 唤醒在reactor的epoll_wait上等待的线程
+void IOManager::wakeReactor(Reactor* reactor) {
+    // 上一次写入还没有被读取，等待的线程一定会醒来
+    if(reactor->tickling.exchange(true)) {
+        return;
+    }
+    uint64_t one = 1;
+    int rt = write(reactor->tickleFd, &one, sizeof(one));
+    ASSERT(rt == sizeof(one));
+}
+
+// 返回工作线程使用的reactor
+IOManager::Reactor* IOManager::getReactor(size_t index) {
+    return m_multiReactor ? m_reactors[index] : m_reactors[0];
+}
+
+// 工作线程取消休眠登记
+bool IOManager::cancelPark(IdleWorker* worker) {
+    bool parked = true;
+    if(worker->parked.compare_exchange_strong(parked, false)) {
+        --m_parkedCount;
+        return true;
+    }
+    return false;
 }
 
-// 停止调度器的执行
+// 停止调度器的执行，不查询最近的定时器，不需要加锁
 bool IOManager::stopping() {
-    uint64_t timeout = 0;
-    return stopping(timeout);
+    return !hasTimer()
+        && m_pendingEventCount == 0
+        && Scheduler::stopping();
 }
 
 // 调度器没有任务时执行idle
@@ -332,93 +699,133 @@ void IOManager::idle() {
         delete[] ptr;
     });
 
+    int index = getCurrentWorkerIndex();
+    ASSERT(index != -1);
+    IdleWorker* me = m_idleWorkers[index];
+    Reactor* reactor = getReactor(index);
+    // 到期定时器的回调，循环中复用容量
+    std::vector<Task> cbs;
     while(true) {
-        uint64_t next_timeout = 0;
-        if(UNLIKELY(stopping(next_timeout))) {
+        if(UNLIKELY(stopping())) {
             INFO(g_logger) << "name=" << getName() << " idle stopping exit";
+            // 接力唤醒休眠的线程或等待IO事件的线程，让它们也检查是否可以退出
+            tickle();
             break;
         }
 
-        int rt = 0;
-        do {
-            // 等待事件发生，最多3秒返回
-            static const int MAX_TIMEOUT = 3000;
-            if(next_timeout != ~0ull) {
-                next_timeout = (int)next_timeout > MAX_TIMEOUT ? MAX_TIMEOUT : next_timeout;
+        // 单reactor模式下同一时刻只有一个空闲线程负责定时器，也只有它在epoll_wait上等待，
+        // 其他空闲线程在各自的信号量上休眠，这样可以只唤醒指定的线程，而不是由epoll随机挑选
+        // 多reactor模式下每个线程负责自己分片的定时器
+        int expected = -1;
+        bool poller = !m_multiReactor && m_poller.compare_exchange_strong(expected, index);
+        bool timers = poller || m_multiReactor;
+        if(!poller && !m_multiReactor) {
+            // 先登记休眠再检查，和唤醒方先放入任务再检查休眠状态配对，避免丢失唤醒
+            ++m_parkedCount;
+            me->parked = true;
+            if(hasTask() || m_poller == -1 || stopping()) {
+                if(!cancelPark(me)) {
+                    // 已经被唤醒方认领，消耗掉对应的信号
+                    me->sem.wait();
+                }
             } else {
-                next_timeout = MAX_TIMEOUT;
+                me->sem.wait();
             }
-            rt = epoll_wait(m_epfd, events, MAX_EVNETS, (int)next_timeout);
-            if(rt < 0 && errno == EINTR) {
-                // 被中断信号打断，重新调用epoll_wait等待事件
-            } else {
-                break;
-            }
-        } while(true);
-
-        std::vector<std::function<void()> > cbs;
-        listExpiredCb(cbs);
-        if(!cbs.empty()) {
-            //SYLAR_LOG_DEBUG(g_logger) << "on timer cbs.size=" << cbs.size();
-            schedule(cbs.begin(), cbs.end());
-            cbs.clear();
+            Fiber::ptr cur = Fiber::GetThis();
+            auto raw_ptr = cur.get();
+            cur.reset();
+            raw_ptr->swapOut();
+            continue;
         }
 
-        //if(SYLAR_UNLIKELY(rt == MAX_EVNETS)) {
-        //    SYLAR_LOG_INFO(g_logger) << "epoll wait events=" << rt;
-        //}
-        // 遍历监听到的事件处理
-        for(int i = 0; i < rt; ++i) {
-            epoll_event& event = events[i];
-            if(event.data.fd == m_tickleFds[0]) {
-                // 管道的写端写了数据
-                uint8_t dummy[256];
-                while(read(m_tickleFds[0], dummy, sizeof(dummy)) > 0);
-                continue;
-            }
-
-            FdContext* fd_ctx = (FdContext*)event.data.ptr;
-            FdContext::MutexType::Lock lock(fd_ctx->mutex);
-            if(event.events & (EPOLLERR | EPOLLHUP)) {
-                // 如果当前事件是可读或挂起，则修改为同时监听可读和可写
-                event.events |= (EPOLLIN | EPOLLOUT) & fd_ctx->events;
-            }
-            // 根据当前事件的类型，转换成实际的事件类型
-            int real_events = NONE;
-            if(event.events & EPOLLIN) {
-                real_events |= READ;
+        // 多reactor模式下每个空闲线程都在自己的epoll实例上等待，唤醒方认领后写该线程的eventfd
+        if(m_multiReactor) {
+            ++m_parkedCount;
+            me->parked = true;
+        }
+        // 登记后再检查一次，和tickleThread先放入任务再检查m_poller和休眠状态配对
+        if(hasTask()) {
+            if(m_multiReactor) {
+                // 被认领时eventfd中的唤醒留到下次epoll_wait读取
+                cancelPark(me);
             }
-            if(event.events & EPOLLOUT) {
-                real_events |= WRITE;
+            if(poller) {
+                m_poller = -1;
+                unparkOne();
             }
+            Fiber::ptr cur = Fiber::GetThis();
+            auto raw_ptr = cur.get();
+            cur.reset();
+            raw_ptr->swapOut();
+            continue;
+        }
 
-            if((fd_ctx->events & real_events) == NONE) {
-                continue;
-            }
-            // 如果剩余事件不为空，则需要修改，否则表示不需要继续监听
-            int left_events = (fd_ctx->events & ~real_events);
-            int op = left_events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
-            event.events = EPOLLET | left_events;
-
-            int rt2 = epoll_ctl(m_epfd, op, fd_ctx->fd, &event);
-            if(rt2) {
-                ERROR(g_logger) << "epoll_ctl(" << m_epfd << ", "
-                    << (EpollCtlOp)op << ", " << fd_ctx->fd << ", " << (EPOLL_EVENTS)event.events << "):"
-                    << rt2 << " (" << errno << ") (" << strerror(errno) << ")";
-                continue;
+        // 成为负责定时器的线程之前插入的定时器不会唤醒本线程，重新获取超时时间
+        // 超时精确到微秒，sub-ms的定时器不会被取整成0毫秒而反复空转
+        // 多reactor模式下其他线程放入本分片收件箱的定时器在这里取走
+        uint64_t next_timeout = timers ? getNextTimerUS() : ~0ull;
+        // 等待事件发生，最多3秒返回
+        static const uint64_t MAX_TIMEOUT = 3000 * 1000;
+        if(next_timeout > MAX_TIMEOUT) {
+            next_timeout = MAX_TIMEOUT;
+        }
+        int rt = 0;
+        if(reactor->uring) {
+            // io_uring后端在ring上等待，epoll句柄本身作为一个可读事件提交，
+            // addEvent注册的事件和eventfd的唤醒都通过它报告
+            if(!reactor->epollArmed) {
+                io_uring_sqe* sqe = reactor->uring->getSqe();
+                if(sqe) {
+                    sqe->opcode = IORING_OP_POLL_ADD;
+                    sqe->fd = reactor->epfd;
+                    sqe->poll32_events = POLLIN;
+                    sqe->user_data = s_uring_epoll_tag;
+                    reactor->epollArmed = true;
+                }
             }
+            reactor->ticks = 0;
+            reactor->uring->submit(1, next_timeout);
+        } else {
+            do {
+                rt = EpollWaitUS(reactor->epfd, events, MAX_EVNETS, next_timeout);
+                if(rt < 0 && errno == EINTR) {
+                    // 被中断信号打断，重新调用epoll_wait等待事件
+                } else {
+                    break;
+                }
+            } while(true);
+        }
+        if(m_multiReactor) {
+            cancelPark(me);
+        }
 
-            //SYLAR_LOG_INFO(g_logger) << " fd=" << fd_ctx->fd << " events=" << fd_ctx->events
-            //                         << " real_events=" << real_events;
-            if(real_events & READ) {
-                fd_ctx->triggerEvent(READ);
-                --m_pendingEventCount;
-            }
-            if(real_events & WRITE) {
-                fd_ctx->triggerEvent(WRITE);
-                --m_pendingEventCount;
+        if(timers) {
+            // 取出超时定时器到调度回调之间，定时器和任务队列可能同时为空，
+            // 期间计为活跃线程，避免其他线程误判为可以停止
+            ++m_activeThreadCount;
+            // 每轮只读取一次时钟，本轮其他需要当前时间的地方使用缓存
+            listExpiredCb(cbs, RefreshCachedUS());
+            if(!cbs.empty()) {
+                //SYLAR_LOG_DEBUG(g_logger) << "on timer cbs.size=" << cbs.size();
+                schedule(cbs.begin(), cbs.end());
+                cbs.clear();
             }
+            --m_activeThreadCount;
+        }
+
+        //if(SYLAR_UNLIKELY(rt == MAX_EVNETS)) {
+        //    SYLAR_LOG_INFO(g_logger) << "epoll wait events=" << rt;
+        //}
+        if(reactor->uring && reapCompletions(reactor)) {
+            rt = epoll_wait(reactor->epfd, events, MAX_EVNETS, 0);
+        }
+        processEvents(reactor, events, rt);
+        // 离开epoll_wait去执行任务，唤醒一个休眠的线程接替负责定时器
+        if(poller) {
+            m_poller = -1;
+            unparkOne();
         }
+
         // 让出控制权
         Fiber::ptr cur = Fiber::GetThis();
         auto raw_ptr = cur.get();
@@ -428,6 +835,67 @@ void IOManager::idle() {
     }
 }
 
+// 处理epoll_wait返回的事件
+void IOManager::processEvents(Reactor* reactor, epoll_event* events, int n) {
+    for(int i = 0; i < n; ++i) {
+        epoll_event& event = events[i];
+        if(event.data.fd == reactor->tickleFd) {
+            // 先读空再清除标记，清除之前的唤醒被合并到本次，本线程接下来会离开idle检查任务
+            // 反过来的话，清除后写入的计数可能被这里读走，epoll收集事件时发现不可读会丢弃该边沿，标记就再也不会被清除
+            uint64_t dummy;
+            while(read(reactor->tickleFd, &dummy, sizeof(dummy)) > 0);
+            reactor->tickling = false;
+            continue;
+        }
+
+        FdContext* fd_ctx = (FdContext*)event.data.ptr;
+        FdContext::MutexType::Lock lock(fd_ctx->mutex);
+        // 事件已经从本reactor删除并重新注册到其他reactor，由新的reactor报告
+        if(getReactor(fd_ctx->reactor) != reactor) {
+            continue;
+        }
+        if(event.events & (EPOLLERR | EPOLLHUP)) {
+            // 如果当前事件是可读或挂起，则修改为同时监听可读和可写
+            event.events |= (EPOLLIN | EPOLLOUT) & fd_ctx->events;
+        }
+        // 根据当前事件的类型，转换成实际的事件类型
+        int real_events = NONE;
+        if(event.events & EPOLLIN) {
+            real_events |= READ;
+        }
+        if(event.events & EPOLLOUT) {
+            real_events |= WRITE;
+        }
+
+        if((fd_ctx->events & real_events) == NONE) {
+            continue;
+        }
+        // 如果剩余事件不为空，则需要修改，否则表示不需要继续监听
+        int left_events = (fd_ctx->events & ~real_events);
+        int op = left_events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
+        event.events = EPOLLET | left_events;
+
+        int rt2 = epoll_ctl(reactor->epfd, op, fd_ctx->fd, &event);
+        if(rt2) {
+            ERROR(g_logger) << "epoll_ctl(" << reactor->epfd << ", "
+                << (EpollCtlOp)op << ", " << fd_ctx->fd << ", " << (EPOLL_EVENTS)event.events << "):"
+                << rt2 << " (" << errno << ") (" << strerror(errno) << ")";
+            continue;
+        }
+
+        //SYLAR_LOG_INFO(g_logger) << " fd=" << fd_ctx->fd << " events=" << fd_ctx->events
+        //                         << " real_events=" << real_events;
+        if(real_events & READ) {
+            fd_ctx->triggerEvent(READ);
+            --m_pendingEventCount;
+        }
+        if(real_events & WRITE) {
+            fd_ctx->triggerEvent(WRITE);
+            --m_pendingEventCount;
+        }
+    }
+}
+
 // 重置句柄上下文容器大小
 void IOManager::contextResize(size_t size) {
     m_fdContexts.resize(size);
@@ -442,15 +910,29 @@ void IOManager::contextResize(size_t size) {
 
 // 是否可以停止，timeout是最近要触发的定时器事件间隔
 bool IOManager::stopping(uint64_t& timeout) {
-    // 获取下一个定时器的超时时间，如果为~0ull（uint64_t最大值）表示没有定时器，定时器队列为空
+    // 获取下一个定时器的超时时间，如果为~0ull（uint64_t最大值）表示没有定时器
     timeout = getNextTimer();
-    return timeout == ~0ull
-        && m_pendingEventCount == 0
-        && Scheduler::stopping();
+    return stopping();
 }
 
-void IOManager::onTimerInsertedAtFront() {
-    tickle();
+int IOManager::getCurrentTimerShard() {
+    int index = getCurrentWorkerIndex();
+    if(m_multiReactor) {
+        return index;
+    }
+    return index != -1 && m_poller == index ? 0 : -1;
+}
+
+void IOManager::onTimerInsertedAtFront(size_t shard) {
+    // 唤醒负责定时器的线程重新计算epoll_wait的超时时间
+    if(m_multiReactor) {
+        // 分片的线程没有在等待时会在下次等待之前重新获取超时时间
+        unpark(shard);
+        return;
+    }
+    if(m_poller != -1) {
+        wakeReactor(m_reactors[0]);
+    }
 }
 }
 
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <sys/epoll.h>
+#include "io_uring.h"
 #include "scheduler.h"
 #include "timer.h"
 
@@ -18,6 +20,34 @@ public:
         // 写事件
         WRITE = 0x4
     };
+
+    // I/O多路复用的实现
+    enum Backend {
+        // 所有操作通过epoll等待就绪后再执行
+        EPOLL = 0,
+        // 读写、accept、connect和超时作为提交队列项交给内核执行，完成后恢复协程
+        IO_URING = 1
+    };
+
+    // io_uring后端提交的操作，字段和io_uring_sqe中的同名字段对应
+    struct IoOp {
+        IoOp(uint8_t opcode_, int fd_, uint64_t addr_ = 0, uint32_t len_ = 0
+             , uint64_t off_ = 0, uint32_t flags_ = 0)
+            :opcode(opcode_), fd(fd_), addr(addr_), len(len_), off(off_), flags(flags_) {}
+
+        // 操作码IORING_OP_*
+        uint8_t opcode;
+        // 文件描述符，没有时为-1
+        int fd;
+        // 缓冲区、iovec、msghdr、sockaddr或timespec的地址
+        uint64_t addr;
+        // 长度或数量
+        uint32_t len;
+        // 偏移，也作为addr2使用
+        uint64_t off;
+        // rw_flags/msg_flags/accept_flags/poll32_events/timeout_flags
+        uint32_t flags;
+    };
 private:
     // 文件描述符上下文结构体，用于异步I/O操作中跟踪事件状态和处理事件回调
     struct FdContext {
@@ -30,7 +60,17 @@ private:
             // 协程智能指针
             Fiber::ptr fiber;
             // 回调函数
-            std::function<void()> cb;
+            Task cb;
+            // 事件触发后协程或回调函数执行的线程，-1表示任意线程
+            int thread = -1;
+            // 等待超时的定时器，第一次设置超时时创建，之后重复使用
+            Timer::ptr timer;
+            // 本次等待的截止时间，单调时钟微秒数，0表示没有设置超时
+            uint64_t deadline = 0;
+            // 每次等待递增的序号
+            uint32_t seq = 0;
+            // 最近一次超时的等待序号
+            uint32_t timedOutSeq = 0;
         };
         
         // 返回事件上下文
@@ -39,6 +79,9 @@ private:
         // 重置事件上下文
         void resetContext(EventContext& ctx);
 
+        // 停止事件上下文的超时
+        void stopDeadline(EventContext& ctx);
+
         // 触发事件
         void triggerEvent(Event event);
 
@@ -50,18 +93,73 @@ private:
         int fd;
         // 当前文件描述符的事件
         Event events = NONE;
+        // 事件注册在的reactor下标，没有事件时在下次添加事件时重新选择
+        int reactor = 0;
+        // 在io_uring中还没有完成的操作数量
+        int uringOps = 0;
         // 事件的互斥锁
         MutexType mutex;
     };
+
+    // io_uring中一个正在进行的操作
+    struct IoRequest {
+        // 等待操作完成的协程
+        Fiber::ptr fiber;
+        // 操作所属的文件描述符上下文，没有时为nullptr
+        FdContext* fdCtx = nullptr;
+        // 操作的结果
+        int64_t res = 0;
+        // 引用计数，等待的协程、操作和链接的超时各占一个
+        int refs = 0;
+        // 链接的超时时间，提交后由内核读取
+        __kernel_timespec ts;
+        // 空闲链表中的下一个节点
+        IoRequest* next = nullptr;
+    };
+
+    // epoll实例及其唤醒用的eventfd，io_uring后端下还有该线程的ring
+    struct Reactor {
+        // epoll句柄
+        int epfd = -1;
+        // 唤醒epoll_wait的eventfd
+        int tickleFd = -1;
+        // eventfd是否已经写入还没有被读取，合并多次唤醒
+        std::atomic<bool> tickling = {false};
+        // io_uring后端下该线程的ring，只由该线程提交和收割
+        IoUring* uring = nullptr;
+        // epoll句柄的可读事件是否已经提交到ring中
+        bool epollArmed = false;
+        // 上次提交之后执行的任务数量
+        uint32_t ticks = 0;
+        // 空闲的操作节点，只由该线程使用
+        IntrusiveQueue<IoRequest> freeRequests;
+    };
+
+    // 空闲的工作线程
+    struct IdleWorker {
+        // 单reactor模式下休眠时等待的信号量
+        Semaphore sem;
+        // 是否登记了休眠，唤醒方通过CAS认领，保证只唤醒一次
+        std::atomic<bool> parked = {false};
+    };
 public:
     // 构造函数，设置线程数量、是否将调用线程纳入调度器以及调度器的名称
-    IOManager(size_t threads = 1, bool use_caller = true, const std::string name = "");
+    // multi_reactor为true时每个工作线程拥有自己的epoll实例，文件描述符的事件在注册它的线程上触发和处理，
+    // 否则所有工作线程共用一个epoll实例，同一时刻只有一个空闲线程在epoll_wait上等待
+    // backend为IO_URING时每个工作线程额外拥有一个io_uring，总是按多reactor模式运行，内核不支持时退回到epoll
+    IOManager(size_t threads = 1, bool use_caller = true, const std::string name = ""
+              , bool multi_reactor = false, Backend backend = EPOLL);
 
     // 析构函数，释放资源
     ~IOManager();
 
     // 向fd添加事件
-    int addEvent(int fd, Event event, std::function<void()> cb = nullptr);
+    int addEvent(int fd, Event event, Task cb = nullptr);
+
+    // 挂起当前协程等待fd上的事件，timeout_ms为~0ull表示不超时
+    // 超时的定时器按fd和事件复用，不会为每次等待分配定时器
+    // 返回0表示事件就绪或者被取消，ETIMEDOUT表示超时，-1表示添加事件失败
+    int waitEvent(int fd, Event event, uint64_t timeout_ms = ~0ull);
 
     // 向fd删除事件
     bool delEvent(int fd, Event event);
@@ -72,12 +170,68 @@ public:
     // 取消fd的所有事件
     bool cancelAll(int fd);
 
+    // 是否每个工作线程拥有自己的epoll实例
+    bool isMultiReactor() const { return m_multiReactor;}
+
+    // 返回实际使用的I/O多路复用实现
+    Backend getBackend() const { return m_backend;}
+
+    // 当前协程是否可以通过submitIo提交操作
+    // 共享栈协程切出后栈上的缓冲区会被其他协程覆盖，不能交给内核异步读写
+    bool canSubmitIo();
+
+    // 在当前线程的ring上提交操作并挂起当前协程直到操作完成，timeout_ms为~0ull表示不超时
+    // 返回操作的结果，失败返回-errno，超时返回-ETIMEDOUT
+    int64_t submitIo(const IoOp& op, uint64_t timeout_ms = ~0ull);
+
     // 返回当前线程正在运行的IOManager
     static IOManager* GetThis();
 protected:
     // 通知调度器有任务可以执行了
     void tickle() override;
 
+    // 通知指定的工作线程有任务可以执行了
+    void tickleThread(int thread) override;
+
+    // 唤醒休眠的工作线程，返回是否由本次调用唤醒
+    bool unpark(int index);
+
+    // 唤醒任意一个休眠的工作线程，返回是否唤醒了线程
+    bool unparkOne();
+
+    // 唤醒在reactor的epoll_wait上等待的线程，已经有未处理的唤醒时不重复写eventfd
+    void wakeReactor(Reactor* reactor);
+
+    // 返回工作线程使用的reactor
+    Reactor* getReactor(size_t index);
+
+    // 工作线程取消休眠登记，返回false表示已经被唤醒方认领
+    bool cancelPark(IdleWorker* worker);
+
+    // 任务回到调度协程后提交积攒的操作并收割已经完成的操作
+    void onTaskReturn() override;
+
+    // 收割ring中已经完成的操作，返回epoll句柄是否有就绪的事件
+    bool reapCompletions(Reactor* reactor);
+
+    // 处理epoll_wait返回的事件
+    void processEvents(Reactor* reactor, epoll_event* events, int n);
+
+    // 释放操作节点的一个引用，没有引用后放回reactor的空闲链表
+    void releaseRequest(Reactor* reactor, IoRequest* req);
+
+    // 返回fd的上下文，不存在时扩容创建
+    FdContext* getFdContext(int fd);
+
+    // 在fd_ctx上注册事件，调用时持有fd_ctx的锁
+    int registerEvent(FdContext* fd_ctx, Event event, Task cb);
+
+    // 取消fd_ctx上的事件，调用时持有fd_ctx的锁
+    bool cancelEventLocked(FdContext* fd_ctx, Event event);
+
+    // 等待超时的定时器到期
+    void onDeadline(FdContext* fd_ctx, Event event);
+
     // 停止调度器的执行
     bool stopping() override;
 
@@ -87,22 +241,39 @@ protected:
     // 重置句柄上下文容器大小
     void contextResize(size_t size);
 
-    // 有新的定时器插入到set中需要唤醒
-    void onTimerInsertedAtFront() override;
+    // 有新的定时器插入到分片的最前面，唤醒负责该分片定时器的线程
+    void onTimerInsertedAtFront(size_t shard) override;
+
+    // 多reactor模式下定时器按工作线程分片，返回当前线程的工作线程下标
+    // 单reactor模式下只有一个分片，只有负责定时器的线程拥有它，其他线程通过收件箱添加，不竞争分片的锁
+    int getCurrentTimerShard() override;
 
     // 是否可以停止，timeout是最近要触发的定时器事件间隔
     bool stopping(uint64_t& timeout);
 private:
-    // epoll句柄
-    int m_epfd = 0;
-    // pipe管道句柄
-    int m_tickleFds[2];
+    // 是否每个工作线程拥有自己的epoll实例
+    bool m_multiReactor = false;
+    // I/O多路复用的实现
+    Backend m_backend = EPOLL;
+    // 积攒多少个提交队列项或执行多少个任务后提交一次
+    uint32_t m_uringBatch = 16;
+    // epoll实例，多reactor模式下下标和工作线程下标一致，否则只有一个
+    std::vector<Reactor*> m_reactors;
+    // 非工作线程添加事件时轮流选择的reactor
+    std::atomic<size_t> m_nextReactor = {0};
     // 等待执行的事件数量
     std::atomic<size_t> m_pendingEventCount = {0};
     // 读写锁
     RWMutexType m_mutex;
     // socket事件上下文的容器
     std::vector<FdContext*> m_fdContexts;
+    // 工作线程的空闲状态，下标和调度器的工作线程下标一致
+    std::vector<IdleWorker*> m_idleWorkers;
+    // 单reactor模式下当前负责定时器的空闲线程下标，-1表示没有，也是唯一在epoll_wait上等待的线程
+    // 多reactor模式下每个工作线程负责自己分片的定时器，不使用该字段
+    std::atomic<int> m_poller = {-1};
+    // 登记了休眠的工作线程数量
+    std::atomic<size_t> m_parkedCount = {0};
 };
 
 }
\ No newline at end of file
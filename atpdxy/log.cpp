@@ -1,5 +1,14 @@
 #include "log.h"
+#include "binlog.h"
 #include "config.h"
+#include <fcntl.h>
+#include <limits.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <zlib.h>
+#include <algorithm>
+#include <thread>
 
 namespace atpdxy {
 const char* LogLevel::ToString(LogLevel::Level level) {
@@ -45,27 +54,113 @@ LogLevel::Level LogLevel::FromString(const std::string& str) {
 }
 
 LogEventWrap::LogEventWrap(LogEvent::ptr e):
-    m_event(e) {
+    // 参数在整个表达式结束时才析构，移走后析构时事件只被包装器持有，可以放回缓存
+    m_event(std::move(e)) {
 
 }
 
 
 LogEventWrap::~LogEventWrap() {
     m_event->getLogger()->log(m_event->getLevel(), m_event);
+    LogEvent::FreeEvent(m_event);
 }
 
 
-std::stringstream& LogEventWrap::getSS() {
+LogStream& LogEventWrap::getSS() {
     return m_event->getSS();
 }
 
+// 缓冲区初始大小
+static const size_t s_log_stream_init_size = 4096;
+// 清空时超过这个大小的缓冲区释放掉，避免偶尔的超长日志一直占用内存
+static const size_t s_log_stream_max_size = 64 * 1024;
+
+LogStream::Buffer::Buffer()
+    :m_data(s_log_stream_init_size) {
+    setp(&m_data[0], &m_data[0] + m_data.size());
+}
+
+void LogStream::Buffer::reset() {
+    if(m_data.size() > s_log_stream_max_size) {
+        std::vector<char>(s_log_stream_init_size).swap(m_data);
+    }
+    setp(&m_data[0], &m_data[0] + m_data.size());
+}
+
+void LogStream::Buffer::reserve(size_t n) {
+    size_t used = size();
+    if(m_data.size() - used >= n) {
+        return;
+    }
+    size_t cap = m_data.size();
+    while(cap - used < n) {
+        cap <<= 1;
+    }
+    m_data.resize(cap);
+    setp(&m_data[0], &m_data[0] + m_data.size());
+    pbump(used);
+}
+
+void LogStream::Buffer::format(const char* fmt, va_list al) {
+    va_list copy;
+    va_copy(copy, al);
+    size_t avail = epptr() - pptr();
+    int len = vsnprintf(pptr(), avail, fmt, al);
+    if(len >= 0 && (size_t)len >= avail) {
+        // 空间不够，扩容后用参数的副本重新格式化
+        reserve(len + 1);
+        len = vsnprintf(pptr(), len + 1, fmt, copy);
+    }
+    va_end(copy);
+    if(len > 0) {
+        pbump(len);
+    }
+}
+
+LogStream::Buffer::int_type LogStream::Buffer::overflow(int_type c) {
+    if(traits_type::eq_int_type(c, traits_type::eof())) {
+        return traits_type::not_eof(c);
+    }
+    reserve(1);
+    *pptr() = traits_type::to_char_type(c);
+    pbump(1);
+    return c;
+}
+
+std::streamsize LogStream::Buffer::xsputn(const char* s, std::streamsize n) {
+    reserve(n);
+    memcpy(pptr(), s, n);
+    pbump(n);
+    return n;
+}
+
+LogStream::LogStream()
+    :std::ostream(nullptr) {
+    rdbuf(&m_buf);
+}
+
+void LogStream::reset() {
+    m_buf.reset();
+    clear();
+    // 调用者可能改过进制、精度等，复用前恢复默认值
+    flags(std::ios_base::skipws | std::ios_base::dec);
+    precision(6);
+    width(0);
+    fill(' ');
+}
+
+void LogStream::format(const char* fmt, va_list al) {
+    m_buf.format(fmt, al);
+}
+
 // 消息体item
 class MessageFormatItem : public LogFormatter::FormatItem {
 public:
     MessageFormatItem(const std::string& str = "") {}
 
     void format(std::ostream& os, Logger::ptr logger, LogLevel::Level level, LogEvent::ptr event) override {
-        os << event->getContent();
+        const LogStream& content = event->getStream();
+        os.write(content.data(), content.size());
     }
 };
 
@@ -157,6 +252,7 @@ public:
 };
 
 // 时间item
+// 每个线程缓存最近一秒格式化好的时间字符串，同一秒内只改写毫秒和微秒的数字，每秒只调用一次localtime_r和strftime
 class DateTimeFormatItem : public LogFormatter::FormatItem {
 public:
     DateTimeFormatItem(const std::string& format = "%Y-%m-%d %H:%M:%S"):
@@ -165,19 +261,101 @@ public:
         if(m_format.empty()) {
             m_format = "%Y-%m-%d %H:%M:%S";
         }
+        static std::atomic<uint64_t> s_id = {0};
+        m_id = ++s_id;
+        // 把%L和%f拆出来，其余部分交给strftime
+        std::string part;
+        for(size_t i = 0; i < m_format.size(); ++i) {
+            if(m_format[i] == '%' && i + 1 < m_format.size()) {
+                char c = m_format[i + 1];
+                if((c == 'L' || c == 'f') && m_parts.size() < s_max_fields) {
+                    m_parts.push_back(std::make_pair(part, c == 'L' ? 3 : 6));
+                    part.clear();
+                } else {
+                    part.append(m_format, i, 2);
+                }
+                ++i;
+            } else {
+                part.push_back(m_format[i]);
+            }
+        }
+        m_parts.push_back(std::make_pair(part, 0));
     }
 
     void format(std::ostream& os, Logger::ptr logger, LogLevel::Level level, LogEvent::ptr event) override {
+        uint64_t us = event->getTimeUS();
+        Cache* cache = getCache(us / 1000000);
+        uint32_t sub = us % 1000000;
+        for(uint32_t i = 0; i < cache->fields; ++i) {
+            uint32_t v = cache->digits[i] == 3 ? sub / 1000 : sub;
+            char* p = cache->text + cache->pos[i] + cache->digits[i];
+            for(uint32_t j = 0; j < cache->digits[i]; ++j) {
+                *--p = '0' + v % 10;
+                v /= 10;
+            }
+        }
+        os.write(cache->text, cache->len);
+    }
+private:
+    // 一个格式中最多替换的毫秒和微秒字段
+    static const size_t s_max_fields = 4;
+    // 每个线程缓存的格式项数量
+    static const size_t s_cache_count = 4;
+
+    // 某个格式项在某一秒的输出，毫秒和微秒字段先填0占位
+    struct Cache {
+        uint64_t id;
+        uint64_t second;
+        uint32_t len;
+        uint32_t fields;
+        uint16_t pos[s_max_fields];
+        uint8_t digits[s_max_fields];
+        char text[128];
+    };
+
+    // 返回当前线程中本格式项在second这一秒的缓存，没有或者过期时重新格式化
+    Cache* getCache(uint64_t second) {
+        static thread_local Cache s_caches[s_cache_count];
+        static thread_local uint32_t s_next = 0;
+        Cache* cache = nullptr;
+        for(auto& i : s_caches) {
+            if(i.id == m_id) {
+                cache = &i;
+                break;
+            }
+        }
+        if(!cache) {
+            cache = &s_caches[s_next++ % s_cache_count];
+            cache->id = m_id;
+        } else if(cache->second == second) {
+            return cache;
+        }
+
         struct tm tm;
-        time_t time = event->getTime();
+        time_t time = second;
         localtime_r(&time, &tm);
-        char buf[64];
-        strftime(buf, sizeof(buf), m_format.c_str(), &tm);
-        os << buf;
+        cache->second = second;
+        cache->len = 0;
+        cache->fields = 0;
+        for(auto& i : m_parts) {
+            if(!i.first.empty()) {
+                cache->len += strftime(cache->text + cache->len, sizeof(cache->text) - cache->len, i.first.c_str(), &tm);
+            }
+            if(i.second && cache->len + i.second <= sizeof(cache->text)) {
+                cache->pos[cache->fields] = cache->len;
+                cache->digits[cache->fields++] = i.second;
+                cache->len += i.second;
+            }
+        }
+        return cache;
     }
 private:
     // 时间格式
     std::string m_format;
+    // 格式项的唯一编号，线程本地缓存用它区分不同的格式项
+    uint64_t m_id = 0;
+    // strftime的格式和紧跟其后的亚秒字段位数(3或者6，0表示没有)
+    std::vector<std::pair<std::string, uint32_t> > m_parts;
 };
 
 // 文件名item
@@ -227,7 +405,7 @@ public:
     }
 
     void format(std::ostream& os, Logger::ptr logger, LogLevel::Level level, LogEvent::ptr event) override {
-        os << std::endl;
+        os << '\n';
     }
 };
 
@@ -246,6 +424,80 @@ LogEvent::LogEvent(std::shared_ptr<Logger> logger, LogLevel::Level level,
 
 }
 
+// 每个线程最多缓存的空闲日志事件数量，日志内容里再打日志或者协程切换时才会同时用到多个
+static const size_t s_event_cache_count = 16;
+
+class LogEvent::Cache {
+public:
+    Cache() {
+        m_free.reserve(s_event_cache_count);
+    }
+
+    ~Cache() {
+        t_destroyed = true;
+    }
+
+    // 取出一个空闲事件，没有返回nullptr
+    static LogEvent::ptr Get() {
+        if(t_destroyed || t_cache.m_free.empty()) {
+            return nullptr;
+        }
+        LogEvent::ptr event = std::move(t_cache.m_free.back());
+        t_cache.m_free.pop_back();
+        return event;
+    }
+
+    // 放回空闲事件，超过缓存上限或缓存已析构时不放回
+    static void Put(LogEvent::ptr& event) {
+        if(t_destroyed || t_cache.m_free.size() >= s_event_cache_count) {
+            return;
+        }
+        t_cache.m_free.push_back(std::move(event));
+    }
+private:
+    // 空闲事件
+    std::vector<LogEvent::ptr> m_free;
+    // 当前线程的缓存
+    static thread_local Cache t_cache;
+    // 线程退出时缓存已经析构，此后的事件不再缓存
+    static thread_local bool t_destroyed;
+};
+
+thread_local LogEvent::Cache LogEvent::Cache::t_cache;
+thread_local bool LogEvent::Cache::t_destroyed = false;
+
+LogEvent::ptr LogEvent::AllocEvent(std::shared_ptr<Logger> logger, LogLevel::Level level,
+    const char* file, int32_t line, uint32_t elapse, uint32_t threadId,
+    uint32_t fiberId, uint64_t time, const std::string& thread_name) {
+    LogEvent::ptr event = Cache::Get();
+    if(!event) {
+        return LogEvent::ptr(new LogEvent(std::move(logger), level, file, line, elapse
+                    , threadId, fiberId, time, thread_name));
+    }
+    event->m_file = file;
+    event->m_line = line;
+    event->m_elapse = elapse;
+    event->m_threadId = threadId;
+    event->m_fiberId = fiberId;
+    event->m_time = time;
+    // 线程名称的空间在复用时保留，赋值不再分配内存
+    event->m_threadName = thread_name;
+    event->m_logger = std::move(logger);
+    event->m_level = level;
+    return event;
+}
+
+void LogEvent::FreeEvent(LogEvent::ptr& event) {
+    // 还被其他地方持有的事件不能复用
+    if(event.use_count() == 1) {
+        event->m_logger.reset();
+        event->m_ss.reset();
+        event->m_output.reset();
+        Cache::Put(event);
+    }
+    event.reset();
+}
+
 void LogEvent::format(const char* fmt, ...) {
     va_list al;
     va_start(al, fmt);
@@ -254,16 +506,17 @@ void LogEvent::format(const char* fmt, ...) {
 }
 
 void LogEvent::format(const char* fmt, va_list al) {
-    char* buf = nullptr;
-    int len = vasprintf(&buf, fmt, al);
-    if(len != -1) {
-        m_ss << std::string(buf, len);
-        free(buf);
-    }
+    m_ss.format(fmt, al);
 }
 
 std::string Logger::toYamlString() {
-    MutexType::Lock lock(m_mutex);
+    LogFormatter::ptr formatter;
+    std::shared_ptr<const AppenderList> appenders;
+    {
+        MutexType::Lock lock(m_mutex);
+        formatter = m_formatter;
+        appenders = m_appenders;
+    }
     YAML::Node node;
     node["name"] = m_name;
     if(m_level != LogLevel::UNKNOW) {
@@ -271,10 +524,10 @@ std::string Logger::toYamlString() {
     } else {
         node["level"] = "UNKNOW";
     }
-    if(m_formatter) {
-        node["formatter"] = m_formatter->getPattern();
+    if(formatter) {
+        node["formatter"] = formatter->getPattern();
     }
-    for(auto& i : m_appenders) {
+    for(auto& i : *appenders) {
         node["appenders"].push_back(YAML::Load(i->toYamlString()));
     }
     std::stringstream ss;
@@ -289,7 +542,7 @@ LogFormatter::ptr LogAppender::getFormatter() {
 
 void LogAppender::setFormatter(LogFormatter::ptr val) {
     MutexType::Lock lock(m_mutex);
-    m_formatter = val;
+    updateFormatter(val);
     if(m_formatter) {
         m_hasFormatter = true;
     } else {
@@ -297,6 +550,14 @@ void LogAppender::setFormatter(LogFormatter::ptr val) {
     }
 }
 
+void LogAppender::updateFormatter(LogFormatter::ptr val) {
+    m_formatter = val;
+    if(val && std::find(m_formatters.begin(), m_formatters.end(), val) == m_formatters.end()) {
+        m_formatters.push_back(val);
+    }
+    m_current.store(val.get(), std::memory_order_release);
+}
+
 std::string StdoutLogAppender::toYamlString() {
     MutexType::Lock lock(m_mutex);
     YAML::Node node;
@@ -325,6 +586,19 @@ std::string LoggerManager::toYamlString() {
     return ss.str();
 }
 
+void LoggerManager::flush() {
+    std::vector<Logger::ptr> loggers;
+    {
+        MutexType::Lock lock(m_mutex);
+        for(auto& i : m_loggers) {
+            loggers.push_back(i.second);
+        }
+    }
+    for(auto& i : loggers) {
+        i->flush();
+    }
+}
+
 std::string FileLogAppender::toYamlString() {
     MutexType::Lock lock(m_mutex);
     YAML::Node node;
@@ -345,18 +619,25 @@ std::string FileLogAppender::toYamlString() {
 
 Logger::Logger(const std::string& name):
     m_name(name),
+    m_id(BinaryLog::RegisterLogger(name)),
     m_level(LogLevel::DEBUG) {
     m_formatter.reset(new LogFormatter("%d{%Y-%m-%d %H:%M:%S}%T%t%T%N%T%F%T[%p]%T[%c]%T%f:%l%T%m%n"));
+    m_appenders.reset(new AppenderList);
 }
 
 void Logger::setFormatter(LogFormatter::ptr val) {
-    MutexType::Lock lock(m_mutex);
-    m_formatter = val;
-    for(auto& i : m_appenders) {
-        MutexType::Lock ll(i->m_mutex);
+    std::shared_ptr<const AppenderList> appenders;
+    {
+        MutexType::Lock lock(m_mutex);
+        m_formatter = val;
+        appenders = m_appenders;
+    }
+    // 输出器的锁可能在写文件时被持有，不能在自旋锁内获取
+    for(auto& i : *appenders) {
+        LogAppender::MutexType::Lock ll(i->m_mutex);
         // 输出器没有自己的格式则将logger的格式赋值给输出器
         if(!i->m_hasFormatter) {
-            i->m_formatter = m_formatter;
+            i->updateFormatter(val);
         }
     }
 }
@@ -377,36 +658,55 @@ LogFormatter::ptr Logger::getFormatter() {
 }
 
 void Logger::addAppender(LogAppender::ptr appender) {
-    MutexType::Lock lock(m_mutex);
-    if(!appender->getFormatter()) {
-        MutexType::Lock ll(appender->m_mutex);
-        appender->m_formatter = m_formatter;
+    LogFormatter::ptr formatter = getFormatter();
+    {
+        LogAppender::MutexType::Lock ll(appender->m_mutex);
+        if(!appender->m_formatter) {
+            appender->updateFormatter(formatter);
+        }
     }
-    m_appenders.push_back(appender);
+    std::shared_ptr<const AppenderList> old;
+    MutexType::Lock lock(m_mutex);
+    std::shared_ptr<AppenderList> appenders(new AppenderList(*m_appenders));
+    appenders->push_back(appender);
+    old = m_appenders;
+    m_appenders = appenders;
 }
 
 void Logger::delAppender(LogAppender::ptr appender) {
+    // 旧的列表在锁外释放，输出器可能在释放时析构
+    std::shared_ptr<const AppenderList> old;
     MutexType::Lock lock(m_mutex);
-    for(auto it = m_appenders.begin(); it != m_appenders.end(); ++it) {
+    std::shared_ptr<AppenderList> appenders(new AppenderList(*m_appenders));
+    for(auto it = appenders->begin(); it != appenders->end(); ++it) {
         if(*it == appender) {
-            m_appenders.erase(it);
+            appenders->erase(it);
             break;
         }
     }
+    old = m_appenders;
+    m_appenders = appenders;
 }
 
 void Logger::clearAppenders() {
+    std::shared_ptr<const AppenderList> old(new AppenderList);
     MutexType::Lock lock(m_mutex);
-    m_appenders.clear();
+    m_appenders.swap(old);
+}
+
+std::shared_ptr<const Logger::AppenderList> Logger::getAppenders() {
+    MutexType::Lock lock(m_mutex);
+    return m_appenders;
 }
 
 void Logger::log(LogLevel::Level level, LogEvent::ptr event) {
     // 级别高于日志器本身的日志才会被输出
     if(level >= m_level) {
         auto self = shared_from_this();
-        MutexType::Lock lock(m_mutex);
-        if(!m_appenders.empty()) {
-            for(auto& i : m_appenders) {
+        // 输出器可能阻塞或者等待落盘，不能在自旋锁内调用
+        std::shared_ptr<const AppenderList> appenders = getAppenders();
+        if(!appenders->empty()) {
+            for(auto& i : *appenders) {
                 i->log(self, level, event);
             }
         } else if(m_root) {
@@ -415,6 +715,48 @@ void Logger::log(LogLevel::Level level, LogEvent::ptr event) {
     }
 }
 
+void Logger::flush() {
+    std::shared_ptr<const AppenderList> appenders = getAppenders();
+    for(auto& i : *appenders) {
+        i->flush();
+    }
+    if(appenders->empty() && m_root && m_root.get() != this) {
+        m_root->flush();
+    }
+}
+
+void Logger::logBinary(LogLevel::Level level, const char* data, size_t size) {
+    if(level >= m_level) {
+        std::shared_ptr<const AppenderList> appenders = getAppenders();
+        if(!appenders->empty()) {
+            for(auto& i : *appenders) {
+                i->logBinary(this, level, data, size);
+            }
+        } else if(m_root) {
+            m_root->logBinary(level, data, size);
+        }
+    }
+}
+
+void LogAppender::logBinary(Logger* logger, LogLevel::Level level, const char* data, size_t size) {
+    if(level < m_level) {
+        return;
+    }
+    BinaryLog::RecordHeader header;
+    memcpy(&header, data, sizeof(header));
+    const BinaryLog::Site* site = BinaryLog::GetSite(header.site);
+    if(!site) {
+        return;
+    }
+    Logger::ptr self = logger->shared_from_this();
+    LogEvent::ptr event = LogEvent::AllocEvent(self, level, site->file.c_str(), site->line, 0
+                , header.threadId, header.fiberId, header.time, Thread::GetName());
+    BinaryLog::FormatArgs(event->getSS(), site->fmt, site->types
+                , data + sizeof(header), size - sizeof(header));
+    log(self, level, event);
+    LogEvent::FreeEvent(event);
+}
+
 void Logger::debug(LogEvent::ptr event) {
     log(LogLevel::DEBUG, event);
 }
@@ -448,12 +790,21 @@ void FileLogAppender::log(std::shared_ptr<Logger> logger, LogLevel::Level level,
             m_lastTime = now;
         }
         MutexType::Lock lock(m_mutex);
-        if(!(m_filestream << m_formatter->format(logger, level, event))) {
+        LogStream& out = m_formatter->render(logger, level, event);
+        if(!m_filestream.write(out.data(), out.size())) {
             std::cout << "error" << std::endl;
         }
+        if(level >= LogLevel::FATAL) {
+            m_filestream.flush();
+        }
     }
 }
 
+void FileLogAppender::flush() {
+    MutexType::Lock lock(m_mutex);
+    m_filestream.flush();
+}
+
 bool FileLogAppender::reopen() {
     MutexType::Lock lock(m_mutex);
     if(m_filestream) {
@@ -467,20 +818,681 @@ bool FileLogAppender::reopen() {
 void StdoutLogAppender::log(std::shared_ptr<Logger> logger, LogLevel::Level level, LogEvent::ptr event) {
     if(level >= m_level) {
         MutexType::Lock lock(m_mutex);
-        std::cout << m_formatter->format(logger, level, event);
+        LogStream& out = m_formatter->render(logger, level, event);
+        std::cout.write(out.data(), out.size());
+    }
+}
+
+void StdoutLogAppender::flush() {
+    MutexType::Lock lock(m_mutex);
+    std::cout.flush();
+}
+
+const char* RotatingFileLogAppender::PeriodToString(Period period) {
+    switch(period) {
+        case HOURLY:
+            return "hourly";
+        case DAILY:
+            return "daily";
+        default:
+            return "none";
+    }
+}
+
+RotatingFileLogAppender::Period RotatingFileLogAppender::PeriodFromString(const std::string& str) {
+    if(str == "hourly" || str == "HOURLY") {
+        return HOURLY;
+    }
+    if(str == "daily" || str == "DAILY") {
+        return DAILY;
+    }
+    return NONE;
+}
+
+RotatingFileLogAppender::RotatingFileLogAppender(const std::string& filename, uint64_t max_size
+                                                 , Period period, uint32_t max_files, bool compress)
+    :m_filename(filename)
+    ,m_maxSize(max_size)
+    ,m_period(period)
+    ,m_maxFiles(max_files)
+    ,m_compress(compress) {
+    m_fd = open(m_filename.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if(m_fd < 0) {
+        std::cout << "RotatingFileLogAppender open " << m_filename << " failed errno=" << errno
+            << " errstr=" << strerror(errno) << std::endl;
+    } else {
+        struct stat st;
+        if(fstat(m_fd, &st) == 0) {
+            m_written = st.st_size;
+        }
+    }
+    m_nextRoll = getNextRollTime(time(0));
+    m_buffer.reserve(BUFFER_SIZE);
+    // 没有大小和时间限制时永远不会滚动，不需要后台线程
+    if(m_maxSize || m_period != NONE) {
+        m_thread.reset(new Thread(std::bind(&RotatingFileLogAppender::run, this), "log_roll"));
+    }
+}
+
+RotatingFileLogAppender::~RotatingFileLogAppender() {
+    {
+        std::lock_guard<std::mutex> lock(m_waitMutex);
+        m_stopping = true;
+        m_cond.notify_one();
+    }
+    if(m_thread) {
+        m_thread->join();
+    }
+    writeBuffer();
+    if(m_fd >= 0) {
+        close(m_fd);
     }
 }
 
+void RotatingFileLogAppender::log(Logger::ptr logger, LogLevel::Level level, LogEvent::ptr event) {
+    if(level < m_level) {
+        return;
+    }
+    MutexType::Lock lock(m_mutex);
+    LogStream& out = m_formatter->render(logger, level, event);
+    // 和文件流一样先写到缓冲区，满了才写文件，避免持有锁时频繁进入系统调用
+    if(m_buffer.size() + out.size() > BUFFER_SIZE) {
+        writeBuffer();
+    }
+    m_buffer.insert(m_buffer.end(), out.data(), out.data() + out.size());
+    m_written += out.size();
+    if(level >= LogLevel::FATAL) {
+        writeBuffer();
+    }
+    if(!m_rolling && ((m_maxSize && m_written >= m_maxSize)
+                || (m_nextRoll && (uint64_t)event->getTime() >= m_nextRoll))) {
+        m_rolling = true;
+        std::lock_guard<std::mutex> wait_lock(m_waitMutex);
+        ++m_rollRequest;
+        m_cond.notify_one();
+    }
+}
+
+void RotatingFileLogAppender::writeBuffer() {
+    const char* data = m_buffer.data();
+    size_t left = m_buffer.size();
+    while(left > 0 && m_fd >= 0) {
+        ssize_t n = write(m_fd, data, left);
+        if(n <= 0) {
+            if(n < 0 && errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        data += n;
+        left -= n;
+    }
+    m_buffer.clear();
+}
+
+void RotatingFileLogAppender::flush() {
+    {
+        MutexType::Lock lock(m_mutex);
+        writeBuffer();
+    }
+    std::unique_lock<std::mutex> lock(m_waitMutex);
+    uint64_t request = m_rollRequest;
+    m_doneCond.wait(lock, [this, request](){
+        return m_rollDone >= request;
+    });
+}
+
+void RotatingFileLogAppender::run() {
+    while(true) {
+        uint64_t request = 0;
+        {
+            std::unique_lock<std::mutex> lock(m_waitMutex);
+            m_cond.wait(lock, [this](){
+                return m_stopping || m_rollRequest != m_rollDone;
+            });
+            if(m_rollRequest == m_rollDone) {
+                break;
+            }
+            request = m_rollRequest;
+        }
+        roll();
+        std::lock_guard<std::mutex> lock(m_waitMutex);
+        m_rollDone = request;
+        m_doneCond.notify_all();
+    }
+}
+
+// 把文件压缩成"文件名.gz"，成功后删除原文件
+static bool CompressFile(const std::string& filename) {
+    int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+    if(fd < 0) {
+        return false;
+    }
+    std::string gzname = filename + ".gz";
+    gzFile gz = gzopen(gzname.c_str(), "wb");
+    if(!gz) {
+        close(fd);
+        return false;
+    }
+    bool ok = true;
+    std::vector<char> buf(64 * 1024);
+    while(true) {
+        ssize_t n = read(fd, &buf[0], buf.size());
+        if(n < 0 && errno == EINTR) {
+            continue;
+        }
+        if(n <= 0) {
+            ok = n == 0;
+            break;
+        }
+        if(gzwrite(gz, &buf[0], n) != n) {
+            ok = false;
+            break;
+        }
+    }
+    close(fd);
+    if(gzclose(gz) != Z_OK) {
+        ok = false;
+    }
+    if(ok) {
+        unlink(filename.c_str());
+    } else {
+        unlink(gzname.c_str());
+    }
+    return ok;
+}
+
+void RotatingFileLogAppender::roll() {
+    time_t now = time(0);
+    struct tm tm;
+    localtime_r(&now, &tm);
+    char buf[64];
+    strftime(buf, sizeof(buf), ".%Y%m%d-%H%M%S", &tm);
+    std::string base = m_filename + buf;
+    std::string rolled = base;
+    // 同一秒内多次滚动时加上序号
+    for(int i = 1; access(rolled.c_str(), F_OK) == 0 || access((rolled + ".gz").c_str(), F_OK) == 0; ++i) {
+        snprintf(buf, sizeof(buf), ".%03d", i);
+        rolled = base + buf;
+    }
+    bool renamed = rename(m_filename.c_str(), rolled.c_str()) == 0;
+    // 文件被外部删除时直接创建新文件
+    bool missing = !renamed && errno == ENOENT;
+    if(!renamed && !missing) {
+        std::cout << "RotatingFileLogAppender rename " << m_filename << " failed errno=" << errno
+            << " errstr=" << strerror(errno) << std::endl;
+    }
+    // 改名失败时继续写原来的文件，下次达到条件再重试
+    int fd = -1;
+    if(renamed || missing) {
+        fd = open(m_filename.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    }
+    int old = -1;
+    {
+        MutexType::Lock lock(m_mutex);
+        if(fd >= 0) {
+            // 缓冲区中是滚动之前的日志，写到旧文件
+            writeBuffer();
+            old = m_fd;
+            m_fd = fd;
+        }
+        m_written = 0;
+        m_nextRoll = getNextRollTime(now);
+        m_rolling = false;
+    }
+    if(old >= 0) {
+        close(old);
+    }
+    if(renamed) {
+        if(m_compress && !CompressFile(rolled)) {
+            std::cout << "RotatingFileLogAppender compress " << rolled << " failed" << std::endl;
+        }
+        ++m_rollCount;
+    }
+    removeOldFiles();
+}
+
+void RotatingFileLogAppender::removeOldFiles() {
+    if(!m_maxFiles) {
+        return;
+    }
+    size_t pos = m_filename.rfind('/');
+    std::string dir = pos == std::string::npos ? "." : m_filename.substr(0, pos + 1);
+    std::string prefix = (pos == std::string::npos ? m_filename : m_filename.substr(pos + 1)) + ".";
+    DIR* d = opendir(dir.c_str());
+    if(!d) {
+        return;
+    }
+    // 旧文件名中的时间可以按字典序排序，比较时去掉压缩后缀
+    std::vector<std::pair<std::string, std::string> > files;
+    struct dirent* dp = nullptr;
+    while((dp = readdir(d)) != nullptr) {
+        std::string name = dp->d_name;
+        if(name.size() <= prefix.size() || name.compare(0, prefix.size(), prefix) != 0
+                || !isdigit(name[prefix.size()])) {
+            continue;
+        }
+        std::string key = name;
+        if(key.size() > 3 && key.compare(key.size() - 3, 3, ".gz") == 0) {
+            key.resize(key.size() - 3);
+        }
+        files.emplace_back(key, name);
+    }
+    closedir(d);
+    if(files.size() <= m_maxFiles) {
+        return;
+    }
+    std::sort(files.begin(), files.end());
+    for(size_t i = 0; i < files.size() - m_maxFiles; ++i) {
+        std::string path = pos == std::string::npos ? files[i].second : dir + files[i].second;
+        unlink(path.c_str());
+    }
+}
+
+uint64_t RotatingFileLogAppender::getNextRollTime(time_t now) const {
+    if(m_period == NONE) {
+        return 0;
+    }
+    struct tm tm;
+    localtime_r(&now, &tm);
+    tm.tm_min = 0;
+    tm.tm_sec = 0;
+    if(m_period == HOURLY) {
+        tm.tm_hour += 1;
+    } else {
+        tm.tm_hour = 0;
+        tm.tm_mday += 1;
+    }
+    tm.tm_isdst = -1;
+    return mktime(&tm);
+}
+
+std::string RotatingFileLogAppender::toYamlString() {
+    MutexType::Lock lock(m_mutex);
+    YAML::Node node;
+    node["type"] = "RotatingFileLogAppender";
+    node["file"] = m_filename;
+    if(m_maxSize) {
+        node["max_size"] = m_maxSize;
+    }
+    if(m_period != NONE) {
+        node["roll"] = PeriodToString(m_period);
+    }
+    if(m_maxFiles) {
+        node["max_files"] = m_maxFiles;
+    }
+    node["compress"] = m_compress;
+    if(m_level != LogLevel::UNKNOW) {
+        node["level"] = LogLevel::ToString(m_level);
+    } else {
+        node["level"] = "UNKNOW";
+    }
+    if(m_hasFormatter && m_formatter) {
+        node["formatter"] = m_formatter->getPattern();
+    }
+    std::stringstream ss;
+    ss << node;
+    return ss.str();
+}
+
+static ConfigVar<uint32_t>::ptr g_async_buffer_size =
+    Config::Lookup<uint32_t>("log.async.buffer_size", 1024 * 1024, "async log appender buffer size per thread");
+
+static ConfigVar<uint32_t>::ptr g_async_flush_interval =
+    Config::Lookup<uint32_t>("log.async.flush_interval", 100, "async log appender flush interval ms");
+
+struct AsyncLogAppender::Buffer {
+    // 容量向上取整到2的幂，下标用掩码计算
+    Buffer(size_t size) {
+        capacity = 4096;
+        while(capacity < size) {
+            capacity <<= 1;
+        }
+        data = new char[capacity];
+    }
+
+    ~Buffer() {
+        delete[] data;
+    }
+
+    // 追加一条日志，剩余空间不够时返回false，只由所属线程调用
+    bool push(const char* p, size_t n) {
+        size_t t = tail.load(std::memory_order_relaxed);
+        size_t h = head.load(std::memory_order_acquire);
+        if(capacity - (t - h) < n) {
+            return false;
+        }
+        size_t pos = t & (capacity - 1);
+        size_t first = std::min(n, capacity - pos);
+        memcpy(data + pos, p, first);
+        memcpy(data, p + first, n - first);
+        tail.store(t + n, std::memory_order_release);
+        return true;
+    }
+
+    // 还没有写出的字节数
+    size_t size() const {
+        return tail.load(std::memory_order_acquire) - head.load(std::memory_order_acquire);
+    }
+
+    char* data = nullptr;
+    size_t capacity = 0;
+    // 后台线程推进，生产者和消费者的位置放在不同的缓存行
+    std::atomic<size_t> head = {0};
+    char pad1[64];
+    // 所属线程推进
+    std::atomic<size_t> tail = {0};
+    char pad2[64];
+    // 所属线程已经退出，写空后可以回收
+    std::atomic<bool> closed = {false};
+    // 输出器已经析构，线程本地缓存可以丢弃
+    std::atomic<bool> detached = {false};
+};
+
+struct AsyncLogAppender::LocalBuffers {
+    ~LocalBuffers() {
+        for(auto& i : buffers) {
+            i.second->closed = true;
+        }
+    }
+
+    // 输出器编号和对应的缓冲区，一个线程通常只有一两个异步输出器
+    std::vector<std::pair<uint64_t, std::shared_ptr<Buffer> > > buffers;
+};
+
+AsyncLogAppender::AsyncLogAppender(const std::string& filename, size_t buffer_size, bool block)
+    :m_filename(filename)
+    ,m_bufferSize(buffer_size ? buffer_size : g_async_buffer_size->getValue())
+    ,m_block(block) {
+    static std::atomic<uint64_t> s_id = {0};
+    m_id = ++s_id;
+    m_fd = open(m_filename.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if(m_fd < 0) {
+        std::cout << "AsyncLogAppender open " << m_filename << " failed errno=" << errno
+            << " errstr=" << strerror(errno) << std::endl;
+    }
+}
+
+AsyncLogAppender::~AsyncLogAppender() {
+    stop();
+    std::lock_guard<std::mutex> lock(m_buffersMutex);
+    for(auto& i : m_buffers) {
+        i->detached = true;
+    }
+    if(m_fd >= 0) {
+        close(m_fd);
+    }
+}
+
+AsyncLogAppender::Buffer* AsyncLogAppender::getBuffer() {
+    static thread_local LocalBuffers s_local;
+    for(auto& i : s_local.buffers) {
+        if(i.first == m_id) {
+            return i.second.get();
+        }
+    }
+    // 顺便丢弃已经析构的输出器的缓冲区
+    for(auto it = s_local.buffers.begin(); it != s_local.buffers.end();) {
+        if(it->second->detached) {
+            it = s_local.buffers.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    std::shared_ptr<Buffer> buf(new Buffer(m_bufferSize));
+    {
+        std::lock_guard<std::mutex> lock(m_buffersMutex);
+        m_buffers.push_back(buf);
+    }
+    s_local.buffers.emplace_back(m_id, buf);
+    start();
+    onThreadAttached();
+    return buf.get();
+}
+
+void AsyncLogAppender::start() {
+    std::lock_guard<std::mutex> lock(m_waitMutex);
+    if(m_thread || m_stopping) {
+        return;
+    }
+    m_thread.reset(new Thread(std::bind(&AsyncLogAppender::run, this), "log_async"));
+}
+
+void AsyncLogAppender::stop() {
+    {
+        std::lock_guard<std::mutex> lock(m_waitMutex);
+        if(m_stopping) {
+            return;
+        }
+        m_stopping = true;
+        m_cond.notify_one();
+        m_flushCond.notify_all();
+    }
+    // m_stopping之后不会再启动后台线程
+    if(m_thread) {
+        m_thread->join();
+    }
+    // 后台线程退出前已经写出，这里处理退出之后才写入的日志
+    writeAll();
+}
+
+void AsyncLogAppender::log(Logger::ptr logger, LogLevel::Level level, LogEvent::ptr event) {
+    if(level < m_level) {
+        return;
+    }
+    LogStream& out = currentFormatter()->render(logger, level, event);
+    if(push(out.data(), out.size()) && level >= LogLevel::FATAL) {
+        flush();
+    }
+}
+
+bool AsyncLogAppender::push(const char* data, size_t size) {
+    Buffer* buf = getBuffer();
+    while(!buf->push(data, size)) {
+        if(!m_block || size > buf->capacity) {
+            ++m_dropped;
+            return false;
+        }
+        // 阻塞模式下唤醒后台线程，等它腾出空间
+        if(!m_notified.exchange(true)) {
+            std::lock_guard<std::mutex> lock(m_waitMutex);
+            m_cond.notify_one();
+        }
+        std::this_thread::yield();
+    }
+    if(buf->size() >= buf->capacity / 2 && !m_notified.exchange(true)) {
+        // 缓冲区过半时提前唤醒后台线程，避免写满
+        std::lock_guard<std::mutex> lock(m_waitMutex);
+        m_cond.notify_one();
+    }
+    return true;
+}
+
+void AsyncLogAppender::formatNotice(const std::string& msg, std::string& out) {
+    out = msg + "\n";
+}
+
+void AsyncLogAppender::flush() {
+    std::unique_lock<std::mutex> lock(m_waitMutex);
+    if(m_stopping || !m_thread) {
+        return;
+    }
+    uint64_t request = ++m_flushRequest;
+    m_cond.notify_one();
+    m_flushCond.wait(lock, [this, request](){
+        return m_flushDone >= request || m_stopping;
+    });
+}
+
+void AsyncLogAppender::run() {
+    uint64_t last_dropped = 0;
+    while(true) {
+        bool stopping = false;
+        uint64_t request = 0;
+        {
+            std::unique_lock<std::mutex> lock(m_waitMutex);
+            if(!m_stopping && !m_notified && m_flushRequest == m_flushDone) {
+                m_cond.wait_for(lock, std::chrono::milliseconds(g_async_flush_interval->getValue()));
+            }
+            stopping = m_stopping;
+            request = m_flushRequest;
+        }
+        m_notified = false;
+        writeAll();
+
+        // 不能在后台线程打日志，丢弃的条数直接写到文件里
+        uint64_t dropped = m_dropped;
+        if(dropped != last_dropped && m_fd >= 0) {
+            std::string str;
+            formatNotice("AsyncLogAppender dropped " + std::to_string(dropped - last_dropped) + " logs", str);
+            if(write(m_fd, str.c_str(), str.size()) < 0) {
+                std::cout << "AsyncLogAppender write " << m_filename << " failed errno=" << errno << std::endl;
+            }
+            last_dropped = dropped;
+        }
+
+        if(request != m_flushDone) {
+            std::lock_guard<std::mutex> lock(m_waitMutex);
+            m_flushDone = request;
+            m_flushCond.notify_all();
+        }
+        if(stopping) {
+            break;
+        }
+    }
+}
+
+size_t AsyncLogAppender::writeAll() {
+    std::vector<std::shared_ptr<Buffer> > buffers;
+    {
+        std::lock_guard<std::mutex> lock(m_buffersMutex);
+        // 线程已经退出并且写空的缓冲区不再需要
+        for(auto it = m_buffers.begin(); it != m_buffers.end();) {
+            if((*it)->closed && (*it)->size() == 0) {
+                it = m_buffers.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        buffers = m_buffers;
+    }
+    // 只写出调用时已有的日志，生产者一直在写时也能返回
+    std::vector<size_t> ends(buffers.size());
+    for(size_t i = 0; i < buffers.size(); ++i) {
+        ends[i] = buffers[i]->tail.load(std::memory_order_acquire);
+    }
+    // 子类需要先于这批日志写出的内容，比如二进制日志引用的调用处定义
+    std::string head;
+    prologue(head);
+    if(!head.empty()) {
+        size_t pos = 0;
+        while(pos < head.size() && m_fd >= 0) {
+            ssize_t rt = write(m_fd, head.c_str() + pos, head.size() - pos);
+            if(rt < 0 && errno == EINTR) {
+                continue;
+            } else if(rt <= 0) {
+                break;
+            }
+            pos += rt;
+        }
+        prologueWritten(pos, head.size());
+    }
+
+    static const int s_max_iov = 64;
+    iovec iov[s_max_iov];
+    Buffer* owners[s_max_iov];
+    size_t total = 0;
+    while(true) {
+        int count = 0;
+        for(size_t i = 0; i < buffers.size() && count + 2 <= s_max_iov; ++i) {
+            Buffer* b = buffers[i].get();
+            size_t h = b->head.load(std::memory_order_relaxed);
+            if(h == ends[i]) {
+                continue;
+            }
+            // 环形缓冲区绕回时拆成两段
+            size_t pos = h & (b->capacity - 1);
+            size_t n = ends[i] - h;
+            size_t first = std::min(n, b->capacity - pos);
+            iov[count].iov_base = b->data + pos;
+            iov[count].iov_len = first;
+            owners[count++] = b;
+            if(n > first) {
+                iov[count].iov_base = b->data;
+                iov[count].iov_len = n - first;
+                owners[count++] = b;
+            }
+        }
+        if(count == 0) {
+            break;
+        }
+        ssize_t rt = m_fd >= 0 ? writev(m_fd, iov, count) : -1;
+        size_t left = 0;
+        if(rt < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            // 写入失败时丢弃这一批，不能让缓冲区一直满着
+            for(int i = 0; i < count; ++i) {
+                left += iov[i].iov_len;
+            }
+        } else {
+            left = rt;
+        }
+        total += left;
+        // 部分写入时按顺序推进各个缓冲区
+        for(int i = 0; i < count && left; ++i) {
+            size_t n = std::min(left, iov[i].iov_len);
+            owners[i]->head.store(owners[i]->head.load(std::memory_order_relaxed) + n, std::memory_order_release);
+            left -= n;
+        }
+    }
+    return total;
+}
+
+std::string AsyncLogAppender::toYamlString() {
+    MutexType::Lock lock(m_mutex);
+    YAML::Node node;
+    node["type"] = "FileLogAppender";
+    node["file"] = m_filename;
+    node["async"] = true;
+    node["block"] = m_block;
+    node["buffer_size"] = m_bufferSize;
+    if(m_level != LogLevel::UNKNOW) {
+        node["level"] = LogLevel::ToString(m_level);
+    } else {
+        node["level"] = "UNKNOW";
+    }
+    if(m_hasFormatter && m_formatter) {
+        node["formatter"] = m_formatter->getPattern();
+    }
+    std::stringstream ss;
+    ss << node;
+    return ss.str();
+}
+
 LogFormatter::LogFormatter(const std::string& pattern):
     m_pattern(pattern) {
     init();
 }
 std::string LogFormatter::format(std::shared_ptr<Logger> logger, LogLevel::Level level, LogEvent::ptr event) {
-    std::stringstream ss;
+    return render(logger, level, event).str();
+}
+
+std::ostream& LogFormatter::format(std::ostream& ofs, std::shared_ptr<Logger> logger, LogLevel::Level level, LogEvent::ptr event) {
     for(auto& i : m_items) {
-        i->format(ss, logger, level, event);
+        i->format(ofs, logger, level, event);
     }
-    return ss.str();
+    return ofs;
+}
+
+LogStream& LogFormatter::render(std::shared_ptr<Logger> logger, LogLevel::Level level, LogEvent::ptr event) {
+    LogStream& os = event->getOutput();
+    os.reset();
+    for(auto& i : m_items) {
+        i->format(os, logger, level, event);
+    }
+    return os;
 }
 
 void LogFormatter::init() {
@@ -616,12 +1628,28 @@ struct LogAppenderDefine {
     LogLevel::Level level = LogLevel::UNKNOW;
     std::string formatter;
     std::string file;
+    // 文件输出器是否异步写入，以及异步时缓冲区满是否阻塞和每个线程缓冲区的大小
+    bool async = false;
+    bool block = false;
+    uint32_t bufferSize = 0;
+    // 滚动文件输出器单个文件的最大字节数、按时间滚动的周期、保留的旧文件个数以及是否压缩
+    uint64_t maxSize = 0;
+    std::string roll;
+    uint32_t maxFiles = 0;
+    bool compress = false;
 
     bool operator==(const LogAppenderDefine& oth) const {
         return type == oth.type
             && level == oth.level
             && formatter == oth.formatter
-            && file == oth.file;
+            && file == oth.file
+            && async == oth.async
+            && block == oth.block
+            && bufferSize == oth.bufferSize
+            && maxSize == oth.maxSize
+            && roll == oth.roll
+            && maxFiles == oth.maxFiles
+            && compress == oth.compress;
     }
 };
 
@@ -675,6 +1703,50 @@ public:
                         continue;
                     }
                     lad.file = a["file"].as<std::string>();
+                    if(a["async"].IsDefined()) {
+                        lad.async = a["async"].as<bool>();
+                    }
+                    if(a["block"].IsDefined()) {
+                        lad.block = a["block"].as<bool>();
+                    }
+                    if(a["buffer_size"].IsDefined()) {
+                        lad.bufferSize = a["buffer_size"].as<uint32_t>();
+                    }
+                    if(a["formatter"].IsDefined()) {
+                        lad.formatter = a["formatter"].as<std::string>();
+                    }
+                } else if(type == "BinaryLogAppender") {
+                    lad.type = 3;
+                    if(!a["file"].IsDefined()) {
+                        std::cout << "log config error: binaryappender file is null, " << a << std::endl;
+                        continue;
+                    }
+                    lad.file = a["file"].as<std::string>();
+                    if(a["block"].IsDefined()) {
+                        lad.block = a["block"].as<bool>();
+                    }
+                    if(a["buffer_size"].IsDefined()) {
+                        lad.bufferSize = a["buffer_size"].as<uint32_t>();
+                    }
+                } else if(type == "RotatingFileLogAppender") {
+                    lad.type = 4;
+                    if(!a["file"].IsDefined()) {
+                        std::cout << "log config error: rotatingappender file is null, " << a << std::endl;
+                        continue;
+                    }
+                    lad.file = a["file"].as<std::string>();
+                    if(a["max_size"].IsDefined()) {
+                        lad.maxSize = a["max_size"].as<uint64_t>();
+                    }
+                    if(a["roll"].IsDefined()) {
+                        lad.roll = a["roll"].as<std::string>();
+                    }
+                    if(a["max_files"].IsDefined()) {
+                        lad.maxFiles = a["max_files"].as<uint32_t>();
+                    }
+                    if(a["compress"].IsDefined()) {
+                        lad.compress = a["compress"].as<bool>();
+                    }
                     if(a["formatter"].IsDefined()) {
                         lad.formatter = a["formatter"].as<std::string>();
                     }
@@ -713,8 +1785,35 @@ public:
             if(a.type == 1) {
                 na["type"] = "FileLogAppender";
                 na["file"] = a.file;
+                if(a.async) {
+                    na["async"] = true;
+                    na["block"] = a.block;
+                    if(a.bufferSize) {
+                        na["buffer_size"] = a.bufferSize;
+                    }
+                }
             } else if(a.type == 2) {
                 na["type"] = "StdoutLogAppender";
+            } else if(a.type == 4) {
+                na["type"] = "RotatingFileLogAppender";
+                na["file"] = a.file;
+                if(a.maxSize) {
+                    na["max_size"] = a.maxSize;
+                }
+                if(!a.roll.empty()) {
+                    na["roll"] = a.roll;
+                }
+                if(a.maxFiles) {
+                    na["max_files"] = a.maxFiles;
+                }
+                na["compress"] = a.compress;
+            } else if(a.type == 3) {
+                na["type"] = "BinaryLogAppender";
+                na["file"] = a.file;
+                na["block"] = a.block;
+                if(a.bufferSize) {
+                    na["buffer_size"] = a.bufferSize;
+                }
             }
             if(a.level != LogLevel::UNKNOW) {
                 na["level"] = LogLevel::ToString(a.level);
@@ -762,9 +1861,18 @@ struct LogIniter {
                 for(auto& a : i.appenders) {
                     atpdxy::LogAppender::ptr ap;
                     if(a.type == 1) {
-                        ap.reset(new FileLogAppender(a.file));
+                        if(a.async) {
+                            ap.reset(new AsyncLogAppender(a.file, a.bufferSize, a.block));
+                        } else {
+                            ap.reset(new FileLogAppender(a.file));
+                        }
                     } else if(a.type == 2) {
                         ap.reset(new StdoutLogAppender);
+                    } else if(a.type == 3) {
+                        ap.reset(new BinaryLogAppender(a.file, a.bufferSize, a.block));
+                    } else if(a.type == 4) {
+                        ap.reset(new RotatingFileLogAppender(a.file, a.maxSize
+                                    , RotatingFileLogAppender::PeriodFromString(a.roll), a.maxFiles, a.compress));
                     }
                     ap->setLevel(a.level);
                     if(!a.formatter.empty()) {
@@ -10,6 +10,9 @@
 #include <vector>
 #include <stdarg.h>
 #include <map>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
 #include "util.h"
 #include "singleton.h"
 #include "thread.h"
@@ -17,9 +20,9 @@
 // 使用流式方式将日志级别level的日志写入到logger
 #define LOG_LEVEL(logger, level) \
     if(logger->getLevel() <= level) \
-        atpdxy::LogEventWrap(atpdxy::LogEvent::ptr(new atpdxy::LogEvent( \
+        atpdxy::LogEventWrap(atpdxy::LogEvent::AllocEvent( \
         logger, level, __FILE__, __LINE__, 0, atpdxy::GetThreadId(),\
-        atpdxy::GetFiberId(), time(0), atpdxy::Thread::GetName()))).getSS()
+        atpdxy::GetFiberId(), atpdxy::GetCurrentUS(), atpdxy::Thread::GetName())).getSS()
 
 // 写debug级别日志
 #define DEBUG(logger) LOG_LEVEL(logger, atpdxy::LogLevel::DEBUG)
@@ -39,9 +42,9 @@
 // 使用格式化方式将日志级别level的日志写入到logger
 #define LOG_FMT_LEVEL(logger, level, fmt, ...) \
     if(logger->getLevel() <= level) \
-        atpdxy::LogEventWrap(atpdxy::LogEvent::ptr(new atpdxy::LogEvent(logger, level, \
+        atpdxy::LogEventWrap(atpdxy::LogEvent::AllocEvent(logger, level, \
         __FILE__, __LINE__, 0, atpdxy::GetThreadId(), atpdxy::GetFiberId(), \
-        time(0), atpdxy::Thread::GetName()))).getEvent()->format(fmt, __VA_ARGS__)
+        atpdxy::GetCurrentUS(), atpdxy::Thread::GetName())).getEvent()->format(fmt, __VA_ARGS__)
 
 // 写debug级别日志
 #define FMT_DEBUG(logger, fmt, ...) LOG_FMT_LEVEL(logger, atpdxy::LogLevel::DEBUG, fmt, __VA_ARGS__)
@@ -94,16 +97,73 @@ public:
     static LogLevel::Level FromString(const std::string& str);
 };
 
+// 写入可复用字符缓冲区的输出流，清空时保留已经分配的空间，稳定状态下写日志不再分配内存
+class LogStream : public std::ostream {
+public:
+    LogStream();
+
+    // 清空内容并恢复默认的格式标志，保留已经分配的空间
+    void reset();
+
+    // 返回内容的起始地址，不以'\0'结尾
+    const char* data() const { return m_buf.data();}
+
+    // 返回内容的长度
+    size_t size() const { return m_buf.size();}
+
+    // 返回内容的字符串
+    std::string str() const { return std::string(data(), size());}
+
+    // 按printf格式追加内容
+    void format(const char* fmt, va_list al);
+private:
+    // 直接写入连续字符数组的流缓冲区，空间不够时成倍扩容
+    class Buffer : public std::streambuf {
+    public:
+        Buffer();
+
+        // 清空内容，超过上限的空间释放掉
+        void reset();
+
+        // 保证至少还有n个字节的空闲空间
+        void reserve(size_t n);
+
+        // 按printf格式追加内容
+        void format(const char* fmt, va_list al);
+
+        const char* data() const { return pbase();}
+
+        size_t size() const { return pptr() - pbase();}
+    protected:
+        int_type overflow(int_type c) override;
+
+        std::streamsize xsputn(const char* s, std::streamsize n) override;
+    private:
+        std::vector<char> m_data;
+    };
+
+    Buffer m_buf;
+};
+
 // 日志事件
 class LogEvent {
 public:
     typedef std::shared_ptr<LogEvent> ptr;
-    // 构造函数
+    // 构造函数，time是微秒时间戳
     LogEvent(std::shared_ptr<Logger> logger, LogLevel::Level level
         ,const char* file, int32_t line, uint32_t elapse
         ,uint32_t thread_id, uint32_t fiber_id, uint64_t time
         ,const std::string& thread_name);
 
+    // 申请一个日志事件，优先复用线程本地缓存的事件，日志宏通过它创建事件
+    static LogEvent::ptr AllocEvent(std::shared_ptr<Logger> logger, LogLevel::Level level
+        ,const char* file, int32_t line, uint32_t elapse
+        ,uint32_t thread_id, uint32_t fiber_id, uint64_t time
+        ,const std::string& thread_name);
+
+    // 释放日志事件，没有其他地方持有时清空后放回线程本地缓存
+    static void FreeEvent(LogEvent::ptr& event);
+
     // 返回文件名
     const char* getFile() const { return m_file;}
 
@@ -119,8 +179,11 @@ public:
     // 返回协程id
     uint32_t getFiberId() const { return m_fiberId;}
 
-    // 返回时间戳
-    uint64_t getTime() const { return m_time;}
+    // 返回时间戳，秒
+    uint64_t getTime() const { return m_time / 1000000;}
+
+    // 返回时间戳，微秒
+    uint64_t getTimeUS() const { return m_time;}
 
     // 返回线程名称
     const std::string& getThreadName() const { return m_threadName;}
@@ -128,14 +191,20 @@ public:
     // 返回日志内容
     std::string getContent() const { return m_ss.str();}
 
+    // 返回日志内容的缓冲区
+    const LogStream& getStream() const { return m_ss;}
+
+    // 返回格式化整条日志用的缓冲区，和事件一起复用
+    LogStream& getOutput() { return m_output;}
+
     // 返回日志所在的日志器
     std::shared_ptr<Logger> getLogger() const { return m_logger;}
 
     // 返回日志级别
     LogLevel::Level getLevel() const { return m_level;}
 
-    // 返回日志内容的字符串流
-    std::stringstream& getSS() { return m_ss;}
+    // 返回日志内容的输出流
+    LogStream& getSS() { return m_ss;}
 
     // 格式化写入日志内容辅助函数
     void format(const char* fmt, ...);
@@ -153,16 +222,21 @@ private:
     uint32_t m_threadId = 0;
     // 协程ID
     uint32_t m_fiberId = 0;
-    // 时间戳
+    // 时间戳，微秒
     uint64_t m_time = 0;
     // 线程名称
     std::string m_threadName;
     // 日志内容流
-    std::stringstream m_ss;
+    LogStream m_ss;
+    // 格式化整条日志的缓冲区
+    LogStream m_output;
     // 日志器
     std::shared_ptr<Logger> m_logger;
     // 日志等级
     LogLevel::Level m_level;
+private:
+    // 线程本地的空闲日志事件缓存
+    class Cache;
 };
 
 // 日志包装器，实现RAII机制
@@ -178,7 +252,7 @@ public:
     LogEvent::ptr getEvent() const { return m_event;}
 
     // 返回日志事件的内容流
-    std::stringstream& getSS();
+    LogStream& getSS();
 private:
     LogEvent::ptr m_event;
 };
@@ -189,6 +263,7 @@ public:
     typedef std::shared_ptr<LogFormatter> ptr;
 
     // 默认格式 "%d{%Y-%m-%d %H:%M:%S}%T%t%T%N%T%F%T[%p]%T[%c]%T%f:%l%T%m%n"
+    // %d{}中除了strftime的格式，还可以用%L输出3位毫秒，%f输出6位微秒，例如%d{%Y-%m-%d %H:%M:%S.%L}
     LogFormatter(const std::string& pattern);
 
     // 返回格式化日志内容的字符串
@@ -196,6 +271,9 @@ public:
     
     // 返回格式化日志内容的输出流
     std::ostream& format(std::ostream& ofs, std::shared_ptr<Logger> logger, LogLevel::Level level, LogEvent::ptr event);
+
+    // 把整条日志格式化到日志事件自带的输出缓冲区并返回，不分配内存，同一个事件再次格式化之前有效
+    LogStream& render(std::shared_ptr<Logger> logger, LogLevel::Level level, LogEvent::ptr event);
 public:
     // 日志内容项基类
     class FormatItem {
@@ -230,7 +308,8 @@ class LogAppender {
 friend class Logger;
 public:
     typedef std::shared_ptr<LogAppender> ptr;
-    typedef Spinlock MutexType;
+    // 输出器持有锁时会写文件，用会让出CPU的互斥锁
+    typedef Mutex MutexType;
 
     // 虚函数，释放资源
     virtual ~LogAppender() {}
@@ -241,6 +320,13 @@ public:
     // 将日志输出目标的信息转换成yaml格式
     virtual std::string toYamlString() = 0;
 
+    // 把已经写入的日志刷到输出目标
+    virtual void flush() {}
+
+    // 向目标写一条二进制日志记录，默认还原成日志事件后按文本输出
+    // 二进制日志的热路径上不增加日志器的引用计数，需要时再取shared_ptr
+    virtual void logBinary(Logger* logger, LogLevel::Level level, const char* data, size_t size);
+
     // 更改输出器的格式器
     void setFormatter(LogFormatter::ptr val);
 
@@ -252,6 +338,12 @@ public:
 
     // 设置输出器的日志级别
     void setLevel(LogLevel::Level val) { m_level = val;}
+protected:
+    // 返回当前的格式器，不加锁，写日志时不持有m_mutex的子类使用
+    LogFormatter* currentFormatter() const { return m_current.load(std::memory_order_acquire);}
+private:
+    // 更换格式器，调用时持有m_mutex
+    void updateFormatter(LogFormatter::ptr val);
 protected:
     // 日志级别
     LogLevel::Level m_level = LogLevel::DEBUG;
@@ -261,14 +353,21 @@ protected:
     MutexType m_mutex;
     // 日志格式器
     LogFormatter::ptr m_formatter;
+private:
+    // m_formatter指向的对象
+    std::atomic<LogFormatter*> m_current = {nullptr};
+    // 用过的格式器，很少更换，保留到输出器析构，保证currentFormatter返回的指针一直有效
+    std::vector<LogFormatter::ptr> m_formatters;
 };
 
 // 日志器
+// 输出器列表修改时整体替换，写日志时在锁内只复制列表的指针，在锁外调用输出器
 class Logger : public std::enable_shared_from_this<Logger> {
 friend class LoggerManager;
 public:
     typedef std::shared_ptr<Logger> ptr;
     typedef Spinlock MutexType;
+    typedef std::vector<LogAppender::ptr> AppenderList;
 
     // 构造函数
     Logger(const std::string& name = "root");
@@ -291,6 +390,9 @@ public:
     // 写fatal级别的日志
     void fatal(LogEvent::ptr event);
 
+    // 写一条编码好的二进制日志记录，见binlog.h
+    void logBinary(LogLevel::Level level, const char* data, size_t size);
+
     // 添加输出器
     void addAppender(LogAppender::ptr appender);
 
@@ -300,6 +402,9 @@ public:
     // 清空输出器
     void clearAppenders();
 
+    // 刷新所有输出器
+    void flush();
+
     // 返回日志器的级别
     LogLevel::Level getLevel() const { return m_level;}
 
@@ -309,6 +414,9 @@ public:
     // 返回日志器的名称
     const std::string& getName() const { return m_name;}
 
+    // 返回日志器的编号，二进制日志用它引用日志器名称
+    uint32_t getId() const { return m_id;}
+
     // 设置日志器的日志格式
     void setFormatter(LogFormatter::ptr val);
 
@@ -320,15 +428,20 @@ public:
 
     // 将日志器的配置转换成yaml格式
     std::string toYamlString();
+private:
+    // 返回输出器列表的快照
+    std::shared_ptr<const AppenderList> getAppenders();
 private:
     // 日志器名称
     std::string m_name;
+    // 日志器编号
+    uint32_t m_id = 0;
     // 日志器级别
     LogLevel::Level m_level;
     // Mutex
     MutexType m_mutex;
-    // 日志输出目标集合
-    std::list<LogAppender::ptr> m_appenders;
+    // 日志输出目标集合，不会为空指针
+    std::shared_ptr<const AppenderList> m_appenders;
     // 日志器的格式
     LogFormatter::ptr m_formatter;
     // 主日志器
@@ -345,6 +458,9 @@ public:
 
     // 将日志输出目标的配置转换成yaml
     std::string toYamlString() override;
+
+    // 刷新标准输出
+    void flush() override;
 };
 
 // 输出到文件的Appender
@@ -361,6 +477,9 @@ public:
     // 将输出器的配置转换成yaml
     std::string toYamlString() override;
 
+    // 刷新文件流
+    void flush() override;
+
     // 重新打开文件
     bool reopen();
 private:
@@ -372,6 +491,200 @@ private:
     uint64_t m_lastTime = 0;
 };
 
+// 按大小和时间滚动的文件输出器
+// 写日志的线程只累加写入的字节数，并和下一次按时间滚动的时间比较，达到条件时唤醒后台线程
+// 日志先写入缓冲区，满了或者flush时写到文件
+// 后台线程把当前文件改名为"文件名.年月日-时分秒"，打开新文件后替换描述符，再按配置压缩旧文件并删除多余的旧文件
+// 改名到替换描述符之间写入的日志仍然进入改名后的文件，不会丢失
+class RotatingFileLogAppender : public LogAppender {
+public:
+    typedef std::shared_ptr<RotatingFileLogAppender> ptr;
+
+    // 按时间滚动的周期
+    enum Period {
+        // 不按时间滚动
+        NONE = 0,
+        // 每小时整点
+        HOURLY = 1,
+        // 每天零点
+        DAILY = 2
+    };
+
+    // 将周期转换成字符串
+    static const char* PeriodToString(Period period);
+
+    // 将字符串转换成周期，无法识别时返回NONE
+    static Period PeriodFromString(const std::string& str);
+
+    // 构造函数，max_size是单个文件的最大字节数(0表示不限制)，period是按时间滚动的周期
+    // max_files是保留的旧文件个数(0表示不删除)，compress表示是否用gzip压缩旧文件
+    RotatingFileLogAppender(const std::string& filename, uint64_t max_size = 0, Period period = NONE
+                            , uint32_t max_files = 0, bool compress = false);
+
+    // 停止后台线程，已经触发的滚动会先完成
+    // 后台线程只在设置了max_size或period时启动
+    ~RotatingFileLogAppender();
+
+    // 输出器打印日志
+    void log(Logger::ptr logger, LogLevel::Level level, LogEvent::ptr event) override;
+
+    // 将输出器的配置转换成yaml
+    std::string toYamlString() override;
+
+    // 写出缓冲区中的日志，并等待已经触发的滚动、压缩和清理完成
+    void flush() override;
+
+    // 返回已经滚动的次数
+    uint64_t getRollCount() const { return m_rollCount;}
+private:
+    // 后台线程执行函数
+    void run();
+
+    // 把缓冲区写到当前文件，需要持有m_mutex
+    void writeBuffer();
+
+    // 滚动一次文件
+    void roll();
+
+    // 删除超出保留个数的旧文件
+    void removeOldFiles();
+
+    // 返回now之后下一次按时间滚动的时间，不按时间滚动返回0
+    uint64_t getNextRollTime(time_t now) const;
+private:
+    // 写缓冲区的大小
+    static const size_t BUFFER_SIZE = 64 * 1024;
+    // 文件路径
+    std::string m_filename;
+    // 单个文件的最大字节数
+    uint64_t m_maxSize = 0;
+    // 按时间滚动的周期
+    Period m_period = NONE;
+    // 保留的旧文件个数
+    uint32_t m_maxFiles = 0;
+    // 是否压缩旧文件
+    bool m_compress = false;
+    // 文件描述符，在m_mutex保护下写入和替换
+    int m_fd = -1;
+    // 还没有写到文件的日志
+    std::vector<char> m_buffer;
+    // 当前文件已经写入的字节数
+    uint64_t m_written = 0;
+    // 下一次按时间滚动的时间，秒
+    uint64_t m_nextRoll = 0;
+    // 是否已经触发滚动，避免滚动完成之前重复触发
+    bool m_rolling = false;
+    // 后台线程等待用的锁和条件变量
+    std::mutex m_waitMutex;
+    std::condition_variable m_cond;
+    // 等待滚动完成的条件变量
+    std::condition_variable m_doneCond;
+    // 是否停止后台线程
+    bool m_stopping = false;
+    // 已经请求和已经完成的滚动序号
+    uint64_t m_rollRequest = 0;
+    uint64_t m_rollDone = 0;
+    // 已经滚动的次数
+    std::atomic<uint64_t> m_rollCount = {0};
+    // 后台线程
+    Thread::ptr m_thread;
+};
+
+// 异步输出到文件的Appender
+// 调用线程只格式化日志并追加到自己的无锁环形缓冲区，后台线程定期把所有线程的缓冲区用writev批量写入文件
+// 每个线程的缓冲区大小固定，写满时按配置丢弃日志或者阻塞等待后台线程写出
+// 析构时写出所有剩余日志，FATAL级别的日志写入后等待落盘
+class AsyncLogAppender : public LogAppender {
+public:
+    typedef std::shared_ptr<AsyncLogAppender> ptr;
+
+    // 构造函数，设置文件名称，每个线程缓冲区的大小(0表示使用配置log.async.buffer_size)，缓冲区满时是否阻塞
+    AsyncLogAppender(const std::string& filename, size_t buffer_size = 0, bool block = false);
+
+    // 停止后台线程并写出剩余的日志
+    ~AsyncLogAppender();
+
+    // 格式化日志并放入当前线程的缓冲区
+    void log(Logger::ptr logger, LogLevel::Level level, LogEvent::ptr event) override;
+
+    // 将输出器的配置转换成yaml
+    std::string toYamlString() override;
+
+    // 等待调用之前写入的日志全部写到文件
+    void flush() override;
+
+    // 返回缓冲区满时丢弃的日志条数
+    uint64_t getDropped() const { return m_dropped;}
+protected:
+    // 把一段数据追加到当前线程的缓冲区，按配置丢弃或者阻塞，丢弃时返回false
+    bool push(const char* data, size_t size);
+
+    // 停止后台线程并写出剩余的日志，可以重复调用
+    // 重写了下面几个虚函数的子类要在自己的析构函数中先调用
+    void stop();
+
+    // 当前线程第一次向本输出器写日志时调用，子类可以先写入线程相关的内容
+    virtual void onThreadAttached() {}
+
+    // 后台线程每批写出之前调用，out中的内容先于这批日志写到文件
+    virtual void prologue(std::string& out) {}
+
+    // prologue的内容写出之后调用，written是实际写出的字节数，小于size表示写入失败或者只写了一部分
+    virtual void prologueWritten(size_t written, size_t size) {}
+
+    // 把后台线程自己产生的提示转换成写到文件中的内容
+    virtual void formatNotice(const std::string& msg, std::string& out);
+private:
+    // 一个线程的单生产者单消费者环形缓冲区
+    struct Buffer;
+
+    // 线程本地的缓冲区列表，线程退出时通知后台线程回收
+    struct LocalBuffers;
+
+    // 返回当前线程在本输出器上的缓冲区，第一次调用时创建
+    Buffer* getBuffer();
+
+    // 第一次写日志时启动后台线程，保证子类已经构造完成
+    void start();
+
+    // 后台线程执行函数
+    void run();
+
+    // 把所有缓冲区中的日志写到文件，返回写出的字节数
+    size_t writeAll();
+private:
+    // 文件路径
+    std::string m_filename;
+    // 文件描述符
+    int m_fd = -1;
+    // 每个线程缓冲区的大小
+    size_t m_bufferSize = 0;
+    // 缓冲区满时是否阻塞
+    bool m_block = false;
+    // 输出器的唯一编号，线程本地缓存用它查找缓冲区
+    uint64_t m_id = 0;
+    // 保护m_buffers
+    std::mutex m_buffersMutex;
+    // 所有线程的缓冲区
+    std::vector<std::shared_ptr<Buffer> > m_buffers;
+    // 后台线程等待用的锁和条件变量
+    std::mutex m_waitMutex;
+    std::condition_variable m_cond;
+    // 等待flush完成的条件变量
+    std::condition_variable m_flushCond;
+    // 是否停止后台线程
+    bool m_stopping = false;
+    // 已经请求和已经完成的flush序号
+    uint64_t m_flushRequest = 0;
+    uint64_t m_flushDone = 0;
+    // 是否已经通知后台线程，合并多次通知
+    std::atomic<bool> m_notified = {false};
+    // 缓冲区满时丢弃的日志条数
+    std::atomic<uint64_t> m_dropped = {0};
+    // 后台线程，第一次写日志时启动
+    Thread::ptr m_thread;
+};
+
 // 日志器管理类
 class LoggerManager {
 public:
@@ -391,6 +704,9 @@ public:
 
     // 将日志管理器中的所有日志器配置转换成yaml
     std::string toYamlString();
+
+    // 刷新所有日志器的输出器，程序异常退出之前调用
+    void flush();
 private:
     // Mutex
     MutexType m_mutex;
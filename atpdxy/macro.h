@@ -23,6 +23,7 @@
         ERROR(GET_ROOT_LOGGER()) << "ASSERTION: " #x \
             << "\nbacktrace:\n" \
             << atpdxy::BacktraceToString(100, 2, "  "); \
+        atpdxy::LoggerMgr::GetInstance()->flush(); \
         assert(x); \
     }
 
@@ -33,5 +34,6 @@
             << "\n" << w \
             << "\nbacktrace:\n" \
             << atpdxy::BacktraceToString(100, 2, "  "); \
+        atpdxy::LoggerMgr::GetInstance()->flush(); \
         assert(x); \
     }
@@ -1,6 +1,8 @@
 #include "mutex.h"
 #include "macro.h"
 #include "scheduler.h"
+#include <vector>
+#include <stdlib.h>
 
 namespace atpdxy {
 
@@ -26,48 +28,375 @@ void Semaphore::notify() {
     }
 }
 
-// FiberSemaphore::FiberSemaphore(size_t initial_concurrency)
-//     :m_concurrency(initial_concurrency) {
-// }
-
-// FiberSemaphore::~FiberSemaphore() {
-//     SYLAR_ASSERT(m_waiters.empty());
-// }
-
-// bool FiberSemaphore::tryWait() {
-//     SYLAR_ASSERT(Scheduler::GetThis());
-//     {
-//         MutexType::Lock lock(m_mutex);
-//         if(m_concurrency > 0u) {
-//             --m_concurrency;
-//             return true;
-//         }
-//         return false;
-//     }
-// }
-
-// void FiberSemaphore::wait() {
-//     SYLAR_ASSERT(Scheduler::GetThis());
-//     {
-//         MutexType::Lock lock(m_mutex);
-//         if(m_concurrency > 0u) {
-//             --m_concurrency;
-//             return;
-//         }
-//         m_waiters.push_back(std::make_pair(Scheduler::GetThis(), Fiber::GetThis()));
-//     }
-//     Fiber::YieldToHold();
-// }
-
-// void FiberSemaphore::notify() {
-//     MutexType::Lock lock(m_mutex);
-//     if(!m_waiters.empty()) {
-//         auto next = m_waiters.front();
-//         m_waiters.pop_front();
-//         next.first->schedule(next.second);
-//     } else {
-//         ++m_concurrency;
-//     }
-// }
+// 挂起之前自旋检查的次数
+static const int s_spin_count = 100;
+
+// 自旋等待时降低功耗，让出流水线给同一核心上的另一个超线程
+static inline void CpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+}
+
+// 线程缓存的等待节点的最大数量
+static const size_t s_wait_node_cache = 64;
+
+// 线程私有的空闲等待节点
+struct WaitNodeCache {
+    ~WaitNodeCache() {
+        for(auto p : nodes) {
+            free(p);
+        }
+    }
+
+    std::vector<void*> nodes;
+};
+
+static thread_local WaitNodeCache t_wait_node_cache;
+
+void* AllocWaitNode() {
+    auto& nodes = t_wait_node_cache.nodes;
+    if(!nodes.empty()) {
+        void* p = nodes.back();
+        nodes.pop_back();
+        return p;
+    }
+    void* p = malloc(WAIT_NODE_SIZE);
+    if(!p) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void FreeWaitNode(void* p) {
+    auto& nodes = t_wait_node_cache.nodes;
+    if(nodes.size() < s_wait_node_cache) {
+        nodes.push_back(p);
+    } else {
+        free(p);
+    }
+}
+
+FiberWaiter::FiberWaiter() {
+    // 调度协程自己不能挂起，和不在调度器中的线程一样阻塞
+    Scheduler* scheduler = Scheduler::GetThis();
+    if(scheduler) {
+        Fiber::ptr cur = Fiber::GetThis();
+        if(cur.get() != Scheduler::GetMainFiber()) {
+            this->scheduler = scheduler;
+            fiber = std::move(cur);
+        }
+    }
+}
+
+void FiberWaiter::park() {
+    for(int i = 0; i < s_spin_count; ++i) {
+        if(state.load(std::memory_order_acquire) == SIGNALED) {
+            return;
+        }
+        CpuRelax();
+    }
+    int expected = WAITING;
+    if(!state.compare_exchange_strong(expected, PARKED, std::memory_order_acq_rel)) {
+        return;
+    }
+    // 唤醒者可能在切出之前就把协程放回调度器，调度器会等协程切出后再执行它
+    if(scheduler) {
+        Fiber::YieldToHold();
+    } else {
+        semaphore.wait();
+    }
+}
+
+void FiberWaiter::wake() {
+    if(scheduler) {
+        Scheduler* s = scheduler;
+        Fiber::ptr f = fiber;
+        if(state.exchange(SIGNALED, std::memory_order_acq_rel) == PARKED) {
+            s->schedule(std::move(f));
+        }
+    } else if(state.exchange(SIGNALED, std::memory_order_acq_rel) == PARKED) {
+        // 线程阻塞在信号量上，在notify返回之前不会离开
+        semaphore.notify();
+    }
+}
+
+void FiberWaitQueue::push(FiberWaiter* waiter) {
+    waiter->next = nullptr;
+    if(m_tail) {
+        m_tail->next = waiter;
+    } else {
+        m_head = waiter;
+    }
+    m_tail = waiter;
+}
+
+FiberWaiter* FiberWaitQueue::pop() {
+    FiberWaiter* waiter = m_head;
+    if(waiter) {
+        m_head = waiter->next;
+        if(!m_head) {
+            m_tail = nullptr;
+        }
+        waiter->next = nullptr;
+    }
+    return waiter;
+}
+
+FiberWaiter* FiberWaitQueue::popAll() {
+    FiberWaiter* head = m_head;
+    m_head = m_tail = nullptr;
+    return head;
+}
+
+void FiberWaitQueue::WakeAll(FiberWaiter* head) {
+    while(head) {
+        // 唤醒之后不能再访问
+        FiberWaiter* next = head->next;
+        head->wake();
+        head = next;
+    }
+}
+
+FiberMutex::~FiberMutex() {
+    ASSERT(m_waiters.empty());
+}
+
+bool FiberMutex::tryLock() {
+    int expected = 0;
+    return m_state.compare_exchange_strong(expected, 1, std::memory_order_acquire);
+}
+
+void FiberMutex::lock() {
+    if(!tryLock()) {
+        lockSlow();
+    }
+}
+
+void FiberMutex::lockSlow() {
+    for(int i = 0; i < s_spin_count; ++i) {
+        CpuRelax();
+        if(m_state.load(std::memory_order_relaxed) == 0 && tryLock()) {
+            return;
+        }
+    }
+    WaitLocal<FiberWaiter> waiter;
+    {
+        MutexType::Lock lock(m_mutex);
+        // 标记有等待者，释放时走慢路径
+        if(m_state.exchange(2, std::memory_order_acquire) == 0) {
+            return;
+        }
+        m_waiters.push(waiter.get());
+    }
+    // 被唤醒时锁已经交给了自己
+    waiter->park();
+}
+
+void FiberMutex::unlock() {
+    int expected = 1;
+    if(m_state.compare_exchange_strong(expected, 0, std::memory_order_release)) {
+        return;
+    }
+    FiberWaiter* waiter = nullptr;
+    {
+        MutexType::Lock lock(m_mutex);
+        waiter = m_waiters.pop();
+        if(!waiter) {
+            m_state.store(0, std::memory_order_release);
+        } else if(m_waiters.empty()) {
+            m_state.store(1, std::memory_order_relaxed);
+        }
+    }
+    if(waiter) {
+        waiter->wake();
+    }
+}
+
+FiberRWMutex::~FiberRWMutex() {
+    ASSERT(m_readerWaiters.empty() && m_writerWaiters.empty());
+}
+
+bool FiberRWMutex::tryRdlock() {
+    MutexType::Lock lock(m_mutex);
+    if(!m_writer && !m_writerWaiting) {
+        ++m_readers;
+        return true;
+    }
+    return false;
+}
+
+bool FiberRWMutex::tryWrlock() {
+    MutexType::Lock lock(m_mutex);
+    if(!m_writer && !m_readers) {
+        m_writer = true;
+        return true;
+    }
+    return false;
+}
+
+void FiberRWMutex::rdlock() {
+    for(int i = 0; i < s_spin_count; ++i) {
+        if(tryRdlock()) {
+            return;
+        }
+        CpuRelax();
+    }
+    WaitLocal<FiberWaiter> waiter;
+    {
+        MutexType::Lock lock(m_mutex);
+        if(!m_writer && !m_writerWaiting) {
+            ++m_readers;
+            return;
+        }
+        m_readerWaiters.push(waiter.get());
+    }
+    waiter->park();
+}
+
+void FiberRWMutex::wrlock() {
+    for(int i = 0; i < s_spin_count; ++i) {
+        if(tryWrlock()) {
+            return;
+        }
+        CpuRelax();
+    }
+    WaitLocal<FiberWaiter> waiter;
+    {
+        MutexType::Lock lock(m_mutex);
+        if(!m_writer && !m_readers) {
+            m_writer = true;
+            return;
+        }
+        ++m_writerWaiting;
+        m_writerWaiters.push(waiter.get());
+    }
+    waiter->park();
+}
+
+void FiberRWMutex::unlock() {
+    FiberWaiter* readers = nullptr;
+    FiberWaiter* writer = nullptr;
+    {
+        MutexType::Lock lock(m_mutex);
+        bool was_writer = m_writer;
+        if(m_writer) {
+            m_writer = false;
+        } else {
+            ASSERT(m_readers > 0);
+            --m_readers;
+        }
+        if(!m_readers) {
+            // 写锁释放时先让等待的读者进入，避免连续的写者饿死读者
+            if(was_writer && !m_readerWaiters.empty()) {
+                readers = m_readerWaiters.popAll();
+                for(FiberWaiter* i = readers; i; i = i->next) {
+                    ++m_readers;
+                }
+            } else if((writer = m_writerWaiters.pop())) {
+                --m_writerWaiting;
+                m_writer = true;
+            } else {
+                readers = m_readerWaiters.popAll();
+                for(FiberWaiter* i = readers; i; i = i->next) {
+                    ++m_readers;
+                }
+            }
+        }
+    }
+    if(writer) {
+        writer->wake();
+    }
+    FiberWaitQueue::WakeAll(readers);
+}
+
+FiberCondVar::~FiberCondVar() {
+    ASSERT(m_waiters.empty());
+}
+
+void FiberCondVar::wait(FiberMutex& mutex) {
+    WaitLocal<FiberWaiter> waiter;
+    {
+        MutexType::Lock lock(m_mutex);
+        m_waiters.push(waiter.get());
+    }
+    // 先加入队列再释放mutex，释放之后的通知不会丢失
+    mutex.unlock();
+    waiter->park();
+    mutex.lock();
+}
+
+void FiberCondVar::notifyOne() {
+    FiberWaiter* waiter = nullptr;
+    {
+        MutexType::Lock lock(m_mutex);
+        waiter = m_waiters.pop();
+    }
+    if(waiter) {
+        waiter->wake();
+    }
+}
+
+void FiberCondVar::notifyAll() {
+    FiberWaiter* waiters = nullptr;
+    {
+        MutexType::Lock lock(m_mutex);
+        waiters = m_waiters.popAll();
+    }
+    FiberWaitQueue::WakeAll(waiters);
+}
+
+FiberSemaphore::FiberSemaphore(size_t initial_concurrency)
+    :m_concurrency(initial_concurrency) {
+}
+
+FiberSemaphore::~FiberSemaphore() {
+    ASSERT(m_waiters.empty());
+}
+
+bool FiberSemaphore::tryWait() {
+    MutexType::Lock lock(m_mutex);
+    if(m_concurrency > 0u) {
+        --m_concurrency;
+        return true;
+    }
+    return false;
+}
+
+void FiberSemaphore::wait() {
+    for(int i = 0; i < s_spin_count; ++i) {
+        if(tryWait()) {
+            return;
+        }
+        CpuRelax();
+    }
+    WaitLocal<FiberWaiter> waiter;
+    {
+        MutexType::Lock lock(m_mutex);
+        if(m_concurrency > 0u) {
+            --m_concurrency;
+            return;
+        }
+        m_waiters.push(waiter.get());
+    }
+    // 被唤醒时释放者已经把数量交给了自己
+    waiter->park();
+}
+
+void FiberSemaphore::notify() {
+    FiberWaiter* waiter = nullptr;
+    {
+        MutexType::Lock lock(m_mutex);
+        waiter = m_waiters.pop();
+        if(!waiter) {
+            ++m_concurrency;
+        }
+    }
+    if(waiter) {
+        waiter->wake();
+    }
+}
 
 }
\ No newline at end of file
@@ -8,6 +8,8 @@
 #include <stdint.h>
 #include <atomic>
 #include <list>
+#include <new>
+#include <type_traits>
 #include "noncopyable.h"
 #include "fiber.h"
 
@@ -288,26 +290,236 @@ private:
     volatile std::atomic_flag m_mutex;
 };
 
-// class Scheduler;
-// class FiberSemaphore : Noncopyable {
-// public:
-//     typedef Spinlock MutexType;
+class Scheduler;
+
+// 协程同步原语中的一个等待者，通过WaitLocal放在等待的协程或线程的栈上
+// 在调度器的协程中等待时挂起协程(YieldToHold)，唤醒时放回原来的调度器；不在协程中时用信号量阻塞线程
+// 挂起之前先自旋一小段时间，等待时间很短时不需要切换
+struct FiberWaiter : Noncopyable {
+    // 记录当前的协程和调度器
+    FiberWaiter();
+
+    // 等待直到被唤醒
+    void park();
+
+    // 唤醒等待者，调用之后等待者可能已经返回，不能再访问本对象
+    void wake();
+
+    // 等待者的状态
+    enum State {
+        // 还没有挂起
+        WAITING,
+        // 已经挂起或者正在挂起
+        PARKED,
+        // 已经被唤醒
+        SIGNALED
+    };
+
+    // 等待的调度器，不在协程中时为nullptr
+    Scheduler* scheduler = nullptr;
+    // 等待的协程
+    Fiber::ptr fiber;
+    // 不在协程中时阻塞线程的信号量
+    Semaphore semaphore;
+    // 状态
+    std::atomic<int> state = {WAITING};
+    // 队列中的下一个等待者
+    FiberWaiter* next = nullptr;
+};
+
+// 等待期间会被其他协程或线程访问的节点的内存，每个节点WAIT_NODE_SIZE字节，从线程的缓存中申请
+static const size_t WAIT_NODE_SIZE = 128;
+void* AllocWaitNode();
+void FreeWaitNode(void* p);
+
+// 等待期间链入共享队列的局部对象
+// 普通协程和线程直接放在栈上；共享栈协程切出后栈上的内容被拷走，栈空间会被下一个协程覆盖，改为从缓存中申请
+template<class T>
+class WaitLocal : Noncopyable {
+public:
+    WaitLocal() {
+        static_assert(sizeof(T) <= WAIT_NODE_SIZE, "wait node too large");
+        if(Fiber::InSharedStack()) {
+            m_ptr = new (AllocWaitNode()) T();
+        } else {
+            m_ptr = new (&m_storage) T();
+        }
+    }
+
+    ~WaitLocal() {
+        m_ptr->~T();
+        if((void*)m_ptr != (void*)&m_storage) {
+            FreeWaitNode(m_ptr);
+        }
+    }
+
+    T* get() const { return m_ptr;}
+    T* operator->() const { return m_ptr;}
+    T& operator*() const { return *m_ptr;}
+private:
+    // 栈上的存储
+    typename std::aligned_storage<sizeof(T), alignof(T)>::type m_storage;
+    // 对象所在的位置
+    T* m_ptr = nullptr;
+};
+
+// 等待者的先进先出队列，由使用者的锁保护
+class FiberWaitQueue {
+public:
+    // 是否为空
+    bool empty() const { return !m_head;}
+
+    // 加入队尾
+    void push(FiberWaiter* waiter);
+
+    // 取出队头，为空返回nullptr
+    FiberWaiter* pop();
+
+    // 取出所有等待者，通过next串联
+    FiberWaiter* popAll();
+
+    // 唤醒通过next串联的所有等待者
+    static void WakeAll(FiberWaiter* head);
+private:
+    FiberWaiter* m_head = nullptr;
+    FiberWaiter* m_tail = nullptr;
+};
+
+// 协程互斥量，竞争时挂起当前协程而不是阻塞线程，同一线程上的其他协程可以继续执行
+// 释放时直接把锁交给队头的等待者
+class FiberMutex : Noncopyable {
+public:
+    typedef Spinlock MutexType;
+
+    // 局部锁
+    typedef ScopedLockImpl<FiberMutex> Lock;
+
+    FiberMutex() {}
+
+    ~FiberMutex();
+
+    // 尝试加锁，不等待
+    bool tryLock();
+
+    void lock();
+
+    void unlock();
+private:
+    // 没有拿到锁时挂起
+    void lockSlow();
+private:
+    // 0未加锁，1加锁，2加锁并且可能有等待者
+    std::atomic<int> m_state = {0};
+    // 保护等待队列
+    MutexType m_mutex;
+    // 等待队列
+    FiberWaitQueue m_waiters;
+};
+
+// 协程读写锁，有写者等待时新的读者也要等待，写锁释放时优先唤醒所有等待的读者
+class FiberRWMutex : Noncopyable {
+public:
+    typedef Spinlock MutexType;
+
+    // 局部读锁
+    typedef ReadScopedLockImpl<FiberRWMutex> ReadLock;
+
+    // 局部写锁
+    typedef WriteScopedLockImpl<FiberRWMutex> WriteLock;
+
+    FiberRWMutex() {}
+
+    ~FiberRWMutex();
+
+    // 尝试加读锁，不等待
+    bool tryRdlock();
+
+    // 尝试加写锁，不等待
+    bool tryWrlock();
+
+    void rdlock();
+
+    void wrlock();
+
+    void unlock();
+private:
+    // 保护下面的状态和等待队列
+    MutexType m_mutex;
+    // 持有读锁的数量
+    uint32_t m_readers = 0;
+    // 是否有写者持有锁
+    bool m_writer = false;
+    // 等待的写者数量
+    uint32_t m_writerWaiting = 0;
+    // 等待的读者
+    FiberWaitQueue m_readerWaiters;
+    // 等待的写者
+    FiberWaitQueue m_writerWaiters;
+};
+
+// 协程条件变量，和FiberMutex配合使用
+class FiberCondVar : Noncopyable {
+public:
+    typedef Spinlock MutexType;
+
+    FiberCondVar() {}
 
-//     FiberSemaphore(size_t initial_concurrency = 0);
-//     ~FiberSemaphore();
+    ~FiberCondVar();
 
-//     bool tryWait();
-//     void wait();
-//     void notify();
+    // 释放mutex并挂起，被唤醒后重新加锁，调用前必须持有mutex
+    void wait(FiberMutex& mutex);
 
-//     size_t getConcurrency() const { return m_concurrency;}
-//     void reset() { m_concurrency = 0;}
-// private:
-//     MutexType m_mutex;
-//     std::list<std::pair<Scheduler*, Fiber::ptr> > m_waiters;
-//     size_t m_concurrency;
-// };
+    // 等待直到pred返回true
+    template<class Predicate>
+    void wait(FiberMutex& mutex, Predicate pred) {
+        while(!pred()) {
+            wait(mutex);
+        }
+    }
+
+    // 唤醒一个等待者
+    void notifyOne();
+
+    // 唤醒所有等待者
+    void notifyAll();
+private:
+    // 保护等待队列
+    MutexType m_mutex;
+    // 等待队列
+    FiberWaitQueue m_waiters;
+};
+
+// 协程信号量，没有可用的数量时挂起当前协程
+class FiberSemaphore : Noncopyable {
+public:
+    typedef Spinlock MutexType;
+
+    // 设置初始的数量
+    FiberSemaphore(size_t initial_concurrency = 0);
 
+    ~FiberSemaphore();
 
+    // 尝试申请，不等待
+    bool tryWait();
+
+    // 申请，数量-1
+    void wait();
+
+    // 释放，有等待者时直接交给队头的等待者，否则数量+1
+    void notify();
+
+    // 返回当前可用的数量
+    size_t getConcurrency() const { return m_concurrency;}
+
+    // 清空可用的数量
+    void reset() { m_concurrency = 0;}
+private:
+    // 保护数量和等待队列
+    MutexType m_mutex;
+    // 可用的数量
+    size_t m_concurrency;
+    // 等待队列
+    FiberWaitQueue m_waiters;
+};
 
 }
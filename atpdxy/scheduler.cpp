@@ -2,17 +2,67 @@
 #include "log.h"
 #include "macro.h"
 #include "hook.h"
+#include "work_steal_queue.h"
 
 namespace atpdxy {
 
 static atpdxy::Logger::ptr g_logger = GET_LOGGER_BY_NAME("system");
 
+// 每个工作线程本地队列的容量，满了之后溢出到注入队列
+static const size_t s_local_queue_capacity = 4096;
+
+// 每隔多少次取任务优先检查一次注入队列，避免本地任务不断产生新任务时注入队列饿死
+static const uint32_t s_inject_check_interval = 61;
+
+// 从注入队列一次最多搬到本地队列的任务数量
+static const size_t s_inject_batch = 32;
+
+// 工作线程
+struct Scheduler::Worker {
+    Worker(uint32_t s)
+        :queue(s_local_queue_capacity)
+        ,seed(s) {
+    }
+
+    // 返回下一个随机数，只有拥有者线程访问
+    uint32_t rand() {
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        return seed;
+    }
+
+    // 本地任务队列
+    WorkStealQueue<FiberAndThread> queue;
+    // 工作线程的线程id
+    std::atomic<int> thread = {-1};
+    // 信箱的锁
+    Spinlock mailboxMutex;
+    // 信箱，指定在该线程执行的任务，只有该线程会取出
+    IntrusiveQueue<FiberAndThread> mailbox;
+    // 信箱中的任务数量
+    std::atomic<size_t> mailboxCount = {0};
+    // 随机数种子，用于选择窃取对象
+    uint32_t seed;
+    // 取任务的次数
+    uint32_t tick = 0;
+};
+
+// 每个线程最多缓存的空闲任务节点数量
+static const size_t s_task_cache_count = 1024;
+
 // 正在执行的调度器
 static thread_local Scheduler* t_scheduler = nullptr;
 
 // 正在执行的调度器中的协程
 static thread_local Fiber* t_scheduler_fiber = nullptr;
 
+// 当前线程作为工作线程所属的调度器
+static thread_local Scheduler* t_worker_scheduler = nullptr;
+
+// 当前线程在所属调度器中的工作线程下标
+static thread_local size_t t_worker_index = 0;
+
 Scheduler::Scheduler(size_t threads, bool use_caller, const std::string& name)
     :m_name(name) {
     ASSERT(threads > 0);
@@ -24,7 +74,7 @@ Scheduler::Scheduler(size_t threads, bool use_caller, const std::string& name)
         ASSERT(GetThis() == nullptr);
         t_scheduler = this;
 
-        m_rootFiber.reset(new Fiber(std::bind(&Scheduler::run, this), 0, true));
+        m_rootFiber.reset(new Fiber(std::bind(&Scheduler::run, this, 0), 0, true));
         atpdxy::Thread::SetName(m_name);
 
         t_scheduler_fiber = m_rootFiber.get();
@@ -34,6 +84,15 @@ Scheduler::Scheduler(size_t threads, bool use_caller, const std::string& name)
         m_rootThread = -1;
     }
     m_threadCount = threads;
+
+    // use_caller时下标0是调用线程，其余依次是线程池中的线程
+    size_t worker_count = m_threadCount + (m_rootFiber ? 1 : 0);
+    for(size_t i = 0; i < worker_count; ++i) {
+        m_workers.push_back(new Worker(0x9E3779B9u * (i + 1)));
+    }
+    if(m_rootFiber) {
+        m_workers[0]->thread = m_rootThread;
+    }
 }
 
 Scheduler::~Scheduler() {
@@ -41,6 +100,68 @@ Scheduler::~Scheduler() {
     if(GetThis() == this) {
         t_scheduler = nullptr;
     }
+    for(auto& i : m_workers) {
+        while(FiberAndThread* task = i->queue.pop()) {
+            FreeTask(task);
+        }
+        while(FiberAndThread* task = i->mailbox.pop()) {
+            FreeTask(task);
+        }
+        delete i;
+    }
+    while(FiberAndThread* task = m_injectQueue.pop()) {
+        FreeTask(task);
+    }
+}
+
+// 线程私有的空闲任务节点缓存，任务可能被其他线程窃取执行，节点在哪个线程释放就缓存在哪个线程
+class Scheduler::TaskCache {
+public:
+    ~TaskCache() {
+        while(FiberAndThread* task = m_free.pop()) {
+            delete task;
+        }
+        t_destroyed = true;
+    }
+
+    // 取出一个空闲节点，没有返回nullptr
+    static FiberAndThread* Get() {
+        if(t_destroyed) {
+            return nullptr;
+        }
+        return t_cache.m_free.pop();
+    }
+
+    // 放回空闲节点，超过缓存上限或缓存已析构返回false
+    static bool Put(FiberAndThread* task) {
+        if(t_destroyed || t_cache.m_free.size() >= s_task_cache_count) {
+            return false;
+        }
+        t_cache.m_free.push(task);
+        return true;
+    }
+private:
+    // 空闲节点
+    IntrusiveQueue<FiberAndThread> m_free;
+    // 当前线程的缓存
+    static thread_local TaskCache t_cache;
+    // 线程退出时缓存已经析构，此后释放的节点直接删除
+    static thread_local bool t_destroyed;
+};
+
+thread_local Scheduler::TaskCache Scheduler::TaskCache::t_cache;
+thread_local bool Scheduler::TaskCache::t_destroyed = false;
+
+Scheduler::FiberAndThread* Scheduler::AllocTask() {
+    FiberAndThread* task = TaskCache::Get();
+    return task ? task : new FiberAndThread;
+}
+
+void Scheduler::FreeTask(FiberAndThread* task) {
+    task->reset();
+    if(!TaskCache::Put(task)) {
+        delete task;
+    }
 }
 
 Scheduler* Scheduler::GetThis() {
@@ -60,9 +181,12 @@ void Scheduler::start() {
     ASSERT(m_threads.empty());
 
     m_threads.resize(m_threadCount);
+    size_t offset = m_rootFiber ? 1 : 0;
     for(size_t i = 0; i < m_threadCount; ++i) {
-        m_threads[i].reset(new Thread(std::bind(&Scheduler::run, this)
+        m_threads[i].reset(new Thread(std::bind(&Scheduler::run, this, i + offset)
             , m_name + "_" + std::to_string(i)));
+        // 线程构造返回时已经开始运行，线程id可以对外公开之前记录到工作线程上
+        m_workers[i + offset]->thread = m_threads[i]->getId();
         m_threadIds.push_back(m_threads[i]->getId());
     }
     lock.unlock();
@@ -93,13 +217,10 @@ void Scheduler::stop() {
 
     m_stopping = true;
     // 通知所有工作线程，执行完剩余的任务
-    for(size_t i = 0; i < m_threadCount; ++i) {
-        tickle();
-    }
-
-    // 使用了use_caller，则通知根线程的调度协程，执行剩余的任务
-    if(m_rootFiber) {
-        tickle();
+    for(auto& i : m_workers) {
+        if(i->thread != -1) {
+            tickleThread(i->thread);
+        }
     }
 
     // 调度器未处于停止状态，调用call函数，将控制权交给根协程，让其执行调度任务，将任务执行完
@@ -126,7 +247,7 @@ void Scheduler::setThis() {
     t_scheduler = this;
 }
 
-void Scheduler::run() {
+void Scheduler::run(size_t index) {
     DEBUG(g_logger) << m_name << " run";
     set_hook_enable(true);
     setThis();
@@ -134,65 +255,56 @@ void Scheduler::run() {
     if(atpdxy::GetThreadId() != m_rootThread) {
         t_scheduler_fiber = Fiber::GetThis().get();
     }
+    ASSERT(index < m_workers.size());
+    Worker* worker = m_workers[index];
+    t_worker_scheduler = this;
+    t_worker_index = index;
+
     // 创建空闲协程和执行回调函数的协程
     Fiber::ptr idle_fiber(new Fiber(std::bind(&Scheduler::idle, this)));
     Fiber::ptr cb_fiber;
-    // 不断从队列中取出任务来执行
-    FiberAndThread ft;
     while(true) {
         // 选择一个要执行的协程或任务
-        ft.reset();
-        bool tickle_me = false;
-        bool is_active = false;
-        {
-            MutexType::Lock lock(m_mutex);
-            auto it = m_fibers.begin();
-            while(it != m_fibers.end()) {
-                // 指定了执行的线程
-                if(it->thread != -1 && it->thread != atpdxy::GetThreadId()) {
-                    ++it;
-                    tickle_me = true;
-                    continue;
-                }
+        FiberAndThread* task = takeTask(worker);
+        // 还有其他任务，唤醒空闲线程来窃取
+        if(task && m_taskCount > m_pinnedCount && hasIdleThreads()) {
+            tickle();
+        }
 
-                ASSERT(it->fiber || it->cb);
-                if(it->fiber && it->fiber->getState() == Fiber::EXEC) {
-                    ++it;
-                    continue;
+        if(task) {
+            // 协程还在其他线程上执行，还没有切出，稍后再调度
+            if(task->fiber && task->fiber->getState() == Fiber::EXEC) {
+                ++m_taskCount;
+                if(task->thread != -1) {
+                    pushMailbox(worker, task);
+                } else {
+                    pushInjectQueue(task);
                 }
-
-                ft = *it;
-                m_fibers.erase(it++);
-                ++m_activeThreadCount;
-                is_active = true;
-                break;
+                --m_activeThreadCount;
+                continue;
             }
-            tickle_me |= it != m_fibers.end();
-        }
-        // 需要唤醒线程执行
-        if(tickle_me) {
-            tickle();
         }
+
         // 有要执行的协程：EXEC-执行；READY-调度；TERM/EXCEPT-设置HOLD
-        if(ft.fiber && (ft.fiber->getState() != Fiber::TERM
-                        && ft.fiber->getState() != Fiber::EXCEPT)) {
-            ft.fiber->swapIn();
+        if(task && task->fiber && (task->fiber->getState() != Fiber::TERM
+                        && task->fiber->getState() != Fiber::EXCEPT)) {
+            task->fiber->swapIn();
             --m_activeThreadCount;
 
-            if(ft.fiber->getState() == Fiber::READY) {
-                schedule(ft.fiber);
-            } else if(ft.fiber->getState() != Fiber::TERM
-                    && ft.fiber->getState() != Fiber::EXCEPT) {
-                ft.fiber->m_state = Fiber::HOLD;
+            if(task->fiber->getState() == Fiber::READY) {
+                schedule(task->fiber);
+            } else if(task->fiber->getState() != Fiber::TERM
+                    && task->fiber->getState() != Fiber::EXCEPT) {
+                task->fiber->m_state = Fiber::HOLD;
             }
-            ft.reset();
-        } else if(ft.cb) {
+            FreeTask(task);
+        } else if(task && task->cb) {
             if(cb_fiber) {
-                cb_fiber->reset(ft.cb);
+                cb_fiber->reset(std::move(task->cb));
             } else {
-                cb_fiber.reset(new Fiber(ft.cb));
+                cb_fiber.reset(new Fiber(std::move(task->cb), 0, false, m_sharedStack));
             }
-            ft.reset();
+            FreeTask(task);
             cb_fiber->swapIn();
             --m_activeThreadCount;
             if(cb_fiber->getState() == Fiber::READY) {
@@ -205,17 +317,34 @@ void Scheduler::run() {
                 cb_fiber->m_state = Fiber::HOLD;
                 cb_fiber.reset();
             }
-        } else {
-            if(is_active) {
-                --m_activeThreadCount;
-                continue;
+        } else if(task) {
+            // 已经结束的协程
+            --m_activeThreadCount;
+            FreeTask(task);
+        }
+
+        if(task) {
+            onTaskReturn();
+            // 正在停止时，执行完任务后唤醒空闲线程重新检查是否可以退出
+            if(UNLIKELY(m_stopping) && hasIdleThreads()) {
+                tickle();
             }
+        } else {
             if(idle_fiber->getState() == Fiber::TERM) {
                 INFO(g_logger) << "idle fiber term";
+                // 一次通知只能唤醒一个空闲线程，退出前接力唤醒下一个
+                if(hasIdleThreads()) {
+                    tickle();
+                }
                 break;
             }
-            // 没有要执行的任务，执行idle协程
+            // 先登记为空闲再检查一次任务数量，和调度任务时先增加任务数量再检查空闲线程配对，避免丢失唤醒
             ++m_idleThreadCount;
+            if(hasTask()) {
+                --m_idleThreadCount;
+                continue;
+            }
+            // 没有要执行的任务，执行idle协程
             idle_fiber->swapIn();
             --m_idleThreadCount;
             if(idle_fiber->getState() != Fiber::TERM
@@ -224,16 +353,234 @@ void Scheduler::run() {
             }
         }
     }
+    t_worker_scheduler = nullptr;
+}
+
+void Scheduler::scheduleTask(FiberAndThread* task) {
+    // 共享栈协程的栈内容保存在其绑定的线程的共享栈上，只能回到该线程执行
+    if(task->fiber && task->fiber->getSharedStackThread() != -1) {
+        task->thread = task->fiber->getSharedStackThread();
+    }
+    // 先增加任务数量再放入队列，和空闲线程先登记再检查任务数量配对
+    ++m_taskCount;
+    if(task->thread != -1) {
+        Worker* worker = getWorker(task->thread);
+        if(worker) {
+            pushMailbox(worker, task);
+            tickleThread(task->thread);
+            return;
+        }
+        ERROR(g_logger) << "schedule to thread " << task->thread
+            << " which is not a worker of scheduler " << m_name;
+        task->thread = -1;
+    }
+
+    Worker* worker = getCurrentWorker();
+    if(!worker || !worker->queue.push(task)) {
+        pushInjectQueue(task);
+    }
+    if(hasIdleThreads()) {
+        tickle();
+    }
+}
+
+void Scheduler::scheduleTasks(FiberAndThread* head) {
+    if(!head) {
+        return;
+    }
+    Worker* worker = getCurrentWorker();
+    // 放不进本地队列的任务串成一串，最后一次加锁放入注入队列
+    FiberAndThread* inject_head = nullptr;
+    FiberAndThread* inject_tail = nullptr;
+    size_t inject_count = 0;
+    while(head) {
+        FiberAndThread* task = head;
+        head = head->next;
+        task->next = nullptr;
+        if(task->fiber && task->fiber->getSharedStackThread() != -1) {
+            task->thread = task->fiber->getSharedStackThread();
+        }
+        ++m_taskCount;
+        if(task->thread != -1) {
+            Worker* target = getWorker(task->thread);
+            if(target) {
+                pushMailbox(target, task);
+                tickleThread(task->thread);
+                continue;
+            }
+            task->thread = -1;
+        }
+        if(!worker || !worker->queue.push(task)) {
+            if(inject_tail) {
+                inject_tail->next = task;
+            } else {
+                inject_head = task;
+            }
+            inject_tail = task;
+            ++inject_count;
+        }
+    }
+    if(inject_head) {
+        MutexType::Lock lock(m_mutex);
+        m_injectQueue.append(inject_head, inject_tail, inject_count);
+        m_injectCount += inject_count;
+    }
+    if(hasIdleThreads()) {
+        tickle();
+    }
+}
+
+void Scheduler::pushMailbox(Worker* worker, FiberAndThread* task) {
+    Spinlock::Lock lock(worker->mailboxMutex);
+    worker->mailbox.push(task);
+    ++m_pinnedCount;
+    ++worker->mailboxCount;
+}
+
+void Scheduler::pushInjectQueue(FiberAndThread* task) {
+    MutexType::Lock lock(m_mutex);
+    m_injectQueue.push(task);
+    ++m_injectCount;
+}
+
+Scheduler::Worker* Scheduler::getCurrentWorker() {
+    if(t_worker_scheduler != this) {
+        return nullptr;
+    }
+    return m_workers[t_worker_index];
+}
+
+Scheduler::Worker* Scheduler::getWorker(int thread) {
+    int index = getWorkerIndex(thread);
+    return index == -1 ? nullptr : m_workers[index];
+}
+
+int Scheduler::getWorkerIndex(int thread) {
+    // 调度到当前线程
+    if(t_worker_scheduler == this && m_workers[t_worker_index]->thread == thread) {
+        return t_worker_index;
+    }
+    // 工作线程数量在构造时确定，直接遍历，不需要加锁
+    for(size_t i = 0; i < m_workers.size(); ++i) {
+        if(m_workers[i]->thread == thread) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+int Scheduler::getCurrentWorkerIndex() {
+    return t_worker_scheduler == this ? (int)t_worker_index : -1;
+}
+
+int Scheduler::getWorkerThread(size_t index) {
+    return index < m_workers.size() ? m_workers[index]->thread.load() : -1;
+}
+
+bool Scheduler::hasTask() {
+    // 其他线程信箱中的任务当前线程无法执行，不计入
+    if(m_taskCount > m_pinnedCount) {
+        return true;
+    }
+    Worker* worker = getCurrentWorker();
+    return worker && worker->mailboxCount > 0;
+}
+
+Scheduler::FiberAndThread* Scheduler::takeTask(Worker* worker) {
+    FiberAndThread* task = nullptr;
+    // 信箱中指定在本线程执行的任务
+    if(worker->mailboxCount > 0) {
+        Spinlock::Lock lock(worker->mailboxMutex);
+        size_t n = worker->mailbox.size();
+        for(size_t i = 0; i < n; ++i) {
+            FiberAndThread* t = worker->mailbox.pop();
+            // 协程还没有从其他线程切出，放回队尾
+            if(t->fiber && t->fiber->getState() == Fiber::EXEC) {
+                worker->mailbox.push(t);
+                continue;
+            }
+            task = t;
+            --worker->mailboxCount;
+            break;
+        }
+    }
+
+    // 定期优先检查注入队列
+    bool inject_first = (++worker->tick % s_inject_check_interval) == 0;
+    if(!task && !inject_first) {
+        task = worker->queue.pop();
+    }
+
+    // 注入队列，顺便搬一批到本地队列，减少对全局锁的竞争
+    if(!task && m_injectCount > 0) {
+        MutexType::Lock lock(m_mutex);
+        if(!m_injectQueue.empty()) {
+            task = m_injectQueue.pop();
+            --m_injectCount;
+
+            // 只有拥有者会向本地队列压入，剩余空间不会被其他线程占用
+            size_t n = m_injectQueue.size() / m_workers.size();
+            n = std::min(n, s_inject_batch);
+            n = std::min(n, worker->queue.capacity() - worker->queue.size());
+            for(size_t i = 0; i < n; ++i) {
+                worker->queue.push(m_injectQueue.pop());
+                --m_injectCount;
+            }
+        }
+    }
+
+    if(!task && inject_first) {
+        task = worker->queue.pop();
+    }
+
+    if(!task) {
+        task = stealTask(worker);
+    }
+
+    if(task) {
+        // 先增加活跃线程数量再减少任务数量，stopping不会看到两者同时为0的中间状态
+        ++m_activeThreadCount;
+        --m_taskCount;
+        if(task->thread != -1) {
+            --m_pinnedCount;
+        }
+    }
+    return task;
+}
+
+Scheduler::FiberAndThread* Scheduler::stealTask(Worker* worker) {
+    size_t n = m_workers.size();
+    if(n <= 1) {
+        return nullptr;
+    }
+    // 窃取可能因为竞争失败，最多尝试两轮
+    for(int round = 0; round < 2; ++round) {
+        size_t start = worker->rand() % n;
+        for(size_t i = 0; i < n; ++i) {
+            Worker* victim = m_workers[(start + i) % n];
+            if(victim == worker) {
+                continue;
+            }
+            FiberAndThread* task = victim->queue.steal();
+            if(task) {
+                return task;
+            }
+        }
+    }
+    return nullptr;
 }
 
 void Scheduler::tickle() {
     INFO(g_logger) << "tickle";
 }
 
+void Scheduler::tickleThread(int thread) {
+    tickle();
+}
+
 bool Scheduler::stopping() {
-    MutexType::Lock lock(m_mutex);
     return m_autoStop && m_stopping
-        && m_fibers.empty() && m_activeThreadCount == 0;
+        && m_taskCount == 0 && m_activeThreadCount == 0;
 }
 
 void Scheduler::idle() {
@@ -252,6 +599,8 @@ void Scheduler::switchTo(int thread) {
             return;
         }
     }
+    ASSERT_WITH_MSG(!Fiber::GetThis()->isSharedStack()
+            , "shared stack fiber can not switch thread");
     // 将当前协程加入到任务队列中，然后当前协程释放控制器，交给其他协程
     schedule(Fiber::GetThis(), thread);
     Fiber::YieldToHold();
@@ -262,6 +611,7 @@ std::ostream& Scheduler::dump(std::ostream& os) {
        << " size=" << m_threadCount
        << " active_count=" << m_activeThreadCount
        << " idle_count=" << m_idleThreadCount
+       << " task_count=" << m_taskCount
        << " stopping=" << m_stopping
        << " ]" << std::endl << "    ";
     for(size_t i = 0; i < m_threadIds.size(); ++i) {
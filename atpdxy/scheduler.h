@@ -3,14 +3,17 @@
 #include <memory>
 #include <vector>
 #include <list>
+#include <atomic>
 #include <iostream>
 #include "hook.h"
 #include "fiber.h"
+#include "task.h"
 #include "thread.h"
 
 namespace atpdxy {
 
 // 协程调度器,封装的是N-M的协程调度器,内部有一个线程池,支持协程在线程池里面切换
+// 每个工作线程有一个Chase-Lev本地队列，空闲时随机选择其他工作线程窃取任务，外部线程调度的任务放入全局注入队列
 class Scheduler {
 public:
     typedef std::shared_ptr<Scheduler> ptr;
@@ -37,47 +40,65 @@ public:
     // 停止协程调度器
     void stop();
 
-    // 停止协程调度器,协程执行的线程id,-1标识任意线程
+    // 调度协程或回调函数,thread为协程执行的线程id,-1标识任意线程
+    // 在本调度器的工作线程中调用时放入该线程的本地队列，否则放入全局注入队列
+    // 指定了线程的任务放入目标线程的信箱，只唤醒目标线程
+    // 传入Fiber::ptr*、std::function<void()>*或Task*时会移走其中的内容
     template<class FiberOrCb>
     void schedule(FiberOrCb fc, int thread = -1) {
-        bool need_tickle = false;
-        {
-            MutexType::Lock lock(m_mutex);
-            need_tickle = scheduleNoLock(fc, thread);
-        }
-
-        if(need_tickle) {
-            tickle();
+        FiberAndThread* task = AllocTask();
+        task->assign(std::move(fc));
+        task->thread = thread;
+        if(!task->fiber && !task->cb) {
+            FreeTask(task);
+            return;
         }
+        scheduleTask(task);
     }
 
-    // 批量调度协程
+    // 批量调度协程，会移走迭代器指向的内容
     template<class InputIterator>
     void schedule(InputIterator begin, InputIterator end) {
-        bool need_tickle = false;
-        {
-            MutexType::Lock lock(m_mutex);
-            while(begin != end) {
-                need_tickle = scheduleNoLock(&*begin, -1) || need_tickle;
-                ++begin;
+        FiberAndThread* head = nullptr;
+        FiberAndThread* tail = nullptr;
+        while(begin != end) {
+            FiberAndThread* task = AllocTask();
+            task->assign(&*begin);
+            if(task->fiber || task->cb) {
+                if(tail) {
+                    tail->next = task;
+                } else {
+                    head = task;
+                }
+                tail = task;
+            } else {
+                FreeTask(task);
             }
+            ++begin;
         }
-        if(need_tickle) {
-            tickle();
-        }
+        scheduleTasks(head);
     }
 
-    // 在不同线程间切换执行协程
+    // 在不同线程间切换执行协程，共享栈协程只能在其绑定的线程上执行
     void switchTo(int thread = -1);
 
+    // 设置回调任务是否运行在共享栈协程上，对之后新创建的回调协程生效
+    void setSharedStack(bool v) { m_sharedStack = v;}
+
+    // 返回回调任务是否运行在共享栈协程上
+    bool isSharedStack() const { return m_sharedStack;}
+
     // 打印调度器内部的信息
     std::ostream& dump(std::ostream& os);
 protected:
     // 通知协程调度器有任务了
     virtual void tickle();
 
-    // 协程调度函数
-    void run();
+    // 通知指定的工作线程有任务了，默认和tickle相同
+    virtual void tickleThread(int thread);
+
+    // 协程调度函数，index是工作线程下标
+    void run(size_t index);
 
     // 返回是否可以停止
     virtual bool stopping();
@@ -85,52 +106,69 @@ protected:
     // 协程无任务可调度时执行idle协程
     virtual void idle();
 
+    // 每个任务让出或结束回到调度协程后调用
+    virtual void onTaskReturn() {}
+
     // 设置当前线程的协程调度器
     void setThis();
 
     // 是否有空闲线程
     bool hasIdleThreads() { return m_idleThreadCount > 0;}
+
+    // 返回工作线程数量，use_caller时包含调用线程
+    size_t getWorkerCount() const { return m_workers.size();}
+
+    // 返回线程id对应的工作线程下标，不是本调度器的工作线程返回-1
+    int getWorkerIndex(int thread);
+
+    // 返回当前线程的工作线程下标，不是本调度器的工作线程返回-1
+    int getCurrentWorkerIndex();
+
+    // 返回工作线程下标对应的线程id，线程还没有启动返回-1
+    int getWorkerThread(size_t index);
+
+    // 当前线程是否有可以执行的任务
+    bool hasTask();
 private:
-    // 协程调度启动(无锁)
-    template<class FiberOrCb>
-    bool scheduleNoLock(FiberOrCb fc, int thread) {
-        bool need_tickle = m_fibers.empty();
-        FiberAndThread ft(fc, thread);
-        if(ft.fiber || ft.cb) {
-            m_fibers.push_back(ft);
-        }
-        return need_tickle;
-    }
-private:
-    // 协程执行的任务
+    // 协程执行的任务，同时作为侵入式队列的节点，释放后缓存在线程本地复用
     struct FiberAndThread {
         // 协程
         Fiber::ptr fiber;
         // 协程执行函数
-        std::function<void()> cb;
+        Task cb;
         // 线程id
-        int thread;
+        int thread = -1;
+        // 侵入式队列中的下一个节点
+        FiberAndThread* next = nullptr;
 
-        FiberAndThread(Fiber::ptr f, int thr)
-            :fiber(f), thread(thr) {
+        // 设置协程
+        template<class F>
+        typename std::enable_if<std::is_convertible<F, Fiber::ptr>::value>::type
+        assign(F&& f) {
+            fiber = std::forward<F>(f);
         }
 
-        FiberAndThread(Fiber::ptr* f, int thr)
-            :thread(thr) {
-            fiber.swap(*f);
+        // 设置回调函数
+        template<class F>
+        typename std::enable_if<!std::is_convertible<F, Fiber::ptr>::value>::type
+        assign(F&& f) {
+            cb = Task(std::forward<F>(f));
         }
 
-        FiberAndThread(std::function<void()> f, int thr)
-            :cb(f), thread(thr) {
+        // 移走协程
+        void assign(Fiber::ptr* f) {
+            fiber.swap(*f);
         }
 
-        FiberAndThread(std::function<void()>* f, int thr)
-            :thread(thr) {
-            cb.swap(*f);
+        // 移走回调函数
+        void assign(std::function<void()>* f) {
+            cb = Task(std::move(*f));
+            *f = nullptr;
         }
 
-        FiberAndThread()
-            :thread(-1) {
+        // 移走回调任务
+        void assign(Task* f) {
+            cb = std::move(*f);
         }
 
         // 清空任务的内容
@@ -138,15 +176,60 @@ private:
             fiber = nullptr;
             cb = nullptr;
             thread = -1;
+            next = nullptr;
         }
     };
+
+    // 申请一个任务节点，优先从线程本地缓存中取
+    static FiberAndThread* AllocTask();
+
+    // 释放任务节点，清空内容后放回线程本地缓存
+    static void FreeTask(FiberAndThread* task);
+private:
+    // 工作线程
+    struct Worker;
+
+    // 线程本地的空闲任务节点缓存
+    class TaskCache;
+
+    // 任务入队
+    void scheduleTask(FiberAndThread* task);
+
+    // 批量任务入队，任务通过next串联
+    void scheduleTasks(FiberAndThread* head);
+
+    // 将任务放入全局注入队列
+    void pushInjectQueue(FiberAndThread* task);
+
+    // 将任务放入工作线程的信箱
+    void pushMailbox(Worker* worker, FiberAndThread* task);
+
+    // 返回线程id对应的工作线程，不是本调度器的工作线程返回nullptr
+    Worker* getWorker(int thread);
+
+    // 返回当前线程对应的本调度器的工作线程，不是本调度器的工作线程返回nullptr
+    Worker* getCurrentWorker();
+
+    // 按照信箱、本地队列、注入队列、窃取其他工作线程的顺序取出一个任务
+    FiberAndThread* takeTask(Worker* worker);
+
+    // 随机选择其他工作线程窃取任务
+    FiberAndThread* stealTask(Worker* worker);
 private:
     // Mutex
     MutexType m_mutex;
     // 线程池
     std::vector<Thread::ptr> m_threads;
-    // 待执行的协程队列
-    std::list<FiberAndThread> m_fibers;
+    // 全局注入队列，非工作线程调度的任务以及本地队列满时溢出的任务
+    IntrusiveQueue<FiberAndThread> m_injectQueue;
+    // 工作线程，构造时创建，use_caller时包含调用线程
+    std::vector<Worker*> m_workers;
+    // 所有队列中待执行的任务数量
+    std::atomic<size_t> m_taskCount = {0};
+    // 注入队列中的任务数量
+    std::atomic<size_t> m_injectCount = {0};
+    // 所有信箱中的任务数量
+    std::atomic<size_t> m_pinnedCount = {0};
     // use_caller为true时有效, 调度协程
     Fiber::ptr m_rootFiber;
     // 协程调度器名称
@@ -166,6 +249,8 @@ protected:
     bool m_autoStop = false;
     // 主线程id(use_caller)
     int m_rootThread = 0;
+    // 回调任务是否运行在共享栈协程上
+    std::atomic<bool> m_sharedStack = {false};
 };
 
 // 调度器切换类
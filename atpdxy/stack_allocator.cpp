@@ -0,0 +1,170 @@
+#include "stack_allocator.h"
+#include "config.h"
+#include "log.h"
+#include <atomic>
+#include <map>
+#include <new>
+#include <vector>
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace atpdxy {
+
+static Logger::ptr g_logger = GET_LOGGER_BY_NAME("system");
+
+// 每个线程最多缓存的空闲协程栈数量
+static ConfigVar<uint32_t>::ptr g_fiber_stack_cache_count =
+    Config::Lookup<uint32_t>("fiber.stack_cache_count", 64, "fiber stack cache count per thread");
+
+// 缓存配置值，避免每次分配都去获取配置的读锁
+static std::atomic<uint32_t> s_stack_cache_count {64};
+
+// 统计信息
+static std::atomic<uint64_t> s_hits {0};
+static std::atomic<uint64_t> s_misses {0};
+static std::atomic<uint64_t> s_mapped_bytes {0};
+static std::atomic<uint64_t> s_cached_count {0};
+
+struct _StackAllocatorIniter {
+    _StackAllocatorIniter() {
+        s_stack_cache_count = g_fiber_stack_cache_count->getValue();
+        g_fiber_stack_cache_count->addListener([](const uint32_t& old_value, const uint32_t& new_value){
+            INFO(g_logger) << "fiber stack cache count changed from " << old_value << " to " << new_value;
+            s_stack_cache_count = new_value;
+        });
+    }
+};
+
+// 在main函数前初始化
+static _StackAllocatorIniter s_stack_allocator_initer;
+
+// 映射的总长度：栈大小按页对齐后再加一个保护页
+static size_t MappedSize(size_t size) {
+    size_t page = StackAllocator::GetPageSize();
+    return (size + page - 1) / page * page + page;
+}
+
+// 通过mmap申请一块带保护页的栈，返回保护页之上的可用区域
+static void* MapStack(size_t size) {
+    size_t page = StackAllocator::GetPageSize();
+    size_t total = MappedSize(size);
+    void* base = mmap(nullptr, total, PROT_READ | PROT_WRITE
+            , MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+    if(base == MAP_FAILED) {
+        ERROR(g_logger) << "mmap fiber stack size=" << total << " errno=" << errno
+            << " (" << strerror(errno) << ")";
+        throw std::bad_alloc();
+    }
+    // 栈向低地址增长，保护页放在最低地址处
+    if(mprotect(base, page, PROT_NONE)) {
+        ERROR(g_logger) << "mprotect fiber stack guard errno=" << errno
+            << " (" << strerror(errno) << ")";
+        munmap(base, total);
+        throw std::bad_alloc();
+    }
+    s_mapped_bytes += total;
+    return (char*)base + page;
+}
+
+// 释放栈以及其保护页
+static void UnmapStack(void* vp, size_t size) {
+    size_t total = MappedSize(size);
+    munmap((char*)vp - StackAllocator::GetPageSize(), total);
+    s_mapped_bytes -= total;
+}
+
+// 线程退出时缓存已经析构，此后归还的栈直接释放
+static thread_local bool t_stack_cache_destroyed = false;
+
+// 线程私有的空闲栈缓存，按栈大小分组
+class StackCache {
+public:
+    ~StackCache() {
+        for(auto& i : m_free) {
+            for(auto& vp : i.second) {
+                UnmapStack(vp, i.first);
+            }
+            s_cached_count -= i.second.size();
+        }
+        m_free.clear();
+        m_count = 0;
+        t_stack_cache_destroyed = true;
+    }
+
+    // 从缓存中取出一个栈，没有返回nullptr
+    void* get(size_t size) {
+        auto it = m_free.find(size);
+        if(it == m_free.end() || it->second.empty()) {
+            return nullptr;
+        }
+        void* vp = it->second.back();
+        it->second.pop_back();
+        --m_count;
+        --s_cached_count;
+        return vp;
+    }
+
+    // 将栈放回缓存，超过缓存上限返回false
+    bool put(void* vp, size_t size) {
+        if(m_count >= s_stack_cache_count) {
+            return false;
+        }
+        m_free[size].push_back(vp);
+        ++m_count;
+        ++s_cached_count;
+        return true;
+    }
+private:
+    // 栈大小 -> 空闲栈
+    std::map<size_t, std::vector<void*> > m_free;
+    // 缓存中栈的数量
+    size_t m_count = 0;
+};
+
+static thread_local StackCache t_stack_cache;
+
+void* StackAllocator::Alloc(size_t size) {
+    if(!t_stack_cache_destroyed) {
+        void* vp = t_stack_cache.get(size);
+        if(vp) {
+            ++s_hits;
+            return vp;
+        }
+    }
+    ++s_misses;
+    return MapStack(size);
+}
+
+void StackAllocator::Dealloc(void* vp, size_t size) {
+    if(!vp) {
+        return;
+    }
+    if(t_stack_cache_destroyed || !t_stack_cache.put(vp, size)) {
+        UnmapStack(vp, size);
+    }
+}
+
+uint64_t StackAllocator::GetHits() {
+    return s_hits;
+}
+
+uint64_t StackAllocator::GetMisses() {
+    return s_misses;
+}
+
+uint64_t StackAllocator::GetMappedBytes() {
+    return s_mapped_bytes;
+}
+
+uint64_t StackAllocator::GetCachedCount() {
+    return s_cached_count;
+}
+
+size_t StackAllocator::GetPageSize() {
+    static size_t s_page_size = sysconf(_SC_PAGESIZE);
+    return s_page_size;
+}
+
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace atpdxy {
+
+// 协程栈分配器
+// 使用mmap申请协程栈，并在栈的最低地址处放置一个PROT_NONE的保护页，栈溢出时直接触发段错误而不会破坏相邻内存
+// 释放的栈按线程缓存在空闲链表中，下次创建相同大小的协程时直接复用，缓存数量由fiber.stack_cache_count配置
+class StackAllocator {
+public:
+    // 申请size大小的协程栈，返回可用区域的最低地址
+    static void* Alloc(size_t size);
+
+    // 归还协程栈，size必须和申请时一致
+    static void Dealloc(void* vp, size_t size);
+
+    // 返回从线程缓存中命中的次数
+    static uint64_t GetHits();
+
+    // 返回未命中缓存需要mmap的次数
+    static uint64_t GetMisses();
+
+    // 返回当前所有已映射的协程栈(正在使用的和缓存中的)的地址空间字节数，包含保护页
+    // 栈以MAP_NORESERVE映射，只有被访问过的页才占用物理内存，这里不是常驻内存的大小
+    static uint64_t GetMappedBytes();
+
+    // 返回当前所有线程缓存中空闲栈的数量
+    static uint64_t GetCachedCount();
+
+    // 返回系统页大小
+    static size_t GetPageSize();
+};
+
+}
@@ -0,0 +1,195 @@
+#include "stack_profiler.h"
+#include "mutex.h"
+#include <sstream>
+#include <unordered_map>
+#include <cxxabi.h>
+#include <dlfcn.h>
+#include <stdlib.h>
+
+namespace atpdxy {
+
+// 填充栈的哨兵值，正常的栈数据几乎不会恰好等于它
+static const uint64_t s_canary = 0xDEADBEEFCAFEBABEULL;
+
+// 一个入口的统计和缓存的p99.9
+struct EntryProfile {
+    StackProfiler::Profile profile;
+    size_t p999 = 0;
+};
+
+typedef RWMutex ProfileMutexType;
+
+// 统计表在第一次使用时创建，并且不析构，避免静态对象析构后仍有协程结束时访问
+static ProfileMutexType& GetMutex() {
+    static ProfileMutexType* s_mutex = new ProfileMutexType;
+    return *s_mutex;
+}
+
+static std::unordered_map<const void*, EntryProfile>& GetProfiles() {
+    static std::unordered_map<const void*, EntryProfile>* s_profiles
+        = new std::unordered_map<const void*, EntryProfile>;
+    return *s_profiles;
+}
+
+// 返回使用量所在的桶
+static size_t BucketIndex(size_t used) {
+    if(used < ((size_t)1 << StackProfiler::HISTOGRAM_MIN_SHIFT)) {
+        return 0;
+    }
+    size_t p = 63 - __builtin_clzll(used);
+    size_t sub = (used >> (p - 2)) & (StackProfiler::HISTOGRAM_SUB_BUCKETS - 1);
+    size_t idx = (p - StackProfiler::HISTOGRAM_MIN_SHIFT) * StackProfiler::HISTOGRAM_SUB_BUCKETS + sub + 1;
+    return idx < StackProfiler::HISTOGRAM_BUCKETS ? idx : StackProfiler::HISTOGRAM_BUCKETS - 1;
+}
+
+// 返回桶的上界(不包含)
+static size_t BucketUpper(size_t idx) {
+    if(idx == 0) {
+        return (size_t)1 << StackProfiler::HISTOGRAM_MIN_SHIFT;
+    }
+    size_t p = (idx - 1) / StackProfiler::HISTOGRAM_SUB_BUCKETS + StackProfiler::HISTOGRAM_MIN_SHIFT;
+    size_t sub = (idx - 1) % StackProfiler::HISTOGRAM_SUB_BUCKETS;
+    return (StackProfiler::HISTOGRAM_SUB_BUCKETS + sub + 1) << (p - 2);
+}
+
+size_t StackProfiler::Profile::percentile(double q) const {
+    if(!count) {
+        return 0;
+    }
+    uint64_t rank = (uint64_t)(q * count);
+    if(rank < q * count || rank == 0) {
+        ++rank;
+    }
+    uint64_t sum = 0;
+    for(size_t i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+        sum += buckets[i];
+        if(sum >= rank) {
+            size_t upper = BucketUpper(i);
+            return upper < max ? upper : max;
+        }
+    }
+    return max;
+}
+
+void StackProfiler::Paint(void* stack, size_t size) {
+    uint64_t* p = (uint64_t*)stack;
+    uint64_t* end = p + size / sizeof(uint64_t);
+    while(p < end) {
+        *p++ = s_canary;
+    }
+}
+
+size_t StackProfiler::Measure(const void* stack, size_t size) {
+    const uint64_t* begin = (const uint64_t*)stack;
+    const uint64_t* end = begin + size / sizeof(uint64_t);
+    const uint64_t* p = begin;
+    while(p < end && *p == s_canary) {
+        ++p;
+    }
+    return (end - p) * sizeof(uint64_t);
+}
+
+void StackProfiler::Record(const void* entry, size_t used, size_t stacksize) {
+    // 擦除了目标的任务没有入口，不同函数的样本混在一起没有意义
+    if(!entry) {
+        return;
+    }
+    ProfileMutexType::WriteLock lock(GetMutex());
+    EntryProfile& ep = GetProfiles()[entry];
+    Profile& p = ep.profile;
+    ++p.count;
+    ++p.buckets[BucketIndex(used)];
+    if(used > p.max) {
+        p.max = used;
+    }
+    p.stacksize = stacksize;
+    // 分位数每积累一批样本才重新计算，创建协程时只读缓存的值
+    if(p.count % ADAPTIVE_MIN_SAMPLES == 0) {
+        ep.p999 = p.percentile(0.999);
+    }
+}
+
+size_t StackProfiler::GetAdaptiveSize(const void* entry, size_t def, uint32_t headroom) {
+    if(!entry) {
+        return def;
+    }
+    size_t p999 = 0;
+    {
+        ProfileMutexType::ReadLock lock(GetMutex());
+        auto& profiles = GetProfiles();
+        auto it = profiles.find(entry);
+        if(it == profiles.end() || it->second.profile.count < ADAPTIVE_MIN_SAMPLES) {
+            return def;
+        }
+        p999 = it->second.p999;
+    }
+    size_t want = p999 + p999 * headroom / 100;
+    size_t size = ADAPTIVE_MIN_SIZE;
+    while(size < want && size < def) {
+        size <<= 1;
+    }
+    return size < def ? size : def;
+}
+
+bool StackProfiler::GetProfile(const void* entry, Profile& profile) {
+    ProfileMutexType::ReadLock lock(GetMutex());
+    auto& profiles = GetProfiles();
+    auto it = profiles.find(entry);
+    if(it == profiles.end()) {
+        return false;
+    }
+    profile = it->second.profile;
+    return true;
+}
+
+std::string StackProfiler::GetEntryName(const void* entry) {
+    Dl_info info;
+    if(entry && dladdr(entry, &info) && info.dli_sname) {
+        int status = 0;
+        char* v = abi::__cxa_demangle(info.dli_sname, nullptr, nullptr, &status);
+        if(v) {
+            std::string result(v);
+            free(v);
+            return result;
+        }
+        return info.dli_sname;
+    }
+    std::stringstream ss;
+    ss << entry;
+    return ss.str();
+}
+
+std::string StackProfiler::Dump() {
+    std::unordered_map<const void*, Profile> profiles;
+    {
+        ProfileMutexType::ReadLock lock(GetMutex());
+        for(auto& i : GetProfiles()) {
+            profiles[i.first] = i.second.profile;
+        }
+    }
+    // 符号解析较慢，在锁外进行
+    std::stringstream ss;
+    for(auto& i : profiles) {
+        const Profile& p = i.second;
+        ss << "entry=" << GetEntryName(i.first)
+           << " count=" << p.count
+           << " max=" << p.max
+           << " p50=" << p.percentile(0.5)
+           << " p99=" << p.percentile(0.99)
+           << " p99.9=" << p.percentile(0.999)
+           << " stacksize=" << p.stacksize << std::endl;
+        for(size_t j = 0; j < HISTOGRAM_BUCKETS; ++j) {
+            if(p.buckets[j]) {
+                ss << "    <" << BucketUpper(j) << ": " << p.buckets[j] << std::endl;
+            }
+        }
+    }
+    return ss.str();
+}
+
+void StackProfiler::Reset() {
+    ProfileMutexType::WriteLock lock(GetMutex());
+    GetProfiles().clear();
+}
+
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+namespace atpdxy {
+
+// 协程栈使用量的统计
+// 开启fiber.stack_paint后，新分配的协程栈先填满哨兵值，协程结束时从栈底向上找到第一个被改写的位置，得到栈的峰值使用量
+// 峰值按协程入口(见Task::GetEntry)聚合成直方图，开启fiber.stack_adaptive后，新协程的栈大小由该入口的p99.9加上余量决定
+// 没有入口的任务(std::bind等擦除了目标的可调用对象)不统计，始终使用配置的栈大小
+class StackProfiler {
+public:
+    // 直方图从1KB开始，每个2的幂区间再分成4个子区间
+    static const size_t HISTOGRAM_MIN_SHIFT = 10;
+    static const size_t HISTOGRAM_SUB_BUCKETS = 4;
+    // 第0个桶为不超过1KB，最大到2^30
+    static const size_t HISTOGRAM_BUCKETS = (30 - HISTOGRAM_MIN_SHIFT) * HISTOGRAM_SUB_BUCKETS + 1;
+    // 样本数达到该值之后才按统计结果调整栈大小
+    static const uint64_t ADAPTIVE_MIN_SAMPLES = 64;
+    // 调整后的最小栈大小
+    static const size_t ADAPTIVE_MIN_SIZE = 16 * 1024;
+
+    // 一个入口的栈使用量统计
+    struct Profile {
+        // 样本数
+        uint64_t count = 0;
+        // 峰值使用量的最大值
+        size_t max = 0;
+        // 最近一次采样时协程栈的大小
+        size_t stacksize = 0;
+        // 各个桶的样本数
+        uint64_t buckets[HISTOGRAM_BUCKETS] = {};
+
+        // 返回分位数q(0~1)所在桶的上界
+        size_t percentile(double q) const;
+    };
+
+    // 用哨兵值填满[stack, stack + size)
+    static void Paint(void* stack, size_t size);
+
+    // 返回栈的峰值使用量，栈向低地址增长，从最低地址向上第一个不是哨兵值的位置之上都被使用过
+    static size_t Measure(const void* stack, size_t size);
+
+    // 记录entry一次运行的栈峰值使用量，entry为空时忽略
+    static void Record(const void* entry, size_t used, size_t stacksize);
+
+    // 返回entry建议的栈大小：p99.9乘以(100 + headroom)%，向上取整到2的幂，不小于ADAPTIVE_MIN_SIZE，不超过def
+    // entry为空或者样本不足时返回def
+    static size_t GetAdaptiveSize(const void* entry, size_t def, uint32_t headroom);
+
+    // 获取entry的统计，没有样本返回false
+    static bool GetProfile(const void* entry, Profile& profile);
+
+    // 返回入口的符号名，无法解析时返回地址
+    static std::string GetEntryName(const void* entry);
+
+    // 按入口导出统计：样本数、最大值、分位数以及非空的桶
+    static std::string Dump();
+
+    // 清空所有统计
+    static void Reset();
+};
+
+}
@@ -0,0 +1,263 @@
+#pragma once
+
+#include <stddef.h>
+#include <functional>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace atpdxy {
+
+// 只能移动的回调任务
+// 不超过内联缓冲区大小且移动不抛异常的可调用对象直接存放在对象内部，调度时不需要申请堆内存
+// 更大的可调用对象退回到堆上，移动时只移动指针
+class Task {
+public:
+    // 内联缓冲区大小，可以容纳std::function、std::bind以及捕获了几个指针的lambda
+    static const size_t INLINE_SIZE = 48;
+
+    Task() {}
+
+    Task(std::nullptr_t) {}
+
+    // 从任意可调用对象构造，空的函数指针或std::function构造出空任务
+    template<class F, class = typename std::enable_if<
+        !std::is_same<typename std::decay<F>::type, Task>::value>::type>
+    Task(F&& f) {
+        typedef typename std::decay<F>::type Fn;
+        if(IsNull(f)) {
+            return;
+        }
+        construct<Fn>(std::forward<F>(f), std::integral_constant<bool,
+                sizeof(Fn) <= INLINE_SIZE
+                && alignof(Fn) <= alignof(Storage)
+                && std::is_nothrow_move_constructible<Fn>::value>());
+    }
+
+    Task(Task&& rhs) {
+        moveFrom(rhs);
+    }
+
+    Task& operator=(Task&& rhs) {
+        if(this != &rhs) {
+            reset();
+            moveFrom(rhs);
+        }
+        return *this;
+    }
+
+    Task& operator=(std::nullptr_t) {
+        reset();
+        return *this;
+    }
+
+    Task(const Task&) = delete;
+    Task& operator=(const Task&) = delete;
+
+    ~Task() {
+        reset();
+    }
+
+    // 执行任务
+    void operator()() {
+        m_ops->invoke(&m_storage);
+    }
+
+    // 是否为空任务
+    explicit operator bool() const { return m_ops != nullptr;}
+
+    // 清空任务
+    void reset() {
+        if(m_ops) {
+            m_ops->destroy(&m_storage);
+            m_ops = nullptr;
+        }
+    }
+
+    // 交换两个任务
+    void swap(Task& rhs) {
+        Task tmp(std::move(rhs));
+        rhs = std::move(*this);
+        *this = std::move(tmp);
+    }
+
+    // 可调用对象是否存放在内联缓冲区中
+    bool isInline() const { return m_ops && m_ops->inline_storage;}
+
+    // 返回任务的入口，用于按入口聚合协程栈的使用量，见GetEntry
+    const void* getEntry() const { return m_ops ? m_ops->entry(&m_storage) : nullptr;}
+
+    // 返回可调用对象的入口，可以通过dladdr解析出符号
+    // 函数指针和包装了函数指针的std::function返回函数地址，std::bind以及包装了其他对象的std::function
+    // 擦除了真正的目标，返回nullptr，不参与统计；提供getEntry()的包装对象返回它包装的任务的入口；
+    // 其他可调用对象按类型区分
+    template<class F>
+    static const void* GetEntry(const F& f) { return EntryOf(f, 0);}
+private:
+    typedef typename std::aligned_storage<INLINE_SIZE, 16>::type Storage;
+
+    // 类型擦除后的操作
+    struct Ops {
+        // 调用
+        void (*invoke)(void* p);
+        // 移动构造到dst并析构src
+        void (*move)(void* dst, void* src);
+        // 析构
+        void (*destroy)(void* p);
+        // 返回入口
+        const void* (*entry)(const void* p);
+        // 是否内联存放
+        bool inline_storage;
+    };
+
+    // 内联存放的可调用对象
+    template<class Fn>
+    struct InlineOps {
+        static void invoke(void* p) { (*(Fn*)p)();}
+        static void move(void* dst, void* src) {
+            new (dst) Fn(std::move(*(Fn*)src));
+            ((Fn*)src)->~Fn();
+        }
+        static void destroy(void* p) { ((Fn*)p)->~Fn();}
+        static const void* entry(const void* p) { return GetEntry(*(const Fn*)p);}
+        static const Ops ops;
+    };
+
+    // 堆上存放的可调用对象，缓冲区中只保存指针
+    template<class Fn>
+    struct HeapOps {
+        static void invoke(void* p) { (**(Fn**)p)();}
+        static void move(void* dst, void* src) { *(Fn**)dst = *(Fn**)src;}
+        static void destroy(void* p) { delete *(Fn**)p;}
+        static const void* entry(const void* p) { return GetEntry(**(Fn* const*)p);}
+        static const Ops ops;
+    };
+
+    template<class Fn, class F>
+    void construct(F&& f, std::true_type) {
+        new (&m_storage) Fn(std::forward<F>(f));
+        m_ops = &InlineOps<Fn>::ops;
+    }
+
+    template<class Fn, class F>
+    void construct(F&& f, std::false_type) {
+        *(Fn**)&m_storage = new Fn(std::forward<F>(f));
+        m_ops = &HeapOps<Fn>::ops;
+    }
+
+    void moveFrom(Task& rhs) {
+        if(rhs.m_ops) {
+            rhs.m_ops->move(&m_storage, &rhs.m_storage);
+            m_ops = rhs.m_ops;
+            rhs.m_ops = nullptr;
+        }
+    }
+
+    // 包装对象转发到它包装的任务
+    template<class F>
+    static auto EntryOf(const F& f, int) -> decltype(f.getEntry()) { return f.getEntry();}
+
+    // 同一类型的对象使用同一个调用函数的地址，不论内联还是堆上存放
+    template<class F>
+    static const void* EntryOf(const F&, long) {
+        return std::is_bind_expression<F>::value ? nullptr
+            : reinterpret_cast<const void*>(&InlineOps<F>::invoke);
+    }
+
+    template<class R, class... Args>
+    static const void* EntryOf(R (*f)(Args...), int) { return reinterpret_cast<const void*>(f);}
+
+    template<class Sig>
+    static const void* EntryOf(const std::function<Sig>& f, int) {
+        typedef typename std::add_pointer<Sig>::type Fp;
+        const Fp* fp = f.template target<Fp>();
+        return fp ? reinterpret_cast<const void*>(*fp) : nullptr;
+    }
+
+    template<class F>
+    static bool IsNull(const F&) { return false;}
+
+    template<class R, class... Args>
+    static bool IsNull(R (*f)(Args...)) { return f == nullptr;}
+
+    template<class Sig>
+    static bool IsNull(const std::function<Sig>& f) { return !f;}
+private:
+    // 内联缓冲区
+    Storage m_storage;
+    // 操作表，为空表示空任务
+    const Ops* m_ops = nullptr;
+};
+
+template<class Fn>
+const Task::Ops Task::InlineOps<Fn>::ops = {
+    &Task::InlineOps<Fn>::invoke, &Task::InlineOps<Fn>::move, &Task::InlineOps<Fn>::destroy
+    , &Task::InlineOps<Fn>::entry, true};
+
+template<class Fn>
+const Task::Ops Task::HeapOps<Fn>::ops = {
+    &Task::HeapOps<Fn>::invoke, &Task::HeapOps<Fn>::move, &Task::HeapOps<Fn>::destroy
+    , &Task::HeapOps<Fn>::entry, false};
+
+// 侵入式先进先出队列，元素通过自身的next指针串联，入队出队不申请内存
+// 不是线程安全的，由使用者加锁
+template<class T>
+class IntrusiveQueue {
+public:
+    // 队尾插入一个元素
+    void push(T* v) {
+        v->next = nullptr;
+        if(m_tail) {
+            m_tail->next = v;
+        } else {
+            m_head = v;
+        }
+        m_tail = v;
+        ++m_size;
+    }
+
+    // 队尾插入一串已经通过next串联好的元素
+    void append(T* head, T* tail, size_t n) {
+        if(!head) {
+            return;
+        }
+        tail->next = nullptr;
+        if(m_tail) {
+            m_tail->next = head;
+        } else {
+            m_head = head;
+        }
+        m_tail = tail;
+        m_size += n;
+    }
+
+    // 弹出队头元素，队列为空返回nullptr
+    T* pop() {
+        T* v = m_head;
+        if(v) {
+            m_head = v->next;
+            if(!m_head) {
+                m_tail = nullptr;
+            }
+            v->next = nullptr;
+            --m_size;
+        }
+        return v;
+    }
+
+    // 返回元素数量
+    size_t size() const { return m_size;}
+
+    // 返回是否为空
+    bool empty() const { return m_size == 0;}
+private:
+    // 队头
+    T* m_head = nullptr;
+    // 队尾
+    T* m_tail = nullptr;
+    // 元素数量
+    size_t m_size = 0;
+};
+
+}
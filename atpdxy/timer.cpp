@@ -1,69 +1,430 @@
 #include "timer.h"
 #include "util.h"
+#include <string.h>
 
 namespace atpdxy {
-bool Timer::Comparator::operator()(const Timer::ptr& lhs, const Timer::ptr& rhs) const {
-    if(!lhs && !rhs) {
-        return false;
-    }
-    if(!lhs) {
-        return true;
+namespace {
+
+// 循环定时器的回调，多次到期共享同一个回调函数
+struct SharedCallback {
+    std::shared_ptr<Task> cb;
+
+    void operator()() {
+        (*cb)();
     }
-    if(!rhs) {
-        return false;
+
+    // 栈使用量按回调函数统计
+    const void* getEntry() const { return cb->getEntry();}
+};
+
+// 条件定时器的回调，条件对象已经释放时不执行
+struct ConditionCallback {
+    std::weak_ptr<void> cond;
+    Task cb;
+
+    void operator()() {
+        std::shared_ptr<void> tmp = cond.lock();
+        if(tmp) {
+            cb();
+        }
     }
-    if(lhs->m_next  < rhs->m_next) {
-        return true;
+
+    const void* getEntry() const { return cb.getEntry();}
+};
+
+// 在nbits位的位图中从from开始循环查找第一个置位的位，返回它到from的距离，没有返回-1
+int FindNextBit(const uint64_t* bits, int nbits, int from) {
+    int words = nbits / 64;
+    int w = from >> 6;
+    uint64_t word = bits[w] & (~0ull << (from & 63));
+    // 多检查一次起始的字，覆盖from之前的位
+    for(int i = 0; i <= words; ++i) {
+        if(word) {
+            int bit = (w << 6) + __builtin_ctzll(word);
+            return (bit - from + nbits) % nbits;
+        }
+        w = (w + 1) % words;
+        word = bits[w];
     }
-    if(rhs->m_next < lhs->m_next) {
-        return false;
+    return -1;
+}
+
+// 第level层每个槽对应的时间跨度的位数
+inline int LevelShift(int level) {
+    return level == 0 ? 0 : 8 + 6 * (level - 1);
+}
+
+// 允许延迟的定时器把到期时间向上对齐到不超过slack的2的幂，
+// 到期时间相近的定时器落在同一个时间点，一次推进一起取出，也只需要一次唤醒
+inline uint64_t AlignedExpire(uint64_t next, uint64_t slack) {
+    if(slack < 2) {
+        return next;
     }
-    return lhs.get() < rhs.get();
+    uint64_t granularity = 1ull << (63 - __builtin_clzll(slack));
+    return (next + granularity - 1) & ~(granularity - 1);
+}
+
+// 毫秒转换成微秒，过大的值截断，避免加上当前时间后溢出
+inline uint64_t MsToUs(uint64_t ms) {
+    static const uint64_t MAX_US = ~0ull >> 1;
+    return ms >= MAX_US / 1000 ? MAX_US : ms * 1000;
 }
 
-Timer::Timer(uint64_t ms, std::function<void()> cb, bool recurring, TimerManager* manager):
+}
+
+// 定时器在分片的收件箱中
+static const int SLOT_INBOX = -2;
+
+// 一个分片的分层时间轮，时间轮只在持有mutex时访问，收件箱可以不加锁放入
+struct TimerManager::Shard {
+    // 第0层的槽数
+    static const int WHEEL0_BITS = 8;
+    static const int WHEEL0_SIZE = 1 << WHEEL0_BITS;
+    // 第1到4层的槽数
+    static const int WHEELN_BITS = 6;
+    static const int WHEELN_SIZE = 1 << WHEELN_BITS;
+    // 层数
+    static const int WHEEL_LEVELS = 5;
+    // 所有槽的数量
+    static const int SLOT_COUNT = WHEEL0_SIZE + WHEELN_SIZE * (WHEEL_LEVELS - 1);
+
+    Shard(TimerManager* manager, size_t index);
+
+    ~Shard();
+
+    // 新建的定时器放入收件箱，返回是否需要唤醒等待的线程
+    bool push(Timer::ptr val);
+
+    // 把收件箱中的定时器全部放入时间轮，需要持有mutex
+    void drain();
+
+    // 把定时器放入时间轮，返回是否需要唤醒等待的线程，需要持有mutex
+    bool insert(Timer::ptr val);
+
+    // 到最近一个定时器的时间差，owner表示调用者是等待该分片定时器的线程
+    uint64_t nextTimerUS(bool owner);
+
+    // 取出到now_us为止已经超时的定时器的回调函数
+    void listExpiredCb(std::vector<Task>& cbs, uint64_t now_us);
+
+    // 是否有定时器，不需要加锁
+    bool hasTimer() const { return count != 0 || inbox.load() != nullptr;}
+
+    // 按到期时间把定时器挂到时间轮的槽上
+    void link(Timer* timer);
+
+    // 把定时器从所在的槽上摘下
+    void unlink(Timer* timer);
+
+    // 把高层的一个槽中的定时器重新放入时间轮
+    void cascade(int slot);
+
+    // 把一个槽中的定时器全部取出，回调函数放入cbs
+    void expireSlot(int slot, std::vector<Task>& cbs);
+
+    // 推进时间轮到now_us，到期的定时器的回调函数放入cbs
+    void advance(uint64_t now_us, std::vector<Task>& cbs);
+
+    // 返回下一个需要处理的时间点，可能早于实际最早的定时器
+    uint64_t nextTick() const;
+
+    MutexType mutex;
+    // 所在的管理器
+    TimerManager* manager;
+    // 分片下标
+    size_t index;
+    // 时间轮的槽，每个槽是一个双向链表，先是第0层，然后依次是第1到4层
+    Timer* slots[SLOT_COUNT];
+    // 非空槽的位图，快速跳过空槽
+    uint64_t bitmap[SLOT_COUNT / 64];
+    // 时间轮中定时器的数量，hasTimer不加锁读取
+    std::atomic<size_t> count = {0};
+    // 已经处理到的时间点，到期时间不晚于它的定时器放在下一个时间点的槽中
+    uint64_t current = 0;
+    // 本轮到期需要重新挂上的循环定时器，复用容量
+    std::vector<Timer::ptr> recurringList;
+    // 是否触发了onTimerInsertedAtFront
+    bool tickled = false;
+    // 等待定时器的线程醒来的时间点，更早的定时器插入时需要唤醒它
+    // 为0表示等待的线程正在取走收件箱并计算超时时间，这期间放入收件箱的定时器都要唤醒它
+    std::atomic<uint64_t> earliest = {~0ull};
+    // 其他线程新建的定时器，无锁的后进先出栈，通过Timer::m_nextTimer串联
+    std::atomic<Timer*> inbox = {nullptr};
+};
+
+Timer::Timer(uint64_t us, Task cb, bool recurring, TimerManager* manager, size_t shard):
     m_recurring(recurring),
-    m_ms(ms),
-    m_cb(cb),
-    m_manager(manager) {
-    m_next = GetCurrentMS() + m_ms;
+    m_period(us),
+    m_cb(std::move(cb)),
+    m_manager(manager),
+    m_shard(shard) {
+    m_next = GetMonotonicUS() + m_period;
+    if(m_recurring && m_cb) {
+        m_sharedCb = std::make_shared<Task>(std::move(m_cb));
+        m_cb = Task(SharedCallback{m_sharedCb});
+    }
+}
+
+TimerManager::Shard::Shard(TimerManager* manager, size_t index)
+    :manager(manager)
+    ,index(index) {
+    memset(slots, 0, sizeof(slots));
+    memset(bitmap, 0, sizeof(bitmap));
+    current = GetMonotonicUS() - 1;
+}
+
+TimerManager::Shard::~Shard() {
+    drain();
+    // 打断定时器对自身的引用
+    for(int i = 0; i < SLOT_COUNT; ++i) {
+        Timer* timer = slots[i];
+        while(timer) {
+            Timer* next = timer->m_nextTimer;
+            timer->m_slot = -1;
+            timer->m_prevTimer = timer->m_nextTimer = nullptr;
+            timer->m_self.reset();
+            timer = next;
+        }
+    }
+}
+
+// 新建的定时器放入收件箱
+bool TimerManager::Shard::push(Timer::ptr val) {
+    Timer* timer = val.get();
+    timer->m_self = std::move(val);
+    timer->m_slot = SLOT_INBOX;
+    timer->m_inbox.store(1, std::memory_order_relaxed);
+    uint64_t expire = AlignedExpire(timer->m_next, timer->m_slack);
+    Timer* head = inbox.load(std::memory_order_relaxed);
+    do {
+        timer->m_nextTimer = head;
+    } while(!inbox.compare_exchange_weak(head, timer, std::memory_order_seq_cst
+                                         , std::memory_order_relaxed));
+    // 放入之后再读取醒来的时间点，和nextTimerUS先把它置0再取走收件箱配对，需要顺序一致，x86上没有额外开销
+    // 对方取走之前放入的会被取走，之后放入的读到0或者新的时间点，不会漏掉唤醒
+    // 唤醒时把时间点提前到本定时器，之后更晚的定时器不再重复唤醒
+    uint64_t wake = earliest.load();
+    while(wake != 0 && expire < wake) {
+        if(earliest.compare_exchange_weak(wake, expire)) {
+            return true;
+        }
+    }
+    return wake == 0;
+}
+
+// 把收件箱中的定时器全部放入时间轮
+void TimerManager::Shard::drain() {
+    if(!inbox.load()) {
+        return;
+    }
+    Timer* timer = inbox.exchange(nullptr, std::memory_order_acquire);
+    if(count == 0) {
+        // 时间轮为空时直接跳到当前时间，避免下次推进时逐圈走过空闲的时间
+        uint64_t now_us = GetMonotonicUS();
+        if(now_us > current + 1) {
+            current = now_us - 1;
+        }
+    }
+    // 收件箱中的顺序和到期时间无关，逐个挂上即可
+    while(timer) {
+        Timer* next = timer->m_nextTimer;
+        timer->m_nextTimer = nullptr;
+        int expected = 1;
+        if(timer->m_inbox.compare_exchange_strong(expected, 0, std::memory_order_acq_rel)) {
+            link(timer);
+        } else {
+            // 在收件箱中已经被取消，和加锁取消一样在锁内清空回调函数
+            timer->m_inbox.store(0, std::memory_order_relaxed);
+            timer->m_cb = nullptr;
+            timer->m_sharedCb.reset();
+            timer->m_slot = -1;
+            timer->m_self.reset();
+        }
+        timer = next;
+    }
+}
+
+// 把定时器放入时间轮
+bool TimerManager::Shard::insert(Timer::ptr val) {
+    if(count == 0) {
+        uint64_t now_us = GetMonotonicUS();
+        if(now_us > current + 1) {
+            current = now_us - 1;
+        }
+    }
+    Timer* timer = val.get();
+    timer->m_self = std::move(val);
+    link(timer);
+    // 比等待中的线程醒来的时间更早才需要唤醒，允许延迟的定时器按对齐后的时间判断
+    uint64_t expire = AlignedExpire(timer->m_next, timer->m_slack);
+    bool at_front = expire < earliest && !tickled;
+    if(expire < earliest) {
+        earliest = expire;
+    }
+    if(at_front) {
+        tickled = true;
+    }
+    return at_front;
+}
+
+// 到最近一个定时器的时间差
+uint64_t TimerManager::Shard::nextTimerUS(bool owner) {
+    MutexType::Lock lock(mutex);
+    if(owner) {
+        earliest = 0;
+    }
+    drain();
+    uint64_t next = nextTick();
+    // 只有等待该分片的线程更新醒来的时间点，其他线程的查询不影响唤醒判断
+    if(owner) {
+        tickled = false;
+        earliest = next;
+    }
+    lock.unlock();
+    // 时间轮为空，返回最大值
+    if(next == ~0ull) {
+        return ~0ull;
+    }
+    uint64_t now_us = GetMonotonicUS();
+    // 已经到了需要处理的时间点，可能是定时器到期，也可能是高层的槽需要下沉
+    if(now_us >= next) {
+        return 0;
+    } else {
+        return next - now_us;
+    }
+}
+
+// 取出到now_us为止已经超时的定时器的回调函数
+void TimerManager::Shard::listExpiredCb(std::vector<Task>& cbs, uint64_t now_us) {
+    if(!hasTimer()) {
+        return;
+    }
+    MutexType::Lock lock(mutex);
+    drain();
+    if(count == 0) {
+        return;
+    }
+    // 定时器使用单调时钟，不会因为系统时间被修改而回退
+    advance(now_us, cbs);
+    // 全部取出后再重新挂上循环定时器，周期为0的定时器放在下一个时间点，不会被重复取出
+    for(auto& timer : recurringList) {
+        Timer* raw = timer.get();
+        raw->m_next = now_us + raw->m_period;
+        raw->m_self = std::move(timer);
+        link(raw);
+    }
+    recurringList.clear();
 }
 
 TimerManager::TimerManager() {
-    m_previousTime = GetCurrentMS();
+    m_shards.push_back(new Shard(this, 0));
 }
 
 TimerManager::~TimerManager() {
+    for(auto shard : m_shards) {
+        delete shard;
+    }
+}
+
+// 设置分片数量
+void TimerManager::setTimerShards(size_t count) {
+    for(auto shard : m_shards) {
+        delete shard;
+    }
+    m_shards.clear();
+    for(size_t i = 0; i < (count ? count : 1); ++i) {
+        m_shards.push_back(new Shard(this, i));
+    }
+}
+
+// 返回当前线程拥有的分片
+TimerManager::Shard* TimerManager::getLocalShard() {
+    int index = getCurrentTimerShard();
+    if(index < 0 || index >= (int)m_shards.size()) {
+        return nullptr;
+    }
+    return m_shards[index];
+}
 
+// 不拥有分片的线程选择一个分片，只有一个分片时不需要竞争计数器
+size_t TimerManager::nextShard() {
+    return m_shards.size() == 1 ? 0 : m_nextShard++ % m_shards.size();
 }
 
 // 添加定时器
-Timer::ptr TimerManager::addTimer(uint64_t ms, std::function<void()> cb, bool recurring) {
-    Timer::ptr timer(new Timer(ms, cb, recurring, this));
-    RWMutexType::WriteLock lock(m_mutex);
-    addTimer(timer, lock);
-    return timer;
+Timer::ptr TimerManager::addTimer(uint64_t ms, Task cb, bool recurring, uint64_t slack_ms) {
+    return addTimerUS(MsToUs(ms), std::move(cb), recurring, MsToUs(slack_ms));
 }
 
-static void OnTimer(std::weak_ptr<void> weak_cond, std::function<void()> cb) {
-    std::shared_ptr<void> tmp = weak_cond.lock();
-    if(tmp) {
-        cb();
-    }
+// 添加微秒精度的定时器
+Timer::ptr TimerManager::addTimerUS(uint64_t us, Task cb, bool recurring, uint64_t slack_us) {
+    Shard* local = getLocalShard();
+    size_t shard = local ? local->index : nextShard();
+    Timer::ptr timer(new Timer(us, std::move(cb), recurring, this, shard));
+    timer->m_slack = slack_us;
+    return insertTimer(timer);
 }
 
 // 添加定时器加上环境依赖
-Timer::ptr TimerManager::addConditionTimer(uint64_t ms, std::function<void()> cb, std::weak_ptr<void> weak_cond, bool recurring) {
-    return addTimer(ms, std::bind(&OnTimer, weak_cond, cb), recurring);
-}   
+Timer::ptr TimerManager::addConditionTimer(uint64_t ms, Task cb, std::weak_ptr<void> weak_cond
+                                           , bool recurring, uint64_t slack_ms) {
+    return addTimer(ms, Task(ConditionCallback{std::move(weak_cond), std::move(cb)}), recurring, slack_ms);
+}
+
+// 创建一个没有启动的定时器
+Timer::ptr TimerManager::createTimer(Task cb, uint64_t slack_ms) {
+    Shard* local = getLocalShard();
+    size_t shard = local ? local->index : nextShard();
+    Timer::ptr timer(new Timer(0, nullptr, false, this, shard));
+    timer->m_reusable = true;
+    timer->m_slack = MsToUs(slack_ms);
+    if(cb) {
+        timer->m_sharedCb = std::make_shared<Task>(std::move(cb));
+        timer->m_cb = Task(SharedCallback{timer->m_sharedCb});
+    }
+    return timer;
+}
+
+// 把新建的定时器放入分片
+Timer::ptr TimerManager::insertTimer(Timer::ptr timer) {
+    Shard* shard = m_shards[timer->m_shard];
+    if(shard == getLocalShard()) {
+        // 自己的分片只有跨线程取消定时器时才会竞争锁
+        MutexType::Lock lock(shard->mutex);
+        bool at_front = shard->insert(timer);
+        lock.unlock();
+        if(at_front) {
+            onTimerInsertedAtFront(shard->index);
+        }
+    } else if(shard->push(timer)) {
+        // 比分片的线程醒来的时间更早才唤醒，它醒来后会取走收件箱
+        onTimerInsertedAtFront(shard->index);
+    }
+    return timer;
+}
 
 // 取消当前定时器
 bool Timer::cancel() {
-    TimerManager::RWMutexType::WriteLock lock(m_manager->m_mutex);
+    // 还在收件箱中时只做标记，回调函数由取走收件箱的线程在锁内清空，
+    // 和取走收件箱的线程通过状态的交换决定由谁处理
+    int expected = 1;
+    if(m_inbox.compare_exchange_strong(expected, 2, std::memory_order_acq_rel)) {
+        return true;
+    }
+    TimerManager::Shard* shard = m_manager->m_shards[m_shard];
+    TimerManager::MutexType::Lock lock(shard->mutex);
+    if(m_slot == SLOT_INBOX) {
+        shard->drain();
+    }
     if(m_cb) {
         m_cb = nullptr;
-        auto it = m_manager->m_timers.find(shared_from_this());
-        m_manager->m_timers.erase(it);
+        m_sharedCb.reset();
+        // 放到锁的后面析构，定时器可能在这里被释放
+        Timer::ptr self;
+        if(m_slot != -1) {
+            shard->unlink(this);
+            self.swap(m_self);
+        }
         return true;
     }
     return false;
@@ -71,145 +432,313 @@ bool Timer::cancel() {
 
 // 刷新定时器执行时间
 bool Timer::refresh() {
-    TimerManager::RWMutexType::WriteLock lock(m_manager->m_mutex);
-    // 没有回调函数刷新执行时间没意义，则直接返回
-    if(!m_cb) {
-        return false;
+    TimerManager::Shard* shard = m_manager->m_shards[m_shard];
+    TimerManager::MutexType::Lock lock(shard->mutex);
+    if(m_slot == SLOT_INBOX) {
+        shard->drain();
     }
-    auto it = m_manager->m_timers.find(shared_from_this());
-    if(it == m_manager->m_timers.end()) {
+    // 没有回调函数刷新执行时间没意义，则直接返回
+    if(!m_cb || m_slot == -1) {
         return false;
     }
-    // 先删除后插入是由于定时器需要重新排序
-    m_manager->m_timers.erase(it);
-    m_next = GetCurrentMS() + m_ms;
-    m_manager->m_timers.insert(shared_from_this());
+    // 先摘下后挂上是由于定时器所在的槽需要重新计算
+    shard->unlink(this);
+    m_next = GetMonotonicUS() + m_period;
+    shard->link(this);
     return true;
 }
 
 // 重置定时器间隔，是否从当前时间开始
 bool Timer::reset(uint64_t ms, bool from_now) {
-    if(m_ms == ms && !from_now) {
+    uint64_t us = MsToUs(ms);
+    if(m_period == us && !from_now) {
         return true;
     }
-    TimerManager::RWMutexType::WriteLock lock(m_manager->m_mutex);
-    if(!m_cb) {
-        return false;
+    TimerManager::Shard* shard = m_manager->m_shards[m_shard];
+    TimerManager::MutexType::Lock lock(shard->mutex);
+    if(m_slot == SLOT_INBOX) {
+        shard->drain();
     }
-    auto it = m_manager->m_timers.find(shared_from_this());
-    if(it == m_manager->m_timers.end()) {
+    if(!m_cb || m_slot == -1) {
         return false;
     }
-    m_manager->m_timers.erase(it);
+    shard->unlink(this);
     uint64_t start = 0;
     if(from_now) {
-        start = GetCurrentMS();
+        start = GetMonotonicUS();
     } else {
-        start = m_next - m_ms;
+        start = m_next - m_period;
+    }
+    m_period = us;
+    m_next = start + m_period;
+    Timer::ptr self;
+    self.swap(m_self);
+    bool at_front = shard->insert(std::move(self));
+    lock.unlock();
+    if(at_front) {
+        m_manager->onTimerInsertedAtFront(m_shard);
     }
-    m_ms = ms;
-    m_next = start + m_ms;
-    m_manager->addTimer(shared_from_this(), lock);
     return true;
 }
 
-Timer::Timer(uint64_t next):
-    m_next(next) {
+// 从当前时间开始ms毫秒后到期
+bool Timer::restart(uint64_t ms) {
+    return restartUS(MsToUs(ms));
+}
 
+// 从当前时间开始us微秒后到期
+bool Timer::restartUS(uint64_t us) {
+    TimerManager::Shard* shard = m_manager->m_shards[m_shard];
+    TimerManager::MutexType::Lock lock(shard->mutex);
+    if(m_slot == SLOT_INBOX) {
+        shard->drain();
+    }
+    if(!m_cb) {
+        return false;
+    }
+    Timer::ptr self;
+    if(m_slot != -1) {
+        shard->unlink(this);
+        self.swap(m_self);
+    } else {
+        self = shared_from_this();
+    }
+    m_period = us;
+    m_next = GetMonotonicUS() + m_period;
+    bool at_front = shard->insert(std::move(self));
+    lock.unlock();
+    if(at_front) {
+        m_manager->onTimerInsertedAtFront(m_shard);
+    }
+    return true;
 }
 
-// 到最近一个定时器的时间差
+// 停止定时器但保留回调函数
+bool Timer::stop() {
+    TimerManager::Shard* shard = m_manager->m_shards[m_shard];
+    TimerManager::MutexType::Lock lock(shard->mutex);
+    if(m_slot == SLOT_INBOX) {
+        shard->drain();
+    }
+    if(m_slot == -1) {
+        return false;
+    }
+    shard->unlink(this);
+    // 放到锁的后面析构，定时器可能在这里被释放
+    Timer::ptr self;
+    self.swap(m_self);
+    return true;
+}
+
+// 到最近一个定时器的时间差，毫秒
 uint64_t TimerManager::getNextTimer() {
-    RWMutexType::ReadLock lock(m_mutex);
-    m_tickled = false;
-    // 定时器容器为空，返回最大值
-    if(m_timers.empty()) {
+    uint64_t us = getNextTimerUS();
+    if(us == ~0ull) {
         return ~0ull;
     }
-    const Timer::ptr& next = *m_timers.begin();
-    uint64_t now_ms = GetCurrentMS();
-    // 已经过了第一个定时器的超时时间
-    if(now_ms >= next->m_next) {
-        return 0;
-    } else {
-        return next->m_next - now_ms;
+    return (us + 999) / 1000;
+}
+
+// 到最近一个定时器的时间差，微秒
+uint64_t TimerManager::getNextTimerUS() {
+    Shard* local = getLocalShard();
+    if(local) {
+        return local->nextTimerUS(true);
+    }
+    // 不拥有分片的线程查询所有分片
+    uint64_t next = ~0ull;
+    for(auto shard : m_shards) {
+        uint64_t us = shard->nextTimerUS(false);
+        next = us < next ? us : next;
     }
+    return next;
 }
 
 // 返回所有已经超时的定时器的回调函数
-void TimerManager::listExpiredCb(std::vector<std::function<void()>>& cbs) {
-    uint64_t now_ms = GetCurrentMS();
-    // 存储已经超时的定时器
-    std::vector<Timer::ptr> expired;
-    {
-        RWMutexType::ReadLock lock(m_mutex);
-        if(m_timers.empty()) {
-            return;
-        }
-    }
-    RWMutexType::WriteLock lock(m_mutex);
-    if(m_timers.empty()) {
-        return;
-    }
-    // 检查系统时间是否被改变
-    bool rollover = detectClockRollover(now_ms);
-    // 最近的定时器都没有到达，没有定时器到期，直接返回
-    if(!rollover && ((*m_timers.begin())->m_next > now_ms)) {
+void TimerManager::listExpiredCb(std::vector<Task>& cbs) {
+    listExpiredCb(cbs, GetMonotonicUS());
+}
+
+// 返回到now_us为止已经超时的定时器的回调函数
+void TimerManager::listExpiredCb(std::vector<Task>& cbs, uint64_t now_us) {
+    Shard* local = getLocalShard();
+    if(local) {
+        local->listExpiredCb(cbs, now_us);
         return;
     }
-    // 创建定时器，用于查找下次执行时间小于该定时器的定时器
-    Timer::ptr now_timer(new Timer(now_ms));
-    // 发生了时钟溢出，从结尾开始找，否则找到第一个大于等于now_timer的定时器
-    auto it = rollover ? m_timers.end() : m_timers.lower_bound(now_timer);
-    // 继续向下找，一直找到下一个即将执行的定时器
-    while(it != m_timers.end() && (*it)->m_next == now_ms) {
-        ++it;
-    }
-    // 将过期的定时器插入到vector中
-    expired.insert(expired.begin(), m_timers.begin(), it);
-    // 从定时器管理器中删除已经过期的定时器
-    m_timers.erase(m_timers.begin(), it);
-    cbs.reserve(expired.size());
-    for(auto& timer : expired) {
-        cbs.push_back(timer->m_cb);
-        if(timer->m_recurring) {
-            // 需要循环执行，再次插入到定时器管理器中
-            timer->m_next = now_ms + timer->m_ms;
-            m_timers.insert(timer);
-        } else {
-            timer->m_cb = nullptr;
-        }
+    for(auto shard : m_shards) {
+        shard->listExpiredCb(cbs, now_us);
     }
 }
 
 // 是否有定时器
 bool TimerManager::hasTimer() {
-    RWMutexType::ReadLock lock(m_mutex);
-    return !m_timers.empty();
+    for(auto shard : m_shards) {
+        if(shard->hasTimer()) {
+            return true;
+        }
+    }
+    return false;
 }
 
-// 将定时器添加到管理器中
-void TimerManager::addTimer(Timer::ptr val, RWMutexType::WriteLock& lock) {
-    // 获取插入后的迭代器
-    auto it = m_timers.insert(val).first;
-    bool at_front = (it == m_timers.end()) && !m_tickled;
-    if(at_front) {
-        m_tickled = true;
+// 按到期时间把定时器挂到时间轮的槽上
+void TimerManager::Shard::link(Timer* timer) {
+    uint64_t base = current + 1;
+    // 已经到期的定时器放在下一个要处理的时间点
+    uint64_t expire = AlignedExpire(timer->m_next, timer->m_slack);
+    expire = expire < base ? base : expire;
+    uint64_t delta = expire - base;
+    int slot = 0;
+    if(delta < (uint64_t)WHEEL0_SIZE) {
+        slot = expire & (WHEEL0_SIZE - 1);
+    } else {
+        // 超出时间轮范围的放在最高层最远的槽，下沉时重新计算
+        uint64_t range = 1ull << LevelShift(WHEEL_LEVELS);
+        if(delta >= range) {
+            expire = base + range - 1;
+            delta = range - 1;
+        }
+        int level = 1;
+        while(delta >= (1ull << LevelShift(level + 1))) {
+            ++level;
+        }
+        slot = WHEEL0_SIZE + (level - 1) * WHEELN_SIZE
+            + ((expire >> LevelShift(level)) & (WHEELN_SIZE - 1));
     }
-    lock.unlock();
-    if(at_front) {
-        onTimerInsertedAtFront();
+    timer->m_slot = slot;
+    timer->m_prevTimer = nullptr;
+    timer->m_nextTimer = slots[slot];
+    if(slots[slot]) {
+        slots[slot]->m_prevTimer = timer;
     }
+    slots[slot] = timer;
+    bitmap[slot >> 6] |= 1ull << (slot & 63);
+    ++count;
 }
 
-// 检查系统时间是否被修改了
-bool TimerManager::detectClockRollover(uint64_t now_ms) {
-    bool rollover = false;
-    // 如果当前时间比上次执行的一小时还小认为时间出现了溢出
-    if(now_ms < m_previousTime && now_ms < (m_previousTime - 60 * 60 * 1000)) {
-        rollover = true;
+// 把定时器从所在的槽上摘下
+void TimerManager::Shard::unlink(Timer* timer) {
+    int slot = timer->m_slot;
+    if(timer->m_prevTimer) {
+        timer->m_prevTimer->m_nextTimer = timer->m_nextTimer;
+    } else {
+        slots[slot] = timer->m_nextTimer;
+    }
+    if(timer->m_nextTimer) {
+        timer->m_nextTimer->m_prevTimer = timer->m_prevTimer;
+    }
+    if(!slots[slot]) {
+        bitmap[slot >> 6] &= ~(1ull << (slot & 63));
+    }
+    timer->m_slot = -1;
+    timer->m_prevTimer = timer->m_nextTimer = nullptr;
+    --count;
+}
+
+// 把高层的一个槽中的定时器重新放入时间轮
+void TimerManager::Shard::cascade(int slot) {
+    Timer* timer = slots[slot];
+    slots[slot] = nullptr;
+    bitmap[slot >> 6] &= ~(1ull << (slot & 63));
+    while(timer) {
+        Timer* next = timer->m_nextTimer;
+        --count;
+        link(timer);
+        timer = next;
+    }
+}
+
+// 把一个槽中的定时器全部取出，回调函数放入cbs
+void TimerManager::Shard::expireSlot(int slot, std::vector<Task>& cbs) {
+    Timer* timer = slots[slot];
+    slots[slot] = nullptr;
+    bitmap[slot >> 6] &= ~(1ull << (slot & 63));
+    while(timer) {
+        Timer* next = timer->m_nextTimer;
+        timer->m_slot = -1;
+        timer->m_prevTimer = timer->m_nextTimer = nullptr;
+        --count;
+        // 回调函数直接移动到cbs中，循环定时器只复制共享的回调指针
+        // 趁定时器还在缓存中一次处理完，不再遍历第二遍
+        if(timer->m_recurring) {
+            cbs.push_back(Task(SharedCallback{timer->m_sharedCb}));
+            recurringList.push_back(std::move(timer->m_self));
+        } else if(timer->m_reusable) {
+            cbs.push_back(Task(SharedCallback{timer->m_sharedCb}));
+            timer->m_self.reset();
+        } else {
+            cbs.push_back(std::move(timer->m_cb));
+            timer->m_self.reset();
+        }
+        timer = next;
+    }
+}
+
+// 推进时间轮到now_us
+void TimerManager::Shard::advance(uint64_t now_us, std::vector<Task>& cbs) {
+    while(current < now_us) {
+        // 直接跳过下一个需要处理的时间点之前的空闲时间，中间没有需要下沉或到期的槽
+        uint64_t next = nextTick();
+        if(next > now_us) {
+            current = now_us;
+            break;
+        }
+        if(next > current + 1) {
+            current = next - 1;
+        }
+        uint64_t t = current + 1;
+        if((t & (WHEEL0_SIZE - 1)) == 0) {
+            // 到达第0层一圈的边界，从高层到低层依次把到达的槽下沉
+            for(int level = WHEEL_LEVELS - 1; level >= 1; --level) {
+                int shift = LevelShift(level);
+                if((t & ((1ull << shift) - 1)) == 0) {
+                    cascade(WHEEL0_SIZE + (level - 1) * WHEELN_SIZE
+                            + ((t >> shift) & (WHEELN_SIZE - 1)));
+                }
+            }
+        }
+        // 在第0层本圈剩余的范围内跳到下一个非空的槽
+        uint64_t limit = t | (WHEEL0_SIZE - 1);
+        if(limit > now_us) {
+            limit = now_us;
+        }
+        int from = t & (WHEEL0_SIZE - 1);
+        int dist = FindNextBit(bitmap, WHEEL0_SIZE, from);
+        if(dist < 0 || t + dist > limit) {
+            current = limit;
+            continue;
+        }
+        expireSlot(from + dist, cbs);
+        current = t + dist;
+    }
+}
+
+// 返回下一个需要处理的时间点
+uint64_t TimerManager::Shard::nextTick() const {
+    if(count == 0) {
+        return ~0ull;
+    }
+    uint64_t base = current + 1;
+    uint64_t next = ~0ull;
+    // 第0层的槽对应确定的时间点
+    int dist = FindNextBit(bitmap, WHEEL0_SIZE, base & (WHEEL0_SIZE - 1));
+    if(dist >= 0) {
+        next = base + dist;
+    }
+    // 高层的槽取下沉的时间点，槽中定时器的到期时间不会早于它
+    for(int level = 1; level < WHEEL_LEVELS; ++level) {
+        int shift = LevelShift(level);
+        uint64_t pos = base >> shift;
+        if(base & ((1ull << shift) - 1)) {
+            ++pos;
+        }
+        const uint64_t* bits = bitmap + (WHEEL0_SIZE + (level - 1) * WHEELN_SIZE) / 64;
+        dist = FindNextBit(bits, WHEELN_SIZE, pos & (WHEELN_SIZE - 1));
+        if(dist >= 0) {
+            uint64_t tick = (pos + dist) << shift;
+            next = tick < next ? tick : next;
+        }
     }
-    m_previousTime = now_ms;
-    return rollover;
+    return next;
 }
 }
\ No newline at end of file
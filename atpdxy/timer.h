@@ -1,8 +1,9 @@
 #pragma once
 
+#include <atomic>
 #include <memory>
-#include <set>
 #include <vector>
+#include "task.h"
 #include "thread.h"
 
 namespace atpdxy {
@@ -23,64 +24,105 @@ public:
 
     // 重置定时器间隔，是否从当前时间开始
     bool reset(uint64_t ms, bool from_now);
-private:
-    // 构造函数，指定定时器的循环周期，回调函数，是否循环执行，所在的管理器
-    Timer(uint64_t ms, std::function<void()> cb, bool recurring, TimerManager* manager);
 
-    Timer(uint64_t next);
+    // 从当前时间开始ms毫秒后到期，已经启动的重新计算到期时间，已经取消的返回false
+    bool restart(uint64_t ms);
+
+    // 从当前时间开始us微秒后到期
+    bool restartUS(uint64_t us);
+
+    // 停止定时器但保留回调函数，之后可以通过restart再次启动，没有启动返回false
+    bool stop();
 private:
-    // 比较函数
-    struct Comparator {
-        bool operator()(const Timer::ptr& lhs, const Timer::ptr& rhs) const;
-    };
+    // 构造函数，指定定时器的循环周期(微秒)，回调函数，是否循环执行，所在的管理器和分片
+    Timer(uint64_t us, Task cb, bool recurring, TimerManager* manager, size_t shard);
 private:
     bool m_recurring = false;                   // 是否循环执行定时器
-    uint64_t m_ms = 0;                          // 定时器的周期
-    uint64_t m_next = 0;                        // 定时器下次执行的时间
-    std::function<void()> m_cb;                 // 回调函数
+    bool m_reusable = false;                    // 到期后是否保留回调函数以便重新启动
+    uint64_t m_period = 0;                      // 定时器的周期，微秒
+    uint64_t m_next = 0;                        // 定时器下次执行的单调时钟时间，微秒
+    uint64_t m_slack = 0;                       // 允许晚于到期时间触发的最大延迟，微秒
+    Task m_cb;                                  // 回调函数
+    std::shared_ptr<Task> m_sharedCb;           // 循环定时器共享的回调函数，每次到期只复制指针
     TimerManager* m_manager = nullptr;          // 定时器所在的管理器
+    size_t m_shard = 0;                         // 定时器所在的分片，创建时确定
+    int m_slot = -1;                            // 所在时间轮槽的下标，-1表示不在时间轮中，-2表示在分片的收件箱中
+    std::atomic<int> m_inbox = {0};             // 收件箱中的状态，1表示等待取走，2表示在收件箱中被取消，取走时清空回调函数并丢弃
+    Timer* m_prevTimer = nullptr;               // 同一个槽中的前一个定时器
+    Timer* m_nextTimer = nullptr;               // 同一个槽中的后一个定时器，在收件箱中时指向收件箱的下一个定时器
+    Timer::ptr m_self;                          // 在时间轮中时持有自身，保证定时器存活
 };
 
-// 定时器管理器
+// 定时器管理器，定时器按工作线程分片，每个分片是一个分层时间轮，精度为1微秒
+// 第0层256个槽，每个槽对应1微秒，第1到4层各64个槽，每个槽依次对应2^8、2^14、2^20、2^26微秒
+// 插入和取消都是O(1)，高层的槽到达时整体下沉到低层，超过2^32微秒(约71分钟)的定时器先放在最高层，下沉时重新计算位置
+// 拥有分片的线程添加的定时器直接放入自己的分片，只加该分片的锁，其他线程添加的定时器通过无锁的收件箱交给某个分片
+// 还在收件箱中的定时器取消时也不加锁，只做标记，由取走收件箱的线程丢弃
+// 每个线程只取出自己分片中到期的定时器，不拥有分片的线程查询和取出所有分片
 class TimerManager {
-friend class Timer;    
+friend class Timer;
 public:
-    typedef RWMutex RWMutexType;
+    typedef Mutex MutexType;
 
     TimerManager();
 
     virtual ~TimerManager();
 
-    // 添加定时器
-    Timer::ptr addTimer(uint64_t ms, std::function<void()> cb, bool recurring = false);
-    
+    // 添加定时器，ms毫秒后到期
+    // slack_ms允许定时器在到期后最多延迟slack_ms毫秒触发，到期时间相近的定时器合并到同一个时间点，
+    // 一次唤醒取出一批，适合大量不要求精确的空闲超时
+    Timer::ptr addTimer(uint64_t ms, Task cb, bool recurring = false, uint64_t slack_ms = 0);
+
+    // 添加微秒精度的定时器，us微秒后到期，slack_us是允许的延迟
+    Timer::ptr addTimerUS(uint64_t us, Task cb, bool recurring = false, uint64_t slack_us = 0);
+
     // 添加定时器加上环境依赖
-    Timer::ptr addConditionTimer(uint64_t ms, std::function<void()> cb, std::weak_ptr<void> weak_cond, bool recurring = false);
+    Timer::ptr addConditionTimer(uint64_t ms, Task cb, std::weak_ptr<void> weak_cond
+                                 , bool recurring = false, uint64_t slack_ms = 0);
+
+    // 创建一个没有启动的定时器，到期后回调函数保留，通过Timer::restart反复启动
+    // 用于反复设置的超时，只在创建时分配一次，slack_ms是每次启动允许的延迟
+    Timer::ptr createTimer(Task cb, uint64_t slack_ms = 0);
 
-    // 到最近一个定时器的时间差
+    // 到最近一个定时器的时间差，毫秒，不足1毫秒的部分向上取整
     uint64_t getNextTimer();
 
+    // 到最近一个定时器的时间差，微秒，没有定时器返回~0ull
+    uint64_t getNextTimerUS();
+
     // 返回所有已经超时的定时器的回调函数
-    void listExpiredCb(std::vector<std::function<void()>>& cbs);
+    void listExpiredCb(std::vector<Task>& cbs);
 
-    // 是否有定时器
+    // 返回到now_us为止已经超时的定时器的回调函数，now_us是调用者已经读取的单调时钟微秒数
+    void listExpiredCb(std::vector<Task>& cbs, uint64_t now_us);
+
+    // 是否有定时器，包括所有分片
     bool hasTimer();
 protected:
-    // 有定时器被添加到容器头部
-    virtual void onTimerInsertedAtFront() = 0;
-    
-    // 将定时器添加到管理器中
-    void addTimer(Timer::ptr val, RWMutexType::WriteLock& lock);
+    // 有定时器被添加到分片的最前面，需要唤醒等待该分片定时器的线程
+    virtual void onTimerInsertedAtFront(size_t shard) = 0;
+
+    // 返回当前线程拥有的分片下标，不拥有分片返回-1，默认所有线程共用第0个分片
+    virtual int getCurrentTimerShard() { return 0;}
+
+    // 设置分片数量，只能在添加定时器之前调用
+    void setTimerShards(size_t count);
 private:
-    // 检查系统时间是否被修改了
-    bool detectClockRollover(uint64_t now_ms);
+    // 一个分片的时间轮
+    struct Shard;
+
+    // 返回当前线程拥有的分片，不拥有分片返回nullptr
+    Shard* getLocalShard();
+
+    // 不拥有分片的线程添加定时器时选择的分片
+    size_t nextShard();
+
+    // 把新建的定时器放入分片
+    Timer::ptr insertTimer(Timer::ptr timer);
 private:
-    RWMutexType m_mutex;
-    // 存放定时器的容器
-    std::set<Timer::ptr, Timer::Comparator> m_timers;
-    // 是否触发了onTimerInsertedAtFront
-    bool m_tickled = false;
-    // 上次执行时间，用来更新系统时间是否被修改
-    uint64_t m_previousTime = 0;
+    // 分片，多reactor模式下和工作线程一一对应
+    std::vector<Shard*> m_shards;
+    // 不拥有分片的线程添加定时器时轮流选择的分片
+    std::atomic<size_t> m_nextShard = {0};
 };
-}
\ No newline at end of file
+}
@@ -1,12 +1,43 @@
 #include "util.h"
+#include "config.h"
 #include "fiber.h"
+#include "macro.h"
+#include <atomic>
+#include <fstream>
+#include <pthread.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
 
 namespace atpdxy
 {
 static atpdxy::Logger::ptr g_logger = GET_LOGGER_BY_NAME("system");
 
+// 单调时钟的来源
+static ConfigVar<std::string>::ptr g_clock_source =
+    Config::Lookup<std::string>("clock.source", "monotonic", "monotonic clock source: monotonic or tsc");
+
+// 线程id在线程存活期间不变，缓存后每条日志不再需要一次系统调用
+static thread_local pid_t t_thread_id = 0;
+
+// fork出的子进程中调用fork的线程id变了，清掉缓存
+static void ResetThreadIdInChild() {
+    t_thread_id = 0;
+}
+
+struct ThreadIdIniter {
+    ThreadIdIniter() {
+        pthread_atfork(nullptr, nullptr, &ResetThreadIdInChild);
+    }
+};
+
+static ThreadIdIniter s_thread_id_initer;
+
 pid_t GetThreadId() {
-    return syscall(SYS_gettid);
+    if(!t_thread_id) {
+        t_thread_id = syscall(SYS_gettid);
+    }
+    return t_thread_id;
 }
 
 uint32_t GetFiberId() {
@@ -74,4 +105,148 @@ uint64_t GetCurrentUS() {
     gettimeofday(&tv, NULL);
     return tv.tv_sec * 1000 * 1000ul + tv.tv_usec;
 }
+
+// 读取指定时钟的纳秒数
+static uint64_t ClockNS(clockid_t id) {
+    struct timespec ts;
+    clock_gettime(id, &ts);
+    return ts.tv_sec * 1000 * 1000 * 1000ul + ts.tv_nsec;
+}
+
+namespace {
+
+// TSC换算成纳秒的参数，以校准时的CLOCK_MONOTONIC为起点，和默认时钟保持同一个基准
+struct TscClock {
+    bool valid = false;
+    uint64_t baseTsc = 0;
+    uint64_t baseNs = 0;
+    // 每个TSC周期的纳秒数，定点数，小数部分32位
+    uint64_t mult = 0;
+
+    TscClock() {
+#if defined(__x86_64__) || defined(__i386__)
+        // 频率恒定并且在深度睡眠时不停止的TSC才能作为时钟
+        std::ifstream ifs("/proc/cpuinfo");
+        std::string line;
+        bool constant = false;
+        bool nonstop = false;
+        while(std::getline(ifs, line)) {
+            if(line.compare(0, 5, "flags") == 0) {
+                constant = line.find(" constant_tsc") != std::string::npos;
+                nonstop = line.find(" nonstop_tsc") != std::string::npos;
+                break;
+            }
+        }
+        if(!constant || !nonstop) {
+            return;
+        }
+        // 用10毫秒校准频率，clock_nanosleep不会被hook
+        uint64_t ns0 = ClockNS(CLOCK_MONOTONIC);
+        uint64_t tsc0 = __rdtsc();
+        struct timespec req = {0, 10 * 1000 * 1000};
+        clock_nanosleep(CLOCK_MONOTONIC, 0, &req, nullptr);
+        uint64_t ns1 = ClockNS(CLOCK_MONOTONIC);
+        uint64_t tsc1 = __rdtsc();
+        if(tsc1 <= tsc0 || ns1 <= ns0) {
+            return;
+        }
+        mult = ((ns1 - ns0) << 32) / (tsc1 - tsc0);
+        baseTsc = tsc1;
+        baseNs = ns1;
+        valid = mult != 0;
+#endif
+    }
+
+    uint64_t now() const {
+#if defined(__x86_64__) || defined(__i386__)
+        return baseNs + (uint64_t)(((unsigned __int128)(__rdtsc() - baseTsc) * mult) >> 32);
+#else
+        return ClockNS(CLOCK_MONOTONIC);
+#endif
+    }
+};
+
+}
+
+// 第一次使用时校准，局部静态变量的初始化是线程安全的
+static const TscClock& GetTscClock() {
+    static TscClock s_tsc;
+    return s_tsc;
+}
+
+// 缓存配置值，避免每次读取时钟都去获取配置的读锁
+static std::atomic<bool> s_use_tsc {false};
+
+// 按配置选择时钟来源，TSC不可用时退回到CLOCK_MONOTONIC
+static void SetClockSource(const std::string& source) {
+    bool tsc = source == "tsc";
+    if(tsc && !GetTscClock().valid) {
+        WARN(g_logger) << "tsc clock is not available, use CLOCK_MONOTONIC";
+        tsc = false;
+    }
+    s_use_tsc = tsc;
+}
+
+struct _ClockIniter {
+    _ClockIniter() {
+        SetClockSource(g_clock_source->getValue());
+        g_clock_source->addListener([](const std::string& old_value, const std::string& new_value){
+            INFO(g_logger) << "clock source changed from " << old_value << " to " << new_value;
+            SetClockSource(new_value);
+        });
+    }
+};
+
+// 在main函数前初始化
+static _ClockIniter s_clock_initer;
+
+// 返回单调时钟的纳秒数
+uint64_t GetMonotonicNS() {
+    if(s_use_tsc.load(std::memory_order_relaxed)) {
+        return GetTscClock().now();
+    }
+    return ClockNS(CLOCK_MONOTONIC);
+}
+
+// 返回单调时钟的微秒数
+uint64_t GetMonotonicUS() {
+    return GetMonotonicNS() / 1000;
+}
+
+// 返回单调时钟的毫秒数
+uint64_t GetMonotonicMS() {
+    return GetMonotonicNS() / 1000 / 1000;
+}
+
+// 返回粗粒度单调时钟的毫秒数
+uint64_t GetCoarseMonotonicMS() {
+    return ClockNS(CLOCK_MONOTONIC_COARSE) / 1000 / 1000;
+}
+
+// 当前是否使用TSC作为单调时钟
+bool IsTscClock() {
+    return s_use_tsc;
+}
+
+// 当前线程缓存的单调时钟微秒数，0表示没有刷新过
+static thread_local uint64_t t_cached_us = 0;
+
+// 读取单调时钟的微秒数并缓存到当前线程
+uint64_t RefreshCachedUS() {
+    t_cached_us = GetMonotonicUS();
+    return t_cached_us;
+}
+
+// 返回当前线程缓存的单调时钟微秒数
+uint64_t GetCachedUS() {
+    if(UNLIKELY(t_cached_us == 0)) {
+        return RefreshCachedUS();
+    }
+    return t_cached_us;
+}
+
+// 返回当前线程缓存的单调时钟毫秒数
+uint64_t GetCachedMS() {
+    return GetCachedUS() / 1000;
+}
 }
\ No newline at end of file
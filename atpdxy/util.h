@@ -7,6 +7,7 @@
 #include <string>
 #include <stdint.h>
 #include <sys/time.h>
+#include <time.h>
 #include <cxxabi.h>
 #include "log.h"
 
@@ -31,9 +32,35 @@ const char* TypeToName() {
     return s_name;
 }
 
-// 返回毫秒级时间
+// 返回毫秒级时间，墙上时间，会随系统时间调整而跳变
 uint64_t GetCurrentMS();
 
-// 返回微秒级时间
+// 返回微秒级时间，墙上时间，会随系统时间调整而跳变
 uint64_t GetCurrentUS();
+
+// 返回单调时钟的纳秒数，不受系统时间调整影响，只用来计算时间间隔
+// 默认读取CLOCK_MONOTONIC，配置clock.source为tsc且CPU的TSC恒定时直接读取TSC换算
+uint64_t GetMonotonicNS();
+
+// 返回单调时钟的微秒数
+uint64_t GetMonotonicUS();
+
+// 返回单调时钟的毫秒数，定时器使用该时钟
+uint64_t GetMonotonicMS();
+
+// 返回粗粒度单调时钟的毫秒数，读取CLOCK_MONOTONIC_COARSE，精度为一个时钟节拍(通常1到4毫秒)，开销最低
+uint64_t GetCoarseMonotonicMS();
+
+// 当前是否使用TSC作为单调时钟
+bool IsTscClock();
+
+// 读取单调时钟的微秒数并缓存到当前线程，返回读取的值
+uint64_t RefreshCachedUS();
+
+// 返回当前线程缓存的单调时钟微秒数，IOManager的idle每轮刷新一次
+// 不需要读取时钟，但可能落后最多一轮事件循环，当前线程从未刷新过时读取时钟
+uint64_t GetCachedUS();
+
+// 返回当前线程缓存的单调时钟毫秒数
+uint64_t GetCachedMS();
 }
\ No newline at end of file
@@ -0,0 +1,111 @@
+#pragma once
+
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+#include "noncopyable.h"
+
+namespace atpdxy {
+
+// 有界的Chase-Lev工作窃取双端队列，存放T的指针
+// 只有拥有者线程可以调用push/pop，在底部操作，后进先出
+// 其他线程调用steal从顶部窃取，先进先出，通过对top的CAS和拥有者竞争最后一个元素
+// 内存序参考Lê等人的《Correct and Efficient Work-Stealing for Weak Memory Models》
+template<class T>
+class WorkStealQueue : Noncopyable {
+public:
+    // 构造函数，容量向上取整为2的幂
+    WorkStealQueue(size_t capacity = 4096) {
+        size_t cap = 2;
+        while(cap < capacity) {
+            cap <<= 1;
+        }
+        m_mask = cap - 1;
+        m_buffer = new std::atomic<T*>[cap];
+        for(size_t i = 0; i < cap; ++i) {
+            m_buffer[i].store(nullptr, std::memory_order_relaxed);
+        }
+    }
+
+    ~WorkStealQueue() {
+        delete[] m_buffer;
+    }
+
+    // 拥有者在底部压入元素，队列满时返回false
+    bool push(T* v) {
+        int64_t b = m_bottom.load(std::memory_order_relaxed);
+        int64_t t = m_top.load(std::memory_order_acquire);
+        if(b - t > (int64_t)m_mask) {
+            return false;
+        }
+        m_buffer[b & m_mask].store(v, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        m_bottom.store(b + 1, std::memory_order_relaxed);
+        return true;
+    }
+
+    // 拥有者从底部弹出元素，队列为空返回nullptr
+    T* pop() {
+        int64_t b = m_bottom.load(std::memory_order_relaxed) - 1;
+        m_bottom.store(b, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t t = m_top.load(std::memory_order_relaxed);
+        if(t > b) {
+            // 队列为空，恢复bottom
+            m_bottom.store(b + 1, std::memory_order_relaxed);
+            return nullptr;
+        }
+        T* v = m_buffer[b & m_mask].load(std::memory_order_relaxed);
+        if(t == b) {
+            // 只剩最后一个元素，和窃取者竞争
+            if(!m_top.compare_exchange_strong(t, t + 1
+                        , std::memory_order_seq_cst, std::memory_order_relaxed)) {
+                v = nullptr;
+            }
+            m_bottom.store(b + 1, std::memory_order_relaxed);
+        }
+        return v;
+    }
+
+    // 其他线程从顶部窃取元素，队列为空或竞争失败返回nullptr
+    T* steal() {
+        int64_t t = m_top.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t b = m_bottom.load(std::memory_order_acquire);
+        if(t >= b) {
+            return nullptr;
+        }
+        T* v = m_buffer[t & m_mask].load(std::memory_order_relaxed);
+        if(!m_top.compare_exchange_strong(t, t + 1
+                    , std::memory_order_seq_cst, std::memory_order_relaxed)) {
+            return nullptr;
+        }
+        return v;
+    }
+
+    // 返回队列中元素的近似数量
+    size_t size() const {
+        int64_t b = m_bottom.load(std::memory_order_relaxed);
+        int64_t t = m_top.load(std::memory_order_relaxed);
+        return b > t ? b - t : 0;
+    }
+
+    // 返回队列是否近似为空
+    bool empty() const { return size() == 0;}
+
+    // 返回队列容量
+    size_t capacity() const { return m_mask + 1;}
+private:
+    // 窃取者竞争的顶部
+    std::atomic<int64_t> m_top = {0};
+    // 填充，将top和bottom分开在不同的缓存行上，避免伪共享
+    char m_pad[64 - sizeof(std::atomic<int64_t>)];
+    // 拥有者操作的底部
+    std::atomic<int64_t> m_bottom = {0};
+    // 环形缓冲区
+    std::atomic<T*>* m_buffer = nullptr;
+    // 容量掩码
+    size_t m_mask = 0;
+};
+
+}
@@ -0,0 +1,346 @@
+#include "../atpdxy/atpdxy.h"
+#include "../atpdxy/iomanager.h"
+#include <atomic>
+#include <string>
+#include <thread>
+#include <unistd.h>
+
+// 有界多生产者多消费者通道的测试
+// 满时发送、空时接收挂起的是协程，流水线的各级可以在同一个工作线程上交替执行
+atpdxy::Logger::ptr g_logger = GET_ROOT_LOGGER();
+
+// 容量取整，非阻塞的发送和接收
+void test_try() {
+    atpdxy::Channel<int> ch(3);
+    ASSERT(ch.getCapacity() == 4);
+    ASSERT(!ch.canRecv());
+    for(int i = 0; i < 4; ++i) {
+        ASSERT(ch.tryPush(i));
+    }
+    ASSERT(!ch.tryPush(4));
+    ASSERT(!ch.canSend());
+    ASSERT(ch.size() == 4);
+    int v = -1;
+    for(int i = 0; i < 4; ++i) {
+        ASSERT(ch.tryPop(v));
+        ASSERT(v == i);
+    }
+    ASSERT(!ch.tryPop(v));
+
+    // 析构时释放剩余的元素
+    atpdxy::Channel<std::shared_ptr<int> > sp(2);
+    std::shared_ptr<int> p(new int(1));
+    ASSERT(sp.tryPush(p));
+    ASSERT(p.use_count() == 2);
+    sp.close();
+    ASSERT(!sp.tryPush(p));
+    {
+        atpdxy::Channel<std::shared_ptr<int> > tmp(2);
+        tmp.tryPush(p);
+        ASSERT(p.use_count() == 3);
+    }
+    ASSERT(p.use_count() == 2);
+    INFO(g_logger) << "try ok";
+}
+
+// 发送和关闭并发，发送成功的元素都能被接收到，不会在通道析构时丢弃
+void test_close_race() {
+    const int rounds = 200;
+    int64_t lost = 0;
+    for(int r = 0; r < rounds; ++r) {
+        atpdxy::Channel<int> ch(1024);
+        std::atomic<int> sent = {0};
+        std::atomic<int> received = {0};
+        std::vector<std::thread> thrs;
+        for(int i = 0; i < 3; ++i) {
+            thrs.emplace_back([&](){
+                for(int j = 0; j < 200; ++j) {
+                    if(ch.push(j)) {
+                        ++sent;
+                    }
+                }
+            });
+        }
+        thrs.emplace_back([&](){
+            int v;
+            while(ch.pop(v)) {
+                ++received;
+            }
+        });
+        usleep(r % 5 * 100);
+        ch.close();
+        for(auto& i : thrs) {
+            i.join();
+        }
+        lost += sent - received;
+        ASSERT(ch.size() == 0);
+    }
+    ASSERT(lost == 0);
+    INFO(g_logger) << "close race ok rounds=" << rounds;
+}
+
+// 生产者 -> 平方 -> 求和的三级流水线，每级多个协程
+void run_pipeline(int threads, int items, size_t capacity) {
+    atpdxy::Channel<int> source(capacity);
+    atpdxy::Channel<int64_t> squared(capacity);
+    std::atomic<int> workers = {0};
+    std::atomic<int64_t> sum = {0};
+    std::atomic<int> received = {0};
+    uint64_t begin = atpdxy::GetMonotonicUS();
+    {
+        atpdxy::IOManager iom(threads, false, "pipeline");
+        const int producers = 2;
+        const int mappers = 3;
+        std::atomic<int> producing = {producers};
+        for(int i = 0; i < producers; ++i) {
+            iom.schedule([&, i](){
+                for(int j = i + 1; j <= items; j += producers) {
+                    ASSERT(source.push(j));
+                }
+                if(--producing == 0) {
+                    source.close();
+                }
+            });
+        }
+        workers = mappers;
+        for(int i = 0; i < mappers; ++i) {
+            iom.schedule([&](){
+                int v;
+                while(source.pop(v)) {
+                    ASSERT(squared.push((int64_t)v * v));
+                }
+                if(--workers == 0) {
+                    squared.close();
+                }
+            });
+        }
+        for(int i = 0; i < 2; ++i) {
+            iom.schedule([&](){
+                int64_t v;
+                while(squared.pop(v)) {
+                    sum += v;
+                    ++received;
+                }
+            });
+        }
+    }
+    uint64_t used = atpdxy::GetMonotonicUS() - begin;
+    int64_t n = items;
+    ASSERT(received == items);
+    ASSERT(sum == n * (n + 1) * (2 * n + 1) / 6);
+    INFO(g_logger) << "pipeline threads=" << threads << " capacity=" << capacity
+        << " items=" << items << " used=" << used << "us"
+        << " " << (used ? (uint64_t)items * 1000000 / used : 0) << " items/s";
+}
+
+// 生产者比消费者快，通道中的元素数量不会超过容量
+void test_backpressure() {
+    atpdxy::Channel<int> ch(8);
+    std::atomic<int> pushed = {0};
+    std::atomic<int> popped = {0};
+    std::atomic<int> over = {0};
+    {
+        atpdxy::IOManager iom(1, false, "backpressure");
+        iom.schedule([&](){
+            for(int i = 0; i < 1000; ++i) {
+                ASSERT(ch.push(i));
+                ++pushed;
+                if(pushed - popped > 8) {
+                    ++over;
+                }
+            }
+            ch.close();
+        });
+        iom.schedule([&](){
+            int v;
+            int expect = 0;
+            while(ch.pop(v)) {
+                // 单个生产者的元素按发送的顺序到达
+                ASSERT(v == expect++);
+                ++popped;
+                if(v % 100 == 0) {
+                    usleep(1000);
+                }
+            }
+        });
+    }
+    ASSERT(pushed == 1000 && popped == 1000);
+    ASSERT(over == 0);
+    INFO(g_logger) << "backpressure ok";
+}
+
+// 关闭后剩余元素仍然可以取出，挂起的接收者和发送者都被唤醒
+void test_close() {
+    atpdxy::Channel<std::string> ch(2);
+    ASSERT(ch.tryPush("a"));
+    ch.close();
+    ASSERT(ch.isClosed());
+    ASSERT(!ch.push("b"));
+    std::string s;
+    ASSERT(ch.pop(s) && s == "a");
+    ASSERT(!ch.pop(s));
+
+    atpdxy::Channel<int> empty(1);
+    atpdxy::Channel<int> full(1);
+    ASSERT(full.getCapacity() == 2);
+    ASSERT(full.tryPush(0) && full.tryPush(0));
+    std::atomic<int> woken = {0};
+    {
+        atpdxy::IOManager iom(2, false, "close");
+        for(int i = 0; i < 5; ++i) {
+            iom.schedule([&](){
+                int v;
+                ASSERT(!empty.pop(v));
+                ++woken;
+            });
+            iom.schedule([&](){
+                ASSERT(!full.push(1));
+                ++woken;
+            });
+        }
+        iom.schedule([&](){
+            usleep(20 * 1000);
+            empty.close();
+            full.close();
+        });
+    }
+    ASSERT(woken == 10);
+    INFO(g_logger) << "close ok";
+}
+
+// 在多个通道上等待，所有通道关闭后返回-1
+void test_select() {
+    const int per = 1000;
+    atpdxy::Channel<int> a(4);
+    atpdxy::Channel<int> b(4);
+    atpdxy::Channel<int> c(4);
+    int counts[3] = {0, 0, 0};
+    int64_t sum = 0;
+    bool finished = false;
+    {
+        atpdxy::IOManager iom(2, false, "select");
+        atpdxy::Channel<int>* chs[] = {&a, &b, &c};
+        for(int i = 0; i < 3; ++i) {
+            atpdxy::Channel<int>* ch = chs[i];
+            iom.schedule([ch, i](){
+                for(int j = 0; j < per; ++j) {
+                    ASSERT(ch->push(i * per + j));
+                }
+                ch->close();
+            });
+        }
+        iom.schedule([&](){
+            int va, vb, vc;
+            atpdxy::ChannelSelect sel;
+            ASSERT(sel.recv(a, va) == 0);
+            ASSERT(sel.recv(b, vb) == 1);
+            ASSERT(sel.recv(c, vc) == 2);
+            while(true) {
+                int idx = sel.wait();
+                if(idx < 0) {
+                    break;
+                }
+                int v = idx == 0 ? va : (idx == 1 ? vb : vc);
+                ASSERT(v / per == idx);
+                ++counts[idx];
+                sum += v;
+            }
+            finished = true;
+        });
+    }
+    ASSERT(finished);
+    for(int i = 0; i < 3; ++i) {
+        ASSERT(counts[i] == per);
+    }
+    int64_t n = 3 * per;
+    ASSERT(sum == n * (n - 1) / 2);
+
+    // 发送分支，满的通道不能完成，有空位的可以
+    atpdxy::Channel<int> x(2);
+    atpdxy::Channel<int> y(2);
+    ASSERT(x.tryPush(0) && x.tryPush(0));
+    ASSERT(y.tryPush(0));
+    atpdxy::ChannelSelect sel;
+    int one = 1;
+    sel.send(x, one);
+    sel.send(y, one);
+    ASSERT(sel.tryWait() == 1);
+    ASSERT(sel.tryWait() == -1);
+    INFO(g_logger) << "select ok";
+}
+
+// 一个分支的通道已经关闭时，select在其他分支上挂起而不是空转
+// 只有一个工作线程，空转时发送方的协程永远得不到执行
+void test_select_closed() {
+    atpdxy::Channel<int> closed(2);
+    atpdxy::Channel<int> in(2);
+    closed.close();
+    int idx = -2;
+    int got = 0;
+    uint64_t waited = 0;
+    {
+        atpdxy::IOManager iom(1, false, "select_closed");
+        iom.schedule([&](){
+            int one = 1;
+            atpdxy::ChannelSelect sel;
+            sel.send(closed, one);
+            sel.recv(in, got);
+            uint64_t begin = atpdxy::GetMonotonicUS();
+            idx = sel.wait();
+            waited = atpdxy::GetMonotonicUS() - begin;
+        });
+        iom.schedule([&](){
+            usleep(50 * 1000);
+            ASSERT(in.push(7));
+        });
+    }
+    ASSERT(idx == 1 && got == 7);
+    ASSERT(waited >= 40 * 1000);
+    INFO(g_logger) << "select closed ok waited=" << waited << "us";
+}
+
+// 普通线程和协程通过通道交换数据，线程阻塞而协程挂起
+void test_thread() {
+    const int items = 10000;
+    atpdxy::Channel<int> to_fiber(16);
+    atpdxy::Channel<int> to_thread(16);
+    int64_t sum = 0;
+    {
+        atpdxy::IOManager iom(1, false, "thread");
+        iom.schedule([&](){
+            int v;
+            while(to_fiber.pop(v)) {
+                ASSERT(to_thread.push(v * 2));
+            }
+            to_thread.close();
+        });
+        std::thread consumer([&](){
+            int v;
+            while(to_thread.pop(v)) {
+                sum += v;
+            }
+        });
+        for(int i = 1; i <= items; ++i) {
+            ASSERT(to_fiber.push(i));
+        }
+        to_fiber.close();
+        consumer.join();
+    }
+    ASSERT(sum == (int64_t)items * (items + 1));
+    INFO(g_logger) << "thread ok";
+}
+
+int main(int argc, char** argv) {
+    test_try();
+    test_backpressure();
+    test_close();
+    test_close_race();
+    // 只有一个工作线程时，如果通道阻塞线程，流水线会死锁
+    run_pipeline(1, 100000, 16);
+    run_pipeline(2, 100000, 16);
+    run_pipeline(4, 100000, 1024);
+    test_select();
+    test_select_closed();
+    test_thread();
+    return 0;
+}
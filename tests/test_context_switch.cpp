@@ -0,0 +1,76 @@
+#include "../atpdxy/atpdxy.h"
+#include <ucontext.h>
+#include <stdlib.h>
+
+// 协程切换微基准测试
+// 对比当前编译选用的Fiber上下文切换实现(asm或ucontext)和直接使用glibc swapcontext的耗时
+atpdxy::Logger::ptr g_logger = GET_ROOT_LOGGER();
+
+static const uint64_t s_rounds = 1000000;
+
+static atpdxy::Fiber* s_fiber = nullptr;
+static bool s_stop = false;
+
+void fiber_ping() {
+    while(!s_stop) {
+        s_fiber->back();
+    }
+}
+
+// 通过Fiber::call/back来回切换，每轮两次切换
+void bench_fiber() {
+    atpdxy::Fiber::GetThis();
+    atpdxy::Fiber::ptr fiber(new atpdxy::Fiber(&fiber_ping, 0, true));
+    s_fiber = fiber.get();
+    s_stop = false;
+
+    uint64_t begin = atpdxy::GetCurrentUS();
+    for(uint64_t i = 0; i < s_rounds; ++i) {
+        fiber->call();
+    }
+    uint64_t used = atpdxy::GetCurrentUS() - begin;
+    s_stop = true;
+    fiber->call();
+
+    INFO(g_logger) << "fiber(" << atpdxy::ContextBackendName() << ") rounds=" << s_rounds
+        << " used=" << used << "us "
+        << (used * 1000.0 / (s_rounds * 2)) << "ns/switch";
+}
+
+static ucontext_t s_main_uc;
+static ucontext_t s_ping_uc;
+
+void ucontext_ping() {
+    while(true) {
+        swapcontext(&s_ping_uc, &s_main_uc);
+    }
+}
+
+// 直接使用glibc的swapcontext来回切换，每次切换都会有一次rt_sigprocmask系统调用
+void bench_ucontext() {
+    const size_t stack_size = 128 * 1024;
+    void* stack = malloc(stack_size);
+    getcontext(&s_ping_uc);
+    s_ping_uc.uc_link = nullptr;
+    s_ping_uc.uc_stack.ss_sp = stack;
+    s_ping_uc.uc_stack.ss_size = stack_size;
+    makecontext(&s_ping_uc, &ucontext_ping, 0);
+
+    uint64_t begin = atpdxy::GetCurrentUS();
+    for(uint64_t i = 0; i < s_rounds; ++i) {
+        swapcontext(&s_main_uc, &s_ping_uc);
+    }
+    uint64_t used = atpdxy::GetCurrentUS() - begin;
+    free(stack);
+
+    INFO(g_logger) << "raw swapcontext rounds=" << s_rounds
+        << " used=" << used << "us "
+        << (used * 1000.0 / (s_rounds * 2)) << "ns/switch";
+}
+
+int main(int argc, char** argv) {
+    atpdxy::Thread::SetName("main");
+    bench_fiber();
+    bench_ucontext();
+    return 0;
+}
@@ -0,0 +1,151 @@
+#include "../atpdxy/atpdxy.h"
+#include "../atpdxy/iomanager.h"
+#include <atomic>
+#include <string>
+#include <unistd.h>
+
+// 协程局部变量的测试
+// 协程切出后可能在另一个工作线程上恢复，值仍然跟随协程
+atpdxy::Logger::ptr g_logger = GET_ROOT_LOGGER();
+
+// 请求上下文
+struct RequestContext {
+    static std::atomic<int> s_alive;
+
+    RequestContext() { ++s_alive;}
+    RequestContext(const RequestContext& rhs) : traceId(rhs.traceId), deadline(rhs.deadline) { ++s_alive;}
+    ~RequestContext() { --s_alive;}
+
+    std::string traceId;
+    uint64_t deadline = 0;
+};
+
+std::atomic<int> RequestContext::s_alive = {0};
+
+static atpdxy::FiberLocal<RequestContext> s_context;
+static atpdxy::FiberLocal<int> s_counter;
+
+// 超出内联槽数，使用按需申请的数组
+static atpdxy::FiberLocal<int> s_many[12];
+
+// 每个协程有自己的值，切出和在其他线程恢复后不变
+void test_isolation() {
+    const int fibers = 200;
+    std::atomic<int> bad = {0};
+    std::atomic<int> migrated = {0};
+    {
+        atpdxy::IOManager iom(4, false, "isolation");
+        for(int i = 0; i < fibers; ++i) {
+            iom.schedule([&, i](){
+                // 复用的协程对象不会看到上一个任务的值
+                if(s_context.get() || s_counter.get()) {
+                    ++bad;
+                }
+                RequestContext ctx;
+                ctx.traceId = "trace-" + std::to_string(i);
+                ctx.deadline = i;
+                s_context.set(ctx);
+                int thread = atpdxy::GetThreadId();
+                for(int j = 0; j < 10; ++j) {
+                    ++*s_counter;
+                    if(j % 2) {
+                        atpdxy::Fiber::YieldToReady();
+                    } else {
+                        usleep(100);
+                    }
+                    if(s_context->traceId != "trace-" + std::to_string(i)
+                            || s_context->deadline != (uint64_t)i) {
+                        ++bad;
+                    }
+                }
+                if(*s_counter != 10) {
+                    ++bad;
+                }
+                if(atpdxy::GetThreadId() != thread) {
+                    ++migrated;
+                }
+            });
+        }
+    }
+    ASSERT(bad == 0);
+    // 协程结束时释放了值
+    ASSERT(RequestContext::s_alive == 0);
+    INFO(g_logger) << "isolation ok fibers=" << fibers << " migrated=" << migrated;
+}
+
+// 超出内联槽数的槽，以及替换和释放值
+void test_overflow() {
+    ASSERT(s_many[11].getSlot() >= atpdxy::Fiber::LOCAL_INLINE_SLOTS);
+    std::atomic<int> bad = {0};
+    {
+        atpdxy::IOManager iom(2, false, "overflow");
+        for(int i = 0; i < 50; ++i) {
+            iom.schedule([&, i](){
+                for(int j = 0; j < 12; ++j) {
+                    if(s_many[j].get()) {
+                        ++bad;
+                    }
+                    s_many[j].set(i * 100 + j);
+                }
+                atpdxy::Fiber::YieldToReady();
+                for(int j = 0; j < 12; ++j) {
+                    if(*s_many[j] != i * 100 + j) {
+                        ++bad;
+                    }
+                }
+                s_context.set(RequestContext());
+                s_context.set(RequestContext());
+                if(RequestContext::s_alive < 1) {
+                    ++bad;
+                }
+                s_context.reset();
+                if(s_context.get()) {
+                    ++bad;
+                }
+            });
+        }
+    }
+    ASSERT(bad == 0);
+    ASSERT(RequestContext::s_alive == 0);
+    INFO(g_logger) << "overflow ok";
+}
+
+// 不在调度器中时值保存在线程的主协程上
+void test_thread() {
+    ASSERT(!s_counter.get());
+    *s_counter = 5;
+    ASSERT(*s_counter.get() == 5);
+    s_counter.reset();
+    ASSERT(!s_counter.get());
+    INFO(g_logger) << "thread ok";
+}
+
+// 访问开销和thread_local对比
+static thread_local int t_value = 0;
+
+void bench() {
+    const int loops = 10000000;
+    *s_counter = 0;
+    uint64_t t0 = atpdxy::GetMonotonicUS();
+    for(int i = 0; i < loops; ++i) {
+        ++*s_counter.get();
+    }
+    uint64_t t1 = atpdxy::GetMonotonicUS();
+    for(int i = 0; i < loops; ++i) {
+        ++t_value;
+        __asm__ __volatile__("" ::: "memory");
+    }
+    uint64_t t2 = atpdxy::GetMonotonicUS();
+    ASSERT(*s_counter == loops);
+    s_counter.reset();
+    INFO(g_logger) << "fiber_local=" << (t1 - t0) * 1000.0 / loops << "ns/op"
+        << " thread_local=" << (t2 - t1) * 1000.0 / loops << "ns/op";
+}
+
+int main(int argc, char** argv) {
+    test_isolation();
+    test_overflow();
+    test_thread();
+    bench();
+    return 0;
+}
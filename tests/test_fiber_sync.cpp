@@ -0,0 +1,269 @@
+#include "../atpdxy/atpdxy.h"
+#include "../atpdxy/iomanager.h"
+#include <atomic>
+#include <deque>
+#include <thread>
+#include <string.h>
+#include <unistd.h>
+
+// 协程互斥量、读写锁、条件变量和信号量的测试
+// 竞争时挂起的是协程，同一个工作线程上的其他协程仍然可以执行
+atpdxy::Logger::ptr g_logger = GET_ROOT_LOGGER();
+
+// 单线程调度器上持有锁的协程让出，等待锁的协程挂起而不是阻塞线程，否则持有者永远无法继续
+void test_single_thread() {
+    atpdxy::FiberMutex mutex;
+    std::vector<int> order;
+    std::vector<int> arrival;
+    {
+        atpdxy::IOManager iom(1, false, "single");
+        iom.schedule([&](){
+            atpdxy::FiberMutex::Lock lock(mutex);
+            order.push_back(1);
+            // 让其他协程运行，它们在锁上挂起
+            atpdxy::Fiber::YieldToReady();
+            usleep(10 * 1000);
+            order.push_back(2);
+        });
+        for(int i = 0; i < 3; ++i) {
+            iom.schedule([&, i](){
+                arrival.push_back(i);
+                atpdxy::FiberMutex::Lock lock(mutex);
+                order.push_back(10 + i);
+            });
+        }
+        iom.schedule([&](){
+            // 锁被持有期间同一线程上不需要锁的协程照常执行
+            order.push_back(0);
+        });
+    }
+    ASSERT(order.size() == 6);
+    ASSERT(order[0] == 1);
+    ASSERT(order[1] == 0);
+    ASSERT(order[2] == 2);
+    // 按开始等待的顺序交接
+    ASSERT(arrival.size() == 3);
+    for(int i = 0; i < 3; ++i) {
+        ASSERT(order[3 + i] == 10 + arrival[i]);
+    }
+    INFO(g_logger) << "single thread ok";
+}
+
+// 多个工作线程上的大量协程和普通线程一起竞争同一把锁
+void test_mutex() {
+    const int fibers = 100;
+    const int loops = 1000;
+    const int threads = 2;
+    atpdxy::FiberMutex mutex;
+    int64_t count = 0;
+    uint64_t begin = atpdxy::GetMonotonicUS();
+    {
+        atpdxy::IOManager iom(4, false, "mutex");
+        for(int i = 0; i < fibers; ++i) {
+            iom.schedule([&](){
+                for(int j = 0; j < loops; ++j) {
+                    atpdxy::FiberMutex::Lock lock(mutex);
+                    ++count;
+                    if(j % 100 == 0) {
+                        atpdxy::Fiber::YieldToReady();
+                    }
+                }
+            });
+        }
+        std::vector<std::thread> thrs;
+        for(int i = 0; i < threads; ++i) {
+            thrs.emplace_back([&](){
+                for(int j = 0; j < loops * 10; ++j) {
+                    atpdxy::FiberMutex::Lock lock(mutex);
+                    ++count;
+                }
+            });
+        }
+        for(auto& i : thrs) {
+            i.join();
+        }
+    }
+    uint64_t used = atpdxy::GetMonotonicUS() - begin;
+    ASSERT(count == (int64_t)fibers * loops + threads * loops * 10);
+    ASSERT(mutex.tryLock());
+    ASSERT(!mutex.tryLock());
+    mutex.unlock();
+    INFO(g_logger) << "mutex count=" << count << " used=" << used << "us";
+}
+
+// 读者可以同时持有读锁，写者独占
+void test_rwmutex() {
+    atpdxy::FiberRWMutex mutex;
+    std::atomic<int> readers = {0};
+    std::atomic<int> max_readers = {0};
+    std::atomic<int> writers = {0};
+    std::atomic<int> bad = {0};
+    int value = 0;
+    {
+        atpdxy::IOManager iom(2, false, "rwmutex");
+        for(int i = 0; i < 50; ++i) {
+            iom.schedule([&, i](){
+                for(int j = 0; j < 100; ++j) {
+                    if((i + j) % 10 == 0) {
+                        atpdxy::FiberRWMutex::WriteLock lock(mutex);
+                        if(++writers != 1 || readers != 0) {
+                            ++bad;
+                        }
+                        ++value;
+                        atpdxy::Fiber::YieldToReady();
+                        --writers;
+                    } else {
+                        atpdxy::FiberRWMutex::ReadLock lock(mutex);
+                        int n = ++readers;
+                        if(writers != 0) {
+                            ++bad;
+                        }
+                        int old = max_readers;
+                        while(n > old && !max_readers.compare_exchange_weak(old, n));
+                        atpdxy::Fiber::YieldToReady();
+                        --readers;
+                    }
+                }
+            });
+        }
+    }
+    ASSERT(bad == 0);
+    ASSERT(value == 50 * 10);
+    ASSERT(max_readers > 1);
+    INFO(g_logger) << "rwmutex max_readers=" << max_readers << " writes=" << value;
+}
+
+// 生产者消费者队列，消费者既有协程也有普通线程
+void test_condvar() {
+    const int items = 10000;
+    atpdxy::FiberMutex mutex;
+    atpdxy::FiberCondVar not_empty;
+    atpdxy::FiberCondVar not_full;
+    std::deque<int> queue;
+    bool done = false;
+    std::atomic<int64_t> sum = {0};
+    std::atomic<int> consumed = {0};
+    auto consumer = [&](){
+        while(true) {
+            atpdxy::FiberMutex::Lock lock(mutex);
+            not_empty.wait(mutex, [&](){ return !queue.empty() || done;});
+            if(queue.empty()) {
+                break;
+            }
+            sum += queue.front();
+            queue.pop_front();
+            ++consumed;
+            not_full.notifyOne();
+        }
+    };
+    {
+        atpdxy::IOManager iom(2, false, "condvar");
+        for(int i = 0; i < 4; ++i) {
+            iom.schedule(consumer);
+        }
+        std::thread thr(consumer);
+        iom.schedule([&](){
+            for(int i = 1; i <= items; ++i) {
+                atpdxy::FiberMutex::Lock lock(mutex);
+                not_full.wait(mutex, [&](){ return queue.size() < 16;});
+                queue.push_back(i);
+                not_empty.notifyOne();
+            }
+            atpdxy::FiberMutex::Lock lock(mutex);
+            done = true;
+            not_empty.notifyAll();
+        });
+        thr.join();
+    }
+    ASSERT(consumed == items);
+    ASSERT(sum == (int64_t)items * (items + 1) / 2);
+    INFO(g_logger) << "condvar consumed=" << consumed;
+}
+
+// 信号量限制同时进入的协程数量
+void test_semaphore() {
+    const int limit = 3;
+    atpdxy::FiberSemaphore sem(limit);
+    std::atomic<int> running = {0};
+    std::atomic<int> max_running = {0};
+    std::atomic<int> finished = {0};
+    {
+        atpdxy::IOManager iom(2, false, "semaphore");
+        for(int i = 0; i < 30; ++i) {
+            iom.schedule([&](){
+                sem.wait();
+                int n = ++running;
+                int old = max_running;
+                while(n > old && !max_running.compare_exchange_weak(old, n));
+                // 睡眠时协程切出，其他协程在信号量上挂起
+                usleep(2 * 1000);
+                --running;
+                ++finished;
+                sem.notify();
+            });
+        }
+    }
+    ASSERT(finished == 30);
+    ASSERT(max_running == limit);
+    ASSERT(sem.getConcurrency() == (size_t)limit);
+    for(int i = 0; i < limit; ++i) {
+        ASSERT(sem.tryWait());
+    }
+    ASSERT(!sem.tryWait());
+    INFO(g_logger) << "semaphore max_running=" << max_running;
+}
+
+// 共享栈协程挂起时栈上的内容被拷走，栈空间由下一个协程使用，等待节点不能放在栈上
+// 只有一个共享栈，每个协程切入都会覆盖上一个协程留下的栈内容
+void test_shared_stack() {
+    const int fibers = 20;
+    atpdxy::Config::Lookup<uint32_t>("fiber.shared_stack_count")->setValue(1);
+    atpdxy::FiberSemaphore sem(0);
+    atpdxy::FiberMutex mutex;
+    atpdxy::FiberCondVar cond;
+    bool ready = false;
+    std::atomic<int> woken = {0};
+    std::atomic<int> counted = {0};
+    {
+        atpdxy::IOManager iom(1, false, "shared");
+        iom.setSharedStack(true);
+        for(int i = 0; i < fibers; ++i) {
+            iom.schedule([&](){
+                sem.wait();
+                ++woken;
+            });
+            iom.schedule([&](){
+                atpdxy::FiberMutex::Lock lock(mutex);
+                cond.wait(mutex, [&](){ return ready;});
+                ++counted;
+            });
+        }
+        iom.schedule([&](){
+            // 在共享栈上写满一段数据，覆盖挂起的协程留下的栈内容
+            volatile char buf[4096];
+            memset((char*)buf, 0x5a, sizeof(buf));
+            for(int i = 0; i < fibers; ++i) {
+                sem.notify();
+                atpdxy::Fiber::YieldToReady();
+            }
+            atpdxy::FiberMutex::Lock lock(mutex);
+            ready = true;
+            cond.notifyAll();
+        });
+    }
+    atpdxy::Config::Lookup<uint32_t>("fiber.shared_stack_count")->setValue(4);
+    ASSERT(woken == fibers);
+    ASSERT(counted == fibers);
+    ASSERT(sem.getConcurrency() == 0);
+    INFO(g_logger) << "shared stack ok";
+}
+
+int main(int argc, char** argv) {
+    test_single_thread();
+    test_mutex();
+    test_rwmutex();
+    test_condvar();
+    test_semaphore();
+    test_shared_stack();
+    return 0;
+}
@@ -0,0 +1,178 @@
+#include "../atpdxy/atpdxy.h"
+#include "../atpdxy/iomanager.h"
+#include <atomic>
+#include <string>
+#include <thread>
+#include <unistd.h>
+
+// Future/Promise、WaitGroup和WhenAll/WhenAny的测试
+// 等待结果时挂起的是协程，同一个工作线程上被等待的协程可以继续执行
+atpdxy::Logger::ptr g_logger = GET_ROOT_LOGGER();
+
+// 结果、异常和broken promise
+void test_promise() {
+    atpdxy::Future<int> f;
+    ASSERT(!f.valid());
+    {
+        atpdxy::Promise<int> p;
+        f = p.getFuture();
+        ASSERT(f.valid() && !f.isReady());
+        p.setValue(7);
+    }
+    ASSERT(f.isReady() && f.get() == 7);
+
+    // 没有设置结果的Promise析构时以异常完成
+    atpdxy::Future<std::string> broken;
+    {
+        atpdxy::Promise<std::string> p;
+        broken = p.getFuture();
+    }
+    ASSERT(broken.isReady());
+    bool thrown = false;
+    try {
+        broken.get();
+    } catch(std::logic_error& e) {
+        thrown = true;
+    }
+    ASSERT(thrown);
+
+    // 普通线程设置结果，多个等待的线程都被唤醒
+    atpdxy::Promise<void> p;
+    atpdxy::Future<void> done = p.getFuture();
+    std::atomic<int> woken = {0};
+    std::vector<std::thread> thrs;
+    for(int i = 0; i < 3; ++i) {
+        thrs.emplace_back([&](){
+            done.get();
+            ++woken;
+        });
+    }
+    usleep(10 * 1000);
+    ASSERT(woken == 0);
+    p.setValue();
+    for(auto& i : thrs) {
+        i.join();
+    }
+    ASSERT(woken == 3);
+    INFO(g_logger) << "promise ok";
+}
+
+// 在调度器中执行回调并取回结果，调用方不在协程中时阻塞线程
+void test_async() {
+    atpdxy::IOManager iom(2, false, "async");
+    atpdxy::Future<int> f = atpdxy::Async(&iom, [](){ return 42;});
+    ASSERT(f.get() == 42);
+
+    std::atomic<bool> ran = {false};
+    atpdxy::Async(&iom, [&](){ ran = true;}).get();
+    ASSERT(ran);
+
+    atpdxy::Future<std::string> err = atpdxy::Async(&iom, []() -> std::string {
+        throw std::runtime_error("backend failed");
+    });
+    err.wait();
+    ASSERT(err.isReady() && err.getState()->hasException());
+    std::string what;
+    try {
+        err.get();
+    } catch(std::runtime_error& e) {
+        what = e.what();
+    }
+    ASSERT(what == "backend failed");
+    INFO(g_logger) << "async ok";
+}
+
+// 请求处理协程把N个后端调用扇出到各自的协程，全部完成后恢复一次
+// 只有一个工作线程，处理协程如果阻塞线程，后端调用就无法执行
+void test_fanout() {
+    const int calls = 50;
+    std::atomic<int> resumed = {0};
+    int64_t sum = 0;
+    uint64_t used = 0;
+    {
+        atpdxy::IOManager iom(1, false, "fanout");
+        iom.schedule([&](){
+            uint64_t begin = atpdxy::GetMonotonicUS();
+            std::vector<atpdxy::Future<int> > futures;
+            for(int i = 0; i < calls; ++i) {
+                futures.push_back(atpdxy::Async([i](){
+                    // 模拟后端延迟，sleep被hook，只挂起本协程
+                    usleep((10 + i % 5) * 1000);
+                    return i;
+                }));
+            }
+            atpdxy::WhenAll(futures).wait();
+            ++resumed;
+            used = atpdxy::GetMonotonicUS() - begin;
+            for(auto& i : futures) {
+                ASSERT(i.isReady());
+                sum += i.get();
+            }
+        });
+    }
+    ASSERT(resumed == 1);
+    ASSERT(sum == (int64_t)calls * (calls - 1) / 2);
+    // 各个调用同时进行，总时间接近最慢的一个而不是所有延迟之和
+    ASSERT(used < 200 * 1000);
+    INFO(g_logger) << "fanout calls=" << calls << " used=" << used << "us";
+}
+
+// 不同类型的结果一起等待，以及等待最先完成的一个
+void test_when() {
+    atpdxy::IOManager iom(2, false, "when");
+    atpdxy::Future<int> a = atpdxy::Async(&iom, [](){ usleep(50 * 1000); return 1;});
+    atpdxy::Future<std::string> b = atpdxy::Async(&iom, [](){ usleep(5 * 1000); return std::string("b");});
+    atpdxy::Future<void> c = atpdxy::Async(&iom, [](){ usleep(100 * 1000);});
+    ASSERT(atpdxy::WhenAny(a, b, c).get() == 1);
+    ASSERT(b.isReady() && !c.isReady());
+    atpdxy::WhenAll(a, b, c).wait();
+    ASSERT(a.isReady() && c.isReady());
+    ASSERT(a.get() == 1 && b.get() == "b");
+
+    // 已经完成的结果
+    ASSERT(atpdxy::WhenAny(a, c).get() == 0);
+    ASSERT(atpdxy::WhenAll(std::vector<atpdxy::Future<int> >()).isReady());
+    INFO(g_logger) << "when ok";
+}
+
+// 协程和线程都可以在WaitGroup上等待
+void test_waitgroup() {
+    const int tasks = 100;
+    atpdxy::WaitGroup wg;
+    std::atomic<int> finished = {0};
+    std::atomic<int> early = {0};
+    {
+        atpdxy::IOManager iom(1, false, "waitgroup");
+        wg.add(tasks);
+        for(int i = 0; i < tasks; ++i) {
+            iom.schedule([&, i](){
+                usleep((i % 10) * 1000);
+                ++finished;
+                wg.done();
+            });
+        }
+        iom.schedule([&](){
+            wg.wait();
+            early += finished != tasks;
+        });
+        std::thread thr([&](){
+            wg.wait();
+            early += finished != tasks;
+        });
+        thr.join();
+    }
+    ASSERT(early == 0);
+    ASSERT(wg.getCount() == 0);
+    // 计数为0时不等待
+    wg.wait();
+    INFO(g_logger) << "waitgroup ok";
+}
+
+int main(int argc, char** argv) {
+    test_promise();
+    test_async();
+    test_fanout();
+    test_when();
+    test_waitgroup();
+    return 0;
+}
@@ -1,6 +1,8 @@
 #include "../atpdxy/hook.h"
 #include "../atpdxy/log.h"
 #include "../atpdxy/iomanager.h"
+#include "../atpdxy/macro.h"
+#include "../atpdxy/util.h"
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
@@ -64,6 +66,77 @@ void testSock() {
     INFO(g_logger) << buff;
 }
 
+// 本地回环上测试读超时，同一个fd反复超时复用同一个定时器，数据到达后不会被之前的超时误取消
+void testTimeout() {
+    atpdxy::IOManager iom(1);
+    iom.schedule([](){
+        int sock = socket(AF_INET, SOCK_STREAM, 0);
+        sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        ASSERT(bind(sock, (const sockaddr*)&addr, sizeof(addr)) == 0);
+        ASSERT(listen(sock, 1) == 0);
+        socklen_t len = sizeof(addr);
+        ASSERT(getsockname(sock, (sockaddr*)&addr, &len) == 0);
+
+        int client = socket(AF_INET, SOCK_STREAM, 0);
+        ASSERT(connect(client, (const sockaddr*)&addr, sizeof(addr)) == 0);
+        int fd = accept(sock, nullptr, nullptr);
+        ASSERT(fd >= 0);
+        timeval tv = {0, 100 * 1000};
+        ASSERT(setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) == 0);
+
+        char buf[16];
+        for(int i = 0; i < 3; ++i) {
+            uint64_t begin = atpdxy::GetCurrentMS();
+            int rt = read(fd, buf, sizeof(buf));
+            uint64_t used = atpdxy::GetCurrentMS() - begin;
+            INFO(g_logger) << "read rt=" << rt << " errno=" << errno << " used=" << used << "ms";
+            ASSERT(rt == -1 && errno == ETIMEDOUT && used >= 100 && used < 300);
+        }
+
+        // 50毫秒后写入，读在超时之前返回
+        atpdxy::IOManager::GetThis()->addTimer(50, [client](){
+            ASSERT(write(client, "hello", 5) == 5);
+        });
+        int rt = read(fd, buf, sizeof(buf));
+        ASSERT(rt == 5);
+        // 再等一次超时，确认上一次的定时器已经停止
+        uint64_t begin = atpdxy::GetCurrentMS();
+        rt = read(fd, buf, sizeof(buf));
+        ASSERT(rt == -1 && errno == ETIMEDOUT && atpdxy::GetCurrentMS() - begin >= 100);
+        INFO(g_logger) << "timeout ok";
+        close(client);
+        close(fd);
+        close(sock);
+    });
+}
+
+// 不足1毫秒的睡眠按微秒精度到期，既不会截断成0毫秒空转，也不会被取整到1毫秒
+void testUsleep() {
+    atpdxy::IOManager iom(1);
+    iom.schedule([](){
+        const int count = 200;
+        uint64_t begin = atpdxy::GetMonotonicUS();
+        for(int i = 0; i < count; ++i) {
+            usleep(500);
+        }
+        uint64_t used = (atpdxy::GetMonotonicUS() - begin) / count;
+        INFO(g_logger) << "usleep(500) avg=" << used << "us";
+        ASSERT(used >= 500 && used < 900);
+
+        timespec req = {0, 300 * 1000};
+        begin = atpdxy::GetMonotonicUS();
+        for(int i = 0; i < count; ++i) {
+            nanosleep(&req, nullptr);
+        }
+        used = (atpdxy::GetMonotonicUS() - begin) / count;
+        INFO(g_logger) << "nanosleep(300us) avg=" << used << "us";
+        ASSERT(used >= 300 && used < 700);
+    });
+}
+
 void testFiberNum() {
     atpdxy::IOManager iom(1);
     iom.schedule([](){
@@ -77,5 +150,7 @@ int main() {
     // atpdxy::IOManager iom;
     // iom.schedule(testSock);
     testFiberNum();
+    testTimeout();
+    testUsleep();
     return 0;
 }
\ No newline at end of file
@@ -1,6 +1,358 @@
 #include <iostream>
 #include "../atpdxy/log.h"
+#include "../atpdxy/binlog.h"
 #include "../atpdxy/util.h"
+#include "../atpdxy/macro.h"
+#include "../atpdxy/thread.h"
+#include <fstream>
+#include <new>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+// 替换后的new/delete内联到调用处时编译器会误报new和free不配对
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 11
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+// 统计当前线程的堆分配次数，验证写日志的稳定状态下不分配内存
+static thread_local uint64_t t_allocs = 0;
+
+void* operator new(size_t size) {
+    ++t_allocs;
+    void* p = malloc(size ? size : 1);
+    if(!p) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void* p) noexcept {
+    free(p);
+}
+
+// 多个线程同时写同一个日志器，返回耗时，微秒
+static uint64_t write_logs(atpdxy::Logger::ptr logger, int threads, int count) {
+    uint64_t begin = atpdxy::GetMonotonicUS();
+    std::vector<atpdxy::Thread::ptr> thrs;
+    for(int i = 0; i < threads; ++i) {
+        thrs.push_back(atpdxy::Thread::ptr(new atpdxy::Thread([logger, i, count](){
+            for(int j = 0; j < count; ++j) {
+                INFO(logger) << "thread " << i << " log " << j;
+            }
+        }, "log_" + std::to_string(i))));
+    }
+    for(auto& i : thrs) {
+        i->join();
+    }
+    return atpdxy::GetMonotonicUS() - begin;
+}
+
+static size_t count_lines(const std::string& file) {
+    std::ifstream ifs(file);
+    std::string line;
+    size_t n = 0;
+    while(std::getline(ifs, line)) {
+        ++n;
+    }
+    return n;
+}
+
+// 同步和异步文件输出器的写入耗时对比，阻塞模式不丢日志，丢弃模式缓冲区满时丢弃并在文件中记录条数
+void test_async() {
+    const int threads = 4;
+    const int count = 100000;
+    atpdxy::LogFormatter::ptr fmt(new atpdxy::LogFormatter("%d%T%t%T%m%n"));
+
+    unlink("./log_sync.txt");
+    atpdxy::Logger::ptr sync_logger(new atpdxy::Logger("sync"));
+    atpdxy::LogAppender::ptr sync_appender(new atpdxy::FileLogAppender("./log_sync.txt"));
+    sync_appender->setFormatter(fmt);
+    sync_logger->addAppender(sync_appender);
+    uint64_t sync_us = write_logs(sync_logger, threads, count);
+    sync_logger->flush();
+    ASSERT(count_lines("./log_sync.txt") == (size_t)threads * count);
+
+    unlink("./log_async.txt");
+    atpdxy::Logger::ptr async_logger(new atpdxy::Logger("async"));
+    atpdxy::AsyncLogAppender::ptr async_appender(new atpdxy::AsyncLogAppender("./log_async.txt", 1024 * 1024, true));
+    async_appender->setFormatter(fmt);
+    async_logger->addAppender(async_appender);
+    uint64_t async_us = write_logs(async_logger, threads, count);
+    async_logger->flush();
+    ASSERT(async_appender->getDropped() == 0);
+    ASSERT(count_lines("./log_async.txt") == (size_t)threads * count);
+    std::cout << "sync=" << sync_us << "us async=" << async_us << "us lines=" << threads * count << std::endl;
+
+    unlink("./log_drop.txt");
+    atpdxy::Logger::ptr drop_logger(new atpdxy::Logger("drop"));
+    atpdxy::AsyncLogAppender::ptr drop_appender(new atpdxy::AsyncLogAppender("./log_drop.txt", 4096));
+    drop_appender->setFormatter(fmt);
+    drop_logger->addAppender(drop_appender);
+    write_logs(drop_logger, threads, count);
+    uint64_t dropped = drop_appender->getDropped();
+    drop_logger->clearAppenders();
+    drop_appender.reset();
+    // 写出的行数加上丢弃的条数等于总数，另外多出记录丢弃条数的行
+    size_t lines = count_lines("./log_drop.txt");
+    ASSERT(dropped > 0);
+    ASSERT(lines > (size_t)threads * count - dropped);
+    std::cout << "drop mode dropped=" << dropped << " lines=" << lines << std::endl;
+}
+
+// 写日志的开销和每条日志的分配次数，预热之后INFO日志不再分配内存
+void test_zero_alloc() {
+    const int count = 200000;
+    atpdxy::Logger::ptr logger(new atpdxy::Logger("bench"));
+    atpdxy::AsyncLogAppender::ptr async_appender(new atpdxy::AsyncLogAppender("/dev/null", 0, true));
+    logger->addAppender(async_appender);
+
+    // 预热，创建线程本地的事件缓存和异步输出器的缓冲区
+    for(int i = 0; i < 100; ++i) {
+        INFO(logger) << "warm up " << i;
+    }
+    uint64_t allocs = t_allocs;
+    uint64_t begin = atpdxy::GetMonotonicUS();
+    for(int i = 0; i < count; ++i) {
+        INFO(logger) << "bench " << i << " value=" << 3.14 << " name=" << logger->getName();
+    }
+    uint64_t used = atpdxy::GetMonotonicUS() - begin;
+    uint64_t async_allocs = t_allocs - allocs;
+
+    logger->clearAppenders();
+    logger->addAppender(atpdxy::LogAppender::ptr(new atpdxy::FileLogAppender("/dev/null")));
+    for(int i = 0; i < 100; ++i) {
+        INFO(logger) << "warm up " << i;
+    }
+    allocs = t_allocs;
+    begin = atpdxy::GetMonotonicUS();
+    for(int i = 0; i < count; ++i) {
+        FMT_INFO(logger, "bench %d value=%f name=%s", i, 3.14, logger->getName().c_str());
+    }
+    uint64_t file_used = atpdxy::GetMonotonicUS() - begin;
+    uint64_t file_allocs = t_allocs - allocs;
+
+    std::cout << "async " << used * 1000 / count << "ns/line allocs=" << async_allocs
+        << " file " << file_used * 1000 / count << "ns/line allocs=" << file_allocs << std::endl;
+    ASSERT(async_allocs == 0);
+    // 文件输出器每隔3秒重新打开文件，只有那时分配
+    ASSERT(file_allocs <= 2 * (file_used / 3000000 + 1));
+}
+
+static std::string strftime_at(time_t t, const char* fmt) {
+    struct tm tm;
+    localtime_r(&t, &tm);
+    char buf[64];
+    strftime(buf, sizeof(buf), fmt, &tm);
+    return buf;
+}
+
+// 毫秒和微秒的时间格式，同一秒内复用缓存的前缀，和每次调用strftime的耗时对比
+void test_datetime() {
+    atpdxy::Logger::ptr logger(new atpdxy::Logger("time"));
+    atpdxy::LogFormatter::ptr us_fmt(new atpdxy::LogFormatter("%d{%Y-%m-%d %H:%M:%S.%f}"));
+    atpdxy::LogFormatter::ptr ms_fmt(new atpdxy::LogFormatter("%d{%H:%M:%S.%L}|%d{%%L %s}"));
+    uint64_t base = 1700000000ull * 1000000;
+    uint64_t times[] = {base + 123456, base + 999999, base + 1000001, base + 7, base + 3600 * 1000000ull + 42000};
+    for(uint64_t t : times) {
+        atpdxy::LogEvent::ptr event(new atpdxy::LogEvent(logger, atpdxy::LogLevel::INFO
+                    , __FILE__, __LINE__, 0, 0, 0, t, ""));
+        char sub[16];
+        snprintf(sub, sizeof(sub), ".%06u", (uint32_t)(t % 1000000));
+        ASSERT(us_fmt->format(logger, atpdxy::LogLevel::INFO, event)
+                == strftime_at(t / 1000000, "%Y-%m-%d %H:%M:%S") + sub);
+        snprintf(sub, sizeof(sub), ".%03u|", (uint32_t)(t % 1000000 / 1000));
+        ASSERT(ms_fmt->format(logger, atpdxy::LogLevel::INFO, event)
+                == strftime_at(t / 1000000, "%H:%M:%S") + sub + strftime_at(t / 1000000, "%%L %s"));
+    }
+
+    const int count = 1000000;
+    atpdxy::LogEvent::ptr event(new atpdxy::LogEvent(logger, atpdxy::LogLevel::INFO
+                , __FILE__, __LINE__, 0, 0, 0, atpdxy::GetCurrentUS(), ""));
+    uint64_t begin = atpdxy::GetMonotonicUS();
+    for(int i = 0; i < count; ++i) {
+        ms_fmt->render(logger, atpdxy::LogLevel::INFO, event);
+    }
+    uint64_t cached = atpdxy::GetMonotonicUS() - begin;
+    begin = atpdxy::GetMonotonicUS();
+    size_t len = 0;
+    for(int i = 0; i < count; ++i) {
+        len += strftime_at(event->getTime(), "%H:%M:%S").size();
+    }
+    uint64_t raw = atpdxy::GetMonotonicUS() - begin;
+    std::cout << "datetime cached=" << cached * 1000 / count << "ns strftime=" << raw * 1000 / count
+        << "ns len=" << len / count << std::endl;
+}
+
+// 二进制日志和文本日志混合写入同一个文件，解码后和printf的结果一致，并对比两种方式每条日志的耗时
+void test_binary() {
+    unlink("./log_bin.bin");
+    atpdxy::Logger::ptr logger(new atpdxy::Logger("bin"));
+    atpdxy::BinaryLogAppender::ptr appender(new atpdxy::BinaryLogAppender("./log_bin.bin", 1024 * 1024, true));
+    logger->addAppender(appender);
+
+    BIN_INFO(logger, "int %d uint %u big %lld str %s dbl %.3f hex %#x char %c pct %% [%5d] [%-4s] [%*d] [%.2s]"
+             , -7, 42u, -1234567890123LL, "hello", 3.14159, 255, 'A', 12, "ab", 4, 9, "xyz");
+    INFO(logger) << "text " << 1;
+    atpdxy::Thread thr([logger](){
+        BIN_WARN(logger, "from thread %s %p", "bin_t", (void*)0x10);
+    }, "bin_t");
+    thr.join();
+    // 不同线程的记录在各自的缓冲区中，刷新后再写保证文件中的顺序
+    logger->flush();
+    BIN_ERROR(logger, "no args");
+    logger->flush();
+
+    std::string expect = "INFO\tbin\tUNKNOW\tint -7 uint 42 big -1234567890123 str hello dbl 3.142 hex 0xff char A pct % [   12] [ab  ] [   9] [xy]\n"
+        "INFO\tbin\tUNKNOW\ttext 1\n"
+        "WARN\tbin\tbin_t\tfrom thread bin_t 0x10\n"
+        "ERROR\tbin\tUNKNOW\tno args\n";
+    std::ifstream ifs("./log_bin.bin", std::ios::binary);
+    std::stringstream ss;
+    atpdxy::BinaryLogDecoder decoder(atpdxy::LogFormatter::ptr(new atpdxy::LogFormatter("%p%T%c%T%N%T%m%n")));
+    ASSERT(decoder.decode(ifs, ss) == 4);
+    ASSERT_WITH_MSG(ss.str() == expect, ss.str());
+
+    // 引用了未定义调用处的记录输出占位日志，损坏的内容跳到下一个魔数继续
+    {
+        std::ifstream in("./log_bin.bin", std::ios::binary);
+        std::string file((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        std::string data = file;
+        atpdxy::BinaryLog::RecordHeader header = atpdxy::BinaryLog::MakeHeader(sizeof(header) + 8, 999, 0, 0, 0, 0);
+        data.append((const char*)&header, sizeof(header));
+        data.append(8, '\0');
+        // 损坏的记录头
+        header.size = 3;
+        data.append((const char*)&header, sizeof(header));
+        data.append(file);
+        std::stringstream is(data);
+        std::stringstream os;
+        atpdxy::BinaryLogDecoder decoder(atpdxy::LogFormatter::ptr(new atpdxy::LogFormatter("%p%T%m%n")));
+        ASSERT(decoder.decode(is, os) == 9);
+        ASSERT_WITH_MSG(os.str().find("UNKNOW\t<unknown site 999, 8 bytes of arguments>\n") != std::string::npos, os.str());
+        ASSERT(decoder.getSkipped() == sizeof(header));
+    }
+
+    const int count = 200000;
+    uint64_t begin = atpdxy::GetMonotonicUS();
+    uint64_t allocs = 0;
+    for(int i = 0; i < count; ++i) {
+        // 第一次执行时注册调用处，之后不再分配
+        if(i == 1) {
+            allocs = t_allocs;
+        }
+        BIN_INFO(logger, "thread %d log %d value %.2f", 0, i, i * 0.5);
+    }
+    allocs = t_allocs - allocs;
+    uint64_t bin_us = atpdxy::GetMonotonicUS() - begin;
+    begin = atpdxy::GetMonotonicUS();
+    for(int i = 0; i < count; ++i) {
+        INFO(logger) << "thread " << 0 << " log " << i << " value " << i * 0.5;
+    }
+    uint64_t text_us = atpdxy::GetMonotonicUS() - begin;
+    logger->flush();
+    ASSERT(allocs == 0);
+    ASSERT(appender->getDropped() == 0);
+    std::cout << "binary=" << bin_us * 1000 / count << "ns/log text=" << text_us * 1000 / count
+        << "ns/log" << std::endl;
+}
+
+// 写日志时回调日志器的输出器，日志器调用输出器时不持有自己的锁才不会死锁
+class ReentrantAppender : public atpdxy::LogAppender {
+public:
+    void log(atpdxy::Logger::ptr logger, atpdxy::LogLevel::Level level, atpdxy::LogEvent::ptr event) override {
+        ++count;
+        logger->getFormatter();
+        // 写日志时修改输出器列表，本次写日志仍然使用修改前的列表
+        logger->delAppender(other);
+    }
+
+    std::string toYamlString() override { return "";}
+
+    int count = 0;
+    atpdxy::LogAppender::ptr other;
+};
+
+void test_reentrant() {
+    atpdxy::Logger::ptr logger(new atpdxy::Logger("reentrant"));
+    std::shared_ptr<ReentrantAppender> first(new ReentrantAppender);
+    std::shared_ptr<ReentrantAppender> second(new ReentrantAppender);
+    first->other = second;
+    logger->addAppender(first);
+    logger->addAppender(second);
+    INFO(logger) << "reentrant";
+    ASSERT(first->count == 1 && second->count == 1);
+    INFO(logger) << "reentrant";
+    ASSERT(first->count == 2 && second->count == 1);
+    std::cout << "reentrant ok" << std::endl;
+}
+
+// 返回目录下以prefix开头的文件名
+static std::vector<std::string> list_files(const std::string& dir, const std::string& prefix) {
+    std::vector<std::string> files;
+    DIR* d = opendir(dir.c_str());
+    ASSERT(d);
+    struct dirent* dp = nullptr;
+    while((dp = readdir(d)) != nullptr) {
+        std::string name = dp->d_name;
+        if(name.compare(0, prefix.size(), prefix) == 0) {
+            files.push_back(name);
+        }
+    }
+    closedir(d);
+    return files;
+}
+
+// 多线程写入时按大小滚动，不限制保留个数时所有文件的行数之和等于写入的条数；限制个数并压缩时只留下最新的几个.gz文件
+void test_rotate() {
+    const int threads = 4;
+    const int count = 20000;
+    atpdxy::LogFormatter::ptr fmt(new atpdxy::LogFormatter("%d%T%t%T%m%n"));
+    mkdir("./rotate", 0755);
+    for(auto& i : list_files("./rotate", "log")) {
+        unlink(("./rotate/" + i).c_str());
+    }
+
+    atpdxy::Logger::ptr logger(new atpdxy::Logger("rotate"));
+    atpdxy::RotatingFileLogAppender::ptr appender(new atpdxy::RotatingFileLogAppender("./rotate/log_all.txt", 256 * 1024));
+    appender->setFormatter(fmt);
+    logger->addAppender(appender);
+    // 分几轮写入，每轮之后等待滚动完成，单核上后台线程也能及时滚动
+    const int rounds = 4;
+    uint64_t us = 0;
+    for(int i = 0; i < rounds; ++i) {
+        us += write_logs(logger, threads, count / rounds);
+        logger->flush();
+    }
+    std::vector<std::string> files = list_files("./rotate", "log_all.txt");
+    size_t lines = 0;
+    for(auto& i : files) {
+        lines += count_lines("./rotate/" + i);
+    }
+    ASSERT(appender->getRollCount() >= (uint64_t)rounds);
+    ASSERT(files.size() == appender->getRollCount() + 1);
+    ASSERT(lines == (size_t)threads * count);
+    std::cout << "rotate rolls=" << appender->getRollCount() << " " << us * 1000 / (threads * count)
+        << "ns/line" << std::endl;
+
+    logger.reset(new atpdxy::Logger("rotate_gz"));
+    appender.reset(new atpdxy::RotatingFileLogAppender("./rotate/log_gz.txt", 128 * 1024
+                , atpdxy::RotatingFileLogAppender::DAILY, 3, true));
+    appender->setFormatter(fmt);
+    logger->addAppender(appender);
+    for(int i = 0; i < rounds; ++i) {
+        write_logs(logger, threads, count / rounds);
+        logger->flush();
+    }
+    files = list_files("./rotate", "log_gz.txt");
+    ASSERT(appender->getRollCount() >= (uint64_t)rounds);
+    ASSERT(files.size() == 4);
+    for(auto& i : files) {
+        ASSERT(i == "log_gz.txt" || i.substr(i.size() - 3) == ".gz");
+    }
+    std::cout << appender->toYamlString() << std::endl;
+}
 
 int main(int argc, char** argv) {
     atpdxy::Logger::ptr logger(new atpdxy::Logger);
@@ -22,5 +374,12 @@ int main(int argc, char** argv) {
 
     auto l = atpdxy::LoggerMgr::GetInstance()->getLogger("xx");
     INFO(l) << "xxx";
+
+    test_datetime();
+    test_async();
+    test_zero_alloc();
+    test_binary();
+    test_reentrant();
+    test_rotate();
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,147 @@
+#include "../atpdxy/atpdxy.h"
+#include "../atpdxy/iomanager.h"
+#include <atomic>
+#include <thread>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// 多reactor模式和io_uring后端的回显基准测试
+// 同一个IOManager里运行回显服务端和客户端，比较共用一个epoll实例、每个线程一个epoll实例以及每个线程一个io_uring时每秒的往返次数，
+// 同时统计连接处理协程在线程之间迁移的次数，多reactor模式和io_uring后端下应该为0
+atpdxy::Logger::ptr g_logger = GET_ROOT_LOGGER();
+
+// 连接数量
+static const int s_conns = 32;
+// 每个连接的往返次数
+static const int s_rounds = 500;
+// 每次发送的字节数
+static const int s_size = 64;
+
+static std::atomic<uint64_t> s_done {0};
+static std::atomic<uint64_t> s_migrations {0};
+
+// 读满len个字节，连接关闭或出错返回false
+static bool readAll(int fd, char* buf, int len) {
+    while(len > 0) {
+        int rt = read(fd, buf, len);
+        if(rt <= 0) {
+            return false;
+        }
+        buf += rt;
+        len -= rt;
+    }
+    return true;
+}
+
+// 服务端连接处理，读到的数据原样写回
+void serve(int fd) {
+    int thread = atpdxy::GetThreadId();
+    char buf[s_size];
+    while(readAll(fd, buf, s_size)) {
+        if(atpdxy::GetThreadId() != thread) {
+            ++s_migrations;
+            thread = atpdxy::GetThreadId();
+        }
+        if(write(fd, buf, s_size) != s_size) {
+            break;
+        }
+    }
+    close(fd);
+}
+
+// 客户端，发送后等待回显
+void client(sockaddr_in addr) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    ASSERT(fd >= 0);
+    int rt = connect(fd, (const sockaddr*)&addr, sizeof(addr));
+    ASSERT(rt == 0);
+    int thread = atpdxy::GetThreadId();
+    char buf[s_size];
+    memset(buf, 'a', sizeof(buf));
+    for(int i = 0; i < s_rounds; ++i) {
+        if(write(fd, buf, s_size) != s_size || !readAll(fd, buf, s_size)) {
+            break;
+        }
+        if(atpdxy::GetThreadId() != thread) {
+            ++s_migrations;
+            thread = atpdxy::GetThreadId();
+        }
+        ++s_done;
+    }
+    close(fd);
+}
+
+// 在工作线程中创建监听套接字，这样套接字经过hook，accept不会阻塞线程
+// 连接的处理留在接受它的线程上
+void acceptLoop() {
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    ASSERT(sock >= 0);
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = 0;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    ASSERT(bind(sock, (const sockaddr*)&addr, sizeof(addr)) == 0);
+    ASSERT(listen(sock, s_conns) == 0);
+    socklen_t len = sizeof(addr);
+    ASSERT(getsockname(sock, (sockaddr*)&addr, &len) == 0);
+
+    atpdxy::IOManager* iom = atpdxy::IOManager::GetThis();
+    for(int i = 0; i < s_conns; ++i) {
+        iom->schedule(std::bind(&client, addr));
+    }
+    for(int i = 0; i < s_conns; ++i) {
+        int fd = accept(sock, nullptr, nullptr);
+        ASSERT(fd >= 0);
+        iom->schedule(std::bind(&serve, fd), atpdxy::GetThreadId());
+    }
+    close(sock);
+}
+
+void bench(size_t threads, bool multi_reactor
+           , atpdxy::IOManager::Backend backend = atpdxy::IOManager::EPOLL) {
+    s_done = 0;
+    s_migrations = 0;
+    uint64_t begin = atpdxy::GetCurrentUS();
+    const char* mode = multi_reactor ? "multi " : "single";
+    {
+        atpdxy::IOManager iom(threads, false, "reactor", multi_reactor, backend);
+        if(iom.getBackend() == atpdxy::IOManager::IO_URING) {
+            mode = "uring ";
+        } else if(backend == atpdxy::IOManager::IO_URING) {
+            INFO(g_logger) << "io_uring not supported, skip";
+            return;
+        }
+        iom.schedule(&acceptLoop);
+    }
+    uint64_t used = atpdxy::GetCurrentUS() - begin;
+    ASSERT(s_done == (uint64_t)s_conns * s_rounds);
+    INFO(g_logger) << mode << " threads=" << threads
+        << " rounds=" << s_done << " used=" << used << "us "
+        << (used ? s_done * 1000000 / used : 0) << " rounds/s"
+        << " migrations=" << s_migrations;
+    if(multi_reactor) {
+        ASSERT(s_migrations == 0);
+    }
+}
+
+int main(int argc, char** argv) {
+    // 只关注结果，关闭调度器内部的日志
+    GET_LOGGER_BY_NAME("system")->setLevel(atpdxy::LogLevel::ERROR);
+
+    size_t threads = std::thread::hardware_concurrency();
+    if(argc > 1) {
+        threads = atoi(argv[1]);
+    }
+    if(threads == 0) {
+        threads = 1;
+    }
+    bench(threads, false);
+    bench(threads, true);
+    bench(threads, true, atpdxy::IOManager::IO_URING);
+    return 0;
+}
@@ -0,0 +1,72 @@
+#include "../atpdxy/atpdxy.h"
+#include "../atpdxy/iomanager.h"
+#include <atomic>
+#include <thread>
+#include <stdlib.h>
+
+// 调度器扩展性基准测试
+// 分别用1到N个线程运行相同数量的小任务，统计每秒执行的任务数
+// 一部分任务由外部线程调度(经过注入队列)，大部分任务在工作线程中派生(本地队列和窃取)
+atpdxy::Logger::ptr g_logger = GET_ROOT_LOGGER();
+
+// 外部线程调度的根任务数量
+static const int s_roots = 64;
+// 每个根任务派生的子任务数量
+static const int s_children = 4096;
+// 每个任务的计算量
+static const int s_work = 200;
+
+static std::atomic<uint64_t> s_done {0};
+
+void leaf() {
+    volatile uint64_t v = 0;
+    for(int i = 0; i < s_work; ++i) {
+        v += i;
+    }
+    ++s_done;
+}
+
+void root() {
+    atpdxy::Scheduler* sc = atpdxy::Scheduler::GetThis();
+    for(int i = 0; i < s_children; ++i) {
+        sc->schedule(&leaf);
+    }
+    ++s_done;
+}
+
+void bench(size_t threads) {
+    s_done = 0;
+    uint64_t begin = atpdxy::GetCurrentUS();
+    {
+        atpdxy::IOManager iom(threads, false, "scaling");
+        for(int i = 0; i < s_roots; ++i) {
+            iom.schedule(&root);
+        }
+    }
+    uint64_t used = atpdxy::GetCurrentUS() - begin;
+    uint64_t total = s_roots * (s_children + 1);
+    ASSERT(s_done == total);
+    INFO(g_logger) << "threads=" << threads << " tasks=" << total
+        << " used=" << used << "us "
+        << (used ? total * 1000000 / used : 0) << " tasks/s";
+}
+
+int main(int argc, char** argv) {
+    // 只关注结果，关闭调度器内部的日志
+    GET_LOGGER_BY_NAME("system")->setLevel(atpdxy::LogLevel::ERROR);
+
+    size_t max_threads = std::thread::hardware_concurrency();
+    if(argc > 1) {
+        max_threads = atoi(argv[1]);
+    }
+    if(max_threads == 0) {
+        max_threads = 1;
+    }
+    for(size_t i = 1; i <= max_threads; i *= 2) {
+        bench(i);
+        if(i < max_threads && i * 2 > max_threads) {
+            bench(max_threads);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,99 @@
+#include "../atpdxy/atpdxy.h"
+#include "../atpdxy/iomanager.h"
+#include <atomic>
+#include <unistd.h>
+
+// 共享栈协程的测试
+// 同时挂起的协程比共享栈多，切出时栈内容被拷走，切入时拷回，局部变量保持不变
+atpdxy::Logger::ptr g_logger = GET_ROOT_LOGGER();
+
+// 多个协程同时挂起在少量共享栈上，局部变量在让出和恢复之后不变，并且始终在同一个线程上运行
+void test_suspended() {
+    const int fibers = 64;
+    const int threads = 2;
+    const uint32_t stacks = 2;
+    atpdxy::Config::Lookup<uint32_t>("fiber.shared_stack_count")->setValue(stacks);
+    std::atomic<int> arrived = {0};
+    std::atomic<int> suspended = {0};
+    std::atomic<int> max_suspended = {0};
+    std::atomic<int> bad = {0};
+    std::atomic<int> finished = {0};
+    {
+        atpdxy::IOManager iom(threads, false, "shared");
+        iom.setSharedStack(true);
+        for(int i = 0; i < fibers; ++i) {
+            iom.schedule([&, i](){
+                atpdxy::Fiber* self = atpdxy::Fiber::GetThisPtr();
+                if(!self->isSharedStack()) {
+                    ++bad;
+                }
+                int thread = atpdxy::GetThreadId();
+                if(self->getSharedStackThread() != thread) {
+                    ++bad;
+                }
+                // 栈上的数据，每个协程不同
+                volatile uint32_t data[256];
+                for(int j = 0; j < 256; ++j) {
+                    data[j] = i * 1000 + j;
+                }
+                ++arrived;
+                for(int k = 0; k < 5; ++k) {
+                    int n = ++suspended;
+                    int old = max_suspended;
+                    while(n > old && !max_suspended.compare_exchange_weak(old, n));
+                    if(k % 2) {
+                        atpdxy::Fiber::YieldToReady();
+                    } else {
+                        // 第一轮等到所有协程都开始运行，保证它们同时挂起
+                        do {
+                            usleep(1000);
+                        } while(k == 0 && arrived < fibers);
+                    }
+                    --suspended;
+                    for(int j = 0; j < 256; ++j) {
+                        if(data[j] != (uint32_t)(i * 1000 + j)) {
+                            ++bad;
+                            break;
+                        }
+                    }
+                    if(atpdxy::GetThreadId() != thread) {
+                        ++bad;
+                    }
+                }
+                ++finished;
+            });
+        }
+    }
+    atpdxy::Config::Lookup<uint32_t>("fiber.shared_stack_count")->setValue(4);
+    ASSERT(bad == 0);
+    ASSERT(finished == fibers);
+    ASSERT(max_suspended > (int)(stacks * threads));
+    INFO(g_logger) << "suspended ok fibers=" << fibers << " max_suspended=" << max_suspended;
+}
+
+// 调度器复用共享栈协程执行新任务时重新绑定共享栈
+void test_reuse() {
+    const int tasks = 1000;
+    std::atomic<int> sum = {0};
+    {
+        atpdxy::IOManager iom(1, false, "reuse");
+        iom.setSharedStack(true);
+        for(int i = 0; i < tasks; ++i) {
+            iom.schedule([&, i](){
+                volatile int local = i;
+                if(i % 3 == 0) {
+                    atpdxy::Fiber::YieldToReady();
+                }
+                sum += local;
+            });
+        }
+    }
+    ASSERT(sum == tasks * (tasks - 1) / 2);
+    INFO(g_logger) << "reuse ok";
+}
+
+int main(int argc, char** argv) {
+    test_suspended();
+    test_reuse();
+    return 0;
+}
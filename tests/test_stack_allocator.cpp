@@ -0,0 +1,142 @@
+#include "../atpdxy/atpdxy.h"
+#include "../atpdxy/stack_allocator.h"
+#include <signal.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// 协程栈分配器的测试：线程缓存的命中和上限、按大小复用以及保护页
+atpdxy::Logger::ptr g_logger = GET_ROOT_LOGGER();
+
+// 归还的栈放在线程缓存中，下次申请相同大小时直接复用
+void test_hit_miss() {
+    const size_t size = 96 * 1024;
+    uint64_t hits = atpdxy::StackAllocator::GetHits();
+    uint64_t misses = atpdxy::StackAllocator::GetMisses();
+    uint64_t mapped = atpdxy::StackAllocator::GetMappedBytes();
+    uint64_t cached = atpdxy::StackAllocator::GetCachedCount();
+
+    void* vp = atpdxy::StackAllocator::Alloc(size);
+    ASSERT(atpdxy::StackAllocator::GetMisses() == misses + 1);
+    // 保护页也计入映射大小
+    uint64_t total = size + atpdxy::StackAllocator::GetPageSize();
+    ASSERT(atpdxy::StackAllocator::GetMappedBytes() == mapped + total);
+    // 整个可用区域都可以写
+    memset(vp, 0x5a, size);
+
+    atpdxy::StackAllocator::Dealloc(vp, size);
+    ASSERT(atpdxy::StackAllocator::GetCachedCount() == cached + 1);
+    ASSERT(atpdxy::StackAllocator::GetMappedBytes() == mapped + total);
+
+    void* again = atpdxy::StackAllocator::Alloc(size);
+    ASSERT(again == vp);
+    ASSERT(atpdxy::StackAllocator::GetHits() == hits + 1);
+    ASSERT(atpdxy::StackAllocator::GetMisses() == misses + 1);
+    ASSERT(atpdxy::StackAllocator::GetCachedCount() == cached);
+    atpdxy::StackAllocator::Dealloc(again, size);
+    INFO(g_logger) << "hit miss ok";
+}
+
+// 缓存按大小分组，不同大小的申请不会拿到缓存中的栈
+void test_size_class() {
+    const size_t small = 80 * 1024;
+    const size_t large = 160 * 1024;
+    void* vp = atpdxy::StackAllocator::Alloc(small);
+    atpdxy::StackAllocator::Dealloc(vp, small);
+    uint64_t misses = atpdxy::StackAllocator::GetMisses();
+    uint64_t cached = atpdxy::StackAllocator::GetCachedCount();
+
+    void* other = atpdxy::StackAllocator::Alloc(large);
+    ASSERT(other != vp);
+    ASSERT(atpdxy::StackAllocator::GetMisses() == misses + 1);
+    ASSERT(atpdxy::StackAllocator::GetCachedCount() == cached);
+    memset(other, 0, large);
+
+    void* same = atpdxy::StackAllocator::Alloc(small);
+    ASSERT(same == vp);
+    atpdxy::StackAllocator::Dealloc(same, small);
+    atpdxy::StackAllocator::Dealloc(other, large);
+    INFO(g_logger) << "size class ok";
+}
+
+// 超过fiber.stack_cache_count的栈直接释放
+void test_cache_limit() {
+    const size_t size = 72 * 1024;
+    const int count = 16;
+    const uint32_t limit = 4;
+    uint32_t old_limit = atpdxy::Config::Lookup<uint32_t>("fiber.stack_cache_count")->getValue();
+    std::vector<void*> stacks;
+    for(int i = 0; i < count; ++i) {
+        stacks.push_back(atpdxy::StackAllocator::Alloc(size));
+    }
+    uint64_t mapped = atpdxy::StackAllocator::GetMappedBytes();
+    // 上限按线程缓存中所有大小的栈计算，只有这一个线程时等于全局的缓存数量
+    uint64_t cached = atpdxy::StackAllocator::GetCachedCount();
+    atpdxy::Config::Lookup<uint32_t>("fiber.stack_cache_count")->setValue(cached + limit);
+    for(auto vp : stacks) {
+        atpdxy::StackAllocator::Dealloc(vp, size);
+    }
+    uint64_t total = size + atpdxy::StackAllocator::GetPageSize();
+    ASSERT(atpdxy::StackAllocator::GetCachedCount() == cached + limit);
+    ASSERT(atpdxy::StackAllocator::GetMappedBytes() == mapped - (count - limit) * total);
+
+    // 缓存中的栈被依次复用，用完后重新映射
+    uint64_t hits = atpdxy::StackAllocator::GetHits();
+    uint64_t misses = atpdxy::StackAllocator::GetMisses();
+    stacks.clear();
+    for(uint32_t i = 0; i < limit + 1; ++i) {
+        stacks.push_back(atpdxy::StackAllocator::Alloc(size));
+    }
+    ASSERT(atpdxy::StackAllocator::GetHits() == hits + limit);
+    ASSERT(atpdxy::StackAllocator::GetMisses() == misses + 1);
+    for(auto vp : stacks) {
+        atpdxy::StackAllocator::Dealloc(vp, size);
+    }
+    atpdxy::Config::Lookup<uint32_t>("fiber.stack_cache_count")->setValue(old_limit);
+    INFO(g_logger) << "cache limit ok";
+}
+
+// 写入栈底之下的保护页触发段错误，在子进程中验证
+void test_guard_page() {
+    const size_t size = 64 * 1024;
+    pid_t pid = fork();
+    ASSERT(pid >= 0);
+    if(pid == 0) {
+        signal(SIGSEGV, SIG_DFL);
+        char* vp = (char*)atpdxy::StackAllocator::Alloc(size);
+        vp[0] = 1;
+        vp[size - 1] = 1;
+        // 栈溢出时越过栈底
+        *(volatile char*)(vp - 1) = 1;
+        _exit(0);
+    }
+    int status = 0;
+    ASSERT(waitpid(pid, &status, 0) == pid);
+    ASSERT(WIFSIGNALED(status) && WTERMSIG(status) == SIGSEGV);
+    INFO(g_logger) << "guard page ok";
+}
+
+// 协程反复创建和销毁时复用缓存中的栈
+void test_fiber_reuse() {
+    atpdxy::Fiber::GetThis();
+    // 先创建一个，之后的协程都能命中缓存
+    atpdxy::Fiber::ptr(new atpdxy::Fiber([](){}, 0, true))->call();
+    uint64_t misses = atpdxy::StackAllocator::GetMisses();
+    uint64_t hits = atpdxy::StackAllocator::GetHits();
+    for(int i = 0; i < 1000; ++i) {
+        atpdxy::Fiber::ptr fiber(new atpdxy::Fiber([](){}, 0, true));
+        fiber->call();
+    }
+    ASSERT(atpdxy::StackAllocator::GetMisses() == misses);
+    ASSERT(atpdxy::StackAllocator::GetHits() == hits + 1000);
+    INFO(g_logger) << "fiber reuse ok";
+}
+
+int main(int argc, char** argv) {
+    test_hit_miss();
+    test_size_class();
+    test_cache_limit();
+    test_guard_page();
+    test_fiber_reuse();
+    return 0;
+}
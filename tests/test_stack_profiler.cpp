@@ -0,0 +1,192 @@
+#include "../atpdxy/atpdxy.h"
+#include "../atpdxy/iomanager.h"
+#include "../atpdxy/stack_profiler.h"
+#include <atomic>
+#include <functional>
+#include <string.h>
+
+// 协程栈峰值使用量统计和自适应栈大小的测试
+atpdxy::Logger::ptr g_logger = GET_ROOT_LOGGER();
+
+// 每层使用约1KB的栈
+static int Recurse(int depth) {
+    volatile char buf[1024];
+    memset((char*)buf, depth, sizeof(buf));
+    if(depth <= 0) {
+        return buf[0];
+    }
+    return Recurse(depth - 1) + buf[depth % sizeof(buf)];
+}
+
+// 两个栈深度不同的入口，入口按可调用对象的类型区分
+struct Shallow {
+    void operator()() { Recurse(1);}
+};
+
+struct Deep {
+    void operator()() {
+        Recurse(40);
+        if(stacksize) {
+            *stacksize = atpdxy::Fiber::GetThisPtr()->getStackSize();
+        }
+    }
+
+    // 不为空时记下运行所在协程的栈大小
+    size_t* stacksize = nullptr;
+};
+
+// 通过std::function调度的入口，按函数地址区分
+static void ShallowFunc() {
+    Recurse(1);
+}
+
+// 深入口运行所在协程栈大小的最小值
+static std::atomic<size_t> s_deep_min = {~(size_t)0};
+
+static void DeepFunc() {
+    Recurse(40);
+    size_t size = atpdxy::Fiber::GetThisPtr()->getStackSize();
+    size_t old = s_deep_min;
+    while(size < old && !s_deep_min.compare_exchange_weak(old, size));
+}
+
+static const void* s_shallow = atpdxy::Task(Shallow()).getEntry();
+static const void* s_deep = atpdxy::Task(Deep()).getEntry();
+
+// 复用的协程每次运行都测量一次，按入口聚合
+void test_profile() {
+    const int tasks = 200;
+    atpdxy::Config::Lookup<uint32_t>("fiber.stack_paint")->setValue(1);
+    {
+        atpdxy::IOManager iom(1, false, "profile");
+        for(int i = 0; i < tasks; ++i) {
+            iom.schedule(Shallow());
+            iom.schedule(Deep());
+        }
+    }
+    atpdxy::StackProfiler::Profile shallow;
+    atpdxy::StackProfiler::Profile deep;
+    ASSERT(atpdxy::StackProfiler::GetProfile(s_shallow, shallow));
+    ASSERT(atpdxy::StackProfiler::GetProfile(s_deep, deep));
+    ASSERT(shallow.count == (uint64_t)tasks && deep.count == (uint64_t)tasks);
+    ASSERT(shallow.max < 16 * 1024);
+    ASSERT(deep.max > 40 * 1024 && deep.max < 128 * 1024);
+    ASSERT(deep.percentile(0.5) <= deep.percentile(0.999));
+    ASSERT(deep.percentile(0.999) <= deep.max);
+
+    std::string dump = atpdxy::StackProfiler::Dump();
+    ASSERT(dump.find("Shallow") != std::string::npos);
+    ASSERT(dump.find("Deep") != std::string::npos);
+    INFO(g_logger) << "profile ok" << std::endl << dump;
+}
+
+// 新协程按入口的统计结果分配栈，复用时入口变化会换栈
+void test_adaptive() {
+    atpdxy::Config::Lookup<uint32_t>("fiber.stack_size")->setValue(1024 * 1024);
+    atpdxy::Config::Lookup<bool>("fiber.stack_adaptive")->setValue(true);
+    atpdxy::Fiber::GetThis();
+
+    atpdxy::Fiber::ptr shallow(new atpdxy::Fiber(Shallow(), 0, true));
+    ASSERT(shallow->getStackSize() == atpdxy::StackProfiler::ADAPTIVE_MIN_SIZE);
+    shallow->call();
+    ASSERT(shallow->getState() == atpdxy::Fiber::TERM);
+    size_t deep_size = 0;
+    Deep deep;
+    deep.stacksize = &deep_size;
+    atpdxy::Fiber::ptr fiber(new atpdxy::Fiber(deep, 0, true));
+    fiber->call();
+    ASSERT(deep_size > 40 * 1024 && deep_size < 1024 * 1024);
+    // 指定了栈大小的协程不调整
+    atpdxy::Fiber::ptr fixed(new atpdxy::Fiber(Shallow(), 256 * 1024, true));
+    ASSERT(fixed->getStackSize() == 256 * 1024);
+    fixed->call();
+    // 没有统计的入口使用配置的大小
+    atpdxy::Fiber::ptr unknown(new atpdxy::Fiber([](){}, 0, true));
+    ASSERT(unknown->getStackSize() == 1024 * 1024);
+    unknown->call();
+
+    // 只有一个工作线程，调度器复用同一个协程交替执行两个入口，栈随入口切换
+    size_t reused_size = 0;
+    {
+        atpdxy::IOManager iom(1, false, "adaptive");
+        Deep reused;
+        reused.stacksize = &reused_size;
+        iom.schedule(Shallow());
+        iom.schedule(reused);
+        iom.schedule(Shallow());
+    }
+    ASSERT(reused_size == deep_size);
+
+    atpdxy::Config::Lookup<bool>("fiber.stack_adaptive")->setValue(false);
+    atpdxy::Config::Lookup<uint32_t>("fiber.stack_size")->setValue(128 * 1024);
+    INFO(g_logger) << "adaptive ok shallow=" << atpdxy::StackProfiler::ADAPTIVE_MIN_SIZE
+        << " deep=" << deep_size;
+}
+
+// 擦除了类型的任务按真正的目标区分，不同函数的样本不能混在一起，否则少见的深入口会分到过小的栈
+void test_type_erased() {
+    typedef std::function<void()> Func;
+    ASSERT(atpdxy::Task(Func(ShallowFunc)).getEntry() == (const void*)&ShallowFunc);
+    ASSERT(atpdxy::Task(Func(DeepFunc)).getEntry() == (const void*)&DeepFunc);
+    ASSERT(atpdxy::Task(&ShallowFunc).getEntry() == (const void*)&ShallowFunc);
+    // 无法得到目标的任务没有入口
+    ASSERT(atpdxy::Task(std::bind(&DeepFunc)).getEntry() == nullptr);
+    ASSERT(atpdxy::Task(Func([](){ DeepFunc();})).getEntry() == nullptr);
+
+    const int tasks = 200;
+    atpdxy::Config::Lookup<uint32_t>("fiber.stack_size")->setValue(1024 * 1024);
+    atpdxy::Config::Lookup<uint32_t>("fiber.stack_paint")->setValue(1);
+    atpdxy::Config::Lookup<bool>("fiber.stack_adaptive")->setValue(true);
+    {
+        // 先积累足够的浅任务样本，之后少见的深任务，都通过Scheduler::schedule以std::function调度
+        atpdxy::IOManager iom(1, false, "erased");
+        atpdxy::Scheduler* scheduler = &iom;
+        for(int i = 0; i < tasks; ++i) {
+            scheduler->schedule(Func(ShallowFunc));
+        }
+        scheduler->schedule(Func(DeepFunc));
+        scheduler->schedule(Func(std::bind(&DeepFunc)));
+        scheduler->schedule(Func([](){ DeepFunc();}));
+        scheduler->schedule(Func(ShallowFunc));
+    }
+    atpdxy::Config::Lookup<bool>("fiber.stack_adaptive")->setValue(false);
+    atpdxy::Config::Lookup<uint32_t>("fiber.stack_paint")->setValue(0);
+    atpdxy::Config::Lookup<uint32_t>("fiber.stack_size")->setValue(128 * 1024);
+
+    atpdxy::StackProfiler::Profile shallow;
+    atpdxy::StackProfiler::Profile deep;
+    ASSERT(atpdxy::StackProfiler::GetProfile((const void*)&ShallowFunc, shallow));
+    ASSERT(atpdxy::StackProfiler::GetProfile((const void*)&DeepFunc, deep));
+    ASSERT(shallow.count == (uint64_t)tasks + 1 && deep.count == 1);
+    ASSERT(!atpdxy::StackProfiler::GetProfile(nullptr, deep));
+    // 浅入口照常缩小，深任务始终在足够大的栈上运行
+    ASSERT(atpdxy::StackProfiler::GetAdaptiveSize((const void*)&ShallowFunc, 1024 * 1024, 50)
+            == atpdxy::StackProfiler::ADAPTIVE_MIN_SIZE);
+    ASSERT(s_deep_min > 40 * 1024);
+    INFO(g_logger) << "type erased ok deep_min=" << s_deep_min;
+}
+
+// 染色需要写满整个栈，抽样降低开销
+void bench() {
+    const int tasks = 20000;
+    uint32_t rates[] = {0, 64, 1};
+    for(auto rate : rates) {
+        atpdxy::Config::Lookup<uint32_t>("fiber.stack_paint")->setValue(rate);
+        uint64_t begin = atpdxy::GetMonotonicUS();
+        for(int i = 0; i < tasks; ++i) {
+            atpdxy::Fiber::ptr fiber(new atpdxy::Fiber(Shallow(), 0, true));
+            fiber->call();
+        }
+        uint64_t used = atpdxy::GetMonotonicUS() - begin;
+        INFO(g_logger) << "paint=" << rate << " " << used * 1000 / tasks << "ns/fiber";
+    }
+    atpdxy::Config::Lookup<uint32_t>("fiber.stack_paint")->setValue(0);
+}
+
+int main(int argc, char** argv) {
+    test_profile();
+    test_adaptive();
+    test_type_erased();
+    bench();
+    return 0;
+}
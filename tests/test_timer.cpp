@@ -0,0 +1,317 @@
+#include "../atpdxy/atpdxy.h"
+#include "../atpdxy/timer.h"
+#include "../atpdxy/iomanager.h"
+#include <atomic>
+#include <set>
+#include <stdlib.h>
+#include <unistd.h>
+
+// 分层时间轮的正确性测试，以及和原来基于std::set的定时器管理器的插入、取消、到期基准对比
+atpdxy::Logger::ptr g_logger = GET_ROOT_LOGGER();
+
+// 只用来测试，不需要唤醒等待的线程
+class TestTimerManager : public atpdxy::TimerManager {
+public:
+    int tickles = 0;
+protected:
+    void onTimerInsertedAtFront(size_t) override { ++tickles;}
+};
+
+// 原来的实现：定时器放在std::set中按到期时间排序，插入和取消是O(log n)，每次插入分配一个树节点
+class SetTimerManager {
+public:
+    struct Timer {
+        typedef std::shared_ptr<Timer> ptr;
+        uint64_t next = 0;
+        atpdxy::Task cb;
+    };
+
+    struct Comparator {
+        bool operator()(const Timer::ptr& lhs, const Timer::ptr& rhs) const {
+            if(lhs->next != rhs->next) {
+                return lhs->next < rhs->next;
+            }
+            return lhs.get() < rhs.get();
+        }
+    };
+
+    Timer::ptr addTimer(uint64_t ms, atpdxy::Task cb) {
+        Timer::ptr timer(new Timer);
+        timer->next = atpdxy::GetMonotonicMS() + ms;
+        timer->cb = std::move(cb);
+        atpdxy::RWMutex::WriteLock lock(m_mutex);
+        m_timers.insert(timer);
+        return timer;
+    }
+
+    void cancel(const Timer::ptr& timer) {
+        atpdxy::RWMutex::WriteLock lock(m_mutex);
+        m_timers.erase(timer);
+    }
+
+    void listExpiredCb(std::vector<atpdxy::Task>& cbs) {
+        uint64_t now_ms = atpdxy::GetMonotonicMS();
+        atpdxy::RWMutex::WriteLock lock(m_mutex);
+        auto it = m_timers.begin();
+        while(it != m_timers.end() && (*it)->next <= now_ms) {
+            cbs.push_back(std::move((*it)->cb));
+            it = m_timers.erase(it);
+        }
+    }
+private:
+    atpdxy::RWMutex m_mutex;
+    std::set<Timer::ptr, Comparator> m_timers;
+};
+
+static int s_fired = 0;
+
+static void onTimer() {
+    ++s_fired;
+}
+
+// 到期时间在第0层和第1层之间分布，随机取消一部分，检查剩下的全部按时到期
+void test_wheel() {
+    TestTimerManager mgr;
+    const int count = 2000;
+    std::vector<atpdxy::Timer::ptr> timers;
+    std::vector<uint64_t> deadlines;
+    std::vector<int> fired(count, 0);
+    uint64_t begin = atpdxy::GetMonotonicMS();
+    for(int i = 0; i < count; ++i) {
+        uint64_t ms = rand() % 1200;
+        deadlines.push_back(begin + ms);
+        int* flag = &fired[i];
+        timers.push_back(mgr.addTimer(ms, [flag](){ ++*flag;}));
+    }
+    int cancelled = 0;
+    for(int i = 0; i < count; i += 3) {
+        ASSERT(timers[i]->cancel());
+        ASSERT(!timers[i]->cancel());
+        ++cancelled;
+    }
+    int recurring = 0;
+    atpdxy::Timer::ptr rt = mgr.addTimer(100, [&recurring](){ ++recurring;}, true);
+
+    std::vector<atpdxy::Task> cbs;
+    while(atpdxy::GetMonotonicMS() < begin + 1300) {
+        uint64_t next = mgr.getNextTimer();
+        ASSERT(next != ~0ull);
+        usleep((next > 10 ? 10 : next) * 1000);
+        uint64_t now = atpdxy::GetMonotonicMS();
+        mgr.listExpiredCb(cbs);
+        for(auto& cb : cbs) {
+            cb();
+        }
+        cbs.clear();
+        // 回调执行时已经过了到期时间，到期时间不晚于now的都已经执行
+        for(int i = 0; i < count; ++i) {
+            if(i % 3 == 0) {
+                continue;
+            }
+            if(deadlines[i] + 2 <= now) {
+                ASSERT(fired[i] == 1);
+            } else {
+                ASSERT(fired[i] == 0 || deadlines[i] <= atpdxy::GetMonotonicMS());
+            }
+        }
+    }
+    for(int i = 0; i < count; ++i) {
+        ASSERT(fired[i] == (i % 3 == 0 ? 0 : 1));
+    }
+    ASSERT(recurring >= 10 && recurring <= 13);
+    ASSERT(rt->cancel());
+    ASSERT(!mgr.hasTimer());
+    ASSERT(mgr.getNextTimer() == ~0ull);
+    INFO(g_logger) << "wheel ok timers=" << count << " cancelled=" << cancelled
+        << " recurring=" << recurring << " tickles=" << mgr.tickles;
+}
+
+// 插入1M个定时器，取消一半，等全部到期后一次取出剩下的
+void bench(int count) {
+    std::vector<uint64_t> delays;
+    for(int i = 0; i < count; ++i) {
+        delays.push_back(1 + rand() % 1000);
+    }
+    std::vector<atpdxy::Task> cbs;
+    cbs.reserve(count);
+
+    {
+        TestTimerManager mgr;
+        std::vector<atpdxy::Timer::ptr> timers;
+        timers.reserve(count);
+        uint64_t t0 = atpdxy::GetCurrentUS();
+        for(int i = 0; i < count; ++i) {
+            timers.push_back(mgr.addTimer(delays[i], &onTimer));
+        }
+        uint64_t t1 = atpdxy::GetCurrentUS();
+        for(int i = 0; i < count; i += 2) {
+            timers[i]->cancel();
+        }
+        uint64_t t2 = atpdxy::GetCurrentUS();
+        timers.clear();
+        usleep(1100 * 1000);
+        uint64_t t3 = atpdxy::GetCurrentUS();
+        mgr.listExpiredCb(cbs);
+        uint64_t t4 = atpdxy::GetCurrentUS();
+        ASSERT(cbs.size() == (size_t)count / 2);
+        INFO(g_logger) << "wheel timers=" << count << " insert=" << (t1 - t0) << "us"
+            << " cancel=" << (t2 - t1) << "us expire=" << (t4 - t3) << "us";
+        cbs.clear();
+    }
+
+    {
+        SetTimerManager mgr;
+        std::vector<SetTimerManager::Timer::ptr> timers;
+        timers.reserve(count);
+        uint64_t t0 = atpdxy::GetCurrentUS();
+        for(int i = 0; i < count; ++i) {
+            timers.push_back(mgr.addTimer(delays[i], &onTimer));
+        }
+        uint64_t t1 = atpdxy::GetCurrentUS();
+        for(int i = 0; i < count; i += 2) {
+            mgr.cancel(timers[i]);
+        }
+        uint64_t t2 = atpdxy::GetCurrentUS();
+        timers.clear();
+        usleep(1100 * 1000);
+        uint64_t t3 = atpdxy::GetCurrentUS();
+        mgr.listExpiredCb(cbs);
+        uint64_t t4 = atpdxy::GetCurrentUS();
+        ASSERT(cbs.size() == (size_t)count / 2);
+        INFO(g_logger) << "set   timers=" << count << " insert=" << (t1 - t0) << "us"
+            << " cancel=" << (t2 - t1) << "us expire=" << (t4 - t3) << "us";
+        cbs.clear();
+    }
+}
+
+// 大量到期时间分散的定时器，允许延迟后合并到少数几个时间点，唤醒次数大幅减少，触发时间不超出允许的范围
+int run_slack(uint64_t slack_ms) {
+    TestTimerManager mgr;
+    const int count = 10000;
+    std::atomic<int> bad = {0};
+    // 上一次取出到期定时器的时间，在它之前就到期的定时器应该在那一次被取出
+    uint64_t last = 0;
+    for(int i = 0; i < count; ++i) {
+        uint64_t ms = rand() % 500;
+        uint64_t deadline = atpdxy::GetMonotonicUS() + ms * 1000;
+        mgr.addTimer(ms, [&bad, &last, deadline, slack_ms](){
+            uint64_t now = atpdxy::GetMonotonicUS();
+            // 睡眠本身的延迟由系统决定，只检查定时器落在哪一次取出中，1毫秒容纳添加定时器时读取时钟的先后
+            if(now < deadline || deadline + slack_ms * 1000 + 1000 < last) {
+                ++bad;
+            }
+        }, false, slack_ms);
+    }
+    int wakeups = 0;
+    std::vector<atpdxy::Task> cbs;
+    while(mgr.hasTimer()) {
+        uint64_t next = mgr.getNextTimerUS();
+        if(next) {
+            usleep(next);
+        }
+        uint64_t now = atpdxy::GetMonotonicUS();
+        mgr.listExpiredCb(cbs, now);
+        if(!cbs.empty()) {
+            ++wakeups;
+        }
+        for(auto& cb : cbs) {
+            cb();
+        }
+        cbs.clear();
+        last = now;
+    }
+    ASSERT(bad == 0);
+    return wakeups;
+}
+
+void test_slack() {
+    int exact = run_slack(0);
+    int coalesced = run_slack(50);
+    INFO(g_logger) << "slack wakeups exact=" << exact << " slack50ms=" << coalesced;
+    // 50毫秒的延迟按32毫秒对齐，500毫秒内最多17个时间点
+    ASSERT(coalesced <= 17 && coalesced < exact);
+}
+
+// 每个工作线程反复插入和取消自己分片的定时器，同时从外部线程向各分片投递定时器，检查全部按时触发
+void test_shards(bool multi_reactor) {
+    const int threads = 4;
+    const int loops = 100000;
+    const int fires = 1000;
+    std::atomic<int> fired = {0};
+    std::atomic<int> early = {0};
+    std::atomic<uint64_t> used = {0};
+    {
+        atpdxy::IOManager iom(threads, false, "shard", multi_reactor);
+        for(int i = 0; i < threads; ++i) {
+            iom.schedule([&](){
+                atpdxy::IOManager* self = atpdxy::IOManager::GetThis();
+                uint64_t begin = atpdxy::GetMonotonicUS();
+                for(int j = 0; j < loops; ++j) {
+                    self->addTimer(1000 + j % 100, [](){ ASSERT(false);})->cancel();
+                }
+                used += atpdxy::GetMonotonicUS() - begin;
+                for(int j = 0; j < fires; ++j) {
+                    uint64_t us = rand() % 20000;
+                    uint64_t deadline = atpdxy::GetMonotonicUS() + us;
+                    self->addTimerUS(us, [&fired, &early, deadline](){
+                        early += atpdxy::GetMonotonicUS() < deadline;
+                        ++fired;
+                    });
+                }
+            });
+        }
+        // 不是工作线程，定时器通过收件箱交给各个分片
+        for(int j = 0; j < fires; ++j) {
+            uint64_t us = rand() % 20000;
+            uint64_t deadline = atpdxy::GetMonotonicUS() + us;
+            iom.addTimerUS(us, [&fired, &early, deadline](){
+                early += atpdxy::GetMonotonicUS() < deadline;
+                ++fired;
+            });
+        }
+    }
+    ASSERT(fired == (threads + 1) * fires);
+    ASSERT(early == 0);
+    INFO(g_logger) << "shards multi_reactor=" << multi_reactor << " threads=" << threads
+        << " add+cancel=" << used / threads / (loops / 1000) << "ns/op fired=" << fired;
+}
+
+// 单reactor模式下多个工作线程同时添加和取消定时器，不负责定时器的线程通过收件箱添加、在收件箱中取消，不竞争分片的锁
+// 按线程数输出总吞吐，多核机器上应该随线程数增加
+void bench_single_reactor(int loops) {
+    for(int threads = 1; threads <= 4; threads *= 2) {
+        std::atomic<uint64_t> end = {0};
+        uint64_t begin = atpdxy::GetMonotonicUS();
+        {
+            atpdxy::IOManager iom(threads, false, "scale");
+            for(int i = 0; i < threads; ++i) {
+                iom.schedule([&](){
+                    atpdxy::IOManager* self = atpdxy::IOManager::GetThis();
+                    for(int j = 0; j < loops; ++j) {
+                        ASSERT(self->addTimer(1000 + j % 100, [](){ ASSERT(false);})->cancel());
+                    }
+                    uint64_t now = atpdxy::GetMonotonicUS();
+                    uint64_t old = end;
+                    while(now > old && !end.compare_exchange_weak(old, now));
+                });
+            }
+        }
+        uint64_t used = end - begin;
+        INFO(g_logger) << "single reactor threads=" << threads << " add+cancel="
+            << (uint64_t)threads * loops * 1000 / used << "k ops/s";
+    }
+}
+
+int main(int argc, char** argv) {
+    test_wheel();
+    test_slack();
+    test_shards(false);
+    test_shards(true);
+    bench_single_reactor(200000);
+    int count = 1000000;
+    if(argc > 1) {
+        count = atoi(argv[1]);
+    }
+    bench(count);
+    return 0;
+}
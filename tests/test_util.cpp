@@ -1,5 +1,6 @@
 #include "../atpdxy/atpdxy.h"
 #include <assert.h>
+#include <unistd.h>
 
 atpdxy::Logger::ptr g_logger = GET_ROOT_LOGGER();
 
@@ -8,7 +9,37 @@ void test_assert() {
     ASSERT_WITH_MSG(0 == 1, "abcdef xx");
 }
 
+// 单调时钟不回退，TSC时钟和CLOCK_MONOTONIC保持一致，缓存的时间只在刷新时变化
+void test_clock() {
+    uint64_t last = 0;
+    for(int i = 0; i < 100000; ++i) {
+        uint64_t now = atpdxy::GetMonotonicNS();
+        ASSERT(now >= last);
+        last = now;
+    }
+    uint64_t mono = atpdxy::GetMonotonicMS();
+    uint64_t coarse = atpdxy::GetCoarseMonotonicMS();
+    // 粗粒度时钟可能在两次读取之间跨过毫秒边界，比mono大1，不能用无符号数相减
+    ASSERT(coarse <= mono + 1 && coarse + 10 >= mono);
+
+    atpdxy::Config::Lookup<std::string>("clock.source")->setValue("tsc");
+    if(atpdxy::IsTscClock()) {
+        uint64_t tsc = atpdxy::GetMonotonicUS();
+        atpdxy::Config::Lookup<std::string>("clock.source")->setValue("monotonic");
+        uint64_t mono_us = atpdxy::GetMonotonicUS();
+        ASSERT(tsc <= mono_us + 100 && tsc + 1000 >= mono_us);
+    }
+    atpdxy::Config::Lookup<std::string>("clock.source")->setValue("monotonic");
+
+    uint64_t cached = atpdxy::RefreshCachedUS();
+    usleep(20 * 1000);
+    ASSERT(atpdxy::GetCachedUS() == cached && atpdxy::GetCachedMS() == cached / 1000);
+    ASSERT(atpdxy::RefreshCachedUS() >= cached + 20 * 1000);
+    INFO(g_logger) << "clock ok tsc=" << atpdxy::IsTscClock() << " mono_ms=" << mono;
+}
+
 int main(int argc, char** argv) {
+    test_clock();
     test_assert();
 
     // int arr[] = {1,3,5,7,9,11};
@@ -0,0 +1,54 @@
+#include "../atpdxy/binlog.h"
+#include <fstream>
+#include <iostream>
+#include <unistd.h>
+
+// 把二进制日志文件还原成文本
+// 用法: binlog_decode [-p pattern] [file]，不指定文件时从标准输入读取，pattern是日志格式器的格式
+int main(int argc, char** argv) {
+    std::string pattern;
+    int opt;
+    while((opt = getopt(argc, argv, "p:h")) != -1) {
+        switch(opt) {
+            case 'p':
+                pattern = optarg;
+                break;
+            default:
+                std::cerr << "usage: " << argv[0] << " [-p pattern] [file]" << std::endl;
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    atpdxy::LogFormatter::ptr formatter;
+    if(!pattern.empty()) {
+        formatter.reset(new atpdxy::LogFormatter(pattern));
+        if(formatter->isError()) {
+            std::cerr << "invalid pattern: " << pattern << std::endl;
+            return 1;
+        }
+    }
+
+    std::ifstream ifs;
+    std::istream* is = &std::cin;
+    if(optind < argc) {
+        ifs.open(argv[optind], std::ios::binary);
+        if(!ifs) {
+            std::cerr << "open " << argv[optind] << " failed" << std::endl;
+            return 1;
+        }
+        is = &ifs;
+    }
+
+    std::ios::sync_with_stdio(false);
+    atpdxy::BinaryLogDecoder decoder(formatter);
+    int64_t count = decoder.decode(*is, std::cout);
+    std::cout.flush();
+    if(count < 0) {
+        std::cerr << "invalid binary log" << std::endl;
+        return 1;
+    }
+    if(decoder.getSkipped()) {
+        std::cerr << "skipped " << decoder.getSkipped() << " corrupted bytes" << std::endl;
+    }
+    return 0;
+}